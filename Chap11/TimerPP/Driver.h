@@ -9,6 +9,7 @@ extern "C" {
 #include <WDM.h>
 }
 #include "Unicode.h"
+#include "Nibble.h"
 
 enum DRIVER_STATE {Stopped, Started, Removed};
 
@@ -115,6 +115,10 @@ SOURCE=.\Driver.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\Nibble.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\Unicode.h
 # End Source File
 # End Group
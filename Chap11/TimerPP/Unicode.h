@@ -6,29 +6,149 @@
 
 #pragma once
 
+// Move construction and move assignment need rvalue references,
+// which the VC6 and W2K DDK compilers don't understand.
+#if (defined(_MSC_VER) && _MSC_VER >= 1600) || (__cplusplus >= 201103L)
+#define CUSTRING_HAS_MOVE
+#endif
+
+// Strings up to this many WCHARs (terminator included) live inside
+// the CUString itself and never touch the pool.  Typical device and
+// symbolic link names fit.  Override from the SOURCES file
+// (C_DEFINES) if a driver needs a different trade-off.
+#ifndef CUSTRING_INLINE_CHARS
+#define CUSTRING_INLINE_CHARS 32
+#endif
+
+// Size classes for pool buffers: 128, 256, ... bytes, doubling up
+// to this.  See CUString::InitLookasides.
+#ifndef CUSTRING_LOOKASIDE_MAX
+#define CUSTRING_LOOKASIDE_MAX 512
+#endif
+
+// Pieces appended to a CUStringBuilder are collected in a buffer of
+// this many WCHARs on the stack - enough for any device name.
+#ifndef CUSTRINGBUILDER_CHARS
+#define CUSTRINGBUILDER_CHARS 128
+#endif
+
+// Makes a CUString straight from a string literal, e.g.
+//	CUString devName = CUSTRING_LITERAL("\\Device\\TIMERPP");
+// The compiler stores the text as UTF-16 and supplies its length,
+// so nothing is measured, converted or allocated at run time, and
+// copies of the string share the literal.
+#define CUSTRING_LITERAL(s) \
+	CUString(L##s, (USHORT) (sizeof(L##s) - sizeof(WCHAR)), CUString::Literal)
+
+// The same for a CUStringBuilder's first piece, e.g.
+//	CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\??\\LBK")).Append(n)
+// copies the literal straight into the builder - no CUString in between.
+#define CUSTRINGBUILDER_LITERAL(s) \
+	L##s, (USHORT) (sizeof(L##s) - sizeof(WCHAR)), CUString::Literal
+
+class CUStringBuilder;
 
 class CUString {
+	friend class CUStringBuilder;
 public:
 	CUString() {Init(); }	// constructor relies on internal Init function
 	CUString(const char* pAnsiString);
 	CUString(PCWSTR pWideString);
+	CUString(const CUStringBuilder& builder);	// one allocation at most
+	enum LITERAL_TAG {Literal};	// see CUSTRING_LITERAL
+	CUString(PCWSTR pLiteral, USHORT nBytes, LITERAL_TAG);
 	~CUString();			// destructor gives back buffer allocation
 	void Init();			// performs "real" initialization
 	void Free();			// performs real destruct
 	CUString(const CUString& orig);	// copy constructure (required)
-	CUString operator=(const CUString& rop);	// assignment operator overload (required)
+	CUString& operator=(const CUString& rop);	// assignment operator overload (required)
+#ifdef CUSTRING_HAS_MOVE
+	CUString(CUString&& orig);	// move constructor - takes over orig's buffer
+	CUString& operator=(CUString&& rop);	// move assignment
+#endif
+	void Swap(CUString& other);	// exchanges buffers, never allocates
 	BOOLEAN operator==(const CUString& rop) const;	// comparison operator overload
-	CUString operator+(const CUString& rop) const;	// concatenation operator
-	CUString& operator+=(const CUString& rop);	// and a convenient concat
+	BOOLEAN EqualsNoCase(const CUString& rop) const;	// case-insensitive ==
+	// Case-insensitive hash, computed once and kept until the string
+	// changes.  Once two strings are hashed, comparing them is O(1)
+	// unless they're equal.  Changes made through the PWSTR or
+	// UNICODE_STRING& casts aren't seen - don't hash such strings.
+	ULONG Hash() const;
+	CUString operator+(const CUString& rop) const;	// concatenation operator (empty if too long or out of pool)
+	CUString& operator+=(const CUString& rop);	// appends in place (unless too long or out of pool)
+	void Reserve(USHORT nChars);	// room for nChars without regrowing (unchanged if out of pool)
 	operator PWSTR() const;		// cast operator into wchar_t
 	operator UNICODE_STRING&();	// cast into UNICODE_STRING
 	operator ULONG() const;		// cast operator into ULONG
+	BOOLEAN ToULONG(PULONG pValue) const;	// FALSE if no number or too big
 	CUString(ULONG value);		// converter:  ULONG->CUString
+	// Writes value's decimal digits (up to 10, no NULL) to pDigits
+	// and returns how many were written
+	static USHORT FormatULONG(ULONG value, PWSTR pDigits);
 	WCHAR& operator[](int idx);	// buffer access operator
 	USHORT Length() {return uStr.Length/2;}
+	// Buffers too big to live inline, up to CUSTRING_LOOKASIDE_MAX
+	// bytes, can come from lookaside lists - one per size class -
+	// rather than straight from the pool.  Call InitLookasides from
+	// DriverEntry and DeleteLookasides from DriverUnload; strings
+	// made before or after that simply use the pool.
+	static void InitLookasides();
+	static void DeleteLookasides();
 
 protected:
 	UNICODE_STRING uStr;	// W2K kernel structure for Unicode string
-	enum ALLOC_TYPE {Empty, FromCode, FromPaged, FromNonPaged};
+	// Empty must stay zero: Device Extensions holding a CUString
+	// are zero-filled by IoCreateDevice, never constructed
+	enum ALLOC_TYPE {Empty, FromCode, FromPaged, FromNonPaged, FromInline,
+		FromLiteral, FromLookaside};
 	ALLOC_TYPE	aType;		// where buffer is allocated
+	mutable ULONG hash;		// 0 until Hash() is called
+	WCHAR inlineBuf[CUSTRING_INLINE_CHARS];	// small string storage
+
+	BOOLEAN OwnsBuffer() const	// buffer must be given back to pool
+		{return aType == FromPaged || aType == FromNonPaged ||
+			aType == FromLookaside;}
+	BOOLEAN IsWritable() const	// buffer belongs to this object
+		{return OwnsBuffer() || aType == FromInline;}
+	// Inline if it fits, else pool.  FALSE (and Empty) if the pool
+	// has nothing to give - nothing may be written then
+	BOOLEAN AllocBuffer(USHORT nBytes);
+	void TakeOver(CUString& from);	// steals from's buffer, *this empty
+	BOOLEAN Grow(USHORT nBytes);	// keeps contents, at least doubles; FALSE leaves them as is
+};
+
+// Composes a string from prefixes, numbers and suffixes, e.g.
+//	CUString symLinkName(
+//		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\??\\LBK")).Append(n) );
+// Nothing is allocated until the final CUString is built.
+// Pieces that don't fit are dropped and flagged as overflow.
+class CUStringBuilder {
+	friend class CUString;
+public:
+	CUStringBuilder() {Init(); }
+	explicit CUStringBuilder(const char* pAnsiString)
+		{Init(); Append(pAnsiString); }
+	explicit CUStringBuilder(PCWSTR pWideString)
+		{Init(); Append(pWideString); }
+	explicit CUStringBuilder(const CUString& str)
+		{Init(); Append(str); }
+	CUStringBuilder(PCWSTR pLiteral, USHORT nBytes, CUString::LITERAL_TAG)
+		{Init(); AppendChars(pLiteral, nBytes); }	// see CUSTRINGBUILDER_LITERAL
+	CUStringBuilder& Append(const char* pAnsiString);
+	CUStringBuilder& Append(PCWSTR pWideString);
+	CUStringBuilder& Append(const CUString& str);
+	CUStringBuilder& Append(ULONG value);	// in decimal
+	USHORT Length() const {return uStr.Length/2;}
+	BOOLEAN Overflowed() const {return bOverflow;}
+
+protected:
+	void Init();
+	void AppendChars(PCWSTR pChars, USHORT nBytes);
+	UNICODE_STRING uStr;	// describes buf
+	WCHAR buf[CUSTRINGBUILDER_CHARS];
+	BOOLEAN bOverflow;		// something didn't fit
+
+private:	// uStr points into buf - so no copies
+	CUStringBuilder(const CUStringBuilder&);
+	CUStringBuilder& operator=(const CUStringBuilder&);
 };
@@ -202,8 +202,8 @@ NTSTATUS AddDevice (
 	static int ulDeviceNumber = 0;
 	
 	// Form the internal Device Name
-	CUString devName("\\Device\\DMASLAVE"); // for "Slave DMA" dev
-	devName += CUString(ulDeviceNumber);
+	CUString devName( // for "Slave DMA" dev
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\Device\\DMASLAVE")).Append(ulDeviceNumber) );
 
 	// Now create the device
 	status =
@@ -240,8 +240,8 @@ NTSTATUS AddDevice (
 	// pLowerDevExt->pUpperDevice = pfdo;
 
 	// Form the symbolic link name
-	CUString symLinkName("\\??\\DMAS");
-	symLinkName += CUString(ulDeviceNumber+1);	// 1 based
+	CUString symLinkName(
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\??\\DMAS")).Append(ulDeviceNumber+1) );	// 1 based
 	pDevExt->ustrSymLinkName = symLinkName;
 
 	// Now create the link name
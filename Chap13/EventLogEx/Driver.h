@@ -9,6 +9,7 @@ extern "C" {
 #include <WDM.h>
 }
 #include "Unicode.h"
+#include "Nibble.h"
 #include "Eventlog.h"
 #include "Msg.h"
 
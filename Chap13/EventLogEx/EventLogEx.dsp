@@ -154,6 +154,10 @@ SOURCE=.\Msg.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\Nibble.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\Unicode.h
 # End Source File
 # End Group
@@ -12,30 +12,176 @@ extern "C" {
 }
 #endif
 
-#define max(a,b) ((a>b)?a:b)
-
 #include "Unicode.h"
 
+// Two decimal digits per lookup: "00", "01", ... "99"
+static const char DigitPairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+// Value of each ASCII character as a digit (bases up to 36),
+// 0xFF if it isn't one
+static const UCHAR DigitValue[128] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+	0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+	0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+// A UNICODE_STRING's sizes are USHORTs, so no buffer can be bigger
+// than this - the largest even USHORT - terminator included.  Sizes
+// are worked out in ULONGs and checked against it before they're
+// narrowed; a string that won't fit comes out empty.
+#define MAX_BUFFER_BYTES		0xFFFE
+
+// One lookaside list per size class: 128, 256, ... bytes
+#define SIZE_CLASS_BYTES(c)		(128 << (c))
+#define SIZE_CLASSES			4	// enough for CUSTRING_LOOKASIDE_MAX up to 1 KB
+static PAGED_LOOKASIDE_LIST SizeClassLists[SIZE_CLASSES];
+static int nSizeClassLists = 0;		// 0 - not set up
+
+// The smallest class holding nBytes, -1 if none does
+static int SizeClassOf(ULONG nBytes) {
+	for (int c = 0; c < nSizeClassLists; c++)
+		if (nBytes <= (ULONG) SIZE_CLASS_BYTES(c))
+			return c;
+	return -1;
+}
+
+void CUString::InitLookasides() {
+	int nClasses = 0;
+	for (; nClasses < SIZE_CLASSES &&
+			SIZE_CLASS_BYTES(nClasses) <= CUSTRING_LOOKASIDE_MAX; nClasses++)
+		ExInitializePagedLookasideList(&SizeClassLists[nClasses],
+			NULL, NULL, 0, SIZE_CLASS_BYTES(nClasses), 1633, 0);
+	nSizeClassLists = nClasses;
+}
+
+void CUString::DeleteLookasides() {
+	int nClasses = nSizeClassLists;
+	nSizeClassLists = 0;	// from now on, buffers go back to the pool
+	while (nClasses > 0)
+		ExDeletePagedLookasideList(&SizeClassLists[--nClasses]);
+}
+
 void CUString::Init() {
 	uStr.Length = 0;
 	uStr.MaximumLength = 0;
 	uStr.Buffer = NULL;
 	aType = Empty;
+	hash = 0;
+}
+
+BOOLEAN CUString::AllocBuffer(USHORT nBytes) {
+	// Assumes no buffer is currently held
+	uStr.Length = 0;
+	hash = 0;
+	if (nBytes <= sizeof(inlineBuf)) {
+		uStr.MaximumLength = sizeof(inlineBuf);
+		uStr.Buffer = inlineBuf;
+		aType = FromInline;
+	} else {
+		int sizeClass = SizeClassOf(nBytes);
+		if (sizeClass >= 0) {
+			// rounded up to the class size - appends can use the rest
+			uStr.MaximumLength = SIZE_CLASS_BYTES(sizeClass);
+			uStr.Buffer = (PWSTR)
+				ExAllocateFromPagedLookasideList(&SizeClassLists[sizeClass]);
+			aType = FromLookaside;
+		} else {
+			uStr.MaximumLength = nBytes;
+			uStr.Buffer = (PWSTR)
+				ExAllocatePoolWithTag(PagedPool, uStr.MaximumLength, 1633);
+			aType = FromPaged;
+		}
+	}
+	if (uStr.Buffer == NULL) {
+		Init();		// out of pool - stay a harmless, empty string
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOLEAN CUString::Grow(USHORT nBytes) {
+	// At least double the capacity, so that a run of appends
+	// copies each character a bounded number of times
+	ULONG newSize = 2 * (ULONG) uStr.MaximumLength;
+	if (newSize < nBytes)
+		newSize = nBytes;
+	if (newSize > MAX_BUFFER_BYTES)
+		newSize = MAX_BUFFER_BYTES;
+	CUString bigger;
+	if (!bigger.AllocBuffer( (USHORT) newSize ))
+		return FALSE;	// left as it was
+	RtlCopyUnicodeString(&bigger.uStr, &uStr);
+	bigger.uStr.Buffer[bigger.uStr.Length/2] = UNICODE_NULL;
+	Free();
+	TakeOver(bigger);
+	return TRUE;
+}
+
+void CUString::TakeOver(CUString& from) {
+	// Assumes no buffer is currently held
+	if (from.aType == FromInline) {
+		// inline data can't change owner - copy it instead
+		uStr.Length = from.uStr.Length;
+		uStr.MaximumLength = sizeof(inlineBuf);
+		uStr.Buffer = inlineBuf;
+		RtlCopyMemory(inlineBuf, from.inlineBuf, from.uStr.Length + sizeof(WCHAR));
+	} else
+		uStr = from.uStr;
+	aType = from.aType;
+	hash = from.hash;
+	from.Init();	// from no longer owns anything
 }
 
 CUString::CUString(const char* pAnsiString) {
 	ANSI_STRING str;
 	RtlInitAnsiString(&str, pAnsiString);
-	uStr.MaximumLength = (USHORT) max(32, RtlAnsiStringToUnicodeSize(&str) );
-	uStr.Buffer = (PWSTR)
-		ExAllocatePoolWithTag(PagedPool, uStr.MaximumLength, 1633);
-	aType = FromPaged;
+	// A byte never makes more than one WCHAR - no need to
+	// scan the string just to size it exactly
+	ULONG nBytes = ((ULONG) str.Length + 1) * sizeof(WCHAR);
+	if (nBytes > MAX_BUFFER_BYTES) {
+		Init();		// too long for a UNICODE_STRING
+		return;
+	}
+	if (!AllocBuffer( (USHORT) nBytes ))
+		return;		// out of pool - empty
 	RtlAnsiStringToUnicodeString(&uStr, &str, FALSE);
 }
 
 CUString::CUString(PCWSTR pWideString) {
 	RtlInitUnicodeString(&uStr, pWideString);
 	aType = FromCode;
+	hash = 0;
+}
+
+CUString::CUString(PCWSTR pLiteral, USHORT nBytes, LITERAL_TAG) {
+	// pLiteral is static, so it can be pointed to for good
+	uStr.Length = nBytes;
+	uStr.MaximumLength = nBytes + sizeof(WCHAR);
+	uStr.Buffer = (PWSTR) pLiteral;
+	aType = FromLiteral;
+	hash = 0;
+}
+
+CUString::CUString(const CUStringBuilder& builder) {
+	if (!AllocBuffer(builder.uStr.Length + sizeof(WCHAR)))
+		return;		// out of pool - empty
+	RtlCopyUnicodeString(&uStr, (PUNICODE_STRING)&builder.uStr);
+	uStr.Buffer[uStr.Length/2] = UNICODE_NULL;
 }
 
 CUString::~CUString() {
@@ -43,44 +189,141 @@ CUString::~CUString() {
 }
 
 void CUString::Free() {
-	if (aType == FromPaged || aType == FromNonPaged)
+	// A lookaside buffer is a pool block of its class's size, so
+	// it can go back to the pool once the lists are gone
+	int sizeClass = (aType == FromLookaside) ? SizeClassOf(uStr.MaximumLength) : -1;
+	if (sizeClass >= 0)
+		ExFreeToPagedLookasideList(&SizeClassLists[sizeClass], uStr.Buffer);
+	else if (OwnsBuffer())
 		ExFreePool(uStr.Buffer);
-	uStr.Buffer = NULL;
-	uStr.Length = 0;
-	uStr.MaximumLength = 0;
+	Init();		// back to a harmless, empty string
 }
 
 CUString::CUString(const CUString& orig) {	// copy constructor (required)
-	uStr.Length = 0;
-	uStr.MaximumLength = orig.uStr.MaximumLength;
-	uStr.Buffer = (PWSTR)
-		ExAllocatePoolWithTag(PagedPool, uStr.MaximumLength, 1633);
-	aType = FromPaged;
-	RtlCopyUnicodeString(&uStr, (PUNICODE_STRING)&orig.uStr);
-	uStr.Buffer[uStr.Length/2] = UNICODE_NULL;
+	Init();
+	if (orig.aType == Empty)
+		return;		// nothing to copy - and nothing to allocate
+	if (orig.aType == FromLiteral) {
+		uStr = orig.uStr;	// literals never go away - share it
+		aType = FromLiteral;
+	} else {
+		ULONG needed = (ULONG) orig.uStr.Length + sizeof(WCHAR);
+		if (needed > MAX_BUFFER_BYTES)
+			return;		// no room for the terminator
+		if (!AllocBuffer( (USHORT) needed ))
+			return;		// out of pool - empty
+		RtlCopyUnicodeString(&uStr, (PUNICODE_STRING)&orig.uStr);
+		uStr.Buffer[uStr.Length/2] = UNICODE_NULL;
+	}
+	hash = orig.hash;	// same text, same hash
 }
 
-CUString CUString::operator=(const CUString& rop) {	// assignment operator overload (required)
+CUString& CUString::operator=(const CUString& rop) {	// assignment operator overload (required)
 	if (&rop != this) {	// lop == rop ??? why was I called
-		if (rop.uStr.Length >= uStr.Length || 	// does it fit?
-			(aType != FromPaged && aType != FromNonPaged) ) {
+		if (rop.aType == Empty) {
+			Free();
+			return *this;
+		}
+		if (rop.aType == FromLiteral) {
+			Free();
+			uStr = rop.uStr;	// share the literal
+			aType = FromLiteral;
+			hash = rop.hash;
+			return *this;
+		}
+		ULONG needed = (ULONG) rop.uStr.Length + sizeof(WCHAR);
+		if (needed > MAX_BUFFER_BYTES) {
+			Free();		// no room for the terminator
+			return *this;
+		}
+		if (!IsWritable() || needed > uStr.MaximumLength) {
 			// it doesn't fit - free up existing buffer
-			if (aType == FromPaged || aType == FromNonPaged)
-				ExFreePool(uStr.Buffer);
-			uStr.Length = 0;
-			uStr.MaximumLength = rop.uStr.MaximumLength;
-			// and allocate fresh space
-			uStr.Buffer = (PWSTR)
-				ExAllocatePoolWithTag(PagedPool, uStr.MaximumLength, 1633);
-			aType = FromPaged;
+			Free();
+			// and get fresh space
+			if (!AllocBuffer( (USHORT) needed ))
+				return *this;	// out of pool - empty
 		}
+		// otherwise the existing buffer is reused as is
 		RtlCopyUnicodeString(&uStr, (PUNICODE_STRING)&rop.uStr);
 		uStr.Buffer[uStr.Length/2] = UNICODE_NULL;
+		hash = rop.hash;
 	}
 	return *this;
 }
+
+#ifdef CUSTRING_HAS_MOVE
+CUString::CUString(CUString&& orig) {	// move constructor
+	// Take over orig's buffer (whatever kind it is),
+	// leaving orig empty, so its destructor frees nothing
+	TakeOver(orig);
+}
+
+CUString& CUString::operator=(CUString&& rop) {	// move assignment
+	if (&rop != this) {
+		Free();
+		TakeOver(rop);
+	}
+	return *this;
+}
+#endif
+
+void CUString::Swap(CUString& other) {
+	if (&other == this)
+		return;
+	CUString tmp;
+	tmp.TakeOver(*this);
+	TakeOver(other);
+	other.TakeOver(tmp);
+}
+
+// Folds a-z to A-Z and leaves every other WCHAR alone
+#define ASCII_UPCASE(c) \
+	((WCHAR) ((c) ^ ((((ULONG) (c) - L'a') < 26) << 5)))
+
 BOOLEAN CUString::operator ==(const CUString& rop) const {
-	return RtlEqualUnicodeString(&this->uStr, &rop.uStr, FALSE);	// case matters
+	// case matters
+	if (uStr.Length != rop.uStr.Length)
+		return FALSE;	// the cheapest test first
+	if (hash && rop.hash && hash != rop.hash)
+		return FALSE;	// both hashed, and they differ
+	if (uStr.Length == 0)
+		return TRUE;
+	// RtlEqualMemory is a memcmp, which the compiler vectorizes
+	return RtlEqualMemory(uStr.Buffer, rop.uStr.Buffer, uStr.Length);
+}
+
+BOOLEAN CUString::EqualsNoCase(const CUString& rop) const {
+	if (uStr.Length != rop.uStr.Length)
+		return FALSE;
+	if (hash && rop.hash && hash != rop.hash)
+		return FALSE;	// the hash ignores case too
+	for (USHORT i = 0; i < uStr.Length/2; i++) {
+		WCHAR c1 = uStr.Buffer[i];
+		WCHAR c2 = rop.uStr.Buffer[i];
+		if (c1 == c2)
+			continue;
+		if ((c1 | c2) < 128) {	// both ASCII - fold in place
+			if (ASCII_UPCASE(c1) != ASCII_UPCASE(c2))
+				return FALSE;
+		} else if (RtlUpcaseUnicodeChar(c1) != RtlUpcaseUnicodeChar(c2))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+ULONG CUString::Hash() const {
+	if (hash == 0) {
+		// FNV-1a over the upcased characters, so that strings
+		// which are EqualsNoCase (and ==) hash alike
+		ULONG h = 2166136261;
+		for (USHORT i = 0; i < uStr.Length/2; i++) {
+			WCHAR c = uStr.Buffer[i];
+			h ^= (c < 128) ? ASCII_UPCASE(c) : RtlUpcaseUnicodeChar(c);
+			h *= 16777619;
+		}
+		hash = h ? h : 1;	// 0 means "not yet computed"
+	}
+	return hash;
 }
 
 CUString::operator PWSTR() const {
@@ -93,10 +336,11 @@ CUString::operator UNICODE_STRING &() {
 
 CUString CUString::operator+(const CUString& rop) const {
 	CUString retVal;
-	retVal.uStr.Length = this->uStr.Length + rop.uStr.Length;
-	retVal.uStr.MaximumLength = max(32, retVal.uStr.Length+2);
-	retVal.uStr.Buffer = (PWSTR)
-		ExAllocatePoolWithTag(PagedPool, retVal.uStr.MaximumLength, 1633);
+	ULONG needed = (ULONG) this->uStr.Length + rop.uStr.Length + sizeof(WCHAR);
+	if (needed > MAX_BUFFER_BYTES)
+		return retVal;		// too long - empty
+	if (!retVal.AllocBuffer( (USHORT) needed ))
+		return retVal;		// out of pool - empty
 	RtlCopyUnicodeString(&retVal.uStr, (PUNICODE_STRING)&this->uStr);
 	RtlAppendUnicodeStringToString(&retVal.uStr, (PUNICODE_STRING)&rop.uStr);
 	retVal.uStr.Buffer[retVal.uStr.Length/2] = UNICODE_NULL;
@@ -105,30 +349,189 @@ CUString CUString::operator+(const CUString& rop) const {
 }
 
 CUString& CUString::operator+=(const CUString& rop) {
-	*this = *this + rop;
+	if (&rop == this) {	// s += s - must not append from a moving buffer
+		CUString ropCopy(rop);
+		return *this += ropCopy;
+	}
+	ULONG needed = (ULONG) uStr.Length + rop.uStr.Length + sizeof(WCHAR);
+	if (needed > MAX_BUFFER_BYTES)
+		return *this;		// too long - left as it was
+	if ((!IsWritable() || needed > uStr.MaximumLength) &&
+		!Grow( (USHORT) needed ))
+		return *this;		// out of pool - left as it was
+	RtlAppendUnicodeStringToString(&uStr, (PUNICODE_STRING)&rop.uStr);
+	uStr.Buffer[uStr.Length/2] = UNICODE_NULL;
+	hash = 0;
 	return *this;
 }
 
+void CUString::Reserve(USHORT nChars) {
+	ULONG needed = ((ULONG) nChars + 1) * sizeof(WCHAR);
+	if (needed > MAX_BUFFER_BYTES)
+		needed = MAX_BUFFER_BYTES;	// as much as there can be
+	if (!IsWritable() || needed > uStr.MaximumLength) {
+		// exactly what was asked for, not doubled
+		CUString bigger;
+		if (!bigger.AllocBuffer( (USHORT) needed ))
+			return;		// out of pool - left as it was
+		RtlCopyUnicodeString(&bigger.uStr, &uStr);
+		bigger.uStr.Buffer[bigger.uStr.Length/2] = UNICODE_NULL;
+		bigger.hash = hash;	// contents unchanged
+		Free();
+		TakeOver(bigger);
+	}
+}
+
 CUString::operator ULONG() const {
 	ULONG retVal;
-	RtlUnicodeStringToInteger((PUNICODE_STRING)&uStr, 0, &retVal);
+	ToULONG(&retVal);
 	return retVal;
 }
 
+BOOLEAN CUString::ToULONG(PULONG pValue) const {
+	// Accepts an optional sign, then an optional base prefix
+	// (0x, 0o or 0b, as RtlUnicodeStringToInteger) - else
+	// decimal.  Stops at the first character that isn't a digit.
+	PCWSTR next = uStr.Buffer;
+	PCWSTR end = uStr.Buffer + uStr.Length/2;
+	BOOLEAN negative = FALSE;
+	*pValue = 0;
+
+	if (next < end && (*next == L'-' || *next == L'+'))
+		negative = (*next++ == L'-');
+
+	ULONG base = 10;
+	if (end - next >= 2 && *next == L'0') {
+		switch (next[1] | 0x20) {	// lower case
+		case L'x':	base = 16; next += 2; break;
+		case L'o':	base = 8; next += 2; break;
+		case L'b':	base = 2; next += 2; break;
+		}
+	}
+
+	// Accumulate in 64 bits: any carry into the upper half
+	// is an overflow, with no test inside the loop
+	ULONGLONG acc = 0;
+	ULONG overflow = 0;
+	PCWSTR first = next;
+	for (; next < end; next++) {
+		ULONG digit = (*next < 128) ? DigitValue[*next] : 0xFF;
+		if (digit >= base)
+			break;
+		acc = acc * base + digit;
+		overflow |= (ULONG) (acc >> 32);
+		acc &= 0xFFFFFFFF;
+	}
+	if (next == first || overflow)
+		return FALSE;
+
+	*pValue = negative ? 0 - (ULONG) acc : (ULONG) acc;
+	return TRUE;
+}
+
+USHORT CUString::FormatULONG(ULONG value, PWSTR pDigits) {
+	// Digits come out least significant first,
+	// so build them at the end of a scratch buffer
+	WCHAR digits[10];
+	int pos = 10;
+	while (value >= 100) {
+		ULONG pair = (value % 100) * 2;
+		value /= 100;
+		digits[--pos] = DigitPairs[pair+1];
+		digits[--pos] = DigitPairs[pair];
+	}
+	if (value >= 10) {
+		digits[--pos] = DigitPairs[value*2+1];
+		digits[--pos] = DigitPairs[value*2];
+	} else
+		digits[--pos] = (WCHAR) (L'0' + value);
+
+	RtlCopyMemory(pDigits, &digits[pos], (10 - pos) * sizeof(WCHAR));
+	return (USHORT) (10 - pos);
+}
+
 CUString::CUString(ULONG value) {
 	// Converts from a ULONG into a CUString
-	uStr.Length = 0;
-	uStr.MaximumLength = 32;
-	uStr.Buffer = (PWSTR)
-		ExAllocatePoolWithTag(PagedPool, uStr.MaximumLength, 1633);
-	aType = FromPaged;
-	RtlIntegerToUnicodeString(value, 0, &uStr);
+	if (!AllocBuffer(11 * sizeof(WCHAR)))	// 10 digits - inline by default
+		return;		// out of pool - empty
+	uStr.Length = FormatULONG(value, uStr.Buffer) * sizeof(WCHAR);
+	uStr.Buffer[uStr.Length/2] = UNICODE_NULL;
 }
 
 WCHAR& CUString::operator[](int idx) {
 	// accesses an individual WCHAR in CUString buffer
+	static WCHAR discard;	// for strings with nothing to write to
+	if (aType == FromLiteral)
+		Reserve(uStr.Length/2);	// literals are read-only - get a copy
+	hash = 0;	// the caller may well change it
+	if (aType == FromLiteral || uStr.Buffer == NULL) {
+		discard = UNICODE_NULL;	// no copy could be had
+		return discard;
+	}
 	if (idx >= 0  && idx < uStr.MaximumLength/2)
 		return uStr.Buffer[idx];
 	else
 		return uStr.Buffer[0];	// got to return something
 }
+
+void CUStringBuilder::Init() {
+	uStr.Length = 0;
+	uStr.MaximumLength = sizeof(buf);
+	uStr.Buffer = buf;
+	buf[0] = UNICODE_NULL;
+	bOverflow = FALSE;
+}
+
+void CUStringBuilder::AppendChars(PCWSTR pChars, USHORT nBytes) {
+	// always keep room for the terminating NULL
+	if (uStr.Length + nBytes + sizeof(WCHAR) > uStr.MaximumLength) {
+		bOverflow = TRUE;
+		return;
+	}
+	RtlCopyMemory(&buf[uStr.Length/2], pChars, nBytes);
+	uStr.Length += nBytes;
+	buf[uStr.Length/2] = UNICODE_NULL;
+}
+
+CUStringBuilder& CUStringBuilder::Append(const char* pAnsiString) {
+	ANSI_STRING str;
+	RtlInitAnsiString(&str, pAnsiString);
+	// convert straight into the unused tail of buf
+	UNICODE_STRING tail;
+	tail.Length = 0;
+	tail.MaximumLength = uStr.MaximumLength - uStr.Length;
+	tail.Buffer = &buf[uStr.Length/2];
+	if ((str.Length + 1) * sizeof(WCHAR) > tail.MaximumLength &&
+		RtlAnsiStringToUnicodeSize(&str) > tail.MaximumLength) {
+		bOverflow = TRUE;
+		return *this;
+	}
+	RtlAnsiStringToUnicodeString(&tail, &str, FALSE);
+	uStr.Length += tail.Length;
+	buf[uStr.Length/2] = UNICODE_NULL;
+	return *this;
+}
+
+CUStringBuilder& CUStringBuilder::Append(PCWSTR pWideString) {
+	UNICODE_STRING str;
+	RtlInitUnicodeString(&str, pWideString);
+	AppendChars(str.Buffer, str.Length);
+	return *this;
+}
+
+CUStringBuilder& CUStringBuilder::Append(const CUString& str) {
+	AppendChars(str.uStr.Buffer, str.uStr.Length);
+	return *this;
+}
+
+CUStringBuilder& CUStringBuilder::Append(ULONG value) {
+	// 10 digits and a NULL cover any ULONG
+	if ((ULONG) (uStr.MaximumLength - uStr.Length) < 11 * sizeof(WCHAR)) {
+		bOverflow = TRUE;
+		return *this;
+	}
+	uStr.Length +=
+		CUString::FormatULONG(value, &buf[uStr.Length/2]) * sizeof(WCHAR);
+	buf[uStr.Length/2] = UNICODE_NULL;
+	return *this;
+}
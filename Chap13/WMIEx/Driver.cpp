@@ -178,8 +178,8 @@ NTSTATUS AddDevice (
 #endif
 	
 	// Form the internal Device Name
-	CUString devName("\\Device\\WMIEXAMPLE"); // for WMI Example dev
-	devName += CUString(ulDeviceNumber);
+	CUString devName( // for WMI Example dev
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\Device\\WMIEXAMPLE")).Append(ulDeviceNumber) );
 
 	// Now create the device
 	status =
@@ -235,8 +235,8 @@ NTSTATUS AddDevice (
 						(PVOID) pfdo );
 
 	// Form the symbolic link name
-	CUString symLinkName("\\??\\WMIEX");
-	symLinkName += CUString(ulDeviceNumber+1);	// 1 based
+	CUString symLinkName(
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\??\\WMIEX")).Append(ulDeviceNumber+1) );	// 1 based
 	pDevExt->ustrSymLinkName = symLinkName;
 
 	// Now create the link name
@@ -780,28 +780,17 @@ NTSTATUS DispatchRead (
 	pDevExt->mofData.totalTransfers++;
 
 	// The loopback connector requires us to do
-	// some bizzare work.
-	// Bit 0 of the data is sent as bit 0 of Port data.
-	WriteData( pDevExt, nextByte & 1);
-	// It will be read in Status bit 3
-	// Bits 1-3 of the data are sent as bits 0,1, & 3
-	// of the Control register.
-	// Control bits 0 & 1 are inverted.
-	UCHAR bits = (nextByte & 0x8) +
-				 ((nextByte & 0x6)>>1);
-	bits ^= 0x3;	// Invert the 2 control bits (0 & 1)
-	// These bits will be read in Status bits 4,5, & 7
-	WriteControl( pDevExt, bits | CTL_DEFAULT);
+	// some bizzare work (see Nibble.h).
+	WriteData( pDevExt, NibbleEncodeTable[nextByte].Data );
+	WriteControl( pDevExt,
+		NibbleEncodeTable[nextByte].Control | CTL_DEFAULT);
 
 	// Now read the data from the loopback
 	UCHAR status =
 		ReadStatus( pDevExt );
 
 	// Format the nibble into the upper half of the byte
-	UCHAR readByte =
-		((status & 0x8)<< 1) |
-		((status & 0x30)<<1) |
-		(status & 0x80);
+	UCHAR readByte = NibbleDecodeTable[status];
 	pDevExt->deviceBuffer[pDevExt->xferCount++] =
 		readByte;
 #if DBG>=1
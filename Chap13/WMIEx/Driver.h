@@ -16,6 +16,7 @@ extern "C" {
 #include <WMISTR.h>
 }
 #include "Unicode.h"
+#include "Nibble.h"
 
 enum DRIVER_STATE {Stopped, Started, Removed};
 
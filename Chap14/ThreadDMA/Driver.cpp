@@ -139,8 +139,8 @@ NTSTATUS AddDevice (
 #endif
 	
 	// Form the internal Device Name
-	CUString devName("\\Device\\THREADDMA"); // for "ThreadDMA" dev
-	devName += CUString(ulDeviceNumber);
+	CUString devName( // for "ThreadDMA" dev
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\Device\\THREADDMA")).Append(ulDeviceNumber) );
 
 	// Now create the device
 	status =
@@ -181,8 +181,8 @@ NTSTATUS AddDevice (
 	// pLowerDevExt->pUpperDevice = pfdo;
 
 	// Form the symbolic link name
-	CUString symLinkName("\\??\\MPNP");
-	symLinkName += CUString(ulDeviceNumber+1);	// 1 based
+	CUString symLinkName(
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\??\\MPNP")).Append(ulDeviceNumber+1) );	// 1 based
 	pDevExt->ustrSymLinkName = symLinkName;
 
 	// Now create the link name
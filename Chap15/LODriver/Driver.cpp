@@ -141,8 +141,8 @@ NTSTATUS AddDevice (
 #endif
 	
 	// Form the internal Device Name
-	CUString devName("\\Device\\LODRIVER"); // for "LODriver" dev
-	devName += CUString(ulDeviceNumber);
+	CUString devName( // for "LODriver" dev
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\Device\\LODRIVER")).Append(ulDeviceNumber) );
 
 	// Now create the device
 	status =
@@ -182,8 +182,8 @@ NTSTATUS AddDevice (
 	// pLowerDevExt->pUpperDevice = pfdo;
 
 	// Form the symbolic link name
-	CUString symLinkName("\\??\\LODRV");
-	symLinkName += CUString(ulDeviceNumber+1);	// 1 based
+	CUString symLinkName(
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\??\\LODRV")).Append(ulDeviceNumber+1) );	// 1 based
 	pDevExt->ustrSymLinkName = symLinkName;
 
 	// Now create the link name
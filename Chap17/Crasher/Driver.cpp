@@ -94,8 +94,8 @@ NTSTATUS CreateDevice (
 	PDEVICE_EXTENSION pDevExt;
 	
 	// Form the internal Device Name
-	CUString devName("\\Device\\CRASHER");	// for "crasher" device
-	devName += CUString(ulDeviceNumber);
+	CUString devName(	// for "crasher" device
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\Device\\CRASHER")).Append(ulDeviceNumber) );
 
 	// Now create the device
 	status =
@@ -115,8 +115,8 @@ NTSTATUS CreateDevice (
 	pDevExt->ustrDeviceName = devName;
 
 	// Form the symbolic link name
-	CUString symLinkName("\\??\\CRASH");
-	symLinkName += CUString(ulDeviceNumber+1);	// 1 based
+	CUString symLinkName(
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\??\\CRASH")).Append(ulDeviceNumber+1) );	// 1 based
 	pDevExt->ustrSymLinkName = symLinkName;
 
 	// Now create the link name
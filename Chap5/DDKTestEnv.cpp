@@ -3,18 +3,84 @@
 // Copyright (C) 2000 by Jerry Lozano
 //
 
-#include "stdafx.h"
-#include <wchar.h>
+#include "StdAfx.h"
 #include "DDKTestEnv.h"
+#include <stdio.h>
+#ifndef _WIN32
+#include <time.h>
+#include <sched.h>
+#endif
 
-VOID ExFreePool(IN PVOID P) {
-	free(P);
+// SSE2 is always there on x64 (and with /arch:SSE2 on x86);
+// AVX2 only when the compiler is told it may use it
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TESTENV_SSE2
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define TESTENV_AVX2
+#endif
+
+// Widens the leading run of 7-bit ASCII in pAnsi, up to nBytes, into
+// pWide.  Returns how many bytes were widened - the first non-ASCII
+// byte (if any) is at that offset.
+static ULONG WidenAscii(const CHAR* pAnsi, ULONG nBytes, PWSTR pWide) {
+	ULONG i = 0;
+#ifdef TESTENV_AVX2
+	for (; i + 32 <= nBytes; i += 32) {
+		__m256i bytes = _mm256_loadu_si256((const __m256i*) &pAnsi[i]);
+		if (_mm256_movemask_epi8(bytes))
+			break;	// a high bit is set - not ASCII
+		_mm256_storeu_si256((__m256i*) &pWide[i],
+			_mm256_cvtepu8_epi16(_mm256_castsi256_si128(bytes)));
+		_mm256_storeu_si256((__m256i*) &pWide[i+16],
+			_mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1)));
+	}
+#endif
+#ifdef TESTENV_SSE2
+	__m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= nBytes; i += 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*) &pAnsi[i]);
+		if (_mm_movemask_epi8(bytes))
+			break;
+		_mm_storeu_si128((__m128i*) &pWide[i], _mm_unpacklo_epi8(bytes, zero));
+		_mm_storeu_si128((__m128i*) &pWide[i+8], _mm_unpackhi_epi8(bytes, zero));
+	}
+#endif
+	for (; i < nBytes; i++) {
+		if (pAnsi[i] & 0x80)
+			break;
+		pWide[i] = (WCHAR) pAnsi[i];
+	}
+	return i;
+}
+
+// Converts non-ASCII text with the ANSI code page.  Without one (on
+// Linux) bytes are taken as Latin-1, which maps them 1:1.
+// Returns the number of WCHARs produced.
+static ULONG WidenCodePage(const CHAR* pAnsi, ULONG nBytes,
+						   PWSTR pWide, ULONG nWideMax) {
+	if (nBytes == 0)
+		return 0;
+#ifdef _WIN32
+	return MultiByteToWideChar(CP_ACP, 0, pAnsi, nBytes, pWide, nWideMax);
+#else
+	ULONG n = min(nBytes, nWideMax);
+	for (ULONG i = 0; i < n; i++)
+		pWide[i] = (UCHAR) pAnsi[i];
+	return n;
+#endif
 }
 
 ULONG RtlAnsiStringToUnicodeSize(PANSI_STRING AnsiString ) {
-	ULONG len =
-		MultiByteToWideChar(CP_ACP, 0, AnsiString->Buffer, -1, NULL, 0);
-	return len*2;
+	ULONG nChars = AnsiString->Length;
+#ifdef _WIN32
+	if (nChars)	// multibyte characters make for fewer WCHARs
+		nChars = MultiByteToWideChar(CP_ACP, 0,
+					AnsiString->Buffer, AnsiString->Length, NULL, 0);
+#endif
+	return (nChars + 1) * sizeof(WCHAR);
 }
 
 NTSTATUS 
@@ -23,16 +89,27 @@ NTSTATUS
   IN PANSI_STRING  SourceString,
   IN BOOLEAN  AllocateDestinationString
   ) {
-	int len =
-		RtlAnsiStringToUnicodeSize(SourceString);
+	// Each byte yields at most one WCHAR, so this is always enough
+	ULONG maxSize = (SourceString->Length + 1) * sizeof(WCHAR);
 	if (AllocateDestinationString) {
 		DestinationString->Buffer = (PWSTR)
-			malloc(len);
-		DestinationString->MaximumLength = len;
-	}
-	MultiByteToWideChar(CP_ACP, 0, SourceString->Buffer, -1, DestinationString->Buffer, len);
-	DestinationString->Length = len-2;
-	return 0;
+			ExAllocatePoolWithTag(PagedPool, maxSize, 0);
+		DestinationString->MaximumLength = (USHORT) maxSize;
+	} else if (DestinationString->MaximumLength < maxSize &&
+		DestinationString->MaximumLength < RtlAnsiStringToUnicodeSize(SourceString))
+		return STATUS_BUFFER_OVERFLOW;	// only sized exactly when it's tight
+
+	// One pass: ASCII is widened in bulk, anything else
+	// from the first non-ASCII byte on goes the slow way
+	ULONG nAscii = WidenAscii(SourceString->Buffer, SourceString->Length,
+								DestinationString->Buffer);
+	ULONG nChars = nAscii +
+		WidenCodePage(&SourceString->Buffer[nAscii], SourceString->Length - nAscii,
+			&DestinationString->Buffer[nAscii],
+			DestinationString->MaximumLength/2 - 1 - nAscii);
+	DestinationString->Buffer[nChars] = UNICODE_NULL;
+	DestinationString->Length = (USHORT) (nChars * sizeof(WCHAR));
+	return STATUS_SUCCESS;
 }
 
 VOID 
@@ -40,8 +117,11 @@ VOID
   IN OUT PUNICODE_STRING  DestinationString,
   IN PCWSTR  SourceString
   ) {
+	PCWSTR end = SourceString;
+	while (*end != UNICODE_NULL)
+		end++;
 	DestinationString->Buffer = (PWSTR) SourceString;
-	DestinationString->Length = wcslen(SourceString)*2;
+	DestinationString->Length = (USHORT) ((end - SourceString) * sizeof(WCHAR));
 	DestinationString->MaximumLength = DestinationString->Length + 2;
 }
 
@@ -62,18 +142,497 @@ NTSTATUS
   ) {
 	int srcLen = min(Destination->MaximumLength - Destination->Length - 2,
 						Source->Length);
-	Destination->Buffer[Destination->Length/2] = UNICODE_NULL;
+	memmove(&Destination->Buffer[Destination->Length/2], Source->Buffer, srcLen);
 	Destination->Length += srcLen;
-	wcsncat(Destination->Buffer, Source->Buffer, srcLen/2);
+	Destination->Buffer[Destination->Length/2] = UNICODE_NULL;
 
 	return 0;
 }
 
 
+ULONG TestEnvPoolAllocations = 0;
+ULONG TestEnvFailPoolAllocations = 0;
+
+// Paged and nonpaged pool are kept apart - on Windows each gets a
+// heap of its own - and every block starts with a POOL_HEADER.
+// The header's size keeps the caller's part as aligned as malloc's.
+#define POOL_MAGIC		0x4C4F4F50	// "POOL"
+#define POOL_FREED		0x45455246	// "FREE"
+#define POOL_TYPES		2
+#define POOL_TAG_SLOTS	256			// tags (per pool) tracked
+
+typedef union _POOL_HEADER {
+	struct {
+		ULONG Magic;
+		ULONG Tag;
+		POOL_TYPE PoolType;
+		SIZE_T nBytes;
+	} h;
+	ULONGLONG align[4];
+} POOL_HEADER, *PPOOL_HEADER;
+
+// Tags are found by open addressing in all but the last slot.  Once
+// those are full, new tags are charged to the last one.
+#define POOL_TAG_OTHERS	(POOL_TAG_SLOTS - 1)
+static TESTENV_POOL_TAG_STATS poolTags[POOL_TAG_SLOTS];
+static ULONG nPoolTags = 0;
+static BOOLEAN bLeakReport = FALSE;
+#ifdef _WIN32
+static HANDLE hPoolHeaps[POOL_TYPES];
+static volatile LONG poolLock = 0;
+#else
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void LockPool() {
+#ifdef _WIN32
+	while (InterlockedExchange((LONG*) &poolLock, 1) != 0)
+		Sleep(0);
+#else
+	pthread_mutex_lock(&poolLock);
+#endif
+}
+
+static void UnlockPool() {
+#ifdef _WIN32
+	InterlockedExchange((LONG*) &poolLock, 0);
+#else
+	pthread_mutex_unlock(&poolLock);
+#endif
+}
+
+// Milliseconds from some fixed point
+static ULONG PoolTicks() {
+#ifdef _WIN32
+	return GetTickCount();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (ULONG) (now.tv_sec * 1000 + now.tv_nsec / 1000000);
+#endif
+}
+
+// Tags made of printable characters print as text (first character
+// in the low byte, as written with a 'xxxx' constant); others, like
+// CUString's 1633, in decimal
+static const char* PoolTagName(ULONG Tag, char name[16]) {
+	for (int i = 0; i < 4; i++) {
+		UCHAR c = (UCHAR) (Tag >> (8 * i));
+		if (c < ' ' || c > '~') {
+			sprintf(name, "%u", Tag);
+			return name;
+		}
+		name[i] = (char) c;
+	}
+	name[4] = '\0';
+	return name;
+}
+
+// The tag's slot, NULL if it hasn't been used (and bAdd is FALSE).
+// Called with the pool lock held.
+static PTESTENV_POOL_TAG_STATS FindPoolTag(ULONG Tag, POOL_TYPE PoolType,
+											BOOLEAN bAdd) {
+	ULONG i = ((Tag * 0x9E3779B9) ^ PoolType) % POOL_TAG_OTHERS;
+	for (ULONG n = 0; n < POOL_TAG_OTHERS; n++) {
+		PTESTENV_POOL_TAG_STATS pStats = &poolTags[i];
+		if (pStats->Allocs == 0) {		// free slot - tag not there
+			if (!bAdd || nPoolTags == POOL_TAG_OTHERS)
+				break;
+			nPoolTags++;
+			pStats->Tag = Tag;
+			pStats->PoolType = PoolType;
+			pStats->FirstTick = PoolTicks();
+			return pStats;
+		}
+		if (pStats->Tag == Tag && pStats->PoolType == PoolType)
+			return pStats;
+		i = (i + 1) % POOL_TAG_OTHERS;
+	}
+	if (!bAdd)
+		return NULL;
+	if (poolTags[POOL_TAG_OTHERS].Allocs == 0)
+		poolTags[POOL_TAG_OTHERS].FirstTick = PoolTicks();
+	return &poolTags[POOL_TAG_OTHERS];
+}
+
+static void PrintPoolTags(FILE* pFile, BOOLEAN bLeaksOnly) {
+	ULONG now = PoolTicks();
+	fprintf(pFile, "%-10s %-7s %9s %9s %7s %11s %11s %9s\n", "Tag", "Pool",
+		"Allocs", "Frees", "Live", "LiveBytes", "PeakBytes", "Allocs/s");
+	for (ULONG i = 0; i < POOL_TAG_SLOTS; i++) {
+		const TESTENV_POOL_TAG_STATS* pStats = &poolTags[i];
+		if (pStats->Allocs == 0 || (bLeaksOnly && pStats->LiveAllocs == 0))
+			continue;
+		char name[16];
+		ULONG elapsed = now - pStats->FirstTick;
+		fprintf(pFile, "%-10s %-7s %9u %9u %7u %11lu %11lu %9.0f\n",
+			(i == POOL_TAG_OTHERS) ? "(others)" : PoolTagName(pStats->Tag, name),
+			pStats->PoolType == NonPagedPool ? "Nonp" : "Paged",
+			pStats->Allocs, pStats->Frees, pStats->LiveAllocs,
+			(unsigned long) pStats->LiveBytes, (unsigned long) pStats->PeakBytes,
+			pStats->Allocs * 1000.0 / (elapsed ? elapsed : 1));
+	}
+}
+
+static void ReportPoolLeaks() {
+	ULONG nLeaks = 0;
+	for (ULONG i = 0; i < POOL_TAG_SLOTS; i++)
+		nLeaks += poolTags[i].LiveAllocs;
+	if (nLeaks == 0)
+		return;
+	fprintf(stderr, "Pool leaks - %u block(s) never freed:\n", nLeaks);
+	PrintPoolTags(stderr, TRUE);
+}
+
 PVOID ExAllocatePoolWithTag(IN POOL_TYPE  PoolType,
 							IN SIZE_T  NumberOfBytes,
 							IN ULONG  Tag ) {
-	return malloc(NumberOfBytes);
+	LockPool();
+	if (!bLeakReport) {
+		atexit(ReportPoolLeaks);
+		bLeakReport = TRUE;
+	}
+	if (TestEnvFailPoolAllocations > 0) {
+		TestEnvFailPoolAllocations--;
+		UnlockPool();
+		return NULL;
+	}
+#ifdef _WIN32
+	int pool = (PoolType == NonPagedPool);
+	if (hPoolHeaps[pool] == NULL)
+		hPoolHeaps[pool] = HeapCreate(0, 0, 0);
+	PPOOL_HEADER pHeader = (PPOOL_HEADER)
+		HeapAlloc(hPoolHeaps[pool], 0, sizeof(POOL_HEADER) + NumberOfBytes);
+#else
+	PPOOL_HEADER pHeader = (PPOOL_HEADER)
+		malloc(sizeof(POOL_HEADER) + NumberOfBytes);
+#endif
+	if (pHeader == NULL) {
+		UnlockPool();
+		return NULL;
+	}
+	pHeader->h.Magic = POOL_MAGIC;
+	pHeader->h.Tag = Tag;
+	pHeader->h.PoolType = PoolType;
+	pHeader->h.nBytes = NumberOfBytes;
+
+	TestEnvPoolAllocations++;
+	PTESTENV_POOL_TAG_STATS pStats = FindPoolTag(Tag, PoolType, TRUE);
+	pStats->Allocs++;
+	pStats->LiveAllocs++;
+	pStats->LiveBytes += NumberOfBytes;
+	pStats->TotalBytes += NumberOfBytes;
+	if (pStats->LiveBytes > pStats->PeakBytes)
+		pStats->PeakBytes = pStats->LiveBytes;
+	UnlockPool();
+	return pHeader + 1;
+}
+
+VOID ExFreePool(IN PVOID P) {
+	PPOOL_HEADER pHeader = (PPOOL_HEADER) P - 1;
+	if (pHeader->h.Magic != POOL_MAGIC) {
+		// The kernel would bugcheck (BAD_POOL_CALLER)
+		fprintf(stderr, "ExFreePool: %p is %s\n", P,
+			pHeader->h.Magic == POOL_FREED ? "already freed" : "not from the pool");
+		abort();
+	}
+	pHeader->h.Magic = POOL_FREED;
+
+	LockPool();
+	PTESTENV_POOL_TAG_STATS pStats =
+		FindPoolTag(pHeader->h.Tag, pHeader->h.PoolType, TRUE);
+	pStats->Frees++;
+	pStats->LiveAllocs--;
+	pStats->LiveBytes -= pHeader->h.nBytes;
+#ifdef _WIN32
+	HeapFree(hPoolHeaps[pHeader->h.PoolType == NonPagedPool], 0, pHeader);
+#else
+	free(pHeader);
+#endif
+	UnlockPool();
+}
+
+VOID ExFreePoolWithTag(IN PVOID P, IN ULONG Tag) {
+	PPOOL_HEADER pHeader = (PPOOL_HEADER) P - 1;
+	if (pHeader->h.Magic == POOL_MAGIC && pHeader->h.Tag != Tag) {
+		char name1[16], name2[16];
+		fprintf(stderr, "ExFreePoolWithTag: %p has tag %s, not %s\n", P,
+			PoolTagName(pHeader->h.Tag, name1), PoolTagName(Tag, name2));
+		abort();	// BAD_POOL_CALLER again
+	}
+	ExFreePool(P);
+}
+
+BOOLEAN TestEnvQueryPoolTag(IN ULONG Tag, IN POOL_TYPE PoolType,
+							OUT PTESTENV_POOL_TAG_STATS pStats) {
+	LockPool();
+	PTESTENV_POOL_TAG_STATS pFound = FindPoolTag(Tag, PoolType, FALSE);
+	if (pFound != NULL)
+		*pStats = *pFound;
+	UnlockPool();
+	return pFound != NULL;
+}
+
+VOID TestEnvDumpPoolTags() {
+	LockPool();
+	PrintPoolTags(stdout, FALSE);
+	UnlockPool();
+}
+
+NTSTATUS ExInitializeResourceLite(IN PERESOURCE Resource) {
+#ifdef _WIN32
+	InitializeCriticalSection(&Resource->cs);
+#else
+	if (pthread_rwlock_init(&Resource->rwlock, NULL) != 0)
+		return STATUS_INSUFFICIENT_RESOURCES;
+#endif
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS ExDeleteResourceLite(IN PERESOURCE Resource) {
+#ifdef _WIN32
+	DeleteCriticalSection(&Resource->cs);
+#else
+	pthread_rwlock_destroy(&Resource->rwlock);
+#endif
+	return STATUS_SUCCESS;
+}
+
+BOOLEAN ExAcquireResourceSharedLite(IN PERESOURCE Resource, IN BOOLEAN Wait) {
+#ifdef _WIN32
+	if (!Wait)
+		return (BOOLEAN)TryEnterCriticalSection(&Resource->cs);
+	EnterCriticalSection(&Resource->cs);
+#else
+	if (!Wait)
+		return pthread_rwlock_tryrdlock(&Resource->rwlock) == 0;
+	pthread_rwlock_rdlock(&Resource->rwlock);
+#endif
+	return TRUE;
+}
+
+BOOLEAN ExAcquireResourceExclusiveLite(IN PERESOURCE Resource, IN BOOLEAN Wait) {
+#ifdef _WIN32
+	if (!Wait)
+		return (BOOLEAN)TryEnterCriticalSection(&Resource->cs);
+	EnterCriticalSection(&Resource->cs);
+#else
+	if (!Wait)
+		return pthread_rwlock_trywrlock(&Resource->rwlock) == 0;
+	pthread_rwlock_wrlock(&Resource->rwlock);
+#endif
+	return TRUE;
+}
+
+VOID ExReleaseResourceLite(IN PERESOURCE Resource) {
+#ifdef _WIN32
+	LeaveCriticalSection(&Resource->cs);
+#else
+	pthread_rwlock_unlock(&Resource->rwlock);
+#endif
+}
+
+static void SpinLock(volatile LONG* pLock) {
+#ifdef _WIN32
+	while (InterlockedExchange((LONG*) pLock, 1) != 0)
+		Sleep(0);
+#else
+	while (__sync_lock_test_and_set(pLock, 1) != 0)
+		sched_yield();
+#endif
+}
+
+static void SpinUnlock(volatile LONG* pLock) {
+#ifdef _WIN32
+	InterlockedExchange((LONG*) pLock, 0);
+#else
+	__sync_lock_release(pLock);
+#endif
+}
+
+VOID KeInitializeSpinLock(IN PKSPIN_LOCK SpinLock) {
+	*SpinLock = 0;
+}
+
+// There are no IRQLs here - the lock only keeps other threads out
+VOID KeAcquireSpinLock(IN PKSPIN_LOCK SpinLock, OUT PKIRQL OldIrql) {
+	::SpinLock(SpinLock);
+	*OldIrql = PASSIVE_LEVEL;
+}
+
+VOID KeReleaseSpinLock(IN PKSPIN_LOCK SpinLock, IN KIRQL NewIrql) {
+	::SpinUnlock(SpinLock);
+}
+
+// The calling thread's magazine
+static PTESTENV_MAGAZINE MagazineOf(PGENERAL_LOOKASIDE Lookaside) {
+#ifdef _WIN32
+	ULONG id = GetCurrentThreadId();
+#else
+	ULONG id = (ULONG) (SIZE_T) pthread_self();
+	id ^= id >> 12;		// thread stacks are page-aligned
+#endif
+	return &Lookaside->Magazines[(id * 0x9E3779B9) >> 28];	// 16 of them
+}
+
+static VOID InitializeLookaside(PGENERAL_LOOKASIDE Lookaside, POOL_TYPE Type,
+		PALLOCATE_FUNCTION Allocate, PFREE_FUNCTION Free,
+		SIZE_T Size, ULONG Tag) {
+	memset(Lookaside, 0, sizeof(*Lookaside));
+	Lookaside->Depth = Lookaside->MaximumDepth = 256;	// the kernel's limit
+	Lookaside->Type = Type;
+	Lookaside->Tag = Tag;
+	Lookaside->Size = (ULONG) max(Size, sizeof(PVOID));	// room for the link
+	Lookaside->Allocate = Allocate ? Allocate : ExAllocatePoolWithTag;
+	Lookaside->Free = Free ? Free : ExFreePool;
+}
+
+static PVOID AllocateFromLookaside(PGENERAL_LOOKASIDE Lookaside) {
+	PTESTENV_MAGAZINE pMag = MagazineOf(Lookaside);
+	PVOID pBlock = NULL;
+	SpinLock(&pMag->Lock);
+	pMag->Allocates++;
+	if (pMag->Count == 0 && Lookaside->DepotHead != NULL) {
+		// Reload half a magazine from the depot
+		SpinLock(&Lookaside->DepotLock);
+		while (pMag->Count < TESTENV_MAGAZINE_SIZE/2 && Lookaside->DepotHead != NULL) {
+			PVOID pNext = Lookaside->DepotHead;
+			Lookaside->DepotHead = *(PVOID*) pNext;
+			Lookaside->DepotCount--;
+			pMag->Blocks[pMag->Count++] = pNext;
+		}
+		SpinUnlock(&Lookaside->DepotLock);
+	}
+	if (pMag->Count > 0)
+		pBlock = pMag->Blocks[--pMag->Count];
+	else
+		pMag->AllocateMisses++;
+	SpinUnlock(&pMag->Lock);
+
+	if (pBlock == NULL)
+		pBlock = Lookaside->Allocate(Lookaside->Type, Lookaside->Size, Lookaside->Tag);
+	return pBlock;
+}
+
+static VOID FreeToLookaside(PGENERAL_LOOKASIDE Lookaside, PVOID Entry) {
+	PTESTENV_MAGAZINE pMag = MagazineOf(Lookaside);
+	SpinLock(&pMag->Lock);
+	pMag->Frees++;
+	if (pMag->Count == TESTENV_MAGAZINE_SIZE) {
+		// Full - pass half of it on to the depot, while there's room
+		SpinLock(&Lookaside->DepotLock);
+		while (pMag->Count > TESTENV_MAGAZINE_SIZE/2 &&
+				Lookaside->DepotCount < Lookaside->Depth) {
+			PVOID pBlock = pMag->Blocks[--pMag->Count];
+			*(PVOID*) pBlock = Lookaside->DepotHead;
+			Lookaside->DepotHead = pBlock;
+			Lookaside->DepotCount++;
+		}
+		if (Lookaside->DepotCount > Lookaside->PeakDepotCount)
+			Lookaside->PeakDepotCount = Lookaside->DepotCount;
+		SpinUnlock(&Lookaside->DepotLock);
+	}
+	BOOLEAN bCached = (pMag->Count < TESTENV_MAGAZINE_SIZE);
+	if (bCached)
+		pMag->Blocks[pMag->Count++] = Entry;
+	else
+		pMag->FreeMisses++;
+	SpinUnlock(&pMag->Lock);
+
+	if (!bCached)
+		Lookaside->Free(Entry);
+}
+
+static VOID DeleteLookaside(PGENERAL_LOOKASIDE Lookaside) {
+	for (ULONG i = 0; i < TESTENV_MAGAZINES; i++) {
+		PTESTENV_MAGAZINE pMag = &Lookaside->Magazines[i];
+		while (pMag->Count > 0)
+			Lookaside->Free(pMag->Blocks[--pMag->Count]);
+	}
+	while (Lookaside->DepotHead != NULL) {
+		PVOID pBlock = Lookaside->DepotHead;
+		Lookaside->DepotHead = *(PVOID*) pBlock;
+		Lookaside->Free(pBlock);
+	}
+	Lookaside->DepotCount = 0;
+}
+
+VOID ExInitializeNPagedLookasideList(
+	IN PNPAGED_LOOKASIDE_LIST Lookaside,
+	IN PALLOCATE_FUNCTION Allocate OPTIONAL,
+	IN PFREE_FUNCTION Free OPTIONAL,
+	IN ULONG Flags,
+	IN SIZE_T Size,
+	IN ULONG Tag,
+	IN USHORT Depth) {
+	InitializeLookaside(Lookaside, NonPagedPool, Allocate, Free, Size, Tag);
+}
+
+VOID ExDeleteNPagedLookasideList(IN PNPAGED_LOOKASIDE_LIST Lookaside) {
+	DeleteLookaside(Lookaside);
+}
+
+PVOID ExAllocateFromNPagedLookasideList(IN PNPAGED_LOOKASIDE_LIST Lookaside) {
+	return AllocateFromLookaside(Lookaside);
+}
+
+VOID ExFreeToNPagedLookasideList(IN PNPAGED_LOOKASIDE_LIST Lookaside, IN PVOID Entry) {
+	FreeToLookaside(Lookaside, Entry);
+}
+
+VOID ExInitializePagedLookasideList(
+	IN PPAGED_LOOKASIDE_LIST Lookaside,
+	IN PALLOCATE_FUNCTION Allocate OPTIONAL,
+	IN PFREE_FUNCTION Free OPTIONAL,
+	IN ULONG Flags,
+	IN SIZE_T Size,
+	IN ULONG Tag,
+	IN USHORT Depth) {
+	InitializeLookaside(Lookaside, PagedPool, Allocate, Free, Size, Tag);
+}
+
+VOID ExDeletePagedLookasideList(IN PPAGED_LOOKASIDE_LIST Lookaside) {
+	DeleteLookaside(Lookaside);
+}
+
+PVOID ExAllocateFromPagedLookasideList(IN PPAGED_LOOKASIDE_LIST Lookaside) {
+	return AllocateFromLookaside(Lookaside);
+}
+
+VOID ExFreeToPagedLookasideList(IN PPAGED_LOOKASIDE_LIST Lookaside, IN PVOID Entry) {
+	FreeToLookaside(Lookaside, Entry);
+}
+
+VOID TestEnvQueryLookaside(IN PGENERAL_LOOKASIDE Lookaside) {
+	ULONG allocates = 0, allocateMisses = 0, frees = 0, freeMisses = 0, depth = 0;
+	for (ULONG i = 0; i < TESTENV_MAGAZINES; i++) {
+		PTESTENV_MAGAZINE pMag = &Lookaside->Magazines[i];
+		SpinLock(&pMag->Lock);
+		allocates += pMag->Allocates;
+		allocateMisses += pMag->AllocateMisses;
+		frees += pMag->Frees;
+		freeMisses += pMag->FreeMisses;
+		depth += pMag->Count;
+		SpinUnlock(&pMag->Lock);
+	}
+	Lookaside->TotalAllocates = allocates;
+	Lookaside->AllocateMisses = allocateMisses;
+	Lookaside->TotalFrees = frees;
+	Lookaside->FreeMisses = freeMisses;
+	Lookaside->CurrentDepth = depth + Lookaside->DepotCount;
+}
+
+VOID TestEnvDumpLookaside(IN PGENERAL_LOOKASIDE Lookaside, IN const char* pName) {
+	TestEnvQueryLookaside(Lookaside);
+	ULONG allocHits = Lookaside->TotalAllocates - Lookaside->AllocateMisses;
+	ULONG freeHits = Lookaside->TotalFrees - Lookaside->FreeMisses;
+	printf("%-12s %5u bytes: %u allocs (%.1f%% hit), %u frees (%.1f%% hit), "
+		"depth %u (depot %u, peak %u)\n", pName, Lookaside->Size,
+		Lookaside->TotalAllocates,
+		Lookaside->TotalAllocates ? 100.0 * allocHits / Lookaside->TotalAllocates : 0.0,
+		Lookaside->TotalFrees,
+		Lookaside->TotalFrees ? 100.0 * freeHits / Lookaside->TotalFrees : 0.0,
+		Lookaside->CurrentDepth, Lookaside->DepotCount, Lookaside->PeakDepotCount);
 }
 
 BOOLEAN 
@@ -84,10 +643,58 @@ BOOLEAN
   ) {
 	if (String1->Length != String2->Length)
 		return FALSE;
-	if (CaseInSensitive)
-		return wcsicmp(String1->Buffer, String2->Buffer) == 0;
-	else
-		return wcscmp(String1->Buffer, String2->Buffer) == 0;
+	int nChars = String1->Length/2;
+	int i = 0;
+#ifdef TESTENV_SSE2
+	// 8 WCHARs at a time.  Without regard to case, a-z are folded
+	// to A-Z in the vector; a block with anything beyond ASCII
+	// is left to the scalar loop below.
+	__m128i lowerA = _mm_set1_epi16(L'a' - 1);
+	__m128i lowerZ = _mm_set1_epi16(L'z' + 1);
+	__m128i caseBit = _mm_set1_epi16(0x20);
+	__m128i nonAscii = _mm_set1_epi16((short) 0xFF80);
+	for (; i + 8 <= nChars; i += 8) {
+		__m128i c1 = _mm_loadu_si128((const __m128i*) &String1->Buffer[i]);
+		__m128i c2 = _mm_loadu_si128((const __m128i*) &String2->Buffer[i]);
+		if (CaseInSensitive) {
+			if (_mm_movemask_epi8(_mm_and_si128(_mm_or_si128(c1, c2), nonAscii)))
+				break;
+			__m128i lower1 = _mm_and_si128(_mm_cmpgt_epi16(c1, lowerA),
+											_mm_cmplt_epi16(c1, lowerZ));
+			__m128i lower2 = _mm_and_si128(_mm_cmpgt_epi16(c2, lowerA),
+											_mm_cmplt_epi16(c2, lowerZ));
+			c1 = _mm_sub_epi16(c1, _mm_and_si128(lower1, caseBit));
+			c2 = _mm_sub_epi16(c2, _mm_and_si128(lower2, caseBit));
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(c1, c2)) != 0xFFFF)
+			return FALSE;
+	}
+#endif
+	for (; i < nChars; i++) {
+		WCHAR c1 = String1->Buffer[i];
+		WCHAR c2 = String2->Buffer[i];
+		if (CaseInSensitive) {
+			c1 = RtlUpcaseUnicodeChar(c1);
+			c2 = RtlUpcaseUnicodeChar(c2);
+		}
+		if (c1 != c2)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+WCHAR
+  RtlUpcaseUnicodeChar(
+  IN WCHAR  SourceCharacter
+  ) {
+	// ASCII and Latin-1 only - enough for testing
+	WCHAR c = SourceCharacter;
+	if ((c >= L'a' && c <= L'z') ||
+		(c >= 0xE0 && c <= 0xFE && c != 0xF7))
+		return c - 0x20;
+	if (c == 0xFF)
+		return 0x178;
+	return c;
 }
 
 VOID 
@@ -97,7 +704,7 @@ VOID
   ) {
 	int copyLen = min(SourceString->Length, 
 						DestinationString->MaximumLength);
-	wcsncpy(DestinationString->Buffer, SourceString->Buffer, copyLen/2);
+	memmove(DestinationString->Buffer, SourceString->Buffer, copyLen);
 	DestinationString->Length = copyLen;
 }
 
@@ -148,7 +755,11 @@ NTSTATUS
 		}
 	} else {
 		// the standard base 10 case
-		*Value = _wtoi(String->Buffer);
+		*Value = 0;
+		PWSTR next = String->Buffer;
+		while (next < &String->Buffer[String->Length/2] &&
+			*next >= L'0' && *next <= L'9')
+			*Value = *Value * 10 + *next++ - L'0';
 	}
 	return 0;
 }
@@ -159,12 +770,13 @@ NTSTATUS
   IN ULONG  Base  OPTIONAL,
   IN OUT PUNICODE_STRING  String
   ) {
-	WCHAR buffer[32];
+	char buffer[32];
 	USHORT len =
-		swprintf(buffer, L"%d", Value);
+		sprintf(buffer, "%u", Value);
 	len *= 2;	// now in bytes
 	len = min(len, String->MaximumLength);
-	wcsncpy(String->Buffer, buffer, len);
+	for (int i = 0; i < len/2; i++)
+		String->Buffer[i] = buffer[i];
 	String->Length = len;
 	
 	return 0;
@@ -5,7 +5,46 @@
 
 // Simple Win32 DDK Test Environment
 
-#include "stdafx.h"
+#pragma once
+
+#include "StdAfx.h"
+
+#ifndef _WIN32
+// Just enough of Win32 for the test environment to build natively
+// on Linux, e.g.
+//	g++ -fshort-wchar -DWIN32DDK_TEST -I. -o Unicode DDKTestEnv.cpp Unicode.cpp UnicodeTest.cpp ../Chap7/Loopback/DevTable.cpp
+// -fshort-wchar keeps WCHAR (and L"" literals) 16 bits wide, as on
+// Windows.  The C library's wcs* routines then no longer match, so
+// the test environment doesn't use any of them.
+typedef unsigned char UCHAR, *PUCHAR, BOOLEAN;
+typedef char CHAR, *PCHAR, *PSTR;
+typedef unsigned short USHORT;
+typedef short SHORT;
+typedef int LONG;		// LONG and ULONG are 32 bits on Windows
+typedef unsigned int ULONG, *PULONG, DWORD;
+typedef long long LONGLONG;
+typedef unsigned long long ULONGLONG, *PULONGLONG;
+typedef wchar_t WCHAR, *PWSTR;
+typedef const wchar_t *PCWSTR;
+typedef void VOID, *PVOID;
+typedef PVOID HANDLE;
+typedef size_t SIZE_T, ULONG_PTR;
+#ifndef PtrToUlong
+#define PtrToUlong(p) ((ULONG) (ULONG_PTR) (p))
+#define UlongToPtr(ul) ((PVOID) (ULONG_PTR) (ul))
+#endif
+#define CONST const
+#define OPTIONAL
+#define TRUE 1
+#define FALSE 0
+#define UNICODE_NULL ((WCHAR)0)
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+#define RtlCopyMemory(Destination,Source,Length) memcpy((Destination),(Source),(Length))
+#define RtlEqualMemory(Destination,Source,Length) (!memcmp((Destination),(Source),(Length)))
+#define RtlZeroMemory(Destination,Length) memset((Destination),0,(Length))
+#include <pthread.h>
+#endif
 
 typedef struct _UNICODE_STRING {
     USHORT Length;
@@ -16,7 +55,66 @@ typedef UNICODE_STRING *PUNICODE_STRING;
 
 #define IN
 #define OUT
-typedef DWORD NTSTATUS;
+typedef DWORD NTSTATUS, *PNTSTATUS;
+
+#ifndef STATUS_SUCCESS
+#define STATUS_SUCCESS ((NTSTATUS)0x00000000L)
+#endif
+#ifndef STATUS_BUFFER_OVERFLOW
+#define STATUS_BUFFER_OVERFLOW ((NTSTATUS)0x80000005L)
+#endif
+#ifndef STATUS_OBJECT_NAME_COLLISION
+#define STATUS_OBJECT_NAME_COLLISION ((NTSTATUS)0xC0000035L)
+#endif
+#ifndef STATUS_INSUFFICIENT_RESOURCES
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009AL)
+#endif
+#define NT_SUCCESS(Status) ((LONG)(Status) >= 0)
+
+#ifndef STATUS_PENDING
+#define STATUS_PENDING ((NTSTATUS)0x00000103L)
+#endif
+#ifndef STATUS_DEVICE_BUSY
+#define STATUS_DEVICE_BUSY ((NTSTATUS)0x80000011L)
+#endif
+#ifndef STATUS_INVALID_PARAMETER
+#define STATUS_INVALID_PARAMETER ((NTSTATUS)0xC000000DL)
+#endif
+#ifndef STATUS_INVALID_DEVICE_REQUEST
+#define STATUS_INVALID_DEVICE_REQUEST ((NTSTATUS)0xC0000010L)
+#endif
+#ifndef STATUS_OBJECT_NAME_NOT_FOUND
+#define STATUS_OBJECT_NAME_NOT_FOUND ((NTSTATUS)0xC0000034L)
+#endif
+#ifndef STATUS_CANCELLED
+#define STATUS_CANCELLED ((NTSTATUS)0xC0000120L)
+#endif
+#ifndef STATUS_ACCESS_DENIED
+#define STATUS_ACCESS_DENIED ((NTSTATUS)0xC0000022L)
+#endif
+#ifndef STATUS_TIMEOUT
+#define STATUS_TIMEOUT ((NTSTATUS)0x00000102L)
+#endif
+#ifndef STATUS_INVALID_HANDLE
+#define STATUS_INVALID_HANDLE ((NTSTATUS)0xC0000008L)
+#endif
+#ifndef STATUS_OBJECT_TYPE_MISMATCH
+#define STATUS_OBJECT_TYPE_MISMATCH ((NTSTATUS)0xC0000024L)
+#endif
+#ifndef STATUS_BUFFER_TOO_SMALL
+#define STATUS_BUFFER_TOO_SMALL ((NTSTATUS)0xC0000023L)
+#endif
+#ifndef STATUS_INVALID_DEVICE_STATE
+#define STATUS_INVALID_DEVICE_STATE ((NTSTATUS)0xC0000184L)
+#endif
+#ifndef STATUS_INVALID_USER_BUFFER
+#define STATUS_INVALID_USER_BUFFER ((NTSTATUS)0xC00000E8L)
+#endif
+#ifndef STATUS_NOT_SUPPORTED
+#define STATUS_NOT_SUPPORTED ((NTSTATUS)0xC00000BBL)
+#endif
+
+typedef struct _DEVICE_OBJECT DEVICE_OBJECT, *PDEVICE_OBJECT;
 
 enum POOL_TYPE {PagedPool, NonPagedPool};
 
@@ -32,6 +130,7 @@ typedef PSTRING PANSI_STRING;
 typedef const char *PCSZ;
 
 VOID ExFreePool(IN PVOID P);
+VOID ExFreePoolWithTag(IN PVOID P, IN ULONG Tag);
 
 ULONG RtlAnsiStringToUnicodeSize(PANSI_STRING AnsiString );
 
@@ -65,6 +164,133 @@ PVOID ExAllocatePoolWithTag(IN POOL_TYPE  PoolType,
 							IN SIZE_T  NumberOfBytes,
 							IN ULONG  Tag );
 
+// As in the DDK, untagged allocations are charged to 'Ddk '
+#define ExAllocatePool(PoolType,NumberOfBytes) \
+	ExAllocatePoolWithTag((PoolType),(NumberOfBytes),TESTENV_UNTAGGED)
+#define TESTENV_UNTAGGED 0x206B6444
+
+// Not part of the DDK - lets tests count pool allocations
+extern ULONG TestEnvPoolAllocations;
+// Not part of the DDK - the next this many pool allocations fail
+// (return NULL), so that tests can see how a driver copes
+extern ULONG TestEnvFailPoolAllocations;
+
+// Not part of the DDK - what each tag (in each pool) is using,
+// poolmon style.  Freeing a block also needs its tag's counters,
+// so every block carries a small header saying where it came from.
+typedef struct _TESTENV_POOL_TAG_STATS {
+	ULONG Tag;
+	POOL_TYPE PoolType;
+	ULONG Allocs;			// made so far
+	ULONG Frees;
+	ULONG LiveAllocs;		// Allocs - Frees
+	SIZE_T LiveBytes;
+	SIZE_T PeakBytes;		// high-water mark of LiveBytes
+	ULONGLONG TotalBytes;	// allocated so far
+	ULONG FirstTick;		// ms, when the tag was first used
+} TESTENV_POOL_TAG_STATS, *PTESTENV_POOL_TAG_STATS;
+
+// FALSE if the tag hasn't been used in that pool
+BOOLEAN TestEnvQueryPoolTag(IN ULONG Tag, IN POOL_TYPE PoolType,
+							OUT PTESTENV_POOL_TAG_STATS pStats);
+// Prints the table to stdout.  Whatever is still allocated at exit
+// is reported (to stderr) the same way.
+VOID TestEnvDumpPoolTags();
+
+// Reader-writer lock.  On Windows readers are serialized too,
+// which is good enough for testing.
+typedef struct _ERESOURCE {
+#ifdef _WIN32
+	CRITICAL_SECTION cs;
+#else
+	pthread_rwlock_t rwlock;
+#endif
+} ERESOURCE, *PERESOURCE;
+
+NTSTATUS ExInitializeResourceLite(IN PERESOURCE Resource);
+NTSTATUS ExDeleteResourceLite(IN PERESOURCE Resource);
+BOOLEAN ExAcquireResourceSharedLite(IN PERESOURCE Resource, IN BOOLEAN Wait);
+BOOLEAN ExAcquireResourceExclusiveLite(IN PERESOURCE Resource, IN BOOLEAN Wait);
+VOID ExReleaseResourceLite(IN PERESOURCE Resource);
+
+// No APCs to hold off in user mode
+#define KeEnterCriticalRegion()
+#define KeLeaveCriticalRegion()
+
+// Lookaside lists.  Freed blocks are cached in magazines - small
+// stacks, one picked by each thread, much as the kernel gives each
+// processor its own lists - and, once a magazine fills up, in a
+// depot shared by all threads.  Only misses reach the pool.
+// Each magazine counts its own hits and misses, under its own lock;
+// TestEnvQueryLookaside adds them up into the DDK's fields.
+#define TESTENV_MAGAZINES		16
+#define TESTENV_MAGAZINE_SIZE	16
+
+typedef PVOID (*PALLOCATE_FUNCTION)(IN POOL_TYPE PoolType,
+									IN SIZE_T NumberOfBytes,
+									IN ULONG Tag);
+typedef VOID (*PFREE_FUNCTION)(IN PVOID Buffer);
+
+typedef struct _TESTENV_MAGAZINE {
+	volatile LONG Lock;
+	ULONG Count;
+	ULONG Allocates, AllocateMisses, Frees, FreeMisses;
+	PVOID Blocks[TESTENV_MAGAZINE_SIZE];
+} TESTENV_MAGAZINE, *PTESTENV_MAGAZINE;
+
+typedef struct _GENERAL_LOOKASIDE {
+	USHORT Depth;			// most blocks the depot keeps
+	USHORT MaximumDepth;
+	ULONG TotalAllocates;
+	ULONG AllocateMisses;	// had to go to the pool
+	ULONG TotalFrees;
+	ULONG FreeMisses;		// had to go back to the pool
+	POOL_TYPE Type;
+	ULONG Tag;
+	ULONG Size;
+	PALLOCATE_FUNCTION Allocate;
+	PFREE_FUNCTION Free;
+	// Not part of the DDK
+	ULONG CurrentDepth;		// blocks cached, magazines included
+	volatile LONG DepotLock;
+	ULONG DepotCount;
+	ULONG PeakDepotCount;	// high-water mark of DepotCount
+	PVOID DepotHead;		// linked through each block's first PVOID
+	TESTENV_MAGAZINE Magazines[TESTENV_MAGAZINES];
+} GENERAL_LOOKASIDE, *PGENERAL_LOOKASIDE;
+
+typedef GENERAL_LOOKASIDE NPAGED_LOOKASIDE_LIST, *PNPAGED_LOOKASIDE_LIST;
+typedef GENERAL_LOOKASIDE PAGED_LOOKASIDE_LIST, *PPAGED_LOOKASIDE_LIST;
+
+VOID ExInitializeNPagedLookasideList(
+	IN PNPAGED_LOOKASIDE_LIST Lookaside,
+	IN PALLOCATE_FUNCTION Allocate OPTIONAL,
+	IN PFREE_FUNCTION Free OPTIONAL,
+	IN ULONG Flags,
+	IN SIZE_T Size,
+	IN ULONG Tag,
+	IN USHORT Depth);		// reserved - 0
+VOID ExDeleteNPagedLookasideList(IN PNPAGED_LOOKASIDE_LIST Lookaside);
+PVOID ExAllocateFromNPagedLookasideList(IN PNPAGED_LOOKASIDE_LIST Lookaside);
+VOID ExFreeToNPagedLookasideList(IN PNPAGED_LOOKASIDE_LIST Lookaside, IN PVOID Entry);
+
+VOID ExInitializePagedLookasideList(
+	IN PPAGED_LOOKASIDE_LIST Lookaside,
+	IN PALLOCATE_FUNCTION Allocate OPTIONAL,
+	IN PFREE_FUNCTION Free OPTIONAL,
+	IN ULONG Flags,
+	IN SIZE_T Size,
+	IN ULONG Tag,
+	IN USHORT Depth);		// reserved - 0
+VOID ExDeletePagedLookasideList(IN PPAGED_LOOKASIDE_LIST Lookaside);
+PVOID ExAllocateFromPagedLookasideList(IN PPAGED_LOOKASIDE_LIST Lookaside);
+VOID ExFreeToPagedLookasideList(IN PPAGED_LOOKASIDE_LIST Lookaside, IN PVOID Entry);
+
+// Not part of the DDK - bring the counters and CurrentDepth up to
+// date, or print them along with the hit rates
+VOID TestEnvQueryLookaside(IN PGENERAL_LOOKASIDE Lookaside);
+VOID TestEnvDumpLookaside(IN PGENERAL_LOOKASIDE Lookaside, IN const char* pName);
+
 BOOLEAN 
   RtlEqualUnicodeString(
   IN CONST UNICODE_STRING  *String1,
@@ -72,6 +298,11 @@ BOOLEAN
   IN BOOLEAN  CaseInSensitive
   );
 
+WCHAR
+  RtlUpcaseUnicodeChar(
+  IN WCHAR  SourceCharacter
+  );
+
 VOID 
   RtlCopyUnicodeString(
   IN OUT PUNICODE_STRING  DestinationString,
@@ -91,3 +322,726 @@ NTSTATUS
   IN ULONG  Base  OPTIONAL,
   IN OUT PUNICODE_STRING  String
   );
+
+//
+// I/O manager.  Just enough of it for a driver's dispatch routines
+// to run in a test program, which plays the part of the Win32 app
+// through the TestEnvXxx routines at the end.  The DDK's structures
+// are cut down to the fields drivers here use.
+//
+#ifndef _WIN32
+typedef struct _LIST_ENTRY {
+	struct _LIST_ENTRY *Flink;
+	struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+#define CONTAINING_RECORD(address, type, field) \
+	((type *)((PCHAR)(address) - (ULONG_PTR)(&((type *)0)->field)))
+
+typedef union _LARGE_INTEGER {
+	struct {
+		ULONG LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+#endif
+
+inline VOID InitializeListHead(PLIST_ENTRY ListHead) {
+	ListHead->Flink = ListHead->Blink = ListHead;
+}
+#define IsListEmpty(ListHead) ((ListHead)->Flink == (ListHead))
+inline VOID InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry) {
+	Entry->Flink = ListHead;
+	Entry->Blink = ListHead->Blink;
+	ListHead->Blink->Flink = Entry;
+	ListHead->Blink = Entry;
+}
+inline VOID InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry) {
+	Entry->Flink = ListHead->Flink;
+	Entry->Blink = ListHead;
+	ListHead->Flink->Blink = Entry;
+	ListHead->Flink = Entry;
+}
+inline BOOLEAN RemoveEntryList(PLIST_ENTRY Entry) {
+	Entry->Blink->Flink = Entry->Flink;
+	Entry->Flink->Blink = Entry->Blink;
+	return Entry->Flink == Entry->Blink;
+}
+inline PLIST_ENTRY RemoveHeadList(PLIST_ENTRY ListHead) {
+	PLIST_ENTRY Entry = ListHead->Flink;
+	RemoveEntryList(Entry);
+	return Entry;
+}
+
+typedef UCHAR KIRQL, *PKIRQL;
+#define PASSIVE_LEVEL	0
+#define APC_LEVEL		1
+#define DISPATCH_LEVEL	2
+
+typedef volatile LONG KSPIN_LOCK, *PKSPIN_LOCK;
+VOID KeInitializeSpinLock(IN PKSPIN_LOCK SpinLock);
+VOID KeAcquireSpinLock(IN PKSPIN_LOCK SpinLock, OUT PKIRQL OldIrql);
+VOID KeReleaseSpinLock(IN PKSPIN_LOCK SpinLock, IN KIRQL NewIrql);
+
+typedef CHAR KPROCESSOR_MODE;
+enum _MODE {KernelMode, UserMode};
+
+// There's just the one process - the test program - so attaching
+// to a process changes nothing, and it needs no references counted
+typedef struct _EPROCESS EPROCESS, *PEPROCESS;
+PEPROCESS IoGetCurrentProcess();
+
+typedef struct _KAPC_STATE {
+	PEPROCESS Process;		// the one attached to
+} KAPC_STATE, *PKAPC_STATE;
+VOID KeStackAttachProcess(IN PEPROCESS Process, OUT PKAPC_STATE ApcState);
+VOID KeUnstackDetachProcess(IN PKAPC_STATE ApcState);
+
+// Events, the only dispatcher objects here.  On Linux a waiter
+// sleeps on SignalState with futex(2), and KeSetEvent only makes
+// the wake-up call if someone is waiting.
+typedef LONG KPRIORITY;
+typedef enum _EVENT_TYPE {NotificationEvent, SynchronizationEvent} EVENT_TYPE;
+typedef enum _KWAIT_REASON {Executive = 0, UserRequest = 6} KWAIT_REASON;
+
+typedef struct _KEVENT {
+	EVENT_TYPE Type;
+	volatile LONG SignalState;
+	// Not part of the DDK
+	volatile LONG TestEnvWaiters;
+} KEVENT, *PKEVENT;
+
+VOID KeInitializeEvent(IN PKEVENT Event, IN EVENT_TYPE Type, IN BOOLEAN State);
+LONG KeSetEvent(IN PKEVENT Event, IN KPRIORITY Increment, IN BOOLEAN Wait);
+VOID KeClearEvent(IN PKEVENT Event);
+LONG KeResetEvent(IN PKEVENT Event);
+LONG KeReadStateEvent(IN PKEVENT Event);
+// Events only.  Timeout is NULL (forever) or relative - negative,
+// in 100 ns units.  Returns STATUS_SUCCESS or STATUS_TIMEOUT.
+NTSTATUS KeWaitForSingleObject(IN PVOID Object, IN KWAIT_REASON WaitReason,
+							   IN KPROCESSOR_MODE WaitMode, IN BOOLEAN Alertable,
+							   IN PLARGE_INTEGER Timeout OPTIONAL);
+
+// Object manager.  A handle the test program holds points at a
+// TESTENV_OBJECT_HEADER, with the object itself after it.  The
+// handle counts as one reference, ObReferenceObjectByHandle adds
+// another, and the object goes when the last one is dropped.
+typedef struct _OBJECT_TYPE {
+	const char* Name;
+} OBJECT_TYPE, *POBJECT_TYPE;
+extern POBJECT_TYPE* ExEventObjectType;
+
+typedef ULONG ACCESS_MASK;
+#ifndef SYNCHRONIZE
+#define SYNCHRONIZE			0x00100000L
+#define EVENT_MODIFY_STATE	0x0002
+#endif
+
+NTSTATUS ObReferenceObjectByHandle(IN HANDLE Handle, IN ACCESS_MASK DesiredAccess,
+								   IN POBJECT_TYPE ObjectType OPTIONAL,
+								   IN KPROCESSOR_MODE AccessMode,
+								   OUT PVOID* Object,
+								   OUT PVOID HandleInformation OPTIONAL);
+VOID ObReferenceObject(IN PVOID Object);
+VOID ObDereferenceObject(IN PVOID Object);
+
+// Not part of the DDK
+typedef struct _TESTENV_OBJECT_HEADER {
+	POBJECT_TYPE Type;
+	volatile LONG PointerCount;
+} TESTENV_OBJECT_HEADER;
+
+// A new object, zeroed, and a handle to it
+HANDLE TestEnvCreateObject(IN POBJECT_TYPE Type, IN ULONG BodySize);
+// The object a handle is for - NULL if it's of another type
+PVOID TestEnvObjectOf(IN HANDLE Handle, IN POBJECT_TYPE Type);
+// Drops the handle's reference
+VOID TestEnvCloseObject(IN HANDLE Handle);
+
+typedef struct _IRP IRP, *PIRP;
+typedef struct _DRIVER_OBJECT DRIVER_OBJECT, *PDRIVER_OBJECT;
+typedef struct _FILE_OBJECT FILE_OBJECT, *PFILE_OBJECT;
+typedef struct _IO_STATUS_BLOCK IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+
+typedef NTSTATUS (*PDRIVER_INITIALIZE)(IN PDRIVER_OBJECT DriverObject,
+									   IN PUNICODE_STRING RegistryPath);
+typedef NTSTATUS (*PDRIVER_DISPATCH)(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
+typedef VOID (*PDRIVER_UNLOAD)(IN PDRIVER_OBJECT DriverObject);
+typedef VOID (*PDRIVER_CANCEL)(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
+typedef VOID (*PDRIVER_STARTIO)(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
+
+// Fast I/O: the I/O manager calls these instead of building an IRP,
+// and builds one after all if they return FALSE.  Only the first
+// members of the DDK's table are here, and the test environment
+// calls them only as the I/O manager does, for synchronous I/O:
+// FastIoRead and FastIoWrite (TestEnvRead, TestEnvWrite) on a file
+// object with a PrivateCacheMap, as NtReadFile and NtWriteFile do,
+// and FastIoDeviceControl (TestEnvDeviceControl) on any, as
+// NtDeviceIoControlFile does.  Its buffers are the caller's own.
+typedef BOOLEAN (*PFAST_IO_CHECK_IF_POSSIBLE)(IN PFILE_OBJECT FileObject,
+	IN PLARGE_INTEGER FileOffset, IN ULONG Length, IN BOOLEAN Wait,
+	IN ULONG LockKey, IN BOOLEAN CheckForReadOperation,
+	OUT PIO_STATUS_BLOCK IoStatus, IN PDEVICE_OBJECT DeviceObject);
+typedef BOOLEAN (*PFAST_IO_READ)(IN PFILE_OBJECT FileObject,
+	IN PLARGE_INTEGER FileOffset, IN ULONG Length, IN BOOLEAN Wait,
+	IN ULONG LockKey, OUT PVOID Buffer, OUT PIO_STATUS_BLOCK IoStatus,
+	IN PDEVICE_OBJECT DeviceObject);
+typedef BOOLEAN (*PFAST_IO_WRITE)(IN PFILE_OBJECT FileObject,
+	IN PLARGE_INTEGER FileOffset, IN ULONG Length, IN BOOLEAN Wait,
+	IN ULONG LockKey, IN PVOID Buffer, OUT PIO_STATUS_BLOCK IoStatus,
+	IN PDEVICE_OBJECT DeviceObject);
+
+typedef BOOLEAN (*PFAST_IO_DEVICE_CONTROL)(IN PFILE_OBJECT FileObject,
+	IN BOOLEAN Wait, IN PVOID InputBuffer OPTIONAL, IN ULONG InputBufferLength,
+	OUT PVOID OutputBuffer OPTIONAL, IN ULONG OutputBufferLength,
+	IN ULONG IoControlCode, OUT PIO_STATUS_BLOCK IoStatus,
+	IN PDEVICE_OBJECT DeviceObject);
+
+typedef struct _FAST_IO_DISPATCH {
+	ULONG SizeOfFastIoDispatch;
+	PFAST_IO_CHECK_IF_POSSIBLE FastIoCheckIfPossible;
+	PFAST_IO_READ FastIoRead;
+	PFAST_IO_WRITE FastIoWrite;
+	PVOID FastIoQueryBasicInfo;		// never called here
+	PVOID FastIoQueryStandardInfo;
+	PVOID FastIoLock;
+	PVOID FastIoUnlockSingle;
+	PVOID FastIoUnlockAll;
+	PVOID FastIoUnlockAllByKey;
+	PFAST_IO_DEVICE_CONTROL FastIoDeviceControl;
+} FAST_IO_DISPATCH, *PFAST_IO_DISPATCH;
+
+#define IRP_MJ_CREATE			0x00
+#define IRP_MJ_CLOSE			0x02
+#define IRP_MJ_READ				0x03
+#define IRP_MJ_WRITE			0x04
+#define IRP_MJ_DEVICE_CONTROL	0x0e
+#define IRP_MJ_CLEANUP			0x12
+#define IRP_MJ_MAXIMUM_FUNCTION	0x1b
+
+#define DO_BUFFERED_IO			0x00000004
+#define DO_EXCLUSIVE			0x00000008
+#define DO_DIRECT_IO			0x00000010
+#define DO_DEVICE_INITIALIZING	0x00000080
+
+#define FILE_DEVICE_UNKNOWN		0x00000022
+
+#ifndef CTL_CODE
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+	(((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+#define METHOD_BUFFERED			0
+#define METHOD_IN_DIRECT		1
+#define METHOD_OUT_DIRECT		2
+#define METHOD_NEITHER			3
+#define FILE_ANY_ACCESS			0
+#define FILE_READ_ACCESS		0x0001
+#define FILE_WRITE_ACCESS		0x0002
+#endif
+#define METHOD_FROM_CTL_CODE(ctrlCode)	((ULONG) ((ctrlCode) & 3))
+#define IO_NO_INCREMENT			0
+
+// DPCs.  They all run, one at a time, on a thread of the test
+// environment's - the one processor's DPC queue (DDKTestHw.cpp).
+typedef struct _KDPC KDPC, *PKDPC;
+typedef VOID (*PKDEFERRED_ROUTINE)(IN PKDPC Dpc, IN PVOID DeferredContext,
+								   IN PVOID SystemArgument1, IN PVOID SystemArgument2);
+
+struct _KDPC {
+	LIST_ENTRY DpcListEntry;
+	PKDEFERRED_ROUTINE DeferredRoutine;
+	PVOID DeferredContext;
+	PVOID SystemArgument1;
+	PVOID SystemArgument2;
+	BOOLEAN Inserted;			// on the queue
+	// Not part of the DDK
+	LONGLONG TestEnvQueuedNs;
+};
+
+VOID KeInitializeDpc(IN PKDPC Dpc, IN PKDEFERRED_ROUTINE DeferredRoutine,
+					 IN PVOID DeferredContext);
+// FALSE if it was queued already
+BOOLEAN KeInsertQueueDpc(IN PKDPC Dpc, IN PVOID SystemArgument1,
+						 IN PVOID SystemArgument2);
+BOOLEAN KeRemoveQueueDpc(IN PKDPC Dpc);
+
+// Device queues, as the I/O manager keeps for StartIo
+typedef struct _KDEVICE_QUEUE_ENTRY {
+	LIST_ENTRY DeviceListEntry;
+	ULONG SortKey;
+	BOOLEAN Inserted;
+} KDEVICE_QUEUE_ENTRY, *PKDEVICE_QUEUE_ENTRY;
+
+typedef struct _KDEVICE_QUEUE {
+	LIST_ENTRY DeviceListHead;
+	KSPIN_LOCK Lock;
+	BOOLEAN Busy;				// the device has an IRP
+} KDEVICE_QUEUE, *PKDEVICE_QUEUE;
+
+VOID KeInitializeDeviceQueue(IN PKDEVICE_QUEUE DeviceQueue);
+// FALSE (and Busy now set) if the device was idle
+BOOLEAN KeInsertDeviceQueue(IN PKDEVICE_QUEUE DeviceQueue,
+							IN PKDEVICE_QUEUE_ENTRY DeviceQueueEntry);
+// ... kept in SortKey order, first come first served among equals
+BOOLEAN KeInsertByKeyDeviceQueue(IN PKDEVICE_QUEUE DeviceQueue,
+								 IN PKDEVICE_QUEUE_ENTRY DeviceQueueEntry,
+								 IN ULONG SortKey);
+// NULL (and Busy now clear) if the queue is empty
+PKDEVICE_QUEUE_ENTRY KeRemoveDeviceQueue(IN PKDEVICE_QUEUE DeviceQueue);
+// The first entry whose SortKey is at least SortKey, or failing
+// that the first entry
+PKDEVICE_QUEUE_ENTRY KeRemoveByKeyDeviceQueue(IN PKDEVICE_QUEUE DeviceQueue,
+											  IN ULONG SortKey);
+BOOLEAN KeRemoveEntryDeviceQueue(IN PKDEVICE_QUEUE DeviceQueue,
+								 IN PKDEVICE_QUEUE_ENTRY DeviceQueueEntry);
+
+struct _DRIVER_OBJECT {
+	PDEVICE_OBJECT DeviceObject;	// most recently created first
+	PUNICODE_STRING HardwareDatabase;
+	PFAST_IO_DISPATCH FastIoDispatch;
+	PDRIVER_STARTIO DriverStartIo;
+	PDRIVER_UNLOAD DriverUnload;
+	PDRIVER_DISPATCH MajorFunction[IRP_MJ_MAXIMUM_FUNCTION + 1];
+};
+
+struct _DEVICE_OBJECT {
+	PDRIVER_OBJECT DriverObject;
+	PDEVICE_OBJECT NextDevice;
+	ULONG Flags;
+	ULONG DeviceType;
+	PVOID DeviceExtension;
+	PIRP CurrentIrp;			// StartIo's
+	KDEVICE_QUEUE DeviceQueue;
+	KDPC Dpc;					// IoRequestDpc's
+	// Not part of the DDK
+	PWSTR TestEnvName;			// as passed to IoCreateDevice
+	ULONG TestEnvOpenCount;		// file objects - one at most if DO_EXCLUSIVE
+};
+
+struct _FILE_OBJECT {
+	PDEVICE_OBJECT DeviceObject;
+	PVOID FsContext;			// the driver's, per open
+	PVOID FsContext2;
+	PVOID PrivateCacheMap;		// non-NULL: try fast I/O
+	ULONG Flags;
+};
+
+// FILE_OBJECT Flags.  The I/O manager serializes a synchronous
+// handle's requests, so one that waits holds up the rest.
+#define FO_SYNCHRONOUS_IO	0x00000002
+
+// Direct I/O.  The test program and the driver share an address
+// space, so an MDL's "system address" is the caller's buffer itself.
+typedef struct _MDL {
+	struct _MDL* Next;
+	SHORT Size;
+	SHORT MdlFlags;
+	PVOID MappedSystemVa;
+	PVOID StartVa;
+	ULONG ByteCount;
+	ULONG ByteOffset;
+	// Not part of the DDK - for MmAllocatePagesForMdl's
+	int TestEnvPagesFd;			// the memfd (Linux)
+	LONG TestEnvMappings;		// views not yet unmapped
+} MDL, *PMDL;
+
+#define TESTENV_MDL_PAGES		0x4000	// MdlFlags: from MmAllocatePagesForMdl
+
+typedef enum _MM_PAGE_PRIORITY {
+	LowPagePriority,
+	NormalPagePriority = 16,
+	HighPagePriority = 32
+} MM_PAGE_PRIORITY;
+
+#define MmGetMdlByteCount(Mdl)			((Mdl)->ByteCount)
+#define MmGetMdlVirtualAddress(Mdl)		((PVOID) ((PCHAR) (Mdl)->StartVa + (Mdl)->ByteOffset))
+#define MmGetSystemAddressForMdlSafe(Mdl, Priority)	((Mdl)->MappedSystemVa)
+
+// Pages to share with the test program.  On Linux they are a
+// memfd, and every MmMapLockedPagesSpecifyCache is an mmap of it of
+// its own: the user-mode view is a second address for the same
+// memory, as it is in the kernel.  On Windows all views are one.
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 0x1000
+#endif
+#define ROUND_TO_PAGES(Size) (((ULONG_PTR) (Size) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+typedef LARGE_INTEGER PHYSICAL_ADDRESS;
+typedef enum _MEMORY_CACHING_TYPE {MmNonCached, MmCached, MmWriteCombined} MEMORY_CACHING_TYPE;
+
+// Free the MDL with ExFreePool after MmFreePagesFromMdl
+PMDL MmAllocatePagesForMdl(IN PHYSICAL_ADDRESS LowAddress,
+						   IN PHYSICAL_ADDRESS HighAddress,
+						   IN PHYSICAL_ADDRESS SkipBytes,
+						   IN SIZE_T TotalBytes);
+VOID MmFreePagesFromMdl(IN PMDL MemoryDescriptorList);
+// A UserMode mapping that fails would raise an exception; here it
+// returns NULL
+PVOID MmMapLockedPagesSpecifyCache(IN PMDL MemoryDescriptorList,
+								   IN KPROCESSOR_MODE AccessMode,
+								   IN MEMORY_CACHING_TYPE CacheType,
+								   IN PVOID BaseAddress,
+								   IN ULONG BugCheckOnFailure,
+								   IN MM_PAGE_PRIORITY Priority);
+VOID MmUnmapLockedPages(IN PVOID BaseAddress, IN PMDL MemoryDescriptorList);
+
+// No structured exception handling on Linux.  Nothing here raises
+// exceptions, so a __try block just runs and __except never does.
+#ifndef _WIN32
+#define __try					if (1)
+#define __except(Filter)		else if (0)
+#define EXCEPTION_EXECUTE_HANDLER	1
+#endif
+
+struct _IO_STATUS_BLOCK {
+	NTSTATUS Status;
+	ULONG_PTR Information;
+};
+
+#define SL_PENDING_RETURNED		0x01
+
+typedef struct _IO_STACK_LOCATION {
+	UCHAR MajorFunction;
+	UCHAR MinorFunction;
+	UCHAR Flags;
+	UCHAR Control;
+	union {
+		struct {
+			ULONG Length;
+			ULONG Key;
+			LARGE_INTEGER ByteOffset;
+		} Read;
+		struct {
+			ULONG Length;
+			ULONG Key;
+			LARGE_INTEGER ByteOffset;
+		} Write;
+		struct {
+			ULONG OutputBufferLength;
+			ULONG InputBufferLength;
+			ULONG IoControlCode;
+			PVOID Type3InputBuffer;		// METHOD_NEITHER
+		} DeviceIoControl;
+	} Parameters;
+	PDEVICE_OBJECT DeviceObject;
+	PFILE_OBJECT FileObject;
+} IO_STACK_LOCATION, *PIO_STACK_LOCATION;
+
+struct _IRP {
+	PMDL MdlAddress;			// DO_DIRECT_IO
+	union {
+		PVOID SystemBuffer;		// DO_BUFFERED_IO
+	} AssociatedIrp;
+	IO_STATUS_BLOCK IoStatus;
+	KPROCESSOR_MODE RequestorMode;	// UserMode - the test program
+	BOOLEAN PendingReturned;
+	BOOLEAN Cancel;
+	KIRQL CancelIrql;
+	PDRIVER_CANCEL CancelRoutine;
+	PVOID UserBuffer;			// neither buffered nor direct I/O
+	struct {
+		struct {
+			union {
+				KDEVICE_QUEUE_ENTRY DeviceQueueEntry;	// on the StartIo queue
+				struct {
+					PVOID DriverContext[4];
+				};
+			};
+			LIST_ENTRY ListEntry;
+		} Overlay;
+	} Tail;
+	// Not part of the DDK
+	IO_STACK_LOCATION TestEnvStack;	// the one and only stack location
+	volatile LONG TestEnvCompleted;
+	LIST_ENTRY TestEnvLink;		// on the list of IRPs in flight
+	LONG TestEnvHolds;			// TestEnvCancel is using it
+};
+
+#define IoGetCurrentIrpStackLocation(Irp) (&(Irp)->TestEnvStack)
+#define IoMarkIrpPending(Irp) ((Irp)->TestEnvStack.Control |= SL_PENDING_RETURNED)
+VOID IoCompleteRequest(IN PIRP Irp, IN CHAR PriorityBoost);
+
+// Cancellation.  As in the kernel, IoCancelIrp calls the cancel
+// routine holding the cancel spin lock, which the routine must
+// release with IoReleaseCancelSpinLock(Irp->CancelIrql).
+PDRIVER_CANCEL IoSetCancelRoutine(IN PIRP Irp, IN PDRIVER_CANCEL CancelRoutine);
+VOID IoAcquireCancelSpinLock(OUT PKIRQL Irql);
+VOID IoReleaseCancelSpinLock(IN KIRQL Irql);
+BOOLEAN IoCancelIrp(IN PIRP Irp);
+
+// StartIo (DDKTestHw.cpp).  IoStartPacket calls the driver's StartIo
+// at once if the device is idle, and otherwise queues the IRP for
+// IoStartNextPacket - in Key order if the driver passes one, and
+// otherwise first come, first served.
+VOID IoStartPacket(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp,
+				   IN PULONG Key OPTIONAL, IN PDRIVER_CANCEL CancelFunction OPTIONAL);
+VOID IoStartNextPacket(IN PDEVICE_OBJECT DeviceObject, IN BOOLEAN Cancelable);
+VOID IoStartNextPacketByKey(IN PDEVICE_OBJECT DeviceObject, IN BOOLEAN Cancelable,
+							IN ULONG Key);
+
+typedef VOID (*PIO_DPC_ROUTINE)(IN PKDPC Dpc, IN PDEVICE_OBJECT DeviceObject,
+								IN PIRP Irp, IN PVOID Context);
+#define IoInitializeDpcRequest(DeviceObject, DpcRoutine) \
+	KeInitializeDpc(&(DeviceObject)->Dpc, (PKDEFERRED_ROUTINE) (DpcRoutine), (DeviceObject))
+#define IoRequestDpc(DeviceObject, Irp, Context) \
+	KeInsertQueueDpc(&(DeviceObject)->Dpc, (Irp), (Context))
+#define IO_PARALLEL_INCREMENT	1
+
+NTSTATUS IoCreateDevice(
+	IN PDRIVER_OBJECT DriverObject,
+	IN ULONG DeviceExtensionSize,
+	IN PUNICODE_STRING DeviceName OPTIONAL,
+	IN ULONG DeviceType,
+	IN ULONG DeviceCharacteristics,
+	IN BOOLEAN Exclusive,
+	OUT PDEVICE_OBJECT *DeviceObject);
+VOID IoDeleteDevice(IN PDEVICE_OBJECT DeviceObject);
+NTSTATUS IoCreateSymbolicLink(IN PUNICODE_STRING SymbolicLinkName,
+							  IN PUNICODE_STRING DeviceName);
+NTSTATUS IoDeleteSymbolicLink(IN PUNICODE_STRING SymbolicLinkName);
+
+//
+// Hardware (DDKTestHw.cpp).  Port I/O goes to device models the
+// test program attaches with TestEnvAttachPorts, and the models
+// raise interrupts with TestEnvRaiseInterrupt.  Each IRQ line has a
+// thread of its own playing the interrupt controller: it calls the
+// line's ISRs holding their interrupt spin locks, as the kernel
+// does, so KeSynchronizeExecution keeps them out as it should.
+//
+typedef ULONG_PTR KAFFINITY, *PKAFFINITY;
+typedef enum _INTERFACE_TYPE {Internal, Isa, Eisa, MicroChannel, TurboChannel, PCIBus} INTERFACE_TYPE;
+typedef enum _KINTERRUPT_MODE {LevelSensitive, Latched} KINTERRUPT_MODE;
+
+typedef struct _KINTERRUPT KINTERRUPT, *PKINTERRUPT;
+typedef BOOLEAN (*PKSERVICE_ROUTINE)(IN PKINTERRUPT Interrupt, IN PVOID ServiceContext);
+typedef BOOLEAN (*PKSYNCHRONIZE_ROUTINE)(IN PVOID SynchronizeContext);
+
+// Ports no model claims read as 0xFF, and writes to them are lost
+UCHAR READ_PORT_UCHAR(IN PUCHAR Port);
+VOID WRITE_PORT_UCHAR(IN PUCHAR Port, IN UCHAR Value);
+// Spins, as in the kernel
+VOID KeStallExecutionProcessor(IN ULONG MicroSeconds);
+// Counts nanoseconds (the frequency is 1000000000)
+LARGE_INTEGER KeQueryPerformanceCounter(OUT PLARGE_INTEGER PerformanceFrequency OPTIONAL);
+
+// As the x86 HAL does it: bus IRQ n is vector 0x30 + n, at DIRQL
+// 27 - n
+ULONG HalGetInterruptVector(IN INTERFACE_TYPE InterfaceType, IN ULONG BusNumber,
+							IN ULONG BusInterruptLevel, IN ULONG BusInterruptVector,
+							OUT PKIRQL Irql, OUT PKAFFINITY Affinity);
+NTSTATUS IoConnectInterrupt(OUT PKINTERRUPT* InterruptObject,
+							IN PKSERVICE_ROUTINE ServiceRoutine,
+							IN PVOID ServiceContext,
+							IN PKSPIN_LOCK SpinLock OPTIONAL,
+							IN ULONG Vector,
+							IN KIRQL Irql,
+							IN KIRQL SynchronizeIrql,
+							IN KINTERRUPT_MODE InterruptMode,
+							IN BOOLEAN ShareVector,
+							IN KAFFINITY ProcessorEnableMask,
+							IN BOOLEAN FloatingSave);
+VOID IoDisconnectInterrupt(IN PKINTERRUPT InterruptObject);
+BOOLEAN KeSynchronizeExecution(IN PKINTERRUPT Interrupt,
+							   IN PKSYNCHRONIZE_ROUTINE SynchronizeRoutine,
+							   IN PVOID SynchronizeContext);
+
+// Resource claims.  Nothing arbitrates them here, so
+// IoReportDetectedDevice just succeeds.
+#define CmResourceTypePort				1
+#define CmResourceTypeInterrupt			2
+#define CmResourceShareDeviceExclusive	1
+#define CM_RESOURCE_PORT_IO				0x0001
+#define CM_RESOURCE_INTERRUPT_LATCHED	0x0001
+#define FILE_WORD_ALIGNMENT				0x00000001
+
+typedef struct _IO_RESOURCE_DESCRIPTOR {
+	UCHAR Option;
+	UCHAR Type;
+	UCHAR ShareDisposition;
+	UCHAR Spare1;
+	USHORT Flags;
+	USHORT Spare2;
+	union {
+		struct {
+			ULONG Length;
+			ULONG Alignment;
+			PHYSICAL_ADDRESS MinimumAddress;
+			PHYSICAL_ADDRESS MaximumAddress;
+		} Port;
+		struct {
+			ULONG MinimumVector;
+			ULONG MaximumVector;
+		} Interrupt;
+	} u;
+} IO_RESOURCE_DESCRIPTOR, *PIO_RESOURCE_DESCRIPTOR;
+
+typedef struct _IO_RESOURCE_LIST {
+	USHORT Version;
+	USHORT Revision;
+	ULONG Count;
+	IO_RESOURCE_DESCRIPTOR Descriptors[1];
+} IO_RESOURCE_LIST, *PIO_RESOURCE_LIST;
+
+typedef struct _IO_RESOURCE_REQUIREMENTS_LIST {
+	ULONG ListSize;
+	INTERFACE_TYPE InterfaceType;
+	ULONG BusNumber;
+	ULONG SlotNumber;
+	ULONG Reserved[3];
+	ULONG AlternativeLists;
+	IO_RESOURCE_LIST List[1];
+} IO_RESOURCE_REQUIREMENTS_LIST, *PIO_RESOURCE_REQUIREMENTS_LIST;
+
+typedef struct _CM_RESOURCE_LIST CM_RESOURCE_LIST, *PCM_RESOURCE_LIST;
+
+NTSTATUS IoReportDetectedDevice(IN PDRIVER_OBJECT DriverObject,
+								IN INTERFACE_TYPE LegacyBusType,
+								IN ULONG BusNumber,
+								IN ULONG SlotNumber,
+								IN PCM_RESOURCE_LIST ResourceList OPTIONAL,
+								IN PIO_RESOURCE_REQUIREMENTS_LIST ResourceRequirements OPTIONAL,
+								IN BOOLEAN ResourceAssigned,
+								IN OUT PDEVICE_OBJECT* DeviceObject);
+
+// Not part of the DDK - device models.  A model's routines get
+// the offset into its ports.  Attach models before loading the
+// driver that uses them, and detach them after unloading it.
+typedef UCHAR (*PTESTENV_PORT_READ)(IN PVOID Context, IN ULONG Offset);
+typedef VOID (*PTESTENV_PORT_WRITE)(IN PVOID Context, IN ULONG Offset, IN UCHAR Value);
+BOOLEAN TestEnvAttachPorts(IN ULONG PortBase, IN ULONG Length,
+						   IN PTESTENV_PORT_READ ReadRoutine,
+						   IN PTESTENV_PORT_WRITE WriteRoutine, IN PVOID Context);
+VOID TestEnvDetachPorts(IN ULONG PortBase);
+
+// Interrupts are edge-triggered (Latched): one raised while another
+// is still pending on the line is lost in it.  The line's thread
+// calls the ISRs DelayNs after the first.
+VOID TestEnvRaiseInterrupt(IN ULONG Irq, IN ULONG DelayNs);
+
+typedef struct _TESTENV_INTERRUPT_STATS {
+	ULONGLONG Raised;
+	ULONGLONG Coalesced;		// raised while one was pending
+	ULONGLONG Delivered;		// an ISR claimed it
+	ULONGLONG Unclaimed;		// no ISR did, or none was connected
+	ULONGLONG TotalLatencyNs;	// raised to ISR called, over all delivered
+	ULONGLONG MaxLatencyNs;
+} TESTENV_INTERRUPT_STATS, *PTESTENV_INTERRUPT_STATS;
+
+typedef struct _TESTENV_DPC_STATS {
+	ULONGLONG Queued;
+	ULONGLONG Run;
+	ULONGLONG TotalLatencyNs;	// queued to run, over all run
+	ULONGLONG MaxLatencyNs;
+} TESTENV_DPC_STATS, *PTESTENV_DPC_STATS;
+
+// Since the program started
+VOID TestEnvQueryInterrupts(IN ULONG Irq, OUT PTESTENV_INTERRUPT_STATS pStats);
+VOID TestEnvQueryDpcs(OUT PTESTENV_DPC_STATS pStats);
+
+// A parallel port's DATA, STATUS and CONTROL registers, with the
+// Chapter 8 loopback connector plugged in:
+//	D0 (DATA 0)						-> ERROR# (STATUS 3)
+//	STROBE# (CONTROL 0, inverted)	-> SELECT (STATUS 4)
+//	AUTOFD# (CONTROL 1, inverted)	-> PAPER END (STATUS 5)
+//	INIT# (CONTROL 2)				-> ACK# (STATUS 6)
+//	SELECTIN# (CONTROL 3, inverted)	-> BUSY (STATUS 7, inverted)
+// ACK# rising while CONTROL 4 (interrupt enable) is set raises the
+// IRQ, and STATUS 2 (IRQ#) reads 0 from then until STATUS is read.
+// The timing can be changed while the port is attached.
+typedef struct _TESTENV_PARALLEL_PORT {
+	ULONG PortBase;				// e.g. 0x378
+	ULONG Irq;					// e.g. 7
+	ULONG AccessNs;				// each READ/WRITE_PORT_UCHAR spins this long
+	ULONG InterruptDelayNs;		// ACK# to the ISR
+	// The model's state
+	UCHAR Data;
+	UCHAR Control;
+	BOOLEAN bIrqLatched;
+} TESTENV_PARALLEL_PORT, *PTESTENV_PARALLEL_PORT;
+
+BOOLEAN TestEnvAttachParallelPort(IN PTESTENV_PARALLEL_PORT Port);
+VOID TestEnvDetachParallelPort(IN PTESTENV_PARALLEL_PORT Port);
+
+//
+// Registry.  Values (REG_DWORD only) are set by the test program
+// with TestEnvSetRegistryValue and read by the driver as usual.
+//
+#define RTL_REGISTRY_ABSOLUTE		0
+#define RTL_REGISTRY_SERVICES		1
+#define RTL_QUERY_REGISTRY_SUBKEY	0x00000001	// entries after this one are for Path\Name
+#define RTL_QUERY_REGISTRY_REQUIRED	0x00000004
+#define RTL_QUERY_REGISTRY_DIRECT	0x00000020
+#ifndef REG_NONE
+#define REG_NONE	0
+#define REG_DWORD	4
+#endif
+
+typedef NTSTATUS (*PRTL_QUERY_REGISTRY_ROUTINE)(
+	IN PWSTR ValueName, IN ULONG ValueType, IN PVOID ValueData,
+	IN ULONG ValueLength, IN PVOID Context, IN PVOID EntryContext);
+
+typedef struct _RTL_QUERY_REGISTRY_TABLE {
+	PRTL_QUERY_REGISTRY_ROUTINE QueryRoutine;	// not supported
+	ULONG Flags;
+	PWSTR Name;
+	PVOID EntryContext;
+	ULONG DefaultType;
+	PVOID DefaultData;
+	ULONG DefaultLength;
+} RTL_QUERY_REGISTRY_TABLE, *PRTL_QUERY_REGISTRY_TABLE;
+
+NTSTATUS RtlQueryRegistryValues(
+	IN ULONG RelativeTo,
+	IN PCWSTR Path,
+	IN PRTL_QUERY_REGISTRY_TABLE QueryTable,
+	IN PVOID Context,
+	IN PVOID Environment OPTIONAL);
+
+// Not part of the DDK - the test program's side of the I/O manager.
+// A driver's registry path is its service key, as in the real
+// system: \Registry\Machine\System\CurrentControlSet\Services\<name>.
+// The I/O routines wait for the request to complete, as synchronous
+// Win32 calls do.
+VOID TestEnvSetRegistryValue(IN PCWSTR KeyPath, IN PCWSTR ValueName, IN ULONG Value);
+PDRIVER_OBJECT TestEnvLoadDriver(IN PDRIVER_INITIALIZE DriverEntry,
+								 IN PCWSTR ServiceName, OUT NTSTATUS* pStatus);
+VOID TestEnvUnloadDriver(IN PDRIVER_OBJECT DriverObject);
+// Flags are the FILE_OBJECT's: FO_SYNCHRONOUS_IO unless the handle
+// is opened with FILE_FLAG_OVERLAPPED
+NTSTATUS TestEnvOpen(IN PCWSTR Name, IN ULONG Flags,
+					 OUT PFILE_OBJECT* ppFileObject);	// e.g. L"\\??\\LBK1"
+// IRP_MJ_CLEANUP, then - once its last IRP is done - IRP_MJ_CLOSE
+NTSTATUS TestEnvClose(IN PFILE_OBJECT FileObject);
+// IoCancelIrp on every request still in flight for the file object,
+// whichever thread issued it.  They complete (or not) as usual.
+VOID TestEnvCancel(IN PFILE_OBJECT FileObject);
+// Copies the I/O manager has made for buffered I/O (user buffer to
+// SystemBuffer and back) since the program started
+VOID TestEnvQueryIoCopies(OUT PULONGLONG pCopies, OUT PULONGLONG pBytes);
+// Fast I/O calls made since the program started, and how many of
+// them the driver took (the rest went on as IRPs)
+VOID TestEnvQueryFastIo(OUT PULONGLONG pCalls, OUT PULONGLONG pTaken);
+NTSTATUS TestEnvRead(IN PFILE_OBJECT FileObject, OUT PVOID Buffer,
+					 IN ULONG Length, OUT PULONG pInformation);
+NTSTATUS TestEnvWrite(IN PFILE_OBJECT FileObject, IN const VOID* Buffer,
+					  IN ULONG Length, OUT PULONG pInformation);
+// Overlapped reads and writes return as soon as the driver does.  If
+// the request is still pending then, they return STATUS_PENDING and
+// the IRP, which must be handed to TestEnvFinish; otherwise it is
+// finished already and *ppIrp is NULL.  TestEnvFinish returns
+// STATUS_PENDING if the IRP isn't done and bWait is FALSE.
+NTSTATUS TestEnvStartRead(IN PFILE_OBJECT FileObject, OUT PVOID Buffer,
+						  IN ULONG Length, OUT PIRP* ppIrp, OUT PULONG pInformation);
+NTSTATUS TestEnvStartWrite(IN PFILE_OBJECT FileObject, IN const VOID* Buffer,
+						   IN ULONG Length, OUT PIRP* ppIrp, OUT PULONG pInformation);
+NTSTATUS TestEnvFinish(IN PIRP Irp, IN BOOLEAN bWait, OUT PULONG pInformation);
+// IRP_MJ_DEVICE_CONTROL, its buffers passed the way the control
+// code's method says.  Overlapped, as above, or not.
+NTSTATUS TestEnvStartDeviceControl(IN PFILE_OBJECT FileObject, IN ULONG IoControlCode,
+								   IN const VOID* InputBuffer, IN ULONG InputBufferLength,
+								   OUT PVOID OutputBuffer, IN ULONG OutputBufferLength,
+								   OUT PIRP* ppIrp, OUT PULONG pInformation);
+NTSTATUS TestEnvDeviceControl(IN PFILE_OBJECT FileObject, IN ULONG IoControlCode,
+							  IN const VOID* InputBuffer, IN ULONG InputBufferLength,
+							  OUT PVOID OutputBuffer, IN ULONG OutputBufferLength,
+							  OUT PULONG pInformation);
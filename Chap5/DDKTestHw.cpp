@@ -0,0 +1,610 @@
+// DDKTestHw.cpp
+//
+// Copyright (C) 2000 by Jerry Lozano
+//
+
+// Hardware for the Win32 DDK Test Environment: port I/O routed to
+// device models, interrupts, DPCs and the StartIo queue - enough to
+// run a driver like Chapter 8's PPort against a simulated device -
+// and a model of a parallel port with the loopback connector.
+
+#include "StdAfx.h"
+#include "DDKTestEnv.h"
+#include <stdio.h>
+#include <time.h>
+
+#define TESTENV_MAX_PORT_RANGES	8
+#define TESTENV_IRQ_LINES		16
+#define TESTENV_MAX_SHARED		4		// ISRs on one line
+#define PRIMARY_VECTOR_BASE		0x30
+
+// Nanoseconds from some fixed point
+static LONGLONG NowNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (LONGLONG) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static VOID SpinNs(ULONG ns) {
+	if (ns == 0)
+		return;
+	LONGLONG until = NowNs() + ns;
+	while (NowNs() < until)
+		;
+}
+
+VOID KeStallExecutionProcessor(IN ULONG MicroSeconds) {
+	SpinNs(MicroSeconds * 1000);
+}
+
+LARGE_INTEGER KeQueryPerformanceCounter(OUT PLARGE_INTEGER PerformanceFrequency) {
+	LARGE_INTEGER now;
+	if (PerformanceFrequency != NULL)
+		PerformanceFrequency->QuadPart = 1000000000;
+	now.QuadPart = NowNs();
+	return now;
+}
+
+//
+// Ports
+//
+typedef struct _TESTENV_PORT_RANGE {
+	ULONG PortBase;
+	ULONG Length;				// 0 - free slot
+	PTESTENV_PORT_READ ReadRoutine;
+	PTESTENV_PORT_WRITE WriteRoutine;
+	PVOID Context;
+} TESTENV_PORT_RANGE;
+
+// Only changed while no driver is using them, so port I/O reads
+// the table without a lock
+static TESTENV_PORT_RANGE portRanges[TESTENV_MAX_PORT_RANGES];
+
+static TESTENV_PORT_RANGE* RangeOf(ULONG port) {
+	for (ULONG i = 0; i < TESTENV_MAX_PORT_RANGES; i++)
+		if (port - portRanges[i].PortBase < portRanges[i].Length)
+			return &portRanges[i];
+	return NULL;
+}
+
+BOOLEAN TestEnvAttachPorts(IN ULONG PortBase, IN ULONG Length,
+						   IN PTESTENV_PORT_READ ReadRoutine,
+						   IN PTESTENV_PORT_WRITE WriteRoutine, IN PVOID Context) {
+	for (ULONG i = 0; i < TESTENV_MAX_PORT_RANGES; i++)
+		if (portRanges[i].Length == 0) {
+			portRanges[i].PortBase = PortBase;
+			portRanges[i].ReadRoutine = ReadRoutine;
+			portRanges[i].WriteRoutine = WriteRoutine;
+			portRanges[i].Context = Context;
+			portRanges[i].Length = Length;
+			return TRUE;
+		}
+	return FALSE;
+}
+
+VOID TestEnvDetachPorts(IN ULONG PortBase) {
+	for (ULONG i = 0; i < TESTENV_MAX_PORT_RANGES; i++)
+		if (portRanges[i].Length != 0 && portRanges[i].PortBase == PortBase)
+			portRanges[i].Length = 0;
+}
+
+UCHAR READ_PORT_UCHAR(IN PUCHAR Port) {
+	ULONG port = (ULONG) (ULONG_PTR) Port;
+	TESTENV_PORT_RANGE* pRange = RangeOf(port);
+	if (pRange == NULL)
+		return 0xFF;	// nothing drives the bus
+	return pRange->ReadRoutine(pRange->Context, port - pRange->PortBase);
+}
+
+VOID WRITE_PORT_UCHAR(IN PUCHAR Port, IN UCHAR Value) {
+	ULONG port = (ULONG) (ULONG_PTR) Port;
+	TESTENV_PORT_RANGE* pRange = RangeOf(port);
+	if (pRange != NULL)
+		pRange->WriteRoutine(pRange->Context, port - pRange->PortBase, Value);
+}
+
+//
+// Interrupts
+//
+struct _KINTERRUPT {
+	PKSERVICE_ROUTINE ServiceRoutine;
+	PVOID ServiceContext;
+	PKSPIN_LOCK ActualLock;		// the driver's, or SpinLock
+	KSPIN_LOCK SpinLock;
+	ULONG Vector;
+	KIRQL Irql;
+	ULONG Irq;
+};
+
+// An IRQ line, and the thread that delivers its interrupts
+typedef struct _TESTENV_IRQ_LINE {
+	PKINTERRUPT Interrupts[TESTENV_MAX_SHARED];
+	ULONG nInterrupts;
+	BOOLEAN bPending;
+	LONGLONG RaisedNs;
+	LONGLONG DueNs;
+	BOOLEAN bRunning;			// the thread is there
+	BOOLEAN bStop;
+	pthread_t thread;
+	TESTENV_INTERRUPT_STATS Stats;
+} TESTENV_IRQ_LINE;
+
+static TESTENV_IRQ_LINE irqLines[TESTENV_IRQ_LINES];
+static pthread_mutex_t irqLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t irqRaised = PTHREAD_COND_INITIALIZER;
+
+// Waits for the line's interrupts and calls its ISRs
+static void* LineThread(void* pContext) {
+	TESTENV_IRQ_LINE* pLine = (TESTENV_IRQ_LINE*) pContext;
+	pthread_mutex_lock(&irqLock);
+	for (;;) {
+		while (!pLine->bPending && !pLine->bStop)
+			pthread_cond_wait(&irqRaised, &irqLock);
+		if (pLine->bStop)
+			break;
+		LONGLONG wait = pLine->DueNs - NowNs();
+		if (wait > 0) {
+			// Sleep through long delays, spin through the end
+			pthread_mutex_unlock(&irqLock);
+			if (wait > 200000) {
+				LONGLONG sleep = wait - 100000;		// wakes up late
+				struct timespec nap;
+				nap.tv_sec = (time_t) (sleep / 1000000000);
+				nap.tv_nsec = (long) (sleep % 1000000000);
+				nanosleep(&nap, NULL);
+			}
+			while (NowNs() < pLine->DueNs)
+				;
+			pthread_mutex_lock(&irqLock);
+			continue;	// may be stopping now
+		}
+		// A new edge can be latched from here on
+		pLine->bPending = FALSE;
+		LONGLONG raised = pLine->RaisedNs;
+		PKINTERRUPT interrupts[TESTENV_MAX_SHARED];
+		ULONG nInterrupts = pLine->nInterrupts;
+		for (ULONG i = 0; i < nInterrupts; i++)
+			interrupts[i] = pLine->Interrupts[i];
+		pthread_mutex_unlock(&irqLock);
+
+		// Each ISR on the line in turn, until one claims it
+		LONGLONG latency = NowNs() - raised;
+		BOOLEAN bClaimed = FALSE;
+		for (ULONG i = 0; i < nInterrupts && !bClaimed; i++) {
+			KIRQL irql;
+			KeAcquireSpinLock(interrupts[i]->ActualLock, &irql);
+			bClaimed = interrupts[i]->ServiceRoutine(interrupts[i],
+													 interrupts[i]->ServiceContext);
+			KeReleaseSpinLock(interrupts[i]->ActualLock, irql);
+		}
+
+		pthread_mutex_lock(&irqLock);
+		if (bClaimed) {
+			pLine->Stats.Delivered++;
+			pLine->Stats.TotalLatencyNs += latency;
+			if ((ULONGLONG) latency > pLine->Stats.MaxLatencyNs)
+				pLine->Stats.MaxLatencyNs = latency;
+		} else
+			pLine->Stats.Unclaimed++;
+	}
+	pthread_mutex_unlock(&irqLock);
+	return NULL;
+}
+
+VOID TestEnvRaiseInterrupt(IN ULONG Irq, IN ULONG DelayNs) {
+	if (Irq >= TESTENV_IRQ_LINES)
+		return;
+	TESTENV_IRQ_LINE* pLine = &irqLines[Irq];
+	LONGLONG now = NowNs();
+	pthread_mutex_lock(&irqLock);
+	pLine->Stats.Raised++;
+	if (pLine->nInterrupts == 0)
+		pLine->Stats.Unclaimed++;
+	else if (pLine->bPending)
+		pLine->Stats.Coalesced++;
+	else {
+		pLine->bPending = TRUE;
+		pLine->RaisedNs = now;
+		pLine->DueNs = now + DelayNs;
+		pthread_cond_broadcast(&irqRaised);
+	}
+	pthread_mutex_unlock(&irqLock);
+}
+
+VOID TestEnvQueryInterrupts(IN ULONG Irq, OUT PTESTENV_INTERRUPT_STATS pStats) {
+	memset(pStats, 0, sizeof(*pStats));
+	if (Irq >= TESTENV_IRQ_LINES)
+		return;
+	pthread_mutex_lock(&irqLock);
+	*pStats = irqLines[Irq].Stats;
+	pthread_mutex_unlock(&irqLock);
+}
+
+ULONG HalGetInterruptVector(IN INTERFACE_TYPE InterfaceType, IN ULONG BusNumber,
+							IN ULONG BusInterruptLevel, IN ULONG BusInterruptVector,
+							OUT PKIRQL Irql, OUT PKAFFINITY Affinity) {
+	*Irql = (KIRQL) (27 - BusInterruptLevel);
+	*Affinity = 1;		// the one processor
+	return PRIMARY_VECTOR_BASE + BusInterruptLevel;
+}
+
+NTSTATUS IoConnectInterrupt(OUT PKINTERRUPT* InterruptObject,
+							IN PKSERVICE_ROUTINE ServiceRoutine,
+							IN PVOID ServiceContext,
+							IN PKSPIN_LOCK SpinLock OPTIONAL,
+							IN ULONG Vector,
+							IN KIRQL Irql,
+							IN KIRQL SynchronizeIrql,
+							IN KINTERRUPT_MODE InterruptMode,
+							IN BOOLEAN ShareVector,
+							IN KAFFINITY ProcessorEnableMask,
+							IN BOOLEAN FloatingSave) {
+	*InterruptObject = NULL;
+	ULONG irq = Vector - PRIMARY_VECTOR_BASE;
+	if (irq >= TESTENV_IRQ_LINES)
+		return STATUS_INVALID_PARAMETER;
+	TESTENV_IRQ_LINE* pLine = &irqLines[irq];
+	PKINTERRUPT pInterrupt = (PKINTERRUPT) calloc(1, sizeof(KINTERRUPT));
+	pInterrupt->ServiceRoutine = ServiceRoutine;
+	pInterrupt->ServiceContext = ServiceContext;
+	KeInitializeSpinLock(&pInterrupt->SpinLock);
+	pInterrupt->ActualLock = (SpinLock != NULL) ? SpinLock : &pInterrupt->SpinLock;
+	pInterrupt->Vector = Vector;
+	pInterrupt->Irql = SynchronizeIrql;
+	pInterrupt->Irq = irq;
+
+	pthread_mutex_lock(&irqLock);
+	if (pLine->nInterrupts == TESTENV_MAX_SHARED ||
+			(pLine->nInterrupts != 0 && !ShareVector)) {
+		pthread_mutex_unlock(&irqLock);
+		free(pInterrupt);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	pLine->Interrupts[pLine->nInterrupts++] = pInterrupt;
+	if (!pLine->bRunning) {
+		pLine->bStop = FALSE;
+		pLine->bPending = FALSE;
+		pLine->bRunning = TRUE;
+		pthread_create(&pLine->thread, NULL, LineThread, pLine);
+	}
+	pthread_mutex_unlock(&irqLock);
+	*InterruptObject = pInterrupt;
+	return STATUS_SUCCESS;
+}
+
+VOID IoDisconnectInterrupt(IN PKINTERRUPT InterruptObject) {
+	TESTENV_IRQ_LINE* pLine = &irqLines[InterruptObject->Irq];
+	BOOLEAN bStop = FALSE;
+	pthread_mutex_lock(&irqLock);
+	for (ULONG i = 0; i < pLine->nInterrupts; i++)
+		if (pLine->Interrupts[i] == InterruptObject) {
+			pLine->Interrupts[i] = pLine->Interrupts[--pLine->nInterrupts];
+			break;
+		}
+	if (pLine->nInterrupts == 0 && pLine->bRunning) {
+		pLine->bStop = TRUE;
+		pthread_cond_broadcast(&irqRaised);
+		bStop = TRUE;
+	}
+	pthread_mutex_unlock(&irqLock);
+	// Its last ISR call is over once the thread is gone
+	if (bStop) {
+		pthread_join(pLine->thread, NULL);
+		pthread_mutex_lock(&irqLock);
+		pLine->bRunning = FALSE;
+		pthread_mutex_unlock(&irqLock);
+	}
+	free(InterruptObject);
+}
+
+BOOLEAN KeSynchronizeExecution(IN PKINTERRUPT Interrupt,
+							   IN PKSYNCHRONIZE_ROUTINE SynchronizeRoutine,
+							   IN PVOID SynchronizeContext) {
+	KIRQL irql;
+	KeAcquireSpinLock(Interrupt->ActualLock, &irql);
+	BOOLEAN result = SynchronizeRoutine(SynchronizeContext);
+	KeReleaseSpinLock(Interrupt->ActualLock, irql);
+	return result;
+}
+
+NTSTATUS IoReportDetectedDevice(IN PDRIVER_OBJECT DriverObject,
+								IN INTERFACE_TYPE LegacyBusType,
+								IN ULONG BusNumber,
+								IN ULONG SlotNumber,
+								IN PCM_RESOURCE_LIST ResourceList OPTIONAL,
+								IN PIO_RESOURCE_REQUIREMENTS_LIST ResourceRequirements OPTIONAL,
+								IN BOOLEAN ResourceAssigned,
+								IN OUT PDEVICE_OBJECT* DeviceObject) {
+	return STATUS_SUCCESS;
+}
+
+//
+// DPCs
+//
+static LIST_ENTRY dpcQueue = {&dpcQueue, &dpcQueue};
+static BOOLEAN bDpcThread = FALSE;
+static TESTENV_DPC_STATS dpcStats;
+static pthread_mutex_t dpcLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dpcQueued = PTHREAD_COND_INITIALIZER;
+
+// Runs the DPCs, oldest first, for as long as the program does
+static void* DpcThread(void* pContext) {
+	pthread_mutex_lock(&dpcLock);
+	for (;;) {
+		while (IsListEmpty(&dpcQueue))
+			pthread_cond_wait(&dpcQueued, &dpcLock);
+		PKDPC pDpc = CONTAINING_RECORD(RemoveHeadList(&dpcQueue), KDPC, DpcListEntry);
+		pDpc->Inserted = FALSE;		// may be queued again from here on
+		PVOID pArgument1 = pDpc->SystemArgument1;
+		PVOID pArgument2 = pDpc->SystemArgument2;
+		LONGLONG latency = NowNs() - pDpc->TestEnvQueuedNs;
+		dpcStats.Run++;
+		dpcStats.TotalLatencyNs += latency;
+		if ((ULONGLONG) latency > dpcStats.MaxLatencyNs)
+			dpcStats.MaxLatencyNs = latency;
+		pthread_mutex_unlock(&dpcLock);
+		pDpc->DeferredRoutine(pDpc, pDpc->DeferredContext, pArgument1, pArgument2);
+		pthread_mutex_lock(&dpcLock);
+	}
+	return NULL;
+}
+
+VOID KeInitializeDpc(IN PKDPC Dpc, IN PKDEFERRED_ROUTINE DeferredRoutine,
+					 IN PVOID DeferredContext) {
+	Dpc->DeferredRoutine = DeferredRoutine;
+	Dpc->DeferredContext = DeferredContext;
+	Dpc->Inserted = FALSE;
+	InitializeListHead(&Dpc->DpcListEntry);
+}
+
+BOOLEAN KeInsertQueueDpc(IN PKDPC Dpc, IN PVOID SystemArgument1,
+						 IN PVOID SystemArgument2) {
+	pthread_mutex_lock(&dpcLock);
+	if (Dpc->Inserted) {
+		pthread_mutex_unlock(&dpcLock);
+		return FALSE;
+	}
+	Dpc->Inserted = TRUE;
+	Dpc->SystemArgument1 = SystemArgument1;
+	Dpc->SystemArgument2 = SystemArgument2;
+	Dpc->TestEnvQueuedNs = NowNs();
+	InsertTailList(&dpcQueue, &Dpc->DpcListEntry);
+	dpcStats.Queued++;
+	if (!bDpcThread) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, DpcThread, NULL) == 0) {
+			pthread_detach(thread);
+			bDpcThread = TRUE;
+		}
+	}
+	pthread_cond_signal(&dpcQueued);
+	pthread_mutex_unlock(&dpcLock);
+	return TRUE;
+}
+
+BOOLEAN KeRemoveQueueDpc(IN PKDPC Dpc) {
+	pthread_mutex_lock(&dpcLock);
+	BOOLEAN bWasQueued = Dpc->Inserted;
+	if (bWasQueued) {
+		RemoveEntryList(&Dpc->DpcListEntry);
+		Dpc->Inserted = FALSE;
+	}
+	pthread_mutex_unlock(&dpcLock);
+	return bWasQueued;
+}
+
+VOID TestEnvQueryDpcs(OUT PTESTENV_DPC_STATS pStats) {
+	pthread_mutex_lock(&dpcLock);
+	*pStats = dpcStats;
+	pthread_mutex_unlock(&dpcLock);
+}
+
+//
+// Device queues and StartIo
+//
+VOID KeInitializeDeviceQueue(IN PKDEVICE_QUEUE DeviceQueue) {
+	InitializeListHead(&DeviceQueue->DeviceListHead);
+	KeInitializeSpinLock(&DeviceQueue->Lock);
+	DeviceQueue->Busy = FALSE;
+}
+
+BOOLEAN KeInsertDeviceQueue(IN PKDEVICE_QUEUE DeviceQueue,
+							IN PKDEVICE_QUEUE_ENTRY DeviceQueueEntry) {
+	KIRQL irql;
+	KeAcquireSpinLock(&DeviceQueue->Lock, &irql);
+	BOOLEAN bInserted = DeviceQueue->Busy;
+	if (bInserted)
+		InsertTailList(&DeviceQueue->DeviceListHead, &DeviceQueueEntry->DeviceListEntry);
+	else
+		DeviceQueue->Busy = TRUE;
+	DeviceQueueEntry->Inserted = bInserted;
+	KeReleaseSpinLock(&DeviceQueue->Lock, irql);
+	return bInserted;
+}
+
+BOOLEAN KeInsertByKeyDeviceQueue(IN PKDEVICE_QUEUE DeviceQueue,
+								 IN PKDEVICE_QUEUE_ENTRY DeviceQueueEntry,
+								 IN ULONG SortKey) {
+	KIRQL irql;
+	KeAcquireSpinLock(&DeviceQueue->Lock, &irql);
+	DeviceQueueEntry->SortKey = SortKey;
+	BOOLEAN bInserted = DeviceQueue->Busy;
+	if (bInserted) {
+		// Behind everything with the same key or less
+		PLIST_ENTRY pNext = DeviceQueue->DeviceListHead.Flink;
+		while (pNext != &DeviceQueue->DeviceListHead &&
+			   CONTAINING_RECORD(pNext, KDEVICE_QUEUE_ENTRY, DeviceListEntry)->SortKey <= SortKey)
+			pNext = pNext->Flink;
+		InsertTailList(pNext, &DeviceQueueEntry->DeviceListEntry);
+	} else
+		DeviceQueue->Busy = TRUE;
+	DeviceQueueEntry->Inserted = bInserted;
+	KeReleaseSpinLock(&DeviceQueue->Lock, irql);
+	return bInserted;
+}
+
+PKDEVICE_QUEUE_ENTRY KeRemoveDeviceQueue(IN PKDEVICE_QUEUE DeviceQueue) {
+	KIRQL irql;
+	PKDEVICE_QUEUE_ENTRY pEntry = NULL;
+	KeAcquireSpinLock(&DeviceQueue->Lock, &irql);
+	if (IsListEmpty(&DeviceQueue->DeviceListHead))
+		DeviceQueue->Busy = FALSE;
+	else {
+		pEntry = CONTAINING_RECORD(RemoveHeadList(&DeviceQueue->DeviceListHead),
+								   KDEVICE_QUEUE_ENTRY, DeviceListEntry);
+		pEntry->Inserted = FALSE;
+	}
+	KeReleaseSpinLock(&DeviceQueue->Lock, irql);
+	return pEntry;
+}
+
+PKDEVICE_QUEUE_ENTRY KeRemoveByKeyDeviceQueue(IN PKDEVICE_QUEUE DeviceQueue,
+											  IN ULONG SortKey) {
+	KIRQL irql;
+	PKDEVICE_QUEUE_ENTRY pEntry = NULL;
+	KeAcquireSpinLock(&DeviceQueue->Lock, &irql);
+	if (IsListEmpty(&DeviceQueue->DeviceListHead))
+		DeviceQueue->Busy = FALSE;
+	else {
+		PLIST_ENTRY pNext = DeviceQueue->DeviceListHead.Flink;
+		while (pNext != &DeviceQueue->DeviceListHead &&
+			   CONTAINING_RECORD(pNext, KDEVICE_QUEUE_ENTRY, DeviceListEntry)->SortKey < SortKey)
+			pNext = pNext->Flink;
+		if (pNext == &DeviceQueue->DeviceListHead)
+			pNext = DeviceQueue->DeviceListHead.Flink;	// none - wrap around
+		RemoveEntryList(pNext);
+		pEntry = CONTAINING_RECORD(pNext, KDEVICE_QUEUE_ENTRY, DeviceListEntry);
+		pEntry->Inserted = FALSE;
+	}
+	KeReleaseSpinLock(&DeviceQueue->Lock, irql);
+	return pEntry;
+}
+
+BOOLEAN KeRemoveEntryDeviceQueue(IN PKDEVICE_QUEUE DeviceQueue,
+								 IN PKDEVICE_QUEUE_ENTRY DeviceQueueEntry) {
+	KIRQL irql;
+	KeAcquireSpinLock(&DeviceQueue->Lock, &irql);
+	BOOLEAN bWasInserted = DeviceQueueEntry->Inserted;
+	if (bWasInserted) {
+		RemoveEntryList(&DeviceQueueEntry->DeviceListEntry);
+		DeviceQueueEntry->Inserted = FALSE;
+	}
+	KeReleaseSpinLock(&DeviceQueue->Lock, irql);
+	return bWasInserted;
+}
+
+// As in the kernel, the cancel routine is set under the cancel
+// spin lock, and StartIo is called without it
+VOID IoStartPacket(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp,
+				   IN PULONG Key OPTIONAL, IN PDRIVER_CANCEL CancelFunction OPTIONAL) {
+	KIRQL irql;
+	IoAcquireCancelSpinLock(&irql);
+	if (CancelFunction != NULL)
+		IoSetCancelRoutine(Irp, CancelFunction);
+	BOOLEAN bInserted = (Key != NULL) ?
+		KeInsertByKeyDeviceQueue(&DeviceObject->DeviceQueue,
+								 &Irp->Tail.Overlay.DeviceQueueEntry, *Key) :
+		KeInsertDeviceQueue(&DeviceObject->DeviceQueue,
+							&Irp->Tail.Overlay.DeviceQueueEntry);
+	if (bInserted) {
+		IoReleaseCancelSpinLock(irql);	// busy - it waits its turn
+		return;
+	}
+	DeviceObject->CurrentIrp = Irp;
+	IoReleaseCancelSpinLock(irql);
+	DeviceObject->DriverObject->DriverStartIo(DeviceObject, Irp);
+}
+
+static VOID StartNextPacket(IN PDEVICE_OBJECT DeviceObject, IN BOOLEAN Cancelable,
+							IN BOOLEAN bByKey, IN ULONG Key) {
+	KIRQL irql;
+	if (Cancelable)
+		IoAcquireCancelSpinLock(&irql);
+	DeviceObject->CurrentIrp = NULL;
+	PKDEVICE_QUEUE_ENTRY pEntry = bByKey ?
+		KeRemoveByKeyDeviceQueue(&DeviceObject->DeviceQueue, Key) :
+		KeRemoveDeviceQueue(&DeviceObject->DeviceQueue);
+	PIRP pIrp = NULL;
+	if (pEntry != NULL) {
+		pIrp = CONTAINING_RECORD(pEntry, IRP, Tail.Overlay.DeviceQueueEntry);
+		DeviceObject->CurrentIrp = pIrp;
+	}
+	if (Cancelable)
+		IoReleaseCancelSpinLock(irql);
+	if (pIrp != NULL)
+		DeviceObject->DriverObject->DriverStartIo(DeviceObject, pIrp);
+}
+
+VOID IoStartNextPacket(IN PDEVICE_OBJECT DeviceObject, IN BOOLEAN Cancelable) {
+	StartNextPacket(DeviceObject, Cancelable, FALSE, 0);
+}
+
+VOID IoStartNextPacketByKey(IN PDEVICE_OBJECT DeviceObject, IN BOOLEAN Cancelable,
+							IN ULONG Key) {
+	StartNextPacket(DeviceObject, Cancelable, TRUE, Key);
+}
+
+//
+// The parallel port model (see TESTENV_PARALLEL_PORT)
+//
+#define PP_DATA		0
+#define PP_STATUS	1
+#define PP_CONTROL	2
+
+static UCHAR ParallelRead(IN PVOID Context, IN ULONG Offset) {
+	PTESTENV_PARALLEL_PORT pPort = (PTESTENV_PARALLEL_PORT) Context;
+	SpinNs(pPort->AccessNs);
+	switch (Offset) {
+	case PP_DATA:
+		return pPort->Data;
+	case PP_CONTROL:
+		return pPort->Control;
+	case PP_STATUS: {
+		UCHAR control = pPort->Control;
+		UCHAR status = 0x03;				// reserved bits
+		if (!pPort->bIrqLatched)
+			status |= 0x04;					// IRQ#
+		if (pPort->Data & 0x01)
+			status |= 0x08;					// ERROR# <- D0
+		if (!(control & 0x01))
+			status |= 0x10;					// SELECT <- STROBE#
+		if (!(control & 0x02))
+			status |= 0x20;					// PAPER END <- AUTOFD#
+		if (control & 0x04)
+			status |= 0x40;					// ACK# <- INIT#
+		if (control & 0x08)
+			status |= 0x80;					// BUSY <- SELECTIN#, inverted twice
+		pPort->bIrqLatched = FALSE;
+		return status;
+	}
+	default:
+		return 0xFF;
+	}
+}
+
+static VOID ParallelWrite(IN PVOID Context, IN ULONG Offset, IN UCHAR Value) {
+	PTESTENV_PARALLEL_PORT pPort = (PTESTENV_PARALLEL_PORT) Context;
+	SpinNs(pPort->AccessNs);
+	if (Offset == PP_DATA)
+		pPort->Data = Value;
+	else if (Offset == PP_CONTROL) {
+		UCHAR previous = pPort->Control;
+		pPort->Control = Value;
+		// ACK# (wired to INIT#) rising, interrupts enabled
+		if (!(previous & 0x04) && (Value & 0x04) && (Value & 0x10)) {
+			pPort->bIrqLatched = TRUE;
+			TestEnvRaiseInterrupt(pPort->Irq, pPort->InterruptDelayNs);
+		}
+	}
+}
+
+BOOLEAN TestEnvAttachParallelPort(IN PTESTENV_PARALLEL_PORT Port) {
+	Port->Data = 0;
+	Port->Control = 0;
+	Port->bIrqLatched = FALSE;
+	return TestEnvAttachPorts(Port->PortBase, 3, ParallelRead, ParallelWrite, Port);
+}
+
+VOID TestEnvDetachParallelPort(IN PTESTENV_PARALLEL_PORT Port) {
+	TestEnvDetachPorts(Port->PortBase);
+}
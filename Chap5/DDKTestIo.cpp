@@ -0,0 +1,1053 @@
+// DDKTestIo.cpp
+//
+// Copyright (C) 2000 by Jerry Lozano
+//
+
+// I/O manager and registry for the Win32 DDK Test Environment.
+// Drivers see IRPs as they would in the kernel; the test program
+// opens, reads and writes their devices through TestEnvXxx calls.
+// Also the events, object handles and shareable pages drivers use
+// to talk to the test program without IRPs.
+
+#include "StdAfx.h"
+#include "DDKTestEnv.h"
+#include <stdio.h>
+#ifndef _WIN32
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#define TESTENV_MAX_DRIVERS		8
+#define TESTENV_MAX_VALUES		64
+
+#define SERVICES_KEY L"\\Registry\\Machine\\System\\CurrentControlSet\\Services\\"
+
+// A symbolic link
+typedef struct _TESTENV_LINK {
+	PWSTR LinkName;
+	PWSTR Target;
+	struct _TESTENV_LINK* pNext;
+} TESTENV_LINK;
+
+// A REG_DWORD value
+typedef struct _TESTENV_VALUE {
+	PWSTR KeyPath;
+	PWSTR ValueName;
+	ULONG Value;
+} TESTENV_VALUE;
+
+static PDRIVER_OBJECT pDrivers[TESTENV_MAX_DRIVERS];
+static TESTENV_LINK* pLinks = NULL;
+static TESTENV_VALUE registryValues[TESTENV_MAX_VALUES];
+static ULONG nRegistryValues = 0;
+static LIST_ENTRY irpsInFlight = {&irpsInFlight, &irpsInFlight};
+static KSPIN_LOCK cancelSpinLock = 0;
+static ULONGLONG ioCopies = 0;		// see TestEnvQueryIoCopies
+static ULONGLONG ioCopyBytes = 0;
+static ULONGLONG fastIoCalls = 0;	// see TestEnvQueryFastIo
+static ULONGLONG fastIoTaken = 0;
+
+// Guards the name space, and lets waiters know IRPs completed
+#ifdef _WIN32
+static CRITICAL_SECTION ioLock;
+static BOOLEAN bIoLockReady = FALSE;
+#else
+static pthread_mutex_t ioLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ioCompleted = PTHREAD_COND_INITIALIZER;
+#endif
+
+static void LockIo() {
+#ifdef _WIN32
+	if (!bIoLockReady) {	// first use is from the test's main thread
+		InitializeCriticalSection(&ioLock);
+		bIoLockReady = TRUE;
+	}
+	EnterCriticalSection(&ioLock);
+#else
+	pthread_mutex_lock(&ioLock);
+#endif
+}
+
+static void UnlockIo() {
+#ifdef _WIN32
+	LeaveCriticalSection(&ioLock);
+#else
+	pthread_mutex_unlock(&ioLock);
+#endif
+}
+
+// Called with the I/O lock held, which it drops while waiting
+static void WaitIo() {
+#ifdef _WIN32
+	UnlockIo();
+	Sleep(0);
+	LockIo();
+#else
+	pthread_cond_wait(&ioCompleted, &ioLock);
+#endif
+}
+
+static void SignalIo() {
+#ifndef _WIN32
+	pthread_cond_broadcast(&ioCompleted);
+#endif
+}
+
+// The C library's wcs* routines can't be used (see DDKTestEnv.h)
+static ULONG WideLength(PCWSTR pString) {
+	ULONG n = 0;
+	while (pString[n] != UNICODE_NULL)
+		n++;
+	return n;
+}
+
+static WCHAR WideUpcase(WCHAR c) {
+	return (c >= L'a' && c <= L'z') ? (WCHAR) (c - L'a' + L'A') : c;
+}
+
+// Object and registry names ignore case
+static BOOLEAN WideEqualNoCase(PCWSTR pString1, PCWSTR pString2) {
+	for (; *pString1 != UNICODE_NULL; pString1++, pString2++)
+		if (WideUpcase(*pString1) != WideUpcase(*pString2))
+			return FALSE;
+	return *pString2 == UNICODE_NULL;
+}
+
+static PWSTR WideConcat(PCWSTR pFirst, const WCHAR* pSecond, ULONG nSecond) {
+	ULONG nFirst = WideLength(pFirst);
+	PWSTR pCopy = (PWSTR) malloc((nFirst + nSecond + 1) * sizeof(WCHAR));
+	memcpy(pCopy, pFirst, nFirst * sizeof(WCHAR));
+	memcpy(pCopy + nFirst, pSecond, nSecond * sizeof(WCHAR));
+	pCopy[nFirst + nSecond] = UNICODE_NULL;
+	return pCopy;
+}
+
+static PWSTR UnicodeStringCopy(PUNICODE_STRING pString) {
+	return WideConcat(L"", pString->Buffer, pString->Length / sizeof(WCHAR));
+}
+
+static const char* NarrowName(PCWSTR pWide, char* pNarrow, ULONG nSize) {
+	ULONG i = 0;
+	for (; pWide[i] != UNICODE_NULL && i < nSize - 1; i++)
+		pNarrow[i] = (pWide[i] < 128) ? (char) pWide[i] : '?';
+	pNarrow[i] = '\0';
+	return pNarrow;
+}
+
+// Called with the I/O lock held
+static PDEVICE_OBJECT FindDevice(PCWSTR pName) {
+	for (ULONG i = 0; i < TESTENV_MAX_DRIVERS; i++) {
+		if (pDrivers[i] == NULL)
+			continue;
+		for (PDEVICE_OBJECT pDevObj = pDrivers[i]->DeviceObject;
+				pDevObj != NULL; pDevObj = pDevObj->NextDevice)
+			if (pDevObj->TestEnvName != NULL &&
+				WideEqualNoCase(pDevObj->TestEnvName, pName))
+				return pDevObj;
+	}
+	return NULL;
+}
+
+static TESTENV_LINK** FindLink(PCWSTR pLinkName) {
+	TESTENV_LINK** ppLink = &pLinks;
+	while (*ppLink != NULL && !WideEqualNoCase((*ppLink)->LinkName, pLinkName))
+		ppLink = &(*ppLink)->pNext;
+	return ppLink;
+}
+
+NTSTATUS IoCreateDevice(
+	IN PDRIVER_OBJECT DriverObject,
+	IN ULONG DeviceExtensionSize,
+	IN PUNICODE_STRING DeviceName OPTIONAL,
+	IN ULONG DeviceType,
+	IN ULONG DeviceCharacteristics,
+	IN BOOLEAN Exclusive,
+	OUT PDEVICE_OBJECT *DeviceObject) {
+	PWSTR pName = (DeviceName != NULL) ? UnicodeStringCopy(DeviceName) : NULL;
+	LockIo();
+	if (pName != NULL && FindDevice(pName) != NULL) {
+		UnlockIo();
+		free(pName);
+		return STATUS_OBJECT_NAME_COLLISION;
+	}
+	// The extension follows the object, zeroed
+	PDEVICE_OBJECT pDevObj = (PDEVICE_OBJECT)
+		calloc(1, sizeof(DEVICE_OBJECT) + DeviceExtensionSize + 16);
+	pDevObj->DriverObject = DriverObject;
+	pDevObj->DeviceType = DeviceType;
+	pDevObj->Flags = DO_DEVICE_INITIALIZING | (Exclusive ? DO_EXCLUSIVE : 0);
+	pDevObj->DeviceExtension = (PCHAR) pDevObj +
+		((sizeof(DEVICE_OBJECT) + 15) & ~15);
+	pDevObj->TestEnvName = pName;
+	InitializeListHead(&pDevObj->DeviceQueue.DeviceListHead);
+	pDevObj->NextDevice = DriverObject->DeviceObject;
+	DriverObject->DeviceObject = pDevObj;
+	UnlockIo();
+	*DeviceObject = pDevObj;
+	return STATUS_SUCCESS;
+}
+
+VOID IoDeleteDevice(IN PDEVICE_OBJECT DeviceObject) {
+	LockIo();
+	PDEVICE_OBJECT* ppDevObj = &DeviceObject->DriverObject->DeviceObject;
+	while (*ppDevObj != DeviceObject)
+		ppDevObj = &(*ppDevObj)->NextDevice;
+	*ppDevObj = DeviceObject->NextDevice;
+	UnlockIo();
+	free(DeviceObject->TestEnvName);
+	free(DeviceObject);
+}
+
+NTSTATUS IoCreateSymbolicLink(IN PUNICODE_STRING SymbolicLinkName,
+							  IN PUNICODE_STRING DeviceName) {
+	PWSTR pLinkName = UnicodeStringCopy(SymbolicLinkName);
+	LockIo();
+	if (*FindLink(pLinkName) != NULL) {
+		UnlockIo();
+		free(pLinkName);
+		return STATUS_OBJECT_NAME_COLLISION;
+	}
+	TESTENV_LINK* pLink = (TESTENV_LINK*) malloc(sizeof(TESTENV_LINK));
+	pLink->LinkName = pLinkName;
+	pLink->Target = UnicodeStringCopy(DeviceName);
+	pLink->pNext = pLinks;
+	pLinks = pLink;
+	UnlockIo();
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS IoDeleteSymbolicLink(IN PUNICODE_STRING SymbolicLinkName) {
+	PWSTR pLinkName = UnicodeStringCopy(SymbolicLinkName);
+	LockIo();
+	TESTENV_LINK** ppLink = FindLink(pLinkName);
+	TESTENV_LINK* pLink = *ppLink;
+	if (pLink != NULL)
+		*ppLink = pLink->pNext;
+	UnlockIo();
+	free(pLinkName);
+	if (pLink == NULL)
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	free(pLink->LinkName);
+	free(pLink->Target);
+	free(pLink);
+	return STATUS_SUCCESS;
+}
+
+VOID IoCompleteRequest(IN PIRP Irp, IN CHAR PriorityBoost) {
+	if (Irp->TestEnvCompleted) {
+		fprintf(stderr, "IoCompleteRequest: IRP %p completed twice\n", Irp);
+		abort();	// MULTIPLE_IRP_COMPLETE_REQUESTS
+	}
+	if (Irp->CancelRoutine != NULL) {
+		fprintf(stderr, "IoCompleteRequest: IRP %p still has a cancel routine\n", Irp);
+		abort();
+	}
+	Irp->PendingReturned = (Irp->TestEnvStack.Control & SL_PENDING_RETURNED) != 0;
+	LockIo();
+	Irp->TestEnvCompleted = TRUE;
+	SignalIo();
+	UnlockIo();
+}
+
+PDRIVER_CANCEL IoSetCancelRoutine(IN PIRP Irp, IN PDRIVER_CANCEL CancelRoutine) {
+#ifdef _WIN32
+	return (PDRIVER_CANCEL) InterlockedExchangePointer(
+		(PVOID*) &Irp->CancelRoutine, (PVOID) CancelRoutine);
+#else
+	return __sync_lock_test_and_set(&Irp->CancelRoutine, CancelRoutine);
+#endif
+}
+
+VOID IoAcquireCancelSpinLock(OUT PKIRQL Irql) {
+	KeAcquireSpinLock(&cancelSpinLock, Irql);
+}
+
+VOID IoReleaseCancelSpinLock(IN KIRQL Irql) {
+	KeReleaseSpinLock(&cancelSpinLock, Irql);
+}
+
+BOOLEAN IoCancelIrp(IN PIRP Irp) {
+	KIRQL irql;
+	IoAcquireCancelSpinLock(&irql);
+	Irp->Cancel = TRUE;
+	PDRIVER_CANCEL pCancel = IoSetCancelRoutine(Irp, NULL);
+	if (pCancel == NULL) {
+		IoReleaseCancelSpinLock(irql);
+		return FALSE;
+	}
+	Irp->CancelIrql = irql;
+	pCancel(Irp->TestEnvStack.DeviceObject, Irp);	// releases the lock
+	return TRUE;
+}
+
+static LONG AtomicExchange(volatile LONG* pTarget, LONG Value) {
+#ifdef _WIN32
+	return InterlockedExchange((LONG*) pTarget, Value);
+#else
+	return __atomic_exchange_n(pTarget, Value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static LONG AtomicCompareExchange(volatile LONG* pTarget, LONG Exchange, LONG Comperand) {
+#ifdef _WIN32
+	return InterlockedCompareExchange((LONG*) pTarget, Exchange, Comperand);
+#else
+	__atomic_compare_exchange_n(pTarget, &Comperand, Exchange, FALSE,
+								__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return Comperand;
+#endif
+}
+
+// Returns the new value
+static LONG AtomicAdd(volatile LONG* pTarget, LONG Value) {
+#ifdef _WIN32
+	return InterlockedExchangeAdd((LONG*) pTarget, Value) + Value;
+#else
+	return __atomic_add_fetch(pTarget, Value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// 100 ns units from some fixed point
+static LONGLONG Now() {
+#ifdef _WIN32
+	return (LONGLONG) GetTickCount() * 10000;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (LONGLONG) now.tv_sec * 10000000 + now.tv_nsec / 100;
+#endif
+}
+
+VOID KeInitializeEvent(IN PKEVENT Event, IN EVENT_TYPE Type, IN BOOLEAN State) {
+	Event->Type = Type;
+	Event->SignalState = State ? 1 : 0;
+	Event->TestEnvWaiters = 0;
+}
+
+LONG KeSetEvent(IN PKEVENT Event, IN KPRIORITY Increment, IN BOOLEAN Wait) {
+	LONG previous = AtomicExchange(&Event->SignalState, 1);
+#ifndef _WIN32
+	// Waiters count themselves before they look at the state, so
+	// one that is about to sleep is seen here
+	if (previous == 0 && Event->TestEnvWaiters != 0)
+		syscall(SYS_futex, &Event->SignalState, FUTEX_WAKE_PRIVATE,
+				Event->Type == NotificationEvent ? 0x7FFFFFFF : 1, NULL, NULL, 0);
+#endif
+	return previous;
+}
+
+VOID KeClearEvent(IN PKEVENT Event) {
+	AtomicExchange(&Event->SignalState, 0);
+}
+
+LONG KeResetEvent(IN PKEVENT Event) {
+	return AtomicExchange(&Event->SignalState, 0);
+}
+
+LONG KeReadStateEvent(IN PKEVENT Event) {
+	return Event->SignalState;
+}
+
+NTSTATUS KeWaitForSingleObject(IN PVOID Object, IN KWAIT_REASON WaitReason,
+							   IN KPROCESSOR_MODE WaitMode, IN BOOLEAN Alertable,
+							   IN PLARGE_INTEGER Timeout OPTIONAL) {
+	PKEVENT Event = (PKEVENT) Object;
+	LONGLONG deadline = (Timeout != NULL) ? Now() - Timeout->QuadPart : 0;
+	for (;;) {
+		// A synchronization event is reset by the wait it satisfies
+		if (Event->Type == SynchronizationEvent
+				? AtomicCompareExchange(&Event->SignalState, 0, 1) == 1
+				: Event->SignalState != 0)
+			return STATUS_SUCCESS;
+		LONGLONG left = 0;
+		if (Timeout != NULL && (left = deadline - Now()) <= 0)
+			return STATUS_TIMEOUT;
+#ifdef _WIN32
+		Sleep(0);
+#else
+		struct timespec wait;
+		wait.tv_sec = (time_t) (left / 10000000);
+		wait.tv_nsec = (long) (left % 10000000) * 100;
+		AtomicAdd(&Event->TestEnvWaiters, 1);
+		// Sleeps only if the event is still not signaled
+		syscall(SYS_futex, &Event->SignalState, FUTEX_WAIT_PRIVATE, 0,
+				Timeout != NULL ? &wait : NULL, NULL, 0);
+		AtomicAdd(&Event->TestEnvWaiters, -1);
+#endif
+	}
+}
+
+struct _EPROCESS {
+	ULONG Unused;
+};
+static EPROCESS testProgram;
+
+PEPROCESS IoGetCurrentProcess() {
+	return &testProgram;
+}
+
+VOID KeStackAttachProcess(IN PEPROCESS Process, OUT PKAPC_STATE ApcState) {
+	ApcState->Process = Process;
+}
+
+VOID KeUnstackDetachProcess(IN PKAPC_STATE ApcState) {
+	ApcState->Process = NULL;
+}
+
+static OBJECT_TYPE eventObjectType = {"Event"};
+static POBJECT_TYPE pEventObjectType = &eventObjectType;
+POBJECT_TYPE* ExEventObjectType = &pEventObjectType;
+
+// The object follows its header, aligned as malloc would
+#define OBJECT_BODY_OFFSET	((sizeof(TESTENV_OBJECT_HEADER) + 15) & ~15)
+#define BodyOf(pHeader)		((PVOID) ((PCHAR) (pHeader) + OBJECT_BODY_OFFSET))
+#define HeaderOf(Object)	((TESTENV_OBJECT_HEADER*) ((PCHAR) (Object) - OBJECT_BODY_OFFSET))
+
+HANDLE TestEnvCreateObject(IN POBJECT_TYPE Type, IN ULONG BodySize) {
+	TESTENV_OBJECT_HEADER* pHeader = (TESTENV_OBJECT_HEADER*)
+		calloc(1, OBJECT_BODY_OFFSET + BodySize);
+	pHeader->Type = Type;
+	pHeader->PointerCount = 1;		// the handle's
+	return pHeader;
+}
+
+PVOID TestEnvObjectOf(IN HANDLE Handle, IN POBJECT_TYPE Type) {
+	TESTENV_OBJECT_HEADER* pHeader = (TESTENV_OBJECT_HEADER*) Handle;
+	return (pHeader != NULL && pHeader->Type == Type) ? BodyOf(pHeader) : NULL;
+}
+
+VOID TestEnvCloseObject(IN HANDLE Handle) {
+	ObDereferenceObject(BodyOf(Handle));
+}
+
+NTSTATUS ObReferenceObjectByHandle(IN HANDLE Handle, IN ACCESS_MASK DesiredAccess,
+								   IN POBJECT_TYPE ObjectType OPTIONAL,
+								   IN KPROCESSOR_MODE AccessMode,
+								   OUT PVOID* Object,
+								   OUT PVOID HandleInformation OPTIONAL) {
+	TESTENV_OBJECT_HEADER* pHeader = (TESTENV_OBJECT_HEADER*) Handle;
+	*Object = NULL;
+	if (pHeader == NULL)
+		return STATUS_INVALID_HANDLE;
+	if (ObjectType != NULL && pHeader->Type != ObjectType)
+		return STATUS_OBJECT_TYPE_MISMATCH;
+	AtomicAdd(&pHeader->PointerCount, 1);
+	*Object = BodyOf(pHeader);
+	return STATUS_SUCCESS;
+}
+
+VOID ObReferenceObject(IN PVOID Object) {
+	if (Object != &testProgram)		// no header - and it never goes
+		AtomicAdd(&HeaderOf(Object)->PointerCount, 1);
+}
+
+VOID ObDereferenceObject(IN PVOID Object) {
+	if (Object == &testProgram)
+		return;
+	if (AtomicAdd(&HeaderOf(Object)->PointerCount, -1) == 0)
+		free(HeaderOf(Object));
+}
+
+#define MDL_POOL_TAG	0x206C644D	// 'Mdl '
+
+PMDL MmAllocatePagesForMdl(IN PHYSICAL_ADDRESS LowAddress,
+						   IN PHYSICAL_ADDRESS HighAddress,
+						   IN PHYSICAL_ADDRESS SkipBytes,
+						   IN SIZE_T TotalBytes) {
+	SIZE_T nBytes = ROUND_TO_PAGES(TotalBytes);
+	PMDL pMdl = (PMDL) ExAllocatePoolWithTag(NonPagedPool, sizeof(MDL), MDL_POOL_TAG);
+	if (pMdl == NULL || nBytes == 0) {
+		if (pMdl != NULL)
+			ExFreePool(pMdl);
+		return NULL;
+	}
+	RtlZeroMemory(pMdl, sizeof(MDL));
+#ifdef _WIN32
+	pMdl->StartVa = VirtualAlloc(NULL, nBytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (pMdl->StartVa == NULL) {
+		ExFreePool(pMdl);
+		return NULL;
+	}
+#else
+	pMdl->TestEnvPagesFd = memfd_create("TestEnvPages", MFD_CLOEXEC);
+	if (pMdl->TestEnvPagesFd < 0 || ftruncate(pMdl->TestEnvPagesFd, nBytes) != 0) {
+		if (pMdl->TestEnvPagesFd >= 0)
+			close(pMdl->TestEnvPagesFd);
+		ExFreePool(pMdl);
+		return NULL;
+	}
+#endif
+	pMdl->MdlFlags = TESTENV_MDL_PAGES;
+	pMdl->ByteCount = (ULONG) TotalBytes;
+	return pMdl;
+}
+
+VOID MmFreePagesFromMdl(IN PMDL MemoryDescriptorList) {
+	if (MemoryDescriptorList->TestEnvMappings != 0)
+		fprintf(stderr, "MmFreePagesFromMdl: MDL %p still has %d view(s) mapped\n",
+			MemoryDescriptorList, MemoryDescriptorList->TestEnvMappings);
+#ifdef _WIN32
+	VirtualFree(MemoryDescriptorList->StartVa, 0, MEM_RELEASE);
+#else
+	close(MemoryDescriptorList->TestEnvPagesFd);
+#endif
+	MemoryDescriptorList->MdlFlags &= ~TESTENV_MDL_PAGES;
+}
+
+PVOID MmMapLockedPagesSpecifyCache(IN PMDL MemoryDescriptorList,
+								   IN KPROCESSOR_MODE AccessMode,
+								   IN MEMORY_CACHING_TYPE CacheType,
+								   IN PVOID BaseAddress,
+								   IN ULONG BugCheckOnFailure,
+								   IN MM_PAGE_PRIORITY Priority) {
+	PMDL pMdl = MemoryDescriptorList;
+	if (!(pMdl->MdlFlags & TESTENV_MDL_PAGES))
+		return pMdl->MappedSystemVa;	// a caller's buffer - one address space
+#ifdef _WIN32
+	PVOID pView = pMdl->StartVa;
+#else
+	PVOID pView = mmap(NULL, ROUND_TO_PAGES(pMdl->ByteCount), PROT_READ | PROT_WRITE,
+					   MAP_SHARED, pMdl->TestEnvPagesFd, 0);
+	if (pView == MAP_FAILED)
+		return NULL;
+#endif
+	AtomicAdd(&pMdl->TestEnvMappings, 1);
+	if (AccessMode == KernelMode)
+		pMdl->MappedSystemVa = pView;
+	return pView;
+}
+
+VOID MmUnmapLockedPages(IN PVOID BaseAddress, IN PMDL MemoryDescriptorList) {
+	PMDL pMdl = MemoryDescriptorList;
+	if (!(pMdl->MdlFlags & TESTENV_MDL_PAGES))
+		return;
+#ifndef _WIN32
+	munmap(BaseAddress, ROUND_TO_PAGES(pMdl->ByteCount));
+#endif
+	AtomicAdd(&pMdl->TestEnvMappings, -1);
+	if (BaseAddress == pMdl->MappedSystemVa)
+		pMdl->MappedSystemVa = NULL;
+}
+
+// What the I/O manager fills in for dispatch routines a driver
+// doesn't supply
+static NTSTATUS InvalidDeviceRequest(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp) {
+	Irp->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+	Irp->IoStatus.Information = 0;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	return STATUS_INVALID_DEVICE_REQUEST;
+}
+
+static PIRP AllocateIrp(PFILE_OBJECT pFileObject, UCHAR MajorFunction) {
+	PIRP pIrp = (PIRP) calloc(1, sizeof(IRP));
+	pIrp->TestEnvStack.MajorFunction = MajorFunction;
+	pIrp->TestEnvStack.DeviceObject = pFileObject->DeviceObject;
+	pIrp->TestEnvStack.FileObject = pFileObject;
+	pIrp->RequestorMode = UserMode;
+	InitializeListHead(&pIrp->Tail.Overlay.ListEntry);
+	return pIrp;
+}
+
+// Called with the I/O lock held.  Completed IRPs no longer count,
+// even if the test program hasn't collected them yet.
+static BOOLEAN FileHasIrpsInFlight(PFILE_OBJECT pFileObject) {
+	for (PLIST_ENTRY pLink = irpsInFlight.Flink; pLink != &irpsInFlight;
+			pLink = pLink->Flink) {
+		PIRP pIrp = CONTAINING_RECORD(pLink, IRP, TestEnvLink);
+		if (pIrp->TestEnvStack.FileObject == pFileObject && !pIrp->TestEnvCompleted)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Hands the IRP to the driver.  Unless it returns STATUS_PENDING,
+// the IRP has been completed; WaitIrp must be called either way.
+static NTSTATUS StartIrp(PIRP pIrp) {
+	PDEVICE_OBJECT pDevObj = pIrp->TestEnvStack.DeviceObject;
+	PDRIVER_DISPATCH pDispatch =
+		pDevObj->DriverObject->MajorFunction[pIrp->TestEnvStack.MajorFunction];
+	LockIo();
+	InsertTailList(&irpsInFlight, &pIrp->TestEnvLink);
+	UnlockIo();
+	NTSTATUS status = pDispatch(pDevObj, pIrp);
+
+	if (status == STATUS_PENDING) {
+		if (!(pIrp->TestEnvStack.Control & SL_PENDING_RETURNED)) {
+			fprintf(stderr, "IRP %p returned STATUS_PENDING without IoMarkIrpPending\n", pIrp);
+			abort();
+		}
+	} else if (!pIrp->TestEnvCompleted) {
+		fprintf(stderr, "IRP %p returned %08X but was never completed\n", pIrp, status);
+		abort();
+	}
+	return status;
+}
+
+// Waits for a started IRP to be completed, and lets go of it
+static NTSTATUS WaitIrp(PIRP pIrp) {
+	LockIo();
+	while (!pIrp->TestEnvCompleted)
+		WaitIo();
+	// TestEnvCancel may still be looking at it
+	while (pIrp->TestEnvHolds != 0)
+		WaitIo();
+	RemoveEntryList(&pIrp->TestEnvLink);
+	SignalIo();		// for TestEnvClose
+	UnlockIo();
+	return pIrp->IoStatus.Status;
+}
+
+static NTSTATUS CallDriver(PIRP pIrp) {
+	StartIrp(pIrp);
+	return WaitIrp(pIrp);
+}
+
+// A key exists here only if it has values.  Call with the I/O lock held.
+static BOOLEAN KeyHasValues(PCWSTR pKey) {
+	for (ULONG i = 0; i < nRegistryValues; i++)
+		if (WideEqualNoCase(registryValues[i].KeyPath, pKey))
+			return TRUE;
+	return FALSE;
+}
+
+NTSTATUS RtlQueryRegistryValues(
+	IN ULONG RelativeTo,
+	IN PCWSTR Path,
+	IN PRTL_QUERY_REGISTRY_TABLE QueryTable,
+	IN PVOID Context,
+	IN PVOID Environment OPTIONAL) {
+	PWSTR pPath = WideConcat(RelativeTo == RTL_REGISTRY_SERVICES ? SERVICES_KEY : L"",
+							 Path, WideLength(Path));
+	PWSTR pKey = WideConcat(pPath, L"", 0);
+	LockIo();
+	// A table that starts with a subkey needn't name a key with
+	// values of its own - a service key, say
+	NTSTATUS status = ((QueryTable->Flags & RTL_QUERY_REGISTRY_SUBKEY) ||
+					   KeyHasValues(pKey)) ?
+		STATUS_SUCCESS : STATUS_OBJECT_NAME_NOT_FOUND;
+
+	for (PRTL_QUERY_REGISTRY_TABLE pEntry = QueryTable;
+			NT_SUCCESS(status) && (pEntry->QueryRoutine != NULL || pEntry->Name != NULL);
+			pEntry++) {
+		if (pEntry->Flags & RTL_QUERY_REGISTRY_SUBKEY) {
+			// the entries that follow are for Path\Name
+			PWSTR pSubkeyOf = WideConcat(pPath, L"\\", 1);
+			free(pKey);
+			pKey = WideConcat(pSubkeyOf, pEntry->Name, WideLength(pEntry->Name));
+			free(pSubkeyOf);
+			if (!KeyHasValues(pKey))
+				status = STATUS_OBJECT_NAME_NOT_FOUND;
+			continue;
+		}
+		if (!(pEntry->Flags & RTL_QUERY_REGISTRY_DIRECT)) {
+			status = STATUS_INVALID_PARAMETER;	// only direct queries here
+			break;
+		}
+		ULONG i = 0;
+		while (i < nRegistryValues &&
+				!(WideEqualNoCase(registryValues[i].KeyPath, pKey) &&
+				  WideEqualNoCase(registryValues[i].ValueName, pEntry->Name)))
+			i++;
+		if (i < nRegistryValues)
+			*(PULONG) pEntry->EntryContext = registryValues[i].Value;
+		else if (pEntry->Flags & RTL_QUERY_REGISTRY_REQUIRED)
+			status = STATUS_OBJECT_NAME_NOT_FOUND;
+		else if (pEntry->DefaultType == REG_DWORD)
+			*(PULONG) pEntry->EntryContext = *(PULONG) pEntry->DefaultData;
+	}
+	UnlockIo();
+	free(pKey);
+	free(pPath);
+	return status;
+}
+
+VOID TestEnvSetRegistryValue(IN PCWSTR KeyPath, IN PCWSTR ValueName, IN ULONG Value) {
+	LockIo();
+	ULONG i = 0;
+	while (i < nRegistryValues &&
+			!(WideEqualNoCase(registryValues[i].KeyPath, KeyPath) &&
+			  WideEqualNoCase(registryValues[i].ValueName, ValueName)))
+		i++;
+	if (i == nRegistryValues) {
+		if (i == TESTENV_MAX_VALUES) {
+			UnlockIo();
+			fprintf(stderr, "TestEnvSetRegistryValue: too many values\n");
+			return;
+		}
+		registryValues[i].KeyPath = WideConcat(KeyPath, L"", 0);
+		registryValues[i].ValueName = WideConcat(ValueName, L"", 0);
+		nRegistryValues++;
+	}
+	registryValues[i].Value = Value;
+	UnlockIo();
+}
+
+PDRIVER_OBJECT TestEnvLoadDriver(IN PDRIVER_INITIALIZE DriverEntry,
+								 IN PCWSTR ServiceName, OUT NTSTATUS* pStatus) {
+	ULONG slot = 0;
+	while (slot < TESTENV_MAX_DRIVERS && pDrivers[slot] != NULL)
+		slot++;
+	if (slot == TESTENV_MAX_DRIVERS) {
+		*pStatus = STATUS_INSUFFICIENT_RESOURCES;
+		return NULL;
+	}
+
+	PDRIVER_OBJECT pDriverObject = (PDRIVER_OBJECT) calloc(1, sizeof(DRIVER_OBJECT));
+	for (int i = 0; i <= IRP_MJ_MAXIMUM_FUNCTION; i++)
+		pDriverObject->MajorFunction[i] = InvalidDeviceRequest;
+	LockIo();
+	pDrivers[slot] = pDriverObject;		// so its devices can be found
+	UnlockIo();
+
+	PWSTR pServiceKey = WideConcat(SERVICES_KEY, ServiceName, WideLength(ServiceName));
+	UNICODE_STRING registryPath;
+	RtlInitUnicodeString(&registryPath, pServiceKey);
+	*pStatus = DriverEntry(pDriverObject, &registryPath);
+	free(pServiceKey);
+
+	if (!NT_SUCCESS(*pStatus)) {
+		LockIo();
+		pDrivers[slot] = NULL;
+		UnlockIo();
+		free(pDriverObject);
+		return NULL;
+	}
+	// As the I/O manager does once DriverEntry returns
+	for (PDEVICE_OBJECT pDevObj = pDriverObject->DeviceObject;
+			pDevObj != NULL; pDevObj = pDevObj->NextDevice)
+		pDevObj->Flags &= ~DO_DEVICE_INITIALIZING;
+	return pDriverObject;
+}
+
+VOID TestEnvUnloadDriver(IN PDRIVER_OBJECT DriverObject) {
+	if (DriverObject->DriverUnload != NULL)
+		DriverObject->DriverUnload(DriverObject);
+	for (PDEVICE_OBJECT pDevObj = DriverObject->DeviceObject;
+			pDevObj != NULL; pDevObj = pDevObj->NextDevice) {
+		char name[64];
+		fprintf(stderr, "TestEnvUnloadDriver: device %s left behind\n",
+			pDevObj->TestEnvName ? NarrowName(pDevObj->TestEnvName, name, sizeof(name))
+								 : "(unnamed)");
+	}
+	LockIo();
+	for (ULONG i = 0; i < TESTENV_MAX_DRIVERS; i++)
+		if (pDrivers[i] == DriverObject)
+			pDrivers[i] = NULL;
+	UnlockIo();
+	free(DriverObject);
+}
+
+NTSTATUS TestEnvOpen(IN PCWSTR Name, IN ULONG Flags,
+					 OUT PFILE_OBJECT* ppFileObject) {
+	*ppFileObject = NULL;
+	LockIo();
+	TESTENV_LINK* pLink = *FindLink(Name);
+	PDEVICE_OBJECT pDevObj = FindDevice(pLink != NULL ? pLink->Target : Name);
+	if (pDevObj == NULL) {
+		UnlockIo();
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	}
+	if ((pDevObj->Flags & DO_EXCLUSIVE) && pDevObj->TestEnvOpenCount != 0) {
+		UnlockIo();
+		return STATUS_ACCESS_DENIED;
+	}
+	pDevObj->TestEnvOpenCount++;
+	UnlockIo();
+
+	PFILE_OBJECT pFileObject = (PFILE_OBJECT) calloc(1, sizeof(FILE_OBJECT));
+	pFileObject->DeviceObject = pDevObj;
+	pFileObject->Flags = Flags;
+	PIRP pIrp = AllocateIrp(pFileObject, IRP_MJ_CREATE);
+	NTSTATUS status = CallDriver(pIrp);
+	free(pIrp);
+	if (NT_SUCCESS(status))
+		*ppFileObject = pFileObject;
+	else {
+		LockIo();
+		pDevObj->TestEnvOpenCount--;
+		UnlockIo();
+		free(pFileObject);
+	}
+	return status;
+}
+
+NTSTATUS TestEnvClose(IN PFILE_OBJECT FileObject) {
+	// Last handle gone, then last reference gone
+	PIRP pIrp = AllocateIrp(FileObject, IRP_MJ_CLEANUP);
+	CallDriver(pIrp);	// drivers needn't handle it
+	free(pIrp);
+	// Requests still in flight keep the file object open
+	LockIo();
+	while (FileHasIrpsInFlight(FileObject))
+		WaitIo();
+	UnlockIo();
+	pIrp = AllocateIrp(FileObject, IRP_MJ_CLOSE);
+	NTSTATUS status = CallDriver(pIrp);
+	free(pIrp);
+	LockIo();
+	FileObject->DeviceObject->TestEnvOpenCount--;
+	UnlockIo();
+	free(FileObject);
+	return status;
+}
+
+VOID TestEnvCancel(IN PFILE_OBJECT FileObject) {
+	for (;;) {
+		PIRP pIrp = NULL;
+		LockIo();
+		for (PLIST_ENTRY pLink = irpsInFlight.Flink; pLink != &irpsInFlight;
+				pLink = pLink->Flink) {
+			PIRP pCandidate = CONTAINING_RECORD(pLink, IRP, TestEnvLink);
+			if (pCandidate->TestEnvStack.FileObject == FileObject &&
+					!pCandidate->Cancel && !pCandidate->TestEnvCompleted) {
+				pIrp = pCandidate;
+				pIrp->TestEnvHolds++;	// CallDriver won't free it
+				break;
+			}
+		}
+		UnlockIo();
+		if (pIrp == NULL)
+			return;
+		IoCancelIrp(pIrp);		// sets Cancel, so it won't be found again
+		LockIo();
+		pIrp->TestEnvHolds--;
+		SignalIo();
+		UnlockIo();
+	}
+}
+
+static VOID CountCopy(ULONG nBytes) {
+	LockIo();
+	ioCopies++;
+	ioCopyBytes += nBytes;
+	UnlockIo();
+}
+
+VOID TestEnvQueryIoCopies(OUT PULONGLONG pCopies, OUT PULONGLONG pBytes) {
+	LockIo();
+	*pCopies = ioCopies;
+	*pBytes = ioCopyBytes;
+	UnlockIo();
+}
+
+// Sets up the IRP's buffer the way the device asks for.  For
+// buffered I/O the data is copied in (writes) or, by FinishTransfer,
+// back out (reads); direct I/O describes the caller's buffer with
+// an MDL (no zero-length MDLs, as in the kernel).
+static VOID StartTransfer(PIRP pIrp, PVOID pBuffer, ULONG Length, BOOLEAN bWrite) {
+	PDEVICE_OBJECT pDevObj = pIrp->TestEnvStack.DeviceObject;
+	pIrp->UserBuffer = pBuffer;
+	if (bWrite)
+		pIrp->TestEnvStack.Parameters.Write.Length = Length;
+	else
+		pIrp->TestEnvStack.Parameters.Read.Length = Length;
+	if (pDevObj->Flags & DO_BUFFERED_IO) {
+		pIrp->AssociatedIrp.SystemBuffer = (Length != 0) ? malloc(Length) : NULL;
+		if (bWrite && Length != 0) {
+			memcpy(pIrp->AssociatedIrp.SystemBuffer, pBuffer, Length);
+			CountCopy(Length);
+		}
+	} else if (pDevObj->Flags & DO_DIRECT_IO) {
+		if (Length != 0) {
+			PMDL pMdl = (PMDL) calloc(1, sizeof(MDL));
+			pMdl->StartVa = pMdl->MappedSystemVa = pBuffer;
+			pMdl->ByteCount = Length;
+			pIrp->MdlAddress = pMdl;
+		}
+	}
+}
+
+// The same for a device control.  METHOD_BUFFERED shares one
+// SystemBuffer between input and output; the direct methods buffer
+// the input and describe the output with an MDL; METHOD_NEITHER
+// passes both addresses as they are.
+static VOID StartControl(PIRP pIrp, ULONG IoControlCode,
+						 const VOID* pInput, ULONG nInput, PVOID pOutput, ULONG nOutput) {
+	PIO_STACK_LOCATION pStack = &pIrp->TestEnvStack;
+	ULONG method = METHOD_FROM_CTL_CODE(IoControlCode);
+	pStack->Parameters.DeviceIoControl.IoControlCode = IoControlCode;
+	pStack->Parameters.DeviceIoControl.InputBufferLength = nInput;
+	pStack->Parameters.DeviceIoControl.OutputBufferLength = nOutput;
+	pIrp->UserBuffer = pOutput;
+	if (method == METHOD_NEITHER) {
+		pStack->Parameters.DeviceIoControl.Type3InputBuffer = (PVOID) pInput;
+		return;
+	}
+	ULONG nSystem = (method == METHOD_BUFFERED) ? max(nInput, nOutput) : nInput;
+	if (nSystem != 0) {
+		pIrp->AssociatedIrp.SystemBuffer = malloc(nSystem);
+		if (nInput != 0) {
+			memcpy(pIrp->AssociatedIrp.SystemBuffer, pInput, nInput);
+			CountCopy(nInput);
+		}
+	}
+	if (method != METHOD_BUFFERED && nOutput != 0) {
+		PMDL pMdl = (PMDL) calloc(1, sizeof(MDL));
+		pMdl->StartVa = pMdl->MappedSystemVa = pOutput;
+		pMdl->ByteCount = nOutput;
+		pIrp->MdlAddress = pMdl;
+	}
+}
+
+// Waits for the IRP, copies out what was read and frees it all
+static NTSTATUS FinishTransfer(PIRP pIrp, PULONG pInformation) {
+	NTSTATUS status = WaitIrp(pIrp);
+	PIO_STACK_LOCATION pStack = &pIrp->TestEnvStack;
+	if (pIrp->AssociatedIrp.SystemBuffer != NULL) {
+		ULONG nOutput = 0;		// room for what comes back
+		if (pStack->MajorFunction == IRP_MJ_READ)
+			nOutput = pStack->Parameters.Read.Length;
+		else if (pStack->MajorFunction == IRP_MJ_DEVICE_CONTROL &&
+				METHOD_FROM_CTL_CODE(pStack->Parameters.DeviceIoControl.IoControlCode)
+					== METHOD_BUFFERED)
+			nOutput = pStack->Parameters.DeviceIoControl.OutputBufferLength;
+		if (nOutput != 0 && NT_SUCCESS(status)) {
+			ULONG nBytes = min((ULONG) pIrp->IoStatus.Information, nOutput);
+			memcpy(pIrp->UserBuffer, pIrp->AssociatedIrp.SystemBuffer, nBytes);
+			CountCopy(nBytes);
+		}
+		free(pIrp->AssociatedIrp.SystemBuffer);
+	}
+	free(pIrp->MdlAddress);
+	*pInformation = (ULONG) pIrp->IoStatus.Information;
+	free(pIrp);
+	return status;
+}
+
+NTSTATUS TestEnvStartRead(IN PFILE_OBJECT FileObject, OUT PVOID Buffer,
+						  IN ULONG Length, OUT PIRP* ppIrp, OUT PULONG pInformation) {
+	PIRP pIrp = AllocateIrp(FileObject, IRP_MJ_READ);
+	StartTransfer(pIrp, Buffer, Length, FALSE);
+	*ppIrp = NULL;
+	if (StartIrp(pIrp) == STATUS_PENDING && !pIrp->TestEnvCompleted) {
+		*ppIrp = pIrp;
+		return STATUS_PENDING;
+	}
+	return FinishTransfer(pIrp, pInformation);
+}
+
+NTSTATUS TestEnvStartWrite(IN PFILE_OBJECT FileObject, IN const VOID* Buffer,
+						   IN ULONG Length, OUT PIRP* ppIrp, OUT PULONG pInformation) {
+	PIRP pIrp = AllocateIrp(FileObject, IRP_MJ_WRITE);
+	StartTransfer(pIrp, (PVOID) Buffer, Length, TRUE);
+	*ppIrp = NULL;
+	if (StartIrp(pIrp) == STATUS_PENDING && !pIrp->TestEnvCompleted) {
+		*ppIrp = pIrp;
+		return STATUS_PENDING;
+	}
+	return FinishTransfer(pIrp, pInformation);
+}
+
+NTSTATUS TestEnvStartDeviceControl(IN PFILE_OBJECT FileObject, IN ULONG IoControlCode,
+								   IN const VOID* InputBuffer, IN ULONG InputBufferLength,
+								   OUT PVOID OutputBuffer, IN ULONG OutputBufferLength,
+								   OUT PIRP* ppIrp, OUT PULONG pInformation) {
+	PIRP pIrp = AllocateIrp(FileObject, IRP_MJ_DEVICE_CONTROL);
+	StartControl(pIrp, IoControlCode, InputBuffer, InputBufferLength,
+				 OutputBuffer, OutputBufferLength);
+	*ppIrp = NULL;
+	if (StartIrp(pIrp) == STATUS_PENDING && !pIrp->TestEnvCompleted) {
+		*ppIrp = pIrp;
+		return STATUS_PENDING;
+	}
+	return FinishTransfer(pIrp, pInformation);
+}
+
+NTSTATUS TestEnvFinish(IN PIRP Irp, IN BOOLEAN bWait, OUT PULONG pInformation) {
+	if (!bWait && !Irp->TestEnvCompleted)
+		return STATUS_PENDING;
+	return FinishTransfer(Irp, pInformation);
+}
+
+VOID TestEnvQueryFastIo(OUT PULONGLONG pCalls, OUT PULONGLONG pTaken) {
+	LockIo();
+	*pCalls = fastIoCalls;
+	*pTaken = fastIoTaken;
+	UnlockIo();
+}
+
+// The fast I/O routine for a synchronous read or write, if the
+// driver has one and the file object is cached (as NtReadFile and
+// NtWriteFile decide it), else NULL
+static PFAST_IO_DISPATCH FastIoFor(PFILE_OBJECT pFileObject) {
+	PFAST_IO_DISPATCH pFastIo =
+		pFileObject->DeviceObject->DriverObject->FastIoDispatch;
+	return (pFileObject->PrivateCacheMap != NULL) ? pFastIo : NULL;
+}
+
+static VOID CountFastIo(BOOLEAN bTaken) {
+	LockIo();
+	fastIoCalls++;
+	if (bTaken)
+		fastIoTaken++;
+	UnlockIo();
+}
+
+NTSTATUS TestEnvRead(IN PFILE_OBJECT FileObject, OUT PVOID Buffer,
+					 IN ULONG Length, OUT PULONG pInformation) {
+	PFAST_IO_DISPATCH pFastIo = FastIoFor(FileObject);
+	if (pFastIo != NULL && pFastIo->FastIoRead != NULL) {
+		IO_STATUS_BLOCK ioStatus;
+		LARGE_INTEGER offset;
+		offset.QuadPart = 0;
+		BOOLEAN bTaken = pFastIo->FastIoRead(FileObject, &offset, Length, TRUE, 0,
+											  Buffer, &ioStatus, FileObject->DeviceObject);
+		CountFastIo(bTaken);
+		if (bTaken) {
+			*pInformation = (ULONG) ioStatus.Information;
+			return ioStatus.Status;
+		}
+	}
+	PIRP pIrp;
+	NTSTATUS status = TestEnvStartRead(FileObject, Buffer, Length, &pIrp, pInformation);
+	return (pIrp != NULL) ? TestEnvFinish(pIrp, TRUE, pInformation) : status;
+}
+
+NTSTATUS TestEnvWrite(IN PFILE_OBJECT FileObject, IN const VOID* Buffer,
+					  IN ULONG Length, OUT PULONG pInformation) {
+	PFAST_IO_DISPATCH pFastIo = FastIoFor(FileObject);
+	if (pFastIo != NULL && pFastIo->FastIoWrite != NULL) {
+		IO_STATUS_BLOCK ioStatus;
+		LARGE_INTEGER offset;
+		offset.QuadPart = 0;
+		BOOLEAN bTaken = pFastIo->FastIoWrite(FileObject, &offset, Length, TRUE, 0,
+											   (PVOID) Buffer, &ioStatus,
+											   FileObject->DeviceObject);
+		CountFastIo(bTaken);
+		if (bTaken) {
+			*pInformation = (ULONG) ioStatus.Information;
+			return ioStatus.Status;
+		}
+	}
+	PIRP pIrp;
+	NTSTATUS status = TestEnvStartWrite(FileObject, Buffer, Length, &pIrp, pInformation);
+	return (pIrp != NULL) ? TestEnvFinish(pIrp, TRUE, pInformation) : status;
+}
+
+NTSTATUS TestEnvDeviceControl(IN PFILE_OBJECT FileObject, IN ULONG IoControlCode,
+							  IN const VOID* InputBuffer, IN ULONG InputBufferLength,
+							  OUT PVOID OutputBuffer, IN ULONG OutputBufferLength,
+							  OUT PULONG pInformation) {
+	PFAST_IO_DISPATCH pFastIo =
+		FileObject->DeviceObject->DriverObject->FastIoDispatch;
+	if (pFastIo != NULL && pFastIo->FastIoDeviceControl != NULL) {
+		IO_STATUS_BLOCK ioStatus;
+		BOOLEAN bTaken = pFastIo->FastIoDeviceControl(FileObject, TRUE,
+			(PVOID) InputBuffer, InputBufferLength, OutputBuffer, OutputBufferLength,
+			IoControlCode, &ioStatus, FileObject->DeviceObject);
+		CountFastIo(bTaken);
+		if (bTaken) {
+			*pInformation = (ULONG) ioStatus.Information;
+			return ioStatus.Status;
+		}
+	}
+	PIRP pIrp;
+	NTSTATUS status = TestEnvStartDeviceControl(FileObject, IoControlCode,
+												InputBuffer, InputBufferLength,
+												OutputBuffer, OutputBufferLength,
+												&pIrp, pInformation);
+	return (pIrp != NULL) ? TestEnvFinish(pIrp, TRUE, pInformation) : status;
+}
@@ -0,0 +1,314 @@
+// DDKTestWin32.cpp
+//
+// Copyright (C) 2000 by Jerry Lozano
+//
+
+// Win32 calls routed to a driver in the DDK Test Environment
+
+#include "StdAfx.h"
+#include "DDKTestWin32.h"
+#include <time.h>
+#include <unistd.h>
+
+// One per thread, as in Win32
+static __thread DWORD lastError = 0;
+
+// A file or thread handle's object.  Events are the test
+// environment's own (see TestEnvCreateObject).
+typedef struct _TESTENV_HANDLE {
+	enum TYPE {File, Thread} Type;
+	PFILE_OBJECT pFileObject;
+	BOOL bOverlapped;			// FILE_FLAG_OVERLAPPED
+	pthread_t thread;
+	LPTHREAD_START_ROUTINE pStart;
+	LPVOID pParameter;
+	DWORD ExitCode;
+	BOOL bJoined;
+} TESTENV_HANDLE;
+
+static OBJECT_TYPE handleObjectType = {"Win32 handle"};
+
+static TESTENV_HANDLE* HandleOf(HANDLE hObject) {
+	return (TESTENV_HANDLE*) TestEnvObjectOf(hObject, &handleObjectType);
+}
+
+static HANDLE NewHandle(TESTENV_HANDLE::TYPE Type) {
+	HANDLE hObject = TestEnvCreateObject(&handleObjectType, sizeof(TESTENV_HANDLE));
+	HandleOf(hObject)->Type = Type;
+	return hObject;
+}
+
+static PFILE_OBJECT FileOf(HANDLE hFile) {
+	TESTENV_HANDLE* pHandle = HandleOf(hFile);
+	return (pHandle->Type == TESTENV_HANDLE::File) ? pHandle->pFileObject : NULL;
+}
+
+static PKEVENT EventOf(HANDLE hEvent) {
+	return (PKEVENT) TestEnvObjectOf(hEvent, *ExEventObjectType);
+}
+
+// The usual NTSTATUS to Win32 error mapping, for the codes
+// the sample drivers return
+static BOOL Fail(NTSTATUS status) {
+	switch (status) {
+	case STATUS_INVALID_DEVICE_REQUEST:	lastError = ERROR_INVALID_FUNCTION; break;
+	case STATUS_OBJECT_NAME_NOT_FOUND:	lastError = ERROR_FILE_NOT_FOUND; break;
+	case STATUS_ACCESS_DENIED:			lastError = ERROR_ACCESS_DENIED; break;
+	case STATUS_INVALID_HANDLE:			lastError = ERROR_INVALID_HANDLE; break;
+	case STATUS_OBJECT_TYPE_MISMATCH:	lastError = ERROR_INVALID_HANDLE; break;
+	case STATUS_INVALID_DEVICE_STATE:	lastError = ERROR_BAD_COMMAND; break;
+	case STATUS_BUFFER_TOO_SMALL:		lastError = ERROR_INSUFFICIENT_BUFFER; break;
+	case STATUS_INVALID_USER_BUFFER:	lastError = ERROR_INVALID_USER_BUFFER; break;
+	case STATUS_INVALID_PARAMETER:		lastError = ERROR_INVALID_PARAMETER; break;
+	case STATUS_DEVICE_BUSY:			lastError = ERROR_BUSY; break;
+	case STATUS_CANCELLED:				lastError = ERROR_OPERATION_ABORTED; break;
+	case STATUS_INSUFFICIENT_RESOURCES:	lastError = ERROR_NO_SYSTEM_RESOURCES; break;
+	default:							lastError = ERROR_GEN_FAILURE; break;
+	}
+	return FALSE;
+}
+
+HANDLE CreateFile(LPCSTR lpFileName, DWORD dwDesiredAccess, DWORD dwShareMode,
+				  LPSECURITY_ATTRIBUTES lpSecurityAttributes,
+				  DWORD dwCreationDisposition, DWORD dwFlagsAndAttributes,
+				  HANDLE hTemplateFile) {
+	if (strncmp(lpFileName, "\\\\.\\", 4) != 0 || strlen(lpFileName) > 60) {
+		lastError = ERROR_FILE_NOT_FOUND;
+		return INVALID_HANDLE_VALUE;
+	}
+	WCHAR name[64] = L"\\??\\";
+	for (int i = 4; lpFileName[i - 1] != '\0'; i++)
+		name[i] = (WCHAR) (UCHAR) lpFileName[i];
+
+	PFILE_OBJECT pFileObject;
+	BOOL bOverlapped = (dwFlagsAndAttributes & FILE_FLAG_OVERLAPPED) != 0;
+	NTSTATUS status = TestEnvOpen(name, bOverlapped ? 0 : FO_SYNCHRONOUS_IO,
+								  &pFileObject);
+	if (!NT_SUCCESS(status)) {
+		Fail(status);
+		return INVALID_HANDLE_VALUE;
+	}
+	HANDLE hFile = NewHandle(TESTENV_HANDLE::File);
+	HandleOf(hFile)->pFileObject = pFileObject;
+	HandleOf(hFile)->bOverlapped = bOverlapped;
+	return hFile;
+}
+
+// How an overlapped request started, as Win32 reports it
+static BOOL Started(NTSTATUS status, PIRP pIrp, ULONG nBytes,
+					LPDWORD lpNumberOfBytes, LPOVERLAPPED lpOverlapped) {
+	lpOverlapped->Internal = status;
+	if (pIrp != NULL) {
+		lpOverlapped->InternalHigh = (ULONG_PTR) pIrp;
+		lastError = ERROR_IO_PENDING;
+		return FALSE;
+	}
+	lpOverlapped->InternalHigh = nBytes;
+	if (lpNumberOfBytes != NULL)
+		*lpNumberOfBytes = nBytes;
+	return NT_SUCCESS(status) ? TRUE : Fail(status);
+}
+
+BOOL ReadFile(HANDLE hFile, LPVOID lpBuffer, DWORD nNumberOfBytesToRead,
+			  LPDWORD lpNumberOfBytesRead, LPOVERLAPPED lpOverlapped) {
+	NTSTATUS status;
+	if (HandleOf(hFile)->bOverlapped) {
+		PIRP pIrp;
+		ULONG nBytes = 0;
+		status = TestEnvStartRead(FileOf(hFile), lpBuffer, nNumberOfBytesToRead,
+								  &pIrp, &nBytes);
+		return Started(status, pIrp, nBytes, lpNumberOfBytesRead, lpOverlapped);
+	}
+	status = TestEnvRead(FileOf(hFile), lpBuffer,
+						 nNumberOfBytesToRead, lpNumberOfBytesRead);
+	return NT_SUCCESS(status) ? TRUE : Fail(status);
+}
+
+BOOL WriteFile(HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWrite,
+			   LPDWORD lpNumberOfBytesWritten, LPOVERLAPPED lpOverlapped) {
+	NTSTATUS status;
+	if (HandleOf(hFile)->bOverlapped) {
+		PIRP pIrp;
+		ULONG nBytes = 0;
+		status = TestEnvStartWrite(FileOf(hFile), lpBuffer, nNumberOfBytesToWrite,
+								   &pIrp, &nBytes);
+		return Started(status, pIrp, nBytes, lpNumberOfBytesWritten, lpOverlapped);
+	}
+	status = TestEnvWrite(FileOf(hFile), lpBuffer,
+						  nNumberOfBytesToWrite, lpNumberOfBytesWritten);
+	return NT_SUCCESS(status) ? TRUE : Fail(status);
+}
+
+BOOL DeviceIoControl(HANDLE hDevice, DWORD dwIoControlCode,
+					 LPVOID lpInBuffer, DWORD nInBufferSize,
+					 LPVOID lpOutBuffer, DWORD nOutBufferSize,
+					 LPDWORD lpBytesReturned, LPOVERLAPPED lpOverlapped) {
+	NTSTATUS status;
+	if (HandleOf(hDevice)->bOverlapped) {
+		PIRP pIrp;
+		ULONG nBytes = 0;
+		status = TestEnvStartDeviceControl(FileOf(hDevice), dwIoControlCode,
+										   lpInBuffer, nInBufferSize,
+										   lpOutBuffer, nOutBufferSize, &pIrp, &nBytes);
+		return Started(status, pIrp, nBytes, lpBytesReturned, lpOverlapped);
+	}
+	ULONG nBytes = 0;
+	status = TestEnvDeviceControl(FileOf(hDevice), dwIoControlCode,
+								  lpInBuffer, nInBufferSize,
+								  lpOutBuffer, nOutBufferSize, &nBytes);
+	if (lpBytesReturned != NULL)
+		*lpBytesReturned = nBytes;
+	return NT_SUCCESS(status) ? TRUE : Fail(status);
+}
+
+BOOL GetOverlappedResult(HANDLE hFile, LPOVERLAPPED lpOverlapped,
+						 LPDWORD lpNumberOfBytesTransferred, BOOL bWait) {
+	if (lpOverlapped->Internal == (ULONG_PTR) STATUS_PENDING) {
+		ULONG nBytes = 0;
+		NTSTATUS status = TestEnvFinish((PIRP) lpOverlapped->InternalHigh,
+										(BOOLEAN) bWait, &nBytes);
+		if (status == STATUS_PENDING) {
+			lastError = ERROR_IO_INCOMPLETE;
+			return FALSE;
+		}
+		lpOverlapped->Internal = status;
+		lpOverlapped->InternalHigh = nBytes;
+	}
+	*lpNumberOfBytesTransferred = (DWORD) lpOverlapped->InternalHigh;
+	return NT_SUCCESS((NTSTATUS) lpOverlapped->Internal) ? TRUE
+		: Fail((NTSTATUS) lpOverlapped->Internal);
+}
+
+BOOL CloseHandle(HANDLE hObject) {
+	if (EventOf(hObject) != NULL) {
+		TestEnvCloseObject(hObject);	// drivers may still hold a reference
+		return TRUE;
+	}
+	TESTENV_HANDLE* pHandle = HandleOf(hObject);
+	if (pHandle->Type == TESTENV_HANDLE::Thread) {
+		if (!pHandle->bJoined)
+			pthread_detach(pHandle->thread);	// runs on; the handle is leaked
+		else
+			TestEnvCloseObject(hObject);
+		return TRUE;
+	}
+	PFILE_OBJECT pFileObject = pHandle->pFileObject;
+	TestEnvCloseObject(hObject);	// other threads' requests already have the file object
+	NTSTATUS status = TestEnvClose(pFileObject);
+	return NT_SUCCESS(status) ? TRUE : Fail(status);
+}
+
+BOOL CancelIo(HANDLE hFile) {
+	TestEnvCancel(FileOf(hFile));
+	return TRUE;
+}
+
+BOOL CancelIoEx(HANDLE hFile, LPOVERLAPPED lpOverlapped) {
+	return CancelIo(hFile);
+}
+
+DWORD GetLastError() {
+	return lastError;
+}
+
+static void* ThreadStart(void* pContext) {
+	TESTENV_HANDLE* pHandle = (TESTENV_HANDLE*) pContext;
+	pHandle->ExitCode = pHandle->pStart(pHandle->pParameter);
+	return NULL;
+}
+
+HANDLE CreateThread(LPSECURITY_ATTRIBUTES lpThreadAttributes, SIZE_T dwStackSize,
+					LPTHREAD_START_ROUTINE lpStartAddress, LPVOID lpParameter,
+					DWORD dwCreationFlags, LPDWORD lpThreadId) {
+	HANDLE hThread = NewHandle(TESTENV_HANDLE::Thread);
+	TESTENV_HANDLE* pHandle = HandleOf(hThread);
+	pHandle->pStart = lpStartAddress;
+	pHandle->pParameter = lpParameter;
+	if (pthread_create(&pHandle->thread, NULL, ThreadStart, pHandle) != 0) {
+		TestEnvCloseObject(hThread);
+		lastError = ERROR_NOT_ENOUGH_MEMORY;
+		return NULL;
+	}
+	if (lpThreadId != NULL)
+		*lpThreadId = (DWORD) (SIZE_T) pHandle;
+	return hThread;
+}
+
+DWORD WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds) {
+	PKEVENT pEvent = EventOf(hHandle);
+	if (pEvent != NULL) {
+		LARGE_INTEGER timeout;
+		timeout.QuadPart = -10000 * (LONGLONG) dwMilliseconds;	// relative, 100 ns
+		return KeWaitForSingleObject(pEvent, UserRequest, UserMode, FALSE,
+									 dwMilliseconds != INFINITE ? &timeout : NULL)
+			== STATUS_TIMEOUT ? WAIT_TIMEOUT : WAIT_OBJECT_0;
+	}
+	TESTENV_HANDLE* pHandle = HandleOf(hHandle);
+	if (pHandle->Type != TESTENV_HANDLE::Thread || dwMilliseconds != INFINITE) {
+		lastError = ERROR_INVALID_PARAMETER;
+		return WAIT_FAILED;
+	}
+	if (!pHandle->bJoined) {
+		pthread_join(pHandle->thread, NULL);
+		pHandle->bJoined = TRUE;
+	}
+	return WAIT_OBJECT_0;
+}
+
+BOOL GetExitCodeThread(HANDLE hThread, LPDWORD lpExitCode) {
+	TESTENV_HANDLE* pHandle = HandleOf(hThread);
+	if (!pHandle->bJoined) {
+		lastError = ERROR_INVALID_PARAMETER;	// STILL_ACTIVE isn't kept
+		return FALSE;
+	}
+	*lpExitCode = pHandle->ExitCode;
+	return TRUE;
+}
+
+VOID Sleep(DWORD dwMilliseconds) {
+	usleep(dwMilliseconds * 1000);
+}
+
+HANDLE CreateEvent(LPSECURITY_ATTRIBUTES lpEventAttributes, BOOL bManualReset,
+				   BOOL bInitialState, LPCSTR lpName) {
+	if (lpName != NULL) {
+		lastError = ERROR_INVALID_PARAMETER;
+		return NULL;
+	}
+	HANDLE hEvent = TestEnvCreateObject(*ExEventObjectType, sizeof(KEVENT));
+	KeInitializeEvent(EventOf(hEvent),
+		bManualReset ? NotificationEvent : SynchronizationEvent, (BOOLEAN) bInitialState);
+	return hEvent;
+}
+
+BOOL SetEvent(HANDLE hEvent) {
+	KeSetEvent(EventOf(hEvent), IO_NO_INCREMENT, FALSE);
+	return TRUE;
+}
+
+BOOL ResetEvent(HANDLE hEvent) {
+	KeClearEvent(EventOf(hEvent));
+	return TRUE;
+}
+
+LONG InterlockedExchange(LONG volatile* Target, LONG Value) {
+	return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+LONG InterlockedCompareExchange(LONG volatile* Destination, LONG Exchange, LONG Comperand) {
+	__atomic_compare_exchange_n(Destination, &Comperand, Exchange, FALSE,
+								__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return Comperand;
+}
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER* lpPerformanceCount) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	lpPerformanceCount->QuadPart = (LONGLONG) now.tv_sec * 1000000000 + now.tv_nsec;
+	return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* lpFrequency) {
+	lpFrequency->QuadPart = 1000000000;		// nanoseconds
+	return TRUE;
+}
@@ -0,0 +1,114 @@
+// DDKTestWin32.h
+//
+// Copyright (C) 2000 by Jerry Lozano
+//
+
+// The Win32 side of the DDK Test Environment, for building test
+// apps (like the chapter Testors) on Linux.  Their CreateFile,
+// ReadFile, ... calls go to a driver loaded into the same program
+// with TestEnvLoadDriver, e.g.
+//	extern "C" NTSTATUS DriverEntry(PDRIVER_OBJECT, PUNICODE_STRING);
+//	TestEnvLoadDriver(DriverEntry, L"Loopback", &status);
+// Only what the Testors use is here.  On Windows, include
+// <windows.h> and talk to the real driver instead.
+
+#pragma once
+
+#include "DDKTestEnv.h"
+
+typedef int BOOL;
+typedef const char* LPCSTR;
+typedef VOID* LPVOID;
+typedef const VOID* LPCVOID;
+typedef DWORD* LPDWORD;
+// hEvent isn't supported: wait with GetOverlappedResult
+typedef struct _OVERLAPPED {
+	ULONG_PTR Internal;			// status
+	ULONG_PTR InternalHigh;		// bytes - or the IRP, while pending
+	DWORD Offset;
+	DWORD OffsetHigh;
+	HANDLE hEvent;
+} OVERLAPPED, *LPOVERLAPPED;
+typedef struct _SECURITY_ATTRIBUTES SECURITY_ATTRIBUTES, *LPSECURITY_ATTRIBUTES;
+#define WINAPI
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID lpParameter);
+
+#define INVALID_HANDLE_VALUE	((HANDLE) (SIZE_T) -1)
+#define GENERIC_READ			0x80000000
+#define GENERIC_WRITE			0x40000000
+#define OPEN_EXISTING			3
+#define FILE_ATTRIBUTE_NORMAL	0x00000080
+#define FILE_FLAG_OVERLAPPED	0x40000000
+#define INFINITE				0xFFFFFFFF
+#define WAIT_OBJECT_0			0
+#define WAIT_TIMEOUT			258
+#define WAIT_FAILED				0xFFFFFFFF
+
+#define ERROR_INVALID_FUNCTION		1
+#define ERROR_FILE_NOT_FOUND		2
+#define ERROR_ACCESS_DENIED			5
+#define ERROR_INVALID_HANDLE		6
+#define ERROR_NOT_ENOUGH_MEMORY		8
+#define ERROR_BAD_COMMAND			22
+#define ERROR_INVALID_PARAMETER		87
+#define ERROR_INSUFFICIENT_BUFFER	122
+#define ERROR_BUSY					170
+#define ERROR_OPERATION_ABORTED		995
+#define ERROR_IO_INCOMPLETE			996
+#define ERROR_IO_PENDING			997
+#define ERROR_NO_SYSTEM_RESOURCES	1450
+#define ERROR_INVALID_USER_BUFFER	1784
+#define ERROR_GEN_FAILURE			31
+
+// Only "\\.\Name" device names, which stand for \??\Name
+HANDLE CreateFile(LPCSTR lpFileName, DWORD dwDesiredAccess, DWORD dwShareMode,
+				  LPSECURITY_ATTRIBUTES lpSecurityAttributes,
+				  DWORD dwCreationDisposition, DWORD dwFlagsAndAttributes,
+				  HANDLE hTemplateFile);
+BOOL ReadFile(HANDLE hFile, LPVOID lpBuffer, DWORD nNumberOfBytesToRead,
+			  LPDWORD lpNumberOfBytesRead, LPOVERLAPPED lpOverlapped);
+BOOL WriteFile(HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWrite,
+			   LPDWORD lpNumberOfBytesWritten, LPOVERLAPPED lpOverlapped);
+BOOL CloseHandle(HANDLE hObject);
+DWORD GetLastError();
+
+// Reads and writes on a handle opened with FILE_FLAG_OVERLAPPED
+// fail with ERROR_IO_PENDING if the driver pends them
+BOOL GetOverlappedResult(HANDLE hFile, LPOVERLAPPED lpOverlapped,
+						 LPDWORD lpNumberOfBytesTransferred, BOOL bWait);
+// Cancels the handle's requests.  CancelIo is meant to cancel only
+// the calling thread's, but here it cancels them all, as CancelIoEx
+// (Windows Vista and later) does.
+BOOL CancelIo(HANDLE hFile);
+BOOL CancelIoEx(HANDLE hFile, LPOVERLAPPED lpOverlapped);
+
+// Overlapped too, if the handle is.  The control code's method
+// decides how the buffers reach the driver, as in Windows.
+BOOL DeviceIoControl(HANDLE hDevice, DWORD dwIoControlCode,
+					 LPVOID lpInBuffer, DWORD nInBufferSize,
+					 LPVOID lpOutBuffer, DWORD nOutBufferSize,
+					 LPDWORD lpBytesReturned, LPOVERLAPPED lpOverlapped);
+
+// Threads, for tests that need a second caller
+HANDLE CreateThread(LPSECURITY_ATTRIBUTES lpThreadAttributes, SIZE_T dwStackSize,
+					LPTHREAD_START_ROUTINE lpStartAddress, LPVOID lpParameter,
+					DWORD dwCreationFlags, LPDWORD lpThreadId);
+// Threads (INFINITE only) and events
+DWORD WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds);
+BOOL GetExitCodeThread(HANDLE hThread, LPDWORD lpExitCode);
+VOID Sleep(DWORD dwMilliseconds);
+
+// Events are the test environment's KEVENTs, so a driver can take
+// them with ObReferenceObjectByHandle.  Unnamed only.
+HANDLE CreateEvent(LPSECURITY_ATTRIBUTES lpEventAttributes, BOOL bManualReset,
+				   BOOL bInitialState, LPCSTR lpName);
+BOOL SetEvent(HANDLE hEvent);
+BOOL ResetEvent(HANDLE hEvent);
+
+// Full barriers, as on x86 and x64
+LONG InterlockedExchange(LONG volatile* Target, LONG Value);
+LONG InterlockedCompareExchange(LONG volatile* Destination, LONG Exchange, LONG Comperand);
+
+// Timing
+BOOL QueryPerformanceCounter(LARGE_INTEGER* lpPerformanceCount);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* lpFrequency);
@@ -12,7 +12,13 @@
 
 
 // TODO: reference additional headers your program requires here
+#ifdef _WIN32
 #include <windows.h>
+#else
+// Native Linux build - DDKTestEnv.h supplies the Win32 types
+#include <stdlib.h>
+#include <string.h>
+#endif
 
 //{{AFX_INSERT_LOCATION}}
 // Microsoft Visual C++ will insert additional declarations immediately before the previous line.
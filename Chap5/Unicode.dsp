@@ -85,6 +85,12 @@ LINK32=link.exe
 # PROP Default_Filter "cpp;c;cxx;rc;def;r;odl;idl;hpj;bat"
 # Begin Source File
 
+SOURCE=..\Chap7\Loopback\DevTable.cpp
+# ADD CPP /I "."
+# SUBTRACT CPP /YX /Yc /Yu
+# End Source File
+# Begin Source File
+
 SOURCE=.\DDKTestEnv.cpp
 # End Source File
 # Begin Source File
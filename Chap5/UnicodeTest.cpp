@@ -1,11 +1,46 @@
 // Unicode.cpp : Defines the entry point for the console application.
 //
 
-#include "stdafx.h"
+#include "StdAfx.h"
 
 #include "DDKTestEnv.h"
 #include "Unicode.h"
+#include "../Chap7/Loopback/DevTable.h"
 #include "stdio.h"
+#include <time.h>
+
+// wprintf can't be used where WCHAR is narrower than the C library's
+// wchar_t (Linux with -fshort-wchar), so strings are narrowed for printf
+static const char* Narrow(PCWSTR pWide) {
+	static char buffers[4][256];
+	static int next = 0;
+	if (pWide == NULL)
+		return "(null)";
+	char* pNarrow = buffers[next++ % 4];
+	int i = 0;
+	for (; pWide[i] != UNICODE_NULL && i < 255; i++)
+		pNarrow[i] = (pWide[i] < 128) ? (char) pWide[i] : '?';
+	pNarrow[i] = '\0';
+	return pNarrow;
+}
+
+// Stand-in for the Device Extension of the Chapter 6-17 drivers
+struct NAMES_EXTENSION {
+	CUString ustrDeviceName;	// internal name
+	CUString ustrSymLinkName;	// external name
+	DEVICE_TABLE_ENTRY tableEntry;	// as in the Loopback driver
+};
+
+// Name setup exactly as done by CreateDevice in the sample drivers
+static void CreateDeviceNames(NAMES_EXTENSION* pDevExt, ULONG ulDeviceNumber) {
+	CUString devName(
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\Device\\LOOPBACK")).Append(ulDeviceNumber) );
+	pDevExt->ustrDeviceName = devName;
+
+	CUString symLinkName(
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\??\\LBK")).Append(ulDeviceNumber+1) );	// 1 based
+	pDevExt->ustrSymLinkName = symLinkName;
+}
 
 int main(int argc, char* argv[])
 {
@@ -33,31 +68,507 @@ int main(int argc, char* argv[])
 	printf("When comparing strOne to strTwo, we get %d\n",
 				strOne==strTwo);
 
-	wprintf(L"Casting strTwo to wchar_t*, we get: %s\n",
-				(wchar_t*) strTwo);
+	printf("Casting strTwo to wchar_t*, we get: %s\n",
+				Narrow((wchar_t*) strTwo));
 
 	printf("Final results:\n");
 
-	wprintf(L"strOne: %s\n", (PWSTR) strOne);
-	wprintf(L"strTwo: %s\n", (PWSTR) strTwo);
-	wprintf(L"strEmpty: %s\n", (PWSTR) strEmpty);
-	wprintf(L"newCopyOfOne: %s\n", (PWSTR) newCopyOfOne);
-	wprintf(L"strTwoCopy: %s\n", (PWSTR) strTwoCopy);
-	wprintf(L"strOnePlusTwo: %s\n", (PWSTR) strOnePlusTwo);
+	printf("strOne: %s\n", Narrow((PWSTR) strOne));
+	printf("strTwo: %s\n", Narrow((PWSTR) strTwo));
+	printf("strEmpty: %s\n", Narrow((PWSTR) strEmpty));
+	printf("newCopyOfOne: %s\n", Narrow((PWSTR) newCopyOfOne));
+	printf("strTwoCopy: %s\n", Narrow((PWSTR) strTwoCopy));
+	printf("strOnePlusTwo: %s\n", Narrow((PWSTR) strOnePlusTwo));
 	printf("Conversion of str2468 into ULONG = %d\n", ul2468);
 	printf("Conversion of strxFF01 into ULONG = %x (%d)\n", ulxFF01, ulxFF01);
 	printf("Conversion of stro6622 into ULONG = %o (%d)\n", ulo6622, ulo6622);
 
-	wprintf(L"Conversion of 2244 into CUString = %s\n", (PWSTR) str2244);
-	wprintf(L"On the fly conversion of 3366 into CUString = %s\n",
-					(PWSTR)(CUString)3366);
+	printf("Conversion of 2244 into CUString = %s\n", Narrow((PWSTR) str2244));
+	printf("On the fly conversion of 3366 into CUString = %s\n",
+					Narrow((PWSTR) (CUString)3366));
 
 	printf("Test of buffer access using [] operator:\n");
 	for (int i=0; i<strOnePlusTwo.Length(); i++) {
-		wprintf(L"%c ", strOnePlusTwo[i]);
+		printf("%c ", (char) strOnePlusTwo[i]);
 		strOnePlusTwo[i] = L'A' + i;
 	}
-	wprintf(L"\nAfter replacing buffer, strOnePlusTwo = %s\n", (PWSTR)strOnePlusTwo);
+	printf("\nAfter replacing buffer, strOnePlusTwo = %s\n", Narrow((PWSTR) strOnePlusTwo));
+
+	int nFailures = 0;
+	ULONG allocs;
+
+	printf("Test of pool accounting:\n");
+	const ULONG testTag = 0x74736554;	// 'Test'
+	TESTENV_POOL_TAG_STATS tagStats;
+	PVOID pBlocks[3];
+	pBlocks[0] = ExAllocatePoolWithTag(PagedPool, 100, testTag);
+	pBlocks[1] = ExAllocatePoolWithTag(PagedPool, 50, testTag);
+	pBlocks[2] = ExAllocatePoolWithTag(NonPagedPool, 7, testTag);
+	if (((SIZE_T) pBlocks[0] & 15) != 0)	// as aligned as malloc
+		nFailures++;
+	ExFreePool(pBlocks[0]);
+	if (!TestEnvQueryPoolTag(testTag, PagedPool, &tagStats) ||
+		tagStats.Allocs != 2 || tagStats.Frees != 1 || tagStats.LiveAllocs != 1 ||
+		tagStats.LiveBytes != 50 || tagStats.PeakBytes != 150 || tagStats.TotalBytes != 150)
+		nFailures++;
+	ExFreePoolWithTag(pBlocks[1], testTag);
+	if (!TestEnvQueryPoolTag(testTag, NonPagedPool, &tagStats) ||
+		tagStats.LiveAllocs != 1 || tagStats.LiveBytes != 7)
+		nFailures++;
+	ExFreePool(pBlocks[2]);
+	if (TestEnvQueryPoolTag(testTag + 1, PagedPool, &tagStats))
+		nFailures++;
+
+	printf("Test of pool allocations during device name setup:\n");
+	ULONG ulDeviceNumber = 0;
+	CUString ustrDeviceName;	// as found in a fresh Device Extension
+	CUString devName("\\Device\\LOOPBACK");
+	devName += CUString(ulDeviceNumber);
+
+	allocs = TestEnvPoolAllocations;
+	ustrDeviceName = devName;
+	allocs = TestEnvPoolAllocations - allocs;
+	printf("Allocations to assign device name = %d (expected 0)\n", allocs);
+	if (allocs != 0 || !(ustrDeviceName == devName))
+		nFailures++;
+
+	CUString strLong("\\Device\\ThisNameIsMuchTooLongToBeStoredInline");
+	allocs = TestEnvPoolAllocations;
+	ustrDeviceName = strLong;
+	ustrDeviceName = devName;	// shorter - reuses the pool buffer
+	allocs = TestEnvPoolAllocations - allocs;
+	printf("Allocations to assign long name, then short = %d (expected 1)\n", allocs);
+	if (allocs != 1 || !(ustrDeviceName == devName))
+		nFailures++;
+
+	allocs = TestEnvPoolAllocations;
+	ustrDeviceName = devName;	// fits - buffer must be reused
+	allocs = TestEnvPoolAllocations - allocs;
+	printf("Allocations to reassign device name = %d (expected 0)\n", allocs);
+	if (allocs != 0 || !(ustrDeviceName == devName))
+		nFailures++;
+
+	allocs = TestEnvPoolAllocations;
+	CUString strEmptyCopy = strEmpty;
+	ustrDeviceName.Swap(strEmptyCopy);
+	allocs = TestEnvPoolAllocations - allocs;
+	printf("Allocations to copy empty string and swap = %d (expected 0)\n", allocs);
+	if (allocs != 0 || !(strEmptyCopy == devName))
+		nFailures++;
+
+#ifdef CUSTRING_HAS_MOVE
+	allocs = TestEnvPoolAllocations;
+	CUString strMoved((CUString&&) strEmptyCopy);
+	ustrDeviceName = (CUString&&) strMoved;
+	allocs = TestEnvPoolAllocations - allocs;
+	printf("Allocations to move device name twice = %d (expected 0)\n", allocs);
+	if (allocs != 0 || !(ustrDeviceName == devName) ||
+		(PWSTR) strMoved != NULL || (PWSTR) strEmptyCopy != NULL)
+		nFailures++;
+#endif
+
+	printf("Test of repeated appends:\n");
+	CUString strPath("\\Registry\\Machine");
+	CUString strKey(L"\\Key");
+	allocs = TestEnvPoolAllocations;
+	for (int i=0; i<1000; i++)
+		strPath += strKey;
+	allocs = TestEnvPoolAllocations - allocs;
+	printf("Allocations for 1000 appends = %d (expected 10 or fewer)\n", allocs);
+	if (allocs > 10 || strPath.Length() != 17 + 1000*4)
+		nFailures++;
+	strPath += strPath;
+	if (strPath.Length() != 2*(17 + 1000*4))
+		nFailures++;
+
+	printf("Test of CUStringBuilder:\n");
+	allocs = TestEnvPoolAllocations;
+	CUStringBuilder bld("\\??\\");
+	bld.Append(L"LBK").Append(4294967295UL).Append(strTwo).Append("-").Append(ulDeviceNumber);
+	CUString strBuilt(bld);
+	allocs = TestEnvPoolAllocations - allocs;
+	printf("Built %s with %d allocations (expected 0)\n", Narrow((PWSTR) strBuilt), allocs);
+	if (allocs != 0 || !(strBuilt == CUString("\\??\\LBK4294967295Two-0")))
+		nFailures++;
+	for (int i=0; i<CUSTRINGBUILDER_CHARS; i++)
+		bld.Append("x");
+	if (!bld.Overflowed() || bld.Length() != CUSTRINGBUILDER_CHARS-1)
+		nFailures++;
+
+	printf("Test of literal CUStrings:\n");
+	allocs = TestEnvPoolAllocations;
+	CUString strLiteral = CUSTRING_LITERAL("\\Device\\TIMERPP");
+	CUString strLiteralCopy(strLiteral);
+	ustrDeviceName = strLiteral;
+	allocs = TestEnvPoolAllocations - allocs;
+	printf("Allocations to build, copy and assign literal = %d (expected 0)\n", allocs);
+	if (allocs != 0 || strLiteral.Length() != 15 ||
+		(PWSTR) strLiteralCopy != (PWSTR) strLiteral ||
+		(PWSTR) ustrDeviceName != (PWSTR) strLiteral)
+		nFailures++;
+	strLiteralCopy[0] = L'/';	// must not write into the literal
+	printf("After writing to a copy: %s, %s\n",
+		Narrow((PWSTR) strLiteral), Narrow((PWSTR) strLiteralCopy));
+	if (((PWSTR) strLiteral)[0] != L'\\' || ((PWSTR) strLiteralCopy)[0] != L'/')
+		nFailures++;
+
+	printf("Test of ULONG conversions:\n");
+	static const ULONG testValues[] =
+		{0, 1, 9, 10, 99, 100, 12345, 999999999, 1000000000, 4294967295UL};
+	for (ULONG i=0; i<sizeof(testValues)/sizeof(testValues[0]); i++) {
+		CUString strValue(testValues[i]);
+		ULONG ulValue;
+		if (!strValue.ToULONG(&ulValue) || ulValue != testValues[i]) {
+			printf("Round trip of %s failed\n", Narrow((PWSTR) strValue));
+			nFailures++;
+		}
+	}
+	struct {const char* pText; BOOLEAN bValid; ULONG ulValue;} parseTests[] = {
+		{"2468", TRUE, 2468}, {"0xFF01", TRUE, 0xFF01}, {"0XfF01", TRUE, 0xFF01},
+		{"0o6622", TRUE, 06622}, {"0o777", TRUE, 0777}, {"0b1011", TRUE, 11},
+		{"0b2", FALSE, 0}, {"-5", TRUE, (ULONG) -5}, {"42abc", TRUE, 42},
+		{"4294967295", TRUE, 4294967295UL}, {"4294967296", FALSE, 0},
+		{"0xFFFFFFFF", TRUE, 0xFFFFFFFF}, {"0x100000000", FALSE, 0}, {"", FALSE, 0},
+		{"xFF01", FALSE, 0}, {"b101", FALSE, 0}, {"o17", FALSE, 0},
+		{"0123", TRUE, 123}, {"0", TRUE, 0}, {"-0x10", TRUE, (ULONG) -16},
+	};
+	for (ULONG i=0; i<sizeof(parseTests)/sizeof(parseTests[0]); i++) {
+		ULONG ulValue;
+		BOOLEAN bValid = CUString(parseTests[i].pText).ToULONG(&ulValue);
+		if (bValid != parseTests[i].bValid || ulValue != parseTests[i].ulValue) {
+			printf("Parse of \"%s\" gave %d, %u\n", parseTests[i].pText, bValid, ulValue);
+			nFailures++;
+		}
+	}
+
+	printf("Benchmark of ULONG conversions (1000000 each):\n");
+	const ULONG nConversions = 1000000;
+	WCHAR digits[32];
+	UNICODE_STRING ustrDigits = {0, sizeof(digits), digits};
+	ULONG ulSum = 0;
+	clock_t start = clock();
+	for (ULONG n=0; n<nConversions; n++) {
+		RtlIntegerToUnicodeString(n * 4099, 10, &ustrDigits);
+		ulSum += ustrDigits.Length;
+	}
+	clock_t rtlFormat = clock() - start;
+	start = clock();
+	for (ULONG n=0; n<nConversions; n++)
+		ulSum += CUString::FormatULONG(n * 4099, digits);
+	clock_t tableFormat = clock() - start;
+	CUString strNumber("4294967295");
+	start = clock();
+	for (ULONG n=0; n<nConversions; n++) {
+		ULONG ulValue;
+		RtlUnicodeStringToInteger(&(UNICODE_STRING&)strNumber, 10, &ulValue);
+		ulSum += ulValue;
+	}
+	clock_t rtlParse = clock() - start;
+	start = clock();
+	for (ULONG n=0; n<nConversions; n++) {
+		ULONG ulValue;
+		strNumber.ToULONG(&ulValue);
+		ulSum += ulValue;
+	}
+	clock_t tableParse = clock() - start;
+	printf("Format: Rtl %ld ms, table %ld ms\n",
+		rtlFormat * 1000 / CLOCKS_PER_SEC, tableFormat * 1000 / CLOCKS_PER_SEC);
+	printf("Parse:  Rtl %ld ms, table %ld ms\n",
+		rtlParse * 1000 / CLOCKS_PER_SEC, tableParse * 1000 / CLOCKS_PER_SEC);
+	printf("(checksum %u)\n", ulSum);
+
+	printf("Test of ANSI to Unicode conversion:\n");
+	CUString strMixed("ASCII first, then \xE9t\xE9 - Latin-1 on Linux");
+	if (strMixed.Length() != 40 || strMixed[17] != L' ' || strMixed[18] != 0xE9 ||
+		strMixed[19] != L't' || strMixed[39] != L'x' || ((PWSTR) strMixed)[40] != UNICODE_NULL)
+		nFailures++;
+	CUString strSpan("0123456789abcdef0123456789ABCDEF0123456789!");	// >32 bytes
+	if (strSpan.Length() != 43 || strSpan[16] != L'0' || strSpan[42] != L'!')
+		nFailures++;
+
+	printf("Benchmark of ANSI to Unicode conversion:\n");
+	static const USHORT convSizes[] = {8, 64, 512, 4096, 32766};	// to 64 KB of WCHARs
+	CHAR* pAnsiText = (CHAR*) malloc(32766);
+	WCHAR* pWideText = (WCHAR*) malloc(32767 * sizeof(WCHAR));
+	for (ULONG i=0; i<sizeof(convSizes)/sizeof(convSizes[0]); i++) {
+		ANSI_STRING ansiText = {convSizes[i], convSizes[i], pAnsiText};
+		UNICODE_STRING wideText = {0, 32767 * sizeof(WCHAR), pWideText};
+		ULONG nReps = (64 * 1024 * 1024) / convSizes[i];	// 64 MB each
+		clock_t elapsed[2];
+		for (int nonAscii=0; nonAscii<2; nonAscii++) {
+			for (ULONG j=0; j<convSizes[i]; j++)
+				pAnsiText[j] = 'A' + (CHAR) (j % 26);
+			if (nonAscii)
+				pAnsiText[0] = (CHAR) 0xE9;	// forces the byte-by-byte path
+			start = clock();
+			for (ULONG n=0; n<nReps; n++)
+				RtlAnsiStringToUnicodeString(&wideText, &ansiText, FALSE);
+			elapsed[nonAscii] = clock() - start;
+			ulSum += wideText.Length;
+		}
+		printf("%5d bytes: ASCII %6.0f MB/s, non-ASCII %6.0f MB/s\n", convSizes[i],
+			64.0 * CLOCKS_PER_SEC / (elapsed[0] ? elapsed[0] : 1),
+			64.0 * CLOCKS_PER_SEC / (elapsed[1] ? elapsed[1] : 1));
+	}
+	free(pAnsiText);
+	free(pWideText);
+	printf("(checksum %u)\n", ulSum);
+
+	printf("Test of comparisons:\n");
+	CUString strLower("\\??\\lbk12-\xE9");
+	CUString strUpper("\\??\\LBK12-\xC9");
+	CUString strOther("\\??\\LBK13-\xC9");
+	if (strLower == strUpper || !strLower.EqualsNoCase(strUpper) ||
+		strUpper.EqualsNoCase(strOther) || !(strUpper == CUString(strUpper)))
+		nFailures++;
+	if (strLower.Hash() != strUpper.Hash() || strUpper.Hash() == strOther.Hash())
+		nFailures++;
+	if (strLower == strUpper || !strLower.EqualsNoCase(strUpper) ||
+		strUpper.EqualsNoCase(strOther))	// again, now with hashes
+		nFailures++;
+	strLower[4] = L'x';		// changes must drop the cached hash
+	if (strLower.Hash() == strUpper.Hash() || strLower.EqualsNoCase(strUpper))
+		nFailures++;
+	UNICODE_STRING ustrLong1 = {38, 40, (PWSTR) L"Nineteen characters"};
+	UNICODE_STRING ustrLong2 = {38, 40, (PWSTR) L"NINETEEN CHARACTERs"};
+	if (RtlEqualUnicodeString(&ustrLong1, &ustrLong2, FALSE) ||
+		!RtlEqualUnicodeString(&ustrLong1, &ustrLong2, TRUE))
+		nFailures++;
+
+	printf("Test of strings too long for a UNICODE_STRING:\n");
+	char* pHuge = (char*) malloc(40001);
+	memset(pHuge, 'a', 40000);
+	pHuge[40000] = '\0';
+	CUString strHuge(pHuge);	// 80002 bytes wide - can't be held
+	pHuge[20000] = '\0';
+	CUString strHalf(pHuge);	// 40002 bytes - can
+	free(pHuge);
+	CUString strHalfTwice = strHalf + strHalf;
+	CUString strHalfAppended(strHalf);
+	strHalfAppended += strHalf;
+	if (strHuge.Length() != 0 || strHalf.Length() != 20000 ||
+		strHalfTwice.Length() != 0 || strHalfAppended.Length() != 20000)
+		nFailures++;
+	strHalf.Reserve(0xFFFF);	// more than there can be
+	if (strHalf.Length() != 20000 ||
+		((UNICODE_STRING&) strHalf).MaximumLength != 0xFFFE)
+		nFailures++;
+
+	printf("Test of running out of pool:\n");
+	char szBig[2001];	// 4002 bytes wide - straight from the pool
+	memset(szBig, 'b', 2000);
+	szBig[2000] = '\0';
+	CUString strBig(szBig);
+	CUString strSmall("abc");	// inline - needs no pool
+	TestEnvFailPoolAllocations = 1;
+	CUString strNoPool(szBig);
+	TestEnvFailPoolAllocations = 1;
+	CUString strNoCopy(strBig);
+	CUString strNoAssign("abc");
+	TestEnvFailPoolAllocations = 1;
+	strNoAssign = strBig;
+	TestEnvFailPoolAllocations = 1;
+	CUString strNoSum = strBig + strSmall;
+	TestEnvFailPoolAllocations = 1;
+	strSmall += strBig;
+	USHORT nMaxBefore = ((UNICODE_STRING&) strBig).MaximumLength;
+	TestEnvFailPoolAllocations = 1;
+	strBig.Reserve(3000);
+	if (TestEnvFailPoolAllocations != 0 ||
+		strNoPool.Length() != 0 || (PWSTR) strNoPool != NULL ||
+		strNoCopy.Length() != 0 || strNoAssign.Length() != 0 ||
+		strNoSum.Length() != 0 || !(strSmall == CUString("abc")) ||
+		strBig.Length() != 2000 ||
+		((UNICODE_STRING&) strBig).MaximumLength != nMaxBefore)
+		nFailures++;
+
+	printf("Benchmark of name lookups (1000 names, 1000 lookups):\n");
+	CUString* pNames = new CUString[1000];
+	for (ULONG n=0; n<1000; n++)
+		pNames[n] = CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\Device\\LOOPBACK")).Append(1000+n);
+	for (int hashed=0; hashed<2; hashed++) {
+		CUString strWanted(pNames[999]);	// worst case - the last one
+		if (hashed) {
+			for (ULONG n=0; n<1000; n++)
+				pNames[n].Hash();
+			strWanted.Hash();
+		}
+		ULONG nFound = 0;
+		start = clock();
+		for (ULONG k=0; k<1000; k++)
+			for (ULONG n=0; n<1000; n++)
+				if (pNames[n] == strWanted)
+					nFound++;
+		clock_t elapsed = clock() - start;
+		printf("%s: %ld ms (%u found)\n", hashed ? "Hashed  " : "Unhashed",
+			elapsed * 1000 / CLOCKS_PER_SEC, nFound);
+		if (nFound != 1000)
+			nFailures++;
+	}
+	delete [] pNames;
+
+	printf("Benchmark of pool allocations per CreateDevice:\n");
+	const ULONG nDevices = 1000;
+	NAMES_EXTENSION* pExts = (NAMES_EXTENSION*)
+		calloc(nDevices, sizeof(NAMES_EXTENSION));	// zeroed, like IoCreateDevice
+	allocs = TestEnvPoolAllocations;
+	for (ULONG n=0; n<nDevices; n++)
+		CreateDeviceNames(&pExts[n], n);
+	allocs = TestEnvPoolAllocations - allocs;
+	printf("%d devices, %d allocations, %d.%02d per CreateDevice\n",
+		nDevices, allocs, allocs/nDevices, (allocs%nDevices)*100/nDevices);
+	printf("Last names: %s, %s\n", Narrow((PWSTR) pExts[nDevices-1].ustrDeviceName),
+		Narrow((PWSTR) pExts[nDevices-1].ustrSymLinkName));
+	for (ULONG n=0; n<nDevices; n++) {
+		pExts[n].ustrSymLinkName.Free();
+		pExts[n].ustrDeviceName.Free();
+	}
+	free(pExts);
+
+	printf("Benchmark of the device table (10000 devices):\n");
+	const ULONG nTableDevices = 10000;
+	const ULONG nStride = 7919;		// prime, so removals hop around
+	DEVICE_TABLE devTable;
+	pExts = (NAMES_EXTENSION*) calloc(nTableDevices, sizeof(NAMES_EXTENSION));
+	if (!NT_SUCCESS(DevTableInitialize(&devTable, 16)))	// has to grow
+		nFailures++;
+	start = clock();
+	for (ULONG n=0; n<nTableDevices; n++) {
+		CreateDeviceNames(&pExts[n], n);
+		PDEVICE_TABLE_ENTRY pEntry = &pExts[n].tableEntry;
+		pEntry->pDevice = (PDEVICE_OBJECT) &pExts[n];	// stand-in
+		pEntry->DeviceNumber = n;
+		pEntry->pDeviceName = &pExts[n].ustrDeviceName;
+		pEntry->pSymLinkName = &pExts[n].ustrSymLinkName;
+		if (!NT_SUCCESS(DevTableInsert(&devTable, pEntry)))
+			nFailures++;
+	}
+	clock_t tableCreate = clock() - start;
+	NAMES_EXTENSION dupExt;
+	CreateDeviceNames(&dupExt, 17);
+	dupExt.tableEntry.pDevice = NULL;
+	dupExt.tableEntry.DeviceNumber = nTableDevices;		// only the name clashes
+	dupExt.tableEntry.pDeviceName = &dupExt.ustrDeviceName;
+	dupExt.tableEntry.pSymLinkName = NULL;
+	if (DevTableInsert(&devTable, &dupExt.tableEntry) != STATUS_OBJECT_NAME_COLLISION ||
+		DevTableLookupNumber(&devTable, nTableDevices) != NULL)
+		nFailures++;
+	dupExt.ustrDeviceName.Free();
+	dupExt.ustrSymLinkName.Free();
+
+	NAMES_EXTENSION wanted;
+	ULONG nFound = 0;
+	start = clock();
+	for (ULONG n=0; n<nTableDevices; n++) {
+		CreateDeviceNames(&wanted, n);
+		PDEVICE_OBJECT pExpected = (PDEVICE_OBJECT) &pExts[n];
+		if (DevTableLookupNumber(&devTable, n) == pExpected &&
+			DevTableLookupDeviceName(&devTable, wanted.ustrDeviceName) == pExpected &&
+			DevTableLookupSymLink(&devTable, wanted.ustrSymLinkName) == pExpected)
+			nFound++;
+	}
+	clock_t tableLookup = clock() - start;
+	if (nFound != nTableDevices)
+		nFailures++;
+	// The same lookups by walking all devices, as DriverUnload walks
+	// the NextDevice list - sampled, since it's O(n) per lookup
+	start = clock();
+	for (ULONG k=0; k<nTableDevices; k+=100) {
+		CreateDeviceNames(&wanted, k);
+		for (ULONG n=0; n<nTableDevices; n++)
+			if (pExts[n].ustrDeviceName.EqualsNoCase(wanted.ustrDeviceName))
+				break;
+	}
+	clock_t walkLookup = (clock() - start) * 100;
+	wanted.ustrDeviceName.Free();
+	wanted.ustrSymLinkName.Free();
+
+	start = clock();
+	for (ULONG n=0; n<nTableDevices; n++) {
+		ULONG victim = (n * nStride) % nTableDevices;
+		DevTableRemove(&devTable, &pExts[victim].tableEntry);
+		pExts[victim].tableEntry.pDevice = NULL;	// marks it removed
+		if (n == nTableDevices/2) {	// half gone - the rest must still be found
+			clock_t checkStart = clock();
+			for (ULONG m=0; m<nTableDevices; m++)
+				if ((DevTableLookupSymLink(&devTable, pExts[m].ustrSymLinkName) == NULL) !=
+					(pExts[m].tableEntry.pDevice == NULL))
+					nFailures++;
+			start += clock() - checkStart;
+		}
+	}
+	clock_t tableRemove = clock() - start;
+	if (devTable.Count != 0 || DevTableLookupNumber(&devTable, 0) != NULL)
+		nFailures++;
+	DevTableDestroy(&devTable);
+	for (ULONG n=0; n<nTableDevices; n++) {
+		pExts[n].ustrSymLinkName.Free();
+		pExts[n].ustrDeviceName.Free();
+	}
+	free(pExts);
+	printf("Create %ld ms, 3 lookups each %ld ms, remove %ld ms\n",
+		tableCreate * 1000 / CLOCKS_PER_SEC, tableLookup * 1000 / CLOCKS_PER_SEC,
+		tableRemove * 1000 / CLOCKS_PER_SEC);
+	printf("Lookup by walking the list instead: ~%ld ms for 10000 names\n",
+		walkLookup * 1000 / CLOCKS_PER_SEC);
+
+	printf("Test of lookaside lists:\n");
+	const ULONG lookTag = 0x6B6F6F4C;	// 'Look'
+	NPAGED_LOOKASIDE_LIST lookaside;
+	PVOID pLookBlocks[40];
+	ExInitializeNPagedLookasideList(&lookaside, NULL, NULL, 0, 40, lookTag, 0);
+	for (int pass=0; pass<2; pass++) {	// the second pass is all hits
+		for (int i=0; i<40; i++)
+			pLookBlocks[i] = ExAllocateFromNPagedLookasideList(&lookaside);
+		for (int i=0; i<40; i++)
+			ExFreeToNPagedLookasideList(&lookaside, pLookBlocks[i]);
+	}
+	TestEnvDumpLookaside(&lookaside, "Look");
+	TestEnvQueryLookaside(&lookaside);
+	if (lookaside.TotalAllocates != 80 || lookaside.AllocateMisses != 40 ||
+		lookaside.TotalFrees != 80 || lookaside.FreeMisses != 0 ||
+		lookaside.CurrentDepth != 40 || lookaside.DepotCount != 24)
+		nFailures++;
+	ExDeleteNPagedLookasideList(&lookaside);
+	if (!TestEnvQueryPoolTag(lookTag, NonPagedPool, &tagStats) || tagStats.LiveAllocs != 0)
+		nFailures++;
+
+	printf("Benchmark of CUString buffers from lookaside lists:\n");
+	const ULONG nStrings = 1000000;
+	CUStringBuilder longName(CUSTRINGBUILDER_LITERAL("\\Device\\ThisNameIsMuchTooLongToBeStoredInline"));
+	CUString strEarly;
+	TestEnvQueryPoolTag(1633, PagedPool, &tagStats);
+	ULONG liveStrings = tagStats.LiveAllocs;
+	for (int lists=0; lists<2; lists++) {
+		if (lists) {
+			CUString::InitLookasides();
+			CUString strWarm(longName);		// the first one misses
+		}
+		allocs = TestEnvPoolAllocations;
+		start = clock();
+		for (ULONG n=0; n<nStrings; n++) {
+			CUString strLong(longName);
+			ulSum += strLong.Length();
+		}
+		clock_t elapsed = clock() - start;
+		allocs = TestEnvPoolAllocations - allocs;
+		printf("%s: %ld ms, %u pool allocations\n", lists ? "Lookaside" : "Pool     ",
+			elapsed * 1000 / CLOCKS_PER_SEC, allocs);
+		if (lists && allocs != 0)
+			nFailures++;
+	}
+	strEarly = CUString(longName);	// from a lookaside ...
+	strEarly += strEarly;			// ... then a bigger one
+	strEarly += strEarly;
+	CUString::DeleteLookasides();
+	strEarly.Free();				// ... back to the pool
+	TestEnvQueryPoolTag(1633, PagedPool, &tagStats);
+	if (tagStats.LiveAllocs != liveStrings)
+		nFailures++;	// every lookaside buffer went back
+
+	printf("Pool usage by tag:\n");
+	TestEnvDumpPoolTags();
 
-	return 0;
+	printf("%d test failure(s)\n", nFailures);
+	return nFailures;
 }
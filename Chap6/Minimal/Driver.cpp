@@ -84,8 +84,8 @@ NTSTATUS CreateDevice (
 	PDEVICE_EXTENSION pDevExt;
 	
 	// Form the internal Device Name
-	CUString devName("\\Device\\MINIMAL");	// for "minimal" device
-	devName += CUString(ulDeviceNumber);
+	CUString devName(	// for "minimal" device
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\Device\\MINIMAL")).Append(ulDeviceNumber) );
 
 	// Now create the device
 	status =
@@ -105,8 +105,8 @@ NTSTATUS CreateDevice (
 	pDevExt->ustrDeviceName = devName;
 
 	// Form the symbolic link name
-	CUString symLinkName("\\??\\MIN");
-	symLinkName += CUString(ulDeviceNumber+1);	// 1 based
+	CUString symLinkName(
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\??\\MIN")).Append(ulDeviceNumber+1) );	// 1 based
 	pDevExt->ustrSymLinkName = symLinkName;
 
 	// Now create the link name
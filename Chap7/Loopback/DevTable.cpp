@@ -0,0 +1,371 @@
+//
+// DevTable.cpp - Chapter 7 - Driver-wide device index
+//
+// Copyright (C) 2000 by Jerry Lozano
+//
+
+#ifdef WIN32DDK_TEST
+#include "DDKTestEnv.h"
+#else
+extern "C" {
+#include <NTDDK.h>
+}
+#endif
+
+#include "Unicode.h"
+#include "DevTable.h"
+
+#define DEVTABLE_POOL_TAG	1634
+#define DEVTABLE_MIN_SIZE	16
+
+// Which of the three indexes
+enum DEVTABLE_KEY {KeyNumber, KeyDeviceName, KeySymLink};
+
+// Spreads a key's hash over the index (Fibonacci hashing), so
+// that consecutive device numbers don't crowd together
+static ULONG HomeSlot(PDEVICE_TABLE pTable, ULONG hash) {
+	return (ULONG)(hash * (ULONG)0x9E3779B9) >> pTable->Shift;
+}
+
+static PDEVICE_TABLE_SLOT IndexOf(PDEVICE_TABLE pTable, int key) {
+	switch (key) {
+	case KeyNumber:		return pTable->pByNumber;
+	case KeyDeviceName:	return pTable->pByDeviceName;
+	default:			return pTable->pBySymLinkName;
+	}
+}
+
+// The entry's name for the key, or NULL (then it isn't indexed)
+static CUString* NameOf(PDEVICE_TABLE_ENTRY pEntry, int key) {
+	return (key == KeyDeviceName) ? pEntry->pDeviceName :
+		   (key == KeySymLink) ? pEntry->pSymLinkName : NULL;
+}
+
+static ULONG KeyHash(PDEVICE_TABLE_ENTRY pEntry, int key) {
+	return (key == KeyNumber) ? pEntry->DeviceNumber :
+		NameOf(pEntry, key)->Hash();
+}
+
+// Probes for the slot holding a key, NULL if it isn't there
+static PDEVICE_TABLE_SLOT FindSlot(
+		PDEVICE_TABLE pTable, int key, ULONG hash,
+		ULONG number, const CUString* pName ) {
+	PDEVICE_TABLE_SLOT pIndex = IndexOf(pTable, key);
+	ULONG mask = pTable->Size - 1;
+	for (ULONG i = HomeSlot(pTable, hash);
+			pIndex[i].pEntry != NULL; i = (i + 1) & mask) {
+		if (pIndex[i].Hash != hash)
+			continue;
+		if (key == KeyNumber ?
+				pIndex[i].pEntry->DeviceNumber == number :
+				NameOf(pIndex[i].pEntry, key)->EqualsNoCase(*pName))
+			return &pIndex[i];
+	}
+	return NULL;
+}
+
+static VOID PlaceEntry(
+		PDEVICE_TABLE pTable, int key, PDEVICE_TABLE_ENTRY pEntry ) {
+	if (key != KeyNumber && NameOf(pEntry, key) == NULL)
+		return;
+	PDEVICE_TABLE_SLOT pIndex = IndexOf(pTable, key);
+	ULONG mask = pTable->Size - 1;
+	ULONG hash = KeyHash(pEntry, key);
+	ULONG i = HomeSlot(pTable, hash);
+	while (pIndex[i].pEntry != NULL)
+		i = (i + 1) & mask;
+	pIndex[i].Hash = hash;
+	pIndex[i].pEntry = pEntry;
+}
+
+// Takes an entry out of one index.  Rather than leave a marker
+// behind, later entries of the same probe run are shifted back
+// into the hole, so lookups never have to step over dead slots.
+static VOID VacateEntry(
+		PDEVICE_TABLE pTable, int key, PDEVICE_TABLE_ENTRY pEntry ) {
+	if (key != KeyNumber && NameOf(pEntry, key) == NULL)
+		return;
+	PDEVICE_TABLE_SLOT pIndex = IndexOf(pTable, key);
+	ULONG mask = pTable->Size - 1;
+	ULONG hole = HomeSlot(pTable, KeyHash(pEntry, key));
+	while (pIndex[hole].pEntry != pEntry) {
+		if (pIndex[hole].pEntry == NULL)
+			return;		// never inserted
+		hole = (hole + 1) & mask;
+	}
+	for (ULONG i = (hole + 1) & mask; pIndex[i].pEntry != NULL;
+			i = (i + 1) & mask) {
+		// Entry i may fill the hole unless its home slot lies
+		// between the hole and i
+		ULONG home = HomeSlot(pTable, pIndex[i].Hash);
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			pIndex[hole] = pIndex[i];
+			hole = i;
+		}
+	}
+	pIndex[hole].pEntry = NULL;
+}
+
+// Allocates (zeroed) indexes of the given size.  The previous
+// ones, if any, are left for the caller.
+static NTSTATUS AllocIndexes(PDEVICE_TABLE pTable, ULONG size) {
+	SIZE_T nBytes = 3 * size * sizeof(DEVICE_TABLE_SLOT);
+	PDEVICE_TABLE_SLOT pSlots = (PDEVICE_TABLE_SLOT)
+		ExAllocatePoolWithTag(PagedPool, nBytes, DEVTABLE_POOL_TAG);
+	if (pSlots == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	RtlZeroMemory(pSlots, nBytes);
+
+	ULONG bits = 0;
+	while ((1UL << bits) < size)
+		bits++;
+	pTable->Shift = 32 - bits;
+	pTable->Size = size;
+	pTable->pByNumber = pSlots;
+	pTable->pByDeviceName = pSlots + size;
+	pTable->pBySymLinkName = pSlots + 2 * size;
+	return STATUS_SUCCESS;
+}
+
+// Doubles the indexes and rehashes every entry into them
+static NTSTATUS Grow(PDEVICE_TABLE pTable) {
+	PDEVICE_TABLE_SLOT pOld = pTable->pByNumber;
+	ULONG oldSize = pTable->Size;
+	NTSTATUS status = AllocIndexes(pTable, oldSize * 2);
+	if (!NT_SUCCESS(status))
+		return status;
+	for (ULONG i = 0; i < oldSize; i++) {
+		if (pOld[i].pEntry == NULL)
+			continue;
+		PlaceEntry(pTable, KeyNumber, pOld[i].pEntry);
+		PlaceEntry(pTable, KeyDeviceName, pOld[i].pEntry);
+		PlaceEntry(pTable, KeySymLink, pOld[i].pEntry);
+	}
+	ExFreePool(pOld);
+	return STATUS_SUCCESS;
+}
+
+static VOID LockShared(PDEVICE_TABLE pTable) {
+	KeEnterCriticalRegion();	// no suspension while holding it
+	ExAcquireResourceSharedLite(&pTable->Lock, TRUE);
+}
+
+static VOID LockExclusive(PDEVICE_TABLE pTable) {
+	KeEnterCriticalRegion();
+	ExAcquireResourceExclusiveLite(&pTable->Lock, TRUE);
+}
+
+static VOID Unlock(PDEVICE_TABLE pTable) {
+	ExReleaseResourceLite(&pTable->Lock);
+	KeLeaveCriticalRegion();
+}
+
+//++
+// Function:	DevTableInitialize
+//
+// Description:
+//		Sets up an empty device table
+//
+// Arguments:
+//		pTable - Table (in nonpaged memory) to set up
+//		ExpectedCount - Devices to make room for up front;
+//						the table grows past this as needed
+//
+// Return value:
+//		NTSTATUS signaling success or failure
+//--
+NTSTATUS DevTableInitialize(
+		IN PDEVICE_TABLE	pTable,
+		IN ULONG			ExpectedCount	) {
+	ULONG size = DEVTABLE_MIN_SIZE;
+	while (size < ExpectedCount * 2 && size < 0x40000000)
+		size *= 2;
+
+	pTable->Count = 0;
+	NTSTATUS status = AllocIndexes(pTable, size);
+	if (!NT_SUCCESS(status))
+		return status;
+	status = ExInitializeResourceLite(&pTable->Lock);
+	if (!NT_SUCCESS(status)) {
+		ExFreePool(pTable->pByNumber);
+		pTable->pByNumber = NULL;
+	}
+	return status;
+}
+
+//++
+// Function:	DevTableDestroy
+//
+// Description:
+//		Releases the table's indexes and lock.  Entries still
+//		in the table are simply forgotten.
+//
+// Arguments:
+//		pTable - Table set up by DevTableInitialize
+//
+// Return value:
+//		None
+//--
+VOID DevTableDestroy(
+		IN PDEVICE_TABLE	pTable			) {
+	if (pTable->pByNumber == NULL)
+		return;
+	ExFreePool(pTable->pByNumber);
+	pTable->pByNumber = pTable->pByDeviceName =
+		pTable->pBySymLinkName = NULL;
+	pTable->Size = pTable->Count = 0;
+	ExDeleteResourceLite(&pTable->Lock);
+}
+
+//++
+// Function:	DevTableInsert
+//
+// Description:
+//		Registers a device under its number and names
+//
+// Arguments:
+//		pTable - Table set up by DevTableInitialize
+//		pEntry - Filled-in entry, usually part of the
+//				 Device Extension
+//
+// Return value:
+//		STATUS_OBJECT_NAME_COLLISION if the number or either
+//		name is already registered, else success or failure
+//		to make room
+//--
+NTSTATUS DevTableInsert(
+		IN PDEVICE_TABLE	pTable,
+		IN PDEVICE_TABLE_ENTRY pEntry		) {
+	NTSTATUS status = STATUS_SUCCESS;
+	// Hash the names before taking the lock
+	if (pEntry->pDeviceName != NULL)
+		pEntry->pDeviceName->Hash();
+	if (pEntry->pSymLinkName != NULL)
+		pEntry->pSymLinkName->Hash();
+
+	LockExclusive(pTable);
+	if (FindSlot(pTable, KeyNumber, pEntry->DeviceNumber,
+				 pEntry->DeviceNumber, NULL) != NULL ||
+		(pEntry->pDeviceName != NULL &&
+		 FindSlot(pTable, KeyDeviceName, pEntry->pDeviceName->Hash(),
+				  0, pEntry->pDeviceName) != NULL) ||
+		(pEntry->pSymLinkName != NULL &&
+		 FindSlot(pTable, KeySymLink, pEntry->pSymLinkName->Hash(),
+				  0, pEntry->pSymLinkName) != NULL))
+		status = STATUS_OBJECT_NAME_COLLISION;
+	else if ((pTable->Count + 1) * 2 > pTable->Size)
+		status = Grow(pTable);	// keep every index at most half full
+
+	if (NT_SUCCESS(status)) {
+		PlaceEntry(pTable, KeyNumber, pEntry);
+		PlaceEntry(pTable, KeyDeviceName, pEntry);
+		PlaceEntry(pTable, KeySymLink, pEntry);
+		pTable->Count++;
+	}
+	Unlock(pTable);
+	return status;
+}
+
+//++
+// Function:	DevTableRemove
+//
+// Description:
+//		Unregisters a device - before its Device Extension
+//		(holding the entry) goes away
+//
+// Arguments:
+//		pTable - Table set up by DevTableInitialize
+//		pEntry - Entry passed to DevTableInsert
+//
+// Return value:
+//		None
+//--
+VOID DevTableRemove(
+		IN PDEVICE_TABLE	pTable,
+		IN PDEVICE_TABLE_ENTRY pEntry		) {
+	LockExclusive(pTable);
+	if (FindSlot(pTable, KeyNumber, pEntry->DeviceNumber,
+				 pEntry->DeviceNumber, NULL) != NULL) {
+		VacateEntry(pTable, KeyNumber, pEntry);
+		VacateEntry(pTable, KeyDeviceName, pEntry);
+		VacateEntry(pTable, KeySymLink, pEntry);
+		pTable->Count--;
+	}
+	Unlock(pTable);
+}
+
+//++
+// Function:	DevTableLookupNumber
+//
+// Description:
+//		Finds a device by its (zero-based) device number
+//
+// Arguments:
+//		pTable - Table set up by DevTableInitialize
+//		DeviceNumber - Number the device was inserted with
+//
+// Return value:
+//		Device object, or NULL if there's none
+//--
+PDEVICE_OBJECT DevTableLookupNumber(
+		IN PDEVICE_TABLE	pTable,
+		IN ULONG			DeviceNumber	) {
+	PDEVICE_OBJECT pDevObj = NULL;
+	LockShared(pTable);
+	PDEVICE_TABLE_SLOT pSlot =
+		FindSlot(pTable, KeyNumber, DeviceNumber, DeviceNumber, NULL);
+	if (pSlot != NULL)
+		pDevObj = pSlot->pEntry->pDevice;
+	Unlock(pTable);
+	return pDevObj;
+}
+
+static PDEVICE_OBJECT LookupName(
+		PDEVICE_TABLE pTable, int key, const CUString& name ) {
+	PDEVICE_OBJECT pDevObj = NULL;
+	ULONG hash = name.Hash();	// computed outside the lock
+	LockShared(pTable);
+	PDEVICE_TABLE_SLOT pSlot = FindSlot(pTable, key, hash, 0, &name);
+	if (pSlot != NULL)
+		pDevObj = pSlot->pEntry->pDevice;
+	Unlock(pTable);
+	return pDevObj;
+}
+
+//++
+// Function:	DevTableLookupDeviceName
+//
+// Description:
+//		Finds a device by its internal name, ignoring case
+//
+// Arguments:
+//		pTable - Table set up by DevTableInitialize
+//		DeviceName - e.g. \Device\LOOPBACK0
+//
+// Return value:
+//		Device object, or NULL if there's none
+//--
+PDEVICE_OBJECT DevTableLookupDeviceName(
+		IN PDEVICE_TABLE	pTable,
+		IN const CUString&	DeviceName		) {
+	return LookupName(pTable, KeyDeviceName, DeviceName);
+}
+
+//++
+// Function:	DevTableLookupSymLink
+//
+// Description:
+//		Finds a device by its symbolic link name, ignoring case
+//
+// Arguments:
+//		pTable - Table set up by DevTableInitialize
+//		SymLinkName - e.g. \??\LBK1
+//
+// Return value:
+//		Device object, or NULL if there's none
+//--
+PDEVICE_OBJECT DevTableLookupSymLink(
+		IN PDEVICE_TABLE	pTable,
+		IN const CUString&	SymLinkName		) {
+	return LookupName(pTable, KeySymLink, SymLinkName);
+}
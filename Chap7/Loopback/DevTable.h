@@ -0,0 +1,73 @@
+// DevTable.h - Chapter 7 - Driver-wide device index
+//
+// Copyright (C) 2000 by Jerry Lozano
+//
+// Finds a driver's devices by number, device name or symbolic
+// link name in O(1), rather than by walking the driver object's
+// DeviceObject/NextDevice list.  Include NTDDK.h and Unicode.h
+// first.
+//
+
+#pragma once
+
+// Each device embeds one of these (in its Device Extension) and
+// registers it with DevTableInsert.  The names are not copied:
+// they must stay put, and unchanged, until DevTableRemove.
+typedef struct _DEVICE_TABLE_ENTRY {
+	PDEVICE_OBJECT pDevice;
+	ULONG DeviceNumber;
+	CUString* pDeviceName;		// e.g. \Device\LOOPBACK0
+	CUString* pSymLinkName;		// e.g. \??\LBK1
+} DEVICE_TABLE_ENTRY, *PDEVICE_TABLE_ENTRY;
+
+// One slot of an index.  The key's hash is kept alongside the
+// entry so that probing past other keys never touches them.
+typedef struct _DEVICE_TABLE_SLOT {
+	ULONG Hash;
+	PDEVICE_TABLE_ENTRY pEntry;	// NULL if the slot is free
+} DEVICE_TABLE_SLOT, *PDEVICE_TABLE_SLOT;
+
+// Three open-addressing (linear probing) indexes over the same
+// entries, kept at most half full.  Readers share the ERESOURCE,
+// inserts and removals take it exclusively.  Must live in
+// nonpaged memory (a global will do); all the DevTable routines
+// run at IRQL < DISPATCH_LEVEL.
+typedef struct _DEVICE_TABLE {
+	ERESOURCE Lock;
+	ULONG Shift;				// 32 - log2(Size)
+	ULONG Size;					// slots per index, a power of 2
+	ULONG Count;				// entries
+	PDEVICE_TABLE_SLOT pByNumber;
+	PDEVICE_TABLE_SLOT pByDeviceName;
+	PDEVICE_TABLE_SLOT pBySymLinkName;
+} DEVICE_TABLE, *PDEVICE_TABLE;
+
+NTSTATUS DevTableInitialize(
+		IN PDEVICE_TABLE	pTable,
+		IN ULONG			ExpectedCount	);
+
+VOID DevTableDestroy(
+		IN PDEVICE_TABLE	pTable			);
+
+NTSTATUS DevTableInsert(
+		IN PDEVICE_TABLE	pTable,
+		IN PDEVICE_TABLE_ENTRY pEntry		);
+
+VOID DevTableRemove(
+		IN PDEVICE_TABLE	pTable,
+		IN PDEVICE_TABLE_ENTRY pEntry		);
+
+// Lookups return NULL if there's no such device.  The device
+// object stays valid only as long as the caller keeps it from
+// being removed.
+PDEVICE_OBJECT DevTableLookupNumber(
+		IN PDEVICE_TABLE	pTable,
+		IN ULONG			DeviceNumber	);
+
+PDEVICE_OBJECT DevTableLookupDeviceName(
+		IN PDEVICE_TABLE	pTable,
+		IN const CUString&	DeviceName		);	// case-insensitive
+
+PDEVICE_OBJECT DevTableLookupSymLink(
+		IN PDEVICE_TABLE	pTable,
+		IN const CUString&	SymLinkName		);	// case-insensitive
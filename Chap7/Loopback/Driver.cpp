@@ -6,8 +6,28 @@
 
 #include "Driver.h"
 
+// Every device of this driver, by number and by name
+static DEVICE_TABLE DeviceTable;
+
+// Bytes of FIFO per device (see QueryParameters)
+static ULONG RingSize = LOOPBACK_DEFAULT_BUFFER;
+// Nonzero for direct I/O (MDLs) rather than buffered I/O
+static ULONG DirectIo = 0;
+// Devices to create
+static ULONG DeviceCount = LOOPBACK_DEFAULT_DEVICES;
+// Bytes of channel memory each device allows
+static ULONG MemoryLimit = LOOPBACK_DEFAULT_MEMORY_LIMIT;
+
+#define CHANNEL_POOL_TAG	1636
+
+// Small IOCTL_LOOPBACK_READ/WRITEs on synchronous handles skip the IRP
+static FAST_IO_DISPATCH FastIoDispatch;
+
 // Forward declarations
 //
+static VOID QueryParameters (
+		IN PUNICODE_STRING	pRegistryPath	);
+
 static NTSTATUS CreateDevice (
 		IN PDRIVER_OBJECT	pDriverObject,
 		IN ULONG			DeviceNumber	);
@@ -15,6 +35,9 @@ static NTSTATUS CreateDevice (
 static VOID DriverUnload (
 		IN PDRIVER_OBJECT	pDriverObject	);
 
+static VOID DeleteDevices (
+		IN PDRIVER_OBJECT	pDriverObject	);
+
 static NTSTATUS DispatchCreate (
 		IN PDEVICE_OBJECT	pDevObj,
 		IN PIRP				pIrp			);
@@ -23,14 +46,111 @@ static NTSTATUS DispatchClose (
 		IN PDEVICE_OBJECT	pDevObj,
 		IN PIRP				pIrp			);
 
+static NTSTATUS DispatchCleanup (
+		IN PDEVICE_OBJECT	pDevObj,
+		IN PIRP				pIrp			);
+
 static NTSTATUS DispatchWrite (
 		IN PDEVICE_OBJECT	pDevObj,
 		IN PIRP				pIrp			);
 
+static ULONG ChannelWrite (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		IN const VOID*		pData,
+		IN ULONG			length,
+		IN PLIST_ENTRY		pSatisfied		);
+
+static VOID CompleteReads (
+		IN PLIST_ENTRY		pSatisfied		);
+
+static ULONG ChannelRead (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		OUT PVOID			pBuffer,
+		IN ULONG			length,
+		OUT PNTSTATUS		pStatus			);
+
+static BOOLEAN ChargeMemory (
+		IN PDEVICE_EXTENSION	pDevExt,
+		IN ULONG			bytes			);
+
+static VOID UnchargeMemory (
+		IN PDEVICE_EXTENSION	pDevExt,
+		IN ULONG			bytes			);
+
 static NTSTATUS DispatchRead (
 		IN PDEVICE_OBJECT	pDevObj,
 		IN PIRP				pIrp			);
 
+static NTSTATUS WriteChannel (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		IN const VOID*		pData,
+		IN ULONG			length,
+		OUT PULONG			pXferSize		);
+
+static NTSTATUS ReadChannel (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		IN PIRP				pIrp,
+		OUT PVOID			pBuffer,
+		IN ULONG			length,
+		OUT PULONG			pXferSize		);
+
+static BOOLEAN FastIoDeviceControl (
+		IN PFILE_OBJECT		pFileObject,
+		IN BOOLEAN			bWait,
+		IN PVOID			pInBuffer,
+		IN ULONG			inLength,
+		OUT PVOID			pOutBuffer,
+		IN ULONG			outLength,
+		IN ULONG			ioControlCode,
+		OUT PIO_STATUS_BLOCK	pIoStatus,
+		IN PDEVICE_OBJECT	pDevObj			);
+
+static BOOLEAN FastIoWrite (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		IN PVOID			pBuffer,
+		IN ULONG			length,
+		OUT PIO_STATUS_BLOCK	pIoStatus		);
+
+static BOOLEAN FastIoRead (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		OUT PVOID			pBuffer,
+		IN ULONG			length,
+		OUT PIO_STATUS_BLOCK	pIoStatus		);
+
+static NTSTATUS DispatchDeviceControl (
+		IN PDEVICE_OBJECT	pDevObj,
+		IN PIRP				pIrp			);
+
+static NTSTATUS MapSharedRing (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		IN PIRP				pIrp			);
+
+static NTSTATUS WriteVector (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		IN PIRP				pIrp,
+		OUT PULONG			pXferSize		);
+
+static NTSTATUS ReadVector (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		IN PIRP				pIrp,
+		OUT PULONG			pXferSize		);
+
+static VOID FreeSharedRing (
+		IN PMDL				pMdl,
+		IN PLOOPBACK_SHARED_RING	pRing,
+		IN PVOID			pUserVa,
+		IN PKEVENT			pEvent			);
+
+static VOID UnmapSharedView (
+		IN PLOOPBACK_CHANNEL	pChannel		);
+
+static VOID CancelRead (
+		IN PDEVICE_OBJECT	pDevObj,
+		IN PIRP				pIrp			);
+
+static PVOID GetTransferBuffer (
+		IN PIRP				pIrp			);
+
 
 //++
 // Function:	DriverEntry
@@ -52,7 +172,7 @@ static NTSTATUS DispatchRead (
 extern "C" NTSTATUS DriverEntry (
 			IN PDRIVER_OBJECT pDriverObject,
 			IN PUNICODE_STRING pRegistryPath	) {
-	ULONG ulDeviceNumber = 0;
+	ULONG ulDeviceNumber;
 	NTSTATUS status;
 
 	// If this driver controlled real hardware,
@@ -69,24 +189,148 @@ extern "C" NTSTATUS DriverEntry (
 				DispatchCreate;
 	pDriverObject->MajorFunction[IRP_MJ_CLOSE] =
 				DispatchClose;
+	pDriverObject->MajorFunction[IRP_MJ_CLEANUP] =
+				DispatchCleanup;
 	pDriverObject->MajorFunction[IRP_MJ_WRITE] =
 				DispatchWrite;
 	pDriverObject->MajorFunction[IRP_MJ_READ] =
 				DispatchRead;
+	// ... and for the shared-memory ring's controls
+	pDriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] =
+				DispatchDeviceControl;
+	// ... and the fast I/O path for small IOCTL_LOOPBACK_READs
+	// and WRITEs (see LoopbackIoctl.h)
+	FastIoDispatch.SizeOfFastIoDispatch = sizeof(FAST_IO_DISPATCH);
+	FastIoDispatch.FastIoDeviceControl = FastIoDeviceControl;
+	pDriverObject->FastIoDispatch = &FastIoDispatch;
+
+	// Pick up the FIFO size and device count before any
+	// device needs them
+	QueryParameters(pRegistryPath);
+
+	// Longer strings get their buffers from lookaside lists
+	CUString::InitLookasides();
+
+	status = DevTableInitialize(&DeviceTable, DeviceCount);
+	if (!NT_SUCCESS(status)) {
+		CUString::DeleteLookasides();
+		return status;
+	}
 	
 	// For each physical or logical device detected
 	// that will be under this Driver's control,
-	// a new Device object must be created.
-	status =
-		CreateDevice(pDriverObject, ulDeviceNumber);
-	// This call would be repeated until all devices are created
-	//ulDeviceNumber++;
-	//status =
-	//	CreateDevice(pDriverObject, ulDeviceNumber);
+	// a new Device object must be created.  Each handle
+	// gets a channel of its own, whichever device it's
+	// on, so the devices share no lock and no buffer.
+	status = STATUS_SUCCESS;
+	for (ulDeviceNumber = 0;
+		 ulDeviceNumber < DeviceCount && NT_SUCCESS(status);
+		 ulDeviceNumber++)
+		status =
+			CreateDevice(pDriverObject, ulDeviceNumber);
 
+	// DriverUnload won't be called if DriverEntry fails,
+	// so the devices made so far go now
+	if (!NT_SUCCESS(status)) {
+		DeleteDevices(pDriverObject);
+		DevTableDestroy(&DeviceTable);
+		CUString::DeleteLookasides();
+	}
 	return status;
 }
 
+//++
+// Function:	QueryParameters
+//
+// Description:
+//		Reads the BufferSize, DirectIo, DeviceCount and
+//		MemoryLimit values from the Parameters subkey of
+//		the driver's own service key into the globals of
+//		the same names (RingSize for BufferSize).  Missing
+//		values leave the defaults; sizes and counts are
+//		kept in range.
+//
+// Arguments:
+//		pRegistryPath - the service key, as passed
+//						to DriverEntry
+//
+// Return value:
+//		None
+//--
+VOID QueryParameters (
+		IN PUNICODE_STRING	pRegistryPath	) {
+	RTL_QUERY_REGISTRY_TABLE QueryTable[6];
+	ULONG bufferSize = LOOPBACK_DEFAULT_BUFFER;
+	ULONG defaultSize = LOOPBACK_DEFAULT_BUFFER;
+	ULONG directIo = 0;
+	ULONG defaultDirectIo = 0;
+	ULONG deviceCount = LOOPBACK_DEFAULT_DEVICES;
+	ULONG defaultCount = LOOPBACK_DEFAULT_DEVICES;
+	ULONG memoryLimit = LOOPBACK_DEFAULT_MEMORY_LIMIT;
+	ULONG defaultLimit = LOOPBACK_DEFAULT_MEMORY_LIMIT;
+
+	RtlZeroMemory( QueryTable, sizeof( QueryTable ));
+
+	// The values live under <service key>\Parameters
+	QueryTable[0].Name	= (PWSTR) L"Parameters";
+	QueryTable[0].Flags	= RTL_QUERY_REGISTRY_SUBKEY;
+
+	QueryTable[1].Name	= (PWSTR) L"BufferSize";
+	QueryTable[1].Flags	= RTL_QUERY_REGISTRY_DIRECT;
+	QueryTable[1].EntryContext = &bufferSize;
+	QueryTable[1].DefaultType = REG_DWORD;
+	QueryTable[1].DefaultData = &defaultSize;
+	QueryTable[1].DefaultLength = sizeof(ULONG);
+
+	QueryTable[2].Name	= (PWSTR) L"DirectIo";
+	QueryTable[2].Flags	= RTL_QUERY_REGISTRY_DIRECT;
+	QueryTable[2].EntryContext = &directIo;
+	QueryTable[2].DefaultType = REG_DWORD;
+	QueryTable[2].DefaultData = &defaultDirectIo;
+	QueryTable[2].DefaultLength = sizeof(ULONG);
+
+	QueryTable[3].Name	= (PWSTR) L"DeviceCount";
+	QueryTable[3].Flags	= RTL_QUERY_REGISTRY_DIRECT;
+	QueryTable[3].EntryContext = &deviceCount;
+	QueryTable[3].DefaultType = REG_DWORD;
+	QueryTable[3].DefaultData = &defaultCount;
+	QueryTable[3].DefaultLength = sizeof(ULONG);
+
+	QueryTable[4].Name	= (PWSTR) L"MemoryLimit";
+	QueryTable[4].Flags	= RTL_QUERY_REGISTRY_DIRECT;
+	QueryTable[4].EntryContext = &memoryLimit;
+	QueryTable[4].DefaultType = REG_DWORD;
+	QueryTable[4].DefaultData = &defaultLimit;
+	QueryTable[4].DefaultLength = sizeof(ULONG);
+
+	if (!NT_SUCCESS(
+			RtlQueryRegistryValues(
+					RTL_REGISTRY_ABSOLUTE,
+					pRegistryPath->Buffer,
+					QueryTable,
+					NULL, NULL ))) {
+		bufferSize = LOOPBACK_DEFAULT_BUFFER;
+		directIo = 0;
+		deviceCount = LOOPBACK_DEFAULT_DEVICES;
+		memoryLimit = LOOPBACK_DEFAULT_MEMORY_LIMIT;
+	}
+
+	if (bufferSize < LOOPBACK_MIN_BUFFER)
+		bufferSize = LOOPBACK_MIN_BUFFER;
+	if (bufferSize > LOOPBACK_MAX_BUFFER)
+		bufferSize = LOOPBACK_MAX_BUFFER;
+	RingSize = bufferSize;
+	DirectIo = directIo;
+	if (deviceCount < 1)
+		deviceCount = 1;
+	if (deviceCount > LOOPBACK_MAX_DEVICES)
+		deviceCount = LOOPBACK_MAX_DEVICES;
+	DeviceCount = deviceCount;
+	if (memoryLimit < bufferSize)
+		memoryLimit = bufferSize;
+	MemoryLimit = memoryLimit;
+}
+
 //++
 // Function:	CreateDevice
 //
@@ -109,22 +353,23 @@ NTSTATUS CreateDevice (
 	PDEVICE_EXTENSION pDevExt;
 	
 	// Form the internal Device Name
-	CUString devName("\\Device\\LOOPBACK");	// for "loopback" device
-	devName += CUString(ulDeviceNumber);
+	CUString devName(	// for "loopback" device
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\Device\\LOOPBACK")).Append(ulDeviceNumber) );
 
 	// Now create the device
 	status =
 		IoCreateDevice( pDriverObject,
 						sizeof(DEVICE_EXTENSION),
-						&(UNICODE_STRING)devName,
+						&(UNICODE_STRING&)devName,
 						FILE_DEVICE_UNKNOWN,
-						0, TRUE,
+						0, FALSE,	// any number of clients
 						&pDevObj );
 	if (!NT_SUCCESS(status))
 		return status;
 
-	// Announce that we will be working with a copy of the user's buffer
-	pDevObj->Flags |= DO_BUFFERED_IO;
+	// Announce that we will be working with a copy of the user's
+	// buffer - or, for direct I/O, with the user's pages themselves
+	pDevObj->Flags |= DirectIo ? DO_DIRECT_IO : DO_BUFFERED_IO;
 
 	// Initialize the Device Extension
 	pDevExt = (PDEVICE_EXTENSION)pDevObj->DeviceExtension;
@@ -132,24 +377,36 @@ NTSTATUS CreateDevice (
 	pDevExt->pDevice = pDevObj;	// back pointer
 	pDevExt->DeviceNumber = ulDeviceNumber;
 	pDevExt->ustrDeviceName = devName;
-	pDevExt->deviceBuffer = NULL;
-	pDevExt->deviceBufferSize = 0;
+	KeInitializeSpinLock( &pDevExt->lkMemory );
+	pDevExt->MemoryCharged = 0;
 
 	// Form the symbolic link name
-	CUString symLinkName("\\??\\LBK");
-	symLinkName += CUString(ulDeviceNumber+1);	// 1 based
+	CUString symLinkName(
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\??\\LBK")).Append(ulDeviceNumber+1) );	// 1 based
 	pDevExt->ustrSymLinkName = symLinkName;
 
 	// Now create the link name
 	status = 
-		IoCreateSymbolicLink( &(UNICODE_STRING)symLinkName,
-							  &(UNICODE_STRING)devName );
+		IoCreateSymbolicLink( &(UNICODE_STRING&)symLinkName,
+							  &(UNICODE_STRING&)devName );
 	if (!NT_SUCCESS(status)) {
 		// if it fails now, must delete Device object
 		IoDeleteDevice( pDevObj );
 		return status;
 	}
 
+	// Register the device under its number and both names
+	pDevExt->tableEntry.pDevice = pDevObj;
+	pDevExt->tableEntry.DeviceNumber = ulDeviceNumber;
+	pDevExt->tableEntry.pDeviceName = &pDevExt->ustrDeviceName;
+	pDevExt->tableEntry.pSymLinkName = &pDevExt->ustrSymLinkName;
+	status = DevTableInsert(&DeviceTable, &pDevExt->tableEntry);
+	if (!NT_SUCCESS(status)) {
+		IoDeleteSymbolicLink( &(UNICODE_STRING&)symLinkName );
+		IoDeleteDevice( pDevObj );
+		return status;
+	}
+
 	// Made it
 	return STATUS_SUCCESS;
 }
@@ -172,41 +429,68 @@ NTSTATUS CreateDevice (
 VOID DriverUnload (
 		IN PDRIVER_OBJECT	pDriverObject	) {
 
-	PDEVICE_OBJECT	pNextObj;
+	DeleteDevices(pDriverObject);
+	DevTableDestroy(&DeviceTable);
+	CUString::DeleteLookasides();
+	// Finally, hardware that was allocated in DriverEntry
+	// would be released here using
+	// IoReportResourceUsage
+}
+
+//++
+// Function:	DeleteDevices
+//
+// Description:
+//		Deletes every device of the driver, finding
+//		each by number in the device table: first all
+//		of their names, so that no device can be found
+//		(opened, or looked up in the device table) while
+//		the others go, then the devices themselves
+//
+// Arguments:
+//		pDriverObject - Passed from I/O Manager
+//
+// Return value:
+//		None
+//--
+
+VOID DeleteDevices (
+		IN PDRIVER_OBJECT	pDriverObject	) {
+
+	ULONG ulDeviceNumber;
+	PDEVICE_OBJECT pDevObj;
 
-	// Loop through each device controlled by Driver
-	pNextObj = pDriverObject->DeviceObject;
-	while (pNextObj != NULL) {
+	// DriverEntry may have stopped short, so not every
+	// number need have a device
+	for (ulDeviceNumber = 0; ulDeviceNumber < DeviceCount;
+		 ulDeviceNumber++) {
+		pDevObj = DevTableLookupNumber(&DeviceTable, ulDeviceNumber);
+		if (pDevObj == NULL)
+			continue;
 		// Dig out the Device Extension from the
 		// Device Object
 		PDEVICE_EXTENSION pDevExt = (PDEVICE_EXTENSION)
-			pNextObj->DeviceExtension;
-		// Free up any buffer still held by this device
-		if (pDevExt->deviceBuffer != NULL) {
-			ExFreePool(pDevExt->deviceBuffer);
-			pDevExt->deviceBuffer = NULL;
-			pDevExt->deviceBufferSize = 0;
-		}
+			pDevObj->DeviceExtension;
 		// DevExt also holds the symbolic link name
 		UNICODE_STRING pLinkName =
 			pDevExt->ustrSymLinkName;
 		// ... which can now be deleted
 		IoDeleteSymbolicLink(&pLinkName);
-		// a little trickery... 
-		// we need to delete the device object, BUT
-		// the Device object is pointed to by pNextObj
-		// If we delete the device object first,
-		// we can't traverse to the next Device in the list
-		// Rather than create another pointer, we can
-		// use the DeviceExtension's back pointer to the device
-		// So, first update the next pointer...
-		pNextObj = pNextObj->NextDevice;
-		// then delete the device using the Extension
-		IoDeleteDevice( pDevExt->pDevice );
 	}
-	// Finally, hardware that was allocated in DriverEntry
-	// would be released here using
-	// IoReportResourceUsage
+
+	// Now loop again, deleting them
+	for (ulDeviceNumber = 0; ulDeviceNumber < DeviceCount;
+		 ulDeviceNumber++) {
+		pDevObj = DevTableLookupNumber(&DeviceTable, ulDeviceNumber);
+		if (pDevObj == NULL)
+			continue;
+		PDEVICE_EXTENSION pDevExt = (PDEVICE_EXTENSION)
+			pDevObj->DeviceExtension;
+		// The table points into the Device Extension,
+		// so the device must leave it before it is deleted
+		DevTableRemove(&DeviceTable, &pDevExt->tableEntry);
+		IoDeleteDevice( pDevObj );
+	}
 }
 
 //++
@@ -214,7 +498,9 @@ VOID DriverUnload (
 //
 // Description:
 //		Handles call from Win32 CreateFile request
-//		For loopback driver, does nothing
+//		For loopback driver, sets up the new handle's
+//			channel, with its own FIFO - unless the
+//			device's MemoryLimit is used up
 //
 // Arguments:
 //		pDevObj - Passed from I/O Manager
@@ -228,10 +514,40 @@ NTSTATUS DispatchCreate (
 		IN PDEVICE_OBJECT	pDevObj,
 		IN PIRP				pIrp			) {
 
-	pIrp->IoStatus.Status = STATUS_SUCCESS;
+	NTSTATUS status = STATUS_SUCCESS;
+	PIO_STACK_LOCATION pIrpStack =
+		IoGetCurrentIrpStackLocation( pIrp );
+	PDEVICE_EXTENSION pDevExt = (PDEVICE_EXTENSION)
+		pDevObj->DeviceExtension;
+	PLOOPBACK_CHANNEL pChannel = NULL;
+	// The FIFO counts against the device's limit
+	if (ChargeMemory( pDevExt, RingSize )) {
+		pChannel = (PLOOPBACK_CHANNEL)
+			ExAllocatePoolWithTag( NonPagedPool, sizeof(LOOPBACK_CHANNEL),
+								   CHANNEL_POOL_TAG );
+		if (pChannel == NULL)
+			UnchargeMemory( pDevExt, RingSize );
+	}
+	if (pChannel == NULL)
+		status = STATUS_INSUFFICIENT_RESOURCES;
+	else {
+		// The FIFO is allocated now, once - writes only copy into it
+		RtlZeroMemory( pChannel, sizeof(LOOPBACK_CHANNEL) );
+		pChannel->pDevExt = pDevExt;
+		KeInitializeSpinLock( &pChannel->lkRing );
+		InitializeListHead( &pChannel->pendingReads );
+		status = RingInitialize( &pChannel->ring, RingSize );
+		if (!NT_SUCCESS(status)) {
+			ExFreePool( pChannel );
+			UnchargeMemory( pDevExt, RingSize );
+		} else
+			pIrpStack->FileObject->FsContext = pChannel;
+	}
+
+	pIrp->IoStatus.Status = status;
 	pIrp->IoStatus.Information = 0;	// no bytes xfered
 	IoCompleteRequest( pIrp, IO_NO_INCREMENT );
-	return STATUS_SUCCESS;
+	return status;
 }
 
 //++
@@ -239,7 +555,9 @@ NTSTATUS DispatchCreate (
 //
 // Description:
 //		Handles call from Win32 CreateHandle request
-//		For loopback driver, frees any buffer
+//		For loopback driver, frees the handle's channel
+//			and any data left in it, and its shared-memory
+//			ring's pages (their user view is gone first)
 //
 // Arguments:
 //		pDevObj - Passed from I/O Manager
@@ -252,28 +570,156 @@ NTSTATUS DispatchCreate (
 NTSTATUS DispatchClose (
 		IN PDEVICE_OBJECT	pDevObj,
 		IN PIRP				pIrp			) {
-	
-	// Dig out the Device Extension from the Device object
-	PDEVICE_EXTENSION pDevExt = (PDEVICE_EXTENSION)
-		pDevObj->DeviceExtension;
-	if (pDevExt->deviceBuffer != NULL) {
-		ExFreePool(pDevExt->deviceBuffer);
-		pDevExt->deviceBuffer = NULL;
-		pDevExt->deviceBufferSize = 0;
-	}
+
+	// Cleanup has been and the last IRP is done, so
+	// nothing else can be using the channel
+	PLOOPBACK_CHANNEL pChannel = ChannelOf( pIrp );
+	UnmapSharedView( pChannel );	// in case a map beat cleanup
+	if (pChannel->pSharedMdl != NULL)
+		FreeSharedRing( pChannel->pSharedMdl, pChannel->pSharedRing,
+						NULL, pChannel->pSharedEvent );
+	UnchargeMemory( pChannel->pDevExt,
+					pChannel->ring.Size + pChannel->SharedCharge );
+	RingFree( &pChannel->ring );
+	ExFreePool( pChannel );
+
 	pIrp->IoStatus.Status = STATUS_SUCCESS;
 	pIrp->IoStatus.Information = 0;	// no bytes xfered
 	IoCompleteRequest( pIrp, IO_NO_INCREMENT );
 	return STATUS_SUCCESS;
 }
 
+//++
+// Function:	ChargeMemory
+//
+// Description:
+//		Counts memory a channel is about to allocate
+//		against its device's MemoryLimit
+//
+// Arguments:
+//		pDevExt - The channel's device
+//		bytes - How much
+//
+// Return value:
+//		TRUE, or FALSE (and nothing counted) if the
+//		device hasn't that much left
+//--
+
+BOOLEAN ChargeMemory (
+		IN PDEVICE_EXTENSION	pDevExt,
+		IN ULONG			bytes			) {
+
+	BOOLEAN bCharged = FALSE;
+	KIRQL oldIrql;
+
+	KeAcquireSpinLock( &pDevExt->lkMemory, &oldIrql );
+	if (bytes <= MemoryLimit - pDevExt->MemoryCharged) {
+		pDevExt->MemoryCharged += bytes;
+		bCharged = TRUE;
+	}
+	KeReleaseSpinLock( &pDevExt->lkMemory, oldIrql );
+	return bCharged;
+}
+
+//++
+// Function:	UnchargeMemory
+//
+// Description:
+//		Gives back memory ChargeMemory counted, once
+//		it has been freed
+//
+// Arguments:
+//		pDevExt - The channel's device
+//		bytes - How much
+//
+// Return value:
+//		None
+//--
+
+VOID UnchargeMemory (
+		IN PDEVICE_EXTENSION	pDevExt,
+		IN ULONG			bytes			) {
+
+	KIRQL oldIrql;
+
+	KeAcquireSpinLock( &pDevExt->lkMemory, &oldIrql );
+	pDevExt->MemoryCharged -= bytes;
+	KeReleaseSpinLock( &pDevExt->lkMemory, oldIrql );
+}
+
+//++
+// Function:	DispatchCleanup
+//
+// Description:
+//		Handles the last CloseHandle of a file object.
+//		Reads still waiting on its channel are
+//		completed as cancelled - nothing else would
+//		ever complete them.  The shared-memory ring,
+//		if any, leaves the address space of the
+//		process that mapped it, attaching to that
+//		process if need be.
+//
+// Arguments:
+//		pDevObj - Passed from I/O Manager
+//		pIrp - Passed from I/O Manager
+//
+// Return value:
+//		NTSTATUS - success or failuer code
+//--
+
+NTSTATUS DispatchCleanup (
+		IN PDEVICE_OBJECT	pDevObj,
+		IN PIRP				pIrp			) {
+
+	PLOOPBACK_CHANNEL pChannel = ChannelOf( pIrp );
+	LIST_ENTRY cancelled;
+	KIRQL oldIrql;
+
+	// Collect the waiting reads under the lock...
+	InitializeListHead(&cancelled);
+	KeAcquireSpinLock( &pChannel->lkRing, &oldIrql );
+	while (!IsListEmpty(&pChannel->pendingReads)) {
+		PIRP pReadIrp = CONTAINING_RECORD(
+			RemoveHeadList(&pChannel->pendingReads), IRP, Tail.Overlay.ListEntry);
+		if (IoSetCancelRoutine(pReadIrp, NULL) == NULL) {
+			// Being cancelled - CancelRead completes it
+			InitializeListHead( &pReadIrp->Tail.Overlay.ListEntry );
+			continue;
+		}
+		InsertTailList( &cancelled, &pReadIrp->Tail.Overlay.ListEntry );
+	}
+	KeReleaseSpinLock( &pChannel->lkRing, oldIrql );
+
+	// ...and complete them without it
+	while (!IsListEmpty(&cancelled)) {
+		PIRP pReadIrp = CONTAINING_RECORD(
+			RemoveHeadList(&cancelled), IRP, Tail.Overlay.ListEntry);
+		pReadIrp->IoStatus.Status = STATUS_CANCELLED;
+		pReadIrp->IoStatus.Information = 0;
+		IoCompleteRequest( pReadIrp, IO_NO_INCREMENT );
+	}
+
+	// Close frees the shared ring's pages, so its user view
+	// goes now
+	UnmapSharedView( pChannel );
+
+	pIrp->IoStatus.Status = STATUS_SUCCESS;
+	pIrp->IoStatus.Information = 0;
+	IoCompleteRequest( pIrp, IO_NO_INCREMENT );
+	return STATUS_SUCCESS;
+}
+
 //++
 // Function:	DispatchWrite
 //
 // Description:
 //		Handles call from Win32 WriteFile request
-//		For loopback driver, allocates new pool buffer
-//			then xfers user buffer to pool buffer
+//		For loopback driver, passes the data to the
+//			handle's channel (see ChannelWrite).  A short
+//			count means the FIFO filled up; if nothing
+//			fits, the write fails with STATUS_DEVICE_BUSY.
+//			In message mode it's all or nothing, and a
+//			message bigger than the FIFO is invalid.
 //
 // Arguments:
 //		pDevObj - Passed from I/O Manager
@@ -294,35 +740,21 @@ NTSTATUS DispatchWrite (
 	// The stack location contains the user buffer info
 	PIO_STACK_LOCATION pIrpStack =
 		IoGetCurrentIrpStackLocation( pIrp );
-	// Dig out the Device Extension from the Device object
-	PDEVICE_EXTENSION pDevExt = (PDEVICE_EXTENSION)
-		pDevObj->DeviceExtension;
-	// Since we processing a new Write request,
-	// free up any old buffer
-	if (pDevExt->deviceBuffer != NULL) {
-		ExFreePool(pDevExt->deviceBuffer);
-		pDevExt->deviceBuffer = NULL;
-		pDevExt->deviceBufferSize = 0;
-	}
+	// Dig out this handle's channel from the File object
+	PLOOPBACK_CHANNEL pChannel = ChannelOf( pIrp );
 	// Determine the length of the request
 	xferSize = pIrpStack->Parameters.Write.Length;
 	// Obtain user buffer pointer
-	userBuffer = pIrp->AssociatedIrp.SystemBuffer;
-
-	// Allocate the new buffer
-	pDevExt->deviceBuffer =
-		ExAllocatePool( PagedPool, xferSize );
-	if (pDevExt->deviceBuffer == NULL) {
-		// buffer didn't allocate???
-		status = STATUS_INSUFFICIENT_RESOURCES;
-		xferSize = 0;
-	} else {
-		// copy the buffer
-		pDevExt->deviceBufferSize = xferSize;
-		RtlCopyMemory( pDevExt->deviceBuffer, userBuffer,
-							xferSize );
+	userBuffer = GetTransferBuffer( pIrp );
+	if (userBuffer == NULL && xferSize != 0) {
+		pIrp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+		pIrp->IoStatus.Information = 0;
+		IoCompleteRequest( pIrp, IO_NO_INCREMENT );
+		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 
+	status = WriteChannel( pChannel, userBuffer, xferSize, &xferSize );
+
 	// Now complete the IRP
 	pIrp->IoStatus.Status = status;
 	pIrp->IoStatus.Information = xferSize;	// bytes xfered
@@ -330,12 +762,226 @@ NTSTATUS DispatchWrite (
 	return status;
 }
 
+//++
+// Function:	WriteChannel
+//
+// Description:
+//		A write IRP's work, for DispatchWrite and for
+//		IOCTL_LOOPBACK_WRITE: passes the data to the
+//		channel (see ChannelWrite) and completes the
+//		reads it satisfies.  A short count means the
+//		FIFO filled up; if nothing fits, the write fails
+//		with STATUS_DEVICE_BUSY.  In message mode it's
+//		all or nothing, and a message bigger than the
+//		FIFO is invalid.
+//
+// Arguments:
+//		pChannel - The handle's channel
+//		pData - What to write (in system space)
+//		length - Bytes of it
+//		pXferSize - Receives the bytes taken
+//
+// Return value:
+//		NTSTATUS - success or failuer code
+//--
+
+NTSTATUS WriteChannel (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		IN const VOID*		pData,
+		IN ULONG			length,
+		OUT PULONG			pXferSize		) {
+
+	NTSTATUS status = STATUS_SUCCESS;
+	LIST_ENTRY satisfied;
+	KIRQL oldIrql;
+
+	InitializeListHead(&satisfied);
+	ULONG nDone = 0;
+	KeAcquireSpinLock( &pChannel->lkRing, &oldIrql );
+	if (pChannel->bMessageMode && (length >= pChannel->ring.Size ||
+			LoopbackRecordSize(length) > pChannel->ring.Size))
+		status = STATUS_INVALID_PARAMETER;	// a message that could never fit
+	else
+		nDone = ChannelWrite( pChannel, pData, length, &satisfied );
+	KeReleaseSpinLock( &pChannel->lkRing, oldIrql );
+
+	// Readers are completed outside the lock
+	CompleteReads( &satisfied );
+	if (NT_SUCCESS(status) && nDone == 0 && length != 0)
+		status = STATUS_DEVICE_BUSY;	// full - reader must catch up
+	*pXferSize = nDone;
+	return status;
+}
+
+//++
+// Function:	ChannelWrite
+//
+// Description:
+//		Writes to a channel: first satisfies any reads
+//		waiting for data, copying straight from the
+//		writer's buffer to theirs, then appends the
+//		rest to the FIFO, as much as fits.  In message
+//		mode the data goes into the FIFO as one record,
+//		if it fits, and the waiting reads take it from
+//		there.  Called holding lkRing; the satisfied
+//		reads are left on a list for CompleteReads, to
+//		be completed once the lock is released.
+//
+// Arguments:
+//		pChannel - The handle's channel
+//		pData - What to write (in system space)
+//		length - Bytes of it
+//		pSatisfied - Collects the reads it satisfies
+//
+// Return value:
+//		Bytes taken
+//--
+
+ULONG ChannelWrite (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		IN const VOID*		pData,
+		IN ULONG			length,
+		IN PLIST_ENTRY		pSatisfied		) {
+
+	static const UCHAR zeros[LOOPBACK_RECORD_ALIGN] = {0};
+	ULONG nDone = 0;
+	if (pChannel->bMessageMode) {
+		ULONG recordSize = LoopbackRecordSize(length);
+		if (length == 0 || recordSize > RingSpace(&pChannel->ring))
+			return 0;
+		RingWrite( &pChannel->ring, &length, sizeof(ULONG) );
+		RingWrite( &pChannel->ring, pData, length );
+		RingWrite( &pChannel->ring, zeros, recordSize - sizeof(ULONG) - length );
+		// Reads only wait while the FIFO is empty, so this
+		// record is the first each one sees.  One too small
+		// for it fails alone, and the record stays for the
+		// next.
+		while (!IsListEmpty(&pChannel->pendingReads) &&
+			   RingBytes(&pChannel->ring) != 0) {
+			PIRP pReadIrp = CONTAINING_RECORD(
+				RemoveHeadList(&pChannel->pendingReads), IRP, Tail.Overlay.ListEntry);
+			if (IoSetCancelRoutine(pReadIrp, NULL) == NULL) {
+				InitializeListHead( &pReadIrp->Tail.Overlay.ListEntry );
+				continue;
+			}
+			ULONG readLength =
+				PtrToUlong(pReadIrp->Tail.Overlay.DriverContext[1]);
+			if (readLength < recordSize) {
+				pReadIrp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+				pReadIrp->IoStatus.Information = 0;
+			} else
+				pReadIrp->IoStatus.Information = ChannelRead( pChannel,
+					pReadIrp->Tail.Overlay.DriverContext[0], readLength,
+					&pReadIrp->IoStatus.Status );
+			InsertTailList( pSatisfied, &pReadIrp->Tail.Overlay.ListEntry );
+		}
+		return length;
+	}
+	// Waiting readers get the data first, oldest first
+	while (nDone < length && !IsListEmpty(&pChannel->pendingReads)) {
+		PIRP pReadIrp = CONTAINING_RECORD(
+			RemoveHeadList(&pChannel->pendingReads), IRP, Tail.Overlay.ListEntry);
+		if (IoSetCancelRoutine(pReadIrp, NULL) == NULL) {
+			// Being cancelled - CancelRead completes it
+			InitializeListHead( &pReadIrp->Tail.Overlay.ListEntry );
+			continue;
+		}
+		ULONG nRead = min(length - nDone,
+			PtrToUlong(pReadIrp->Tail.Overlay.DriverContext[1]));
+		// The one copy: writer's buffer to reader's (with
+		// direct I/O, user pages to user pages)
+		RtlCopyMemory( pReadIrp->Tail.Overlay.DriverContext[0],
+						(const UCHAR*)pData + nDone, nRead );
+		pReadIrp->IoStatus.Status = STATUS_SUCCESS;
+		pReadIrp->IoStatus.Information = nRead;
+		InsertTailList( pSatisfied, &pReadIrp->Tail.Overlay.ListEntry );
+		nDone += nRead;
+	}
+	// Append what's left behind any unread data
+	return nDone +
+		RingWrite( &pChannel->ring, (const UCHAR*)pData + nDone, length - nDone );
+}
+
+//++
+// Function:	CompleteReads
+//
+// Description:
+//		Completes the reads ChannelWrite satisfied, with
+//		the status it gave them
+//
+// Arguments:
+//		pSatisfied - The list ChannelWrite filled in
+//
+// Return value:
+//		None
+//--
+
+VOID CompleteReads (
+		IN PLIST_ENTRY		pSatisfied		) {
+
+	while (!IsListEmpty(pSatisfied)) {
+		PIRP pReadIrp = CONTAINING_RECORD(
+			RemoveHeadList(pSatisfied), IRP, Tail.Overlay.ListEntry);
+		IoCompleteRequest( pReadIrp, IO_NO_INCREMENT );
+	}
+}
+
+//++
+// Function:	ChannelRead
+//
+// Description:
+//		Reads from a channel's FIFO: as many bytes as
+//		it has, up to length - or, in message mode, as
+//		many whole records as fit in length.  Called
+//		holding lkRing.
+//
+// Arguments:
+//		pChannel - The handle's channel
+//		pBuffer - Where to put the data (in system space)
+//		length - Bytes of room there
+//		pStatus - STATUS_SUCCESS, or STATUS_BUFFER_TOO_SMALL
+//				if the next message doesn't fit (the
+//				FIFO is left as it was)
+//
+// Return value:
+//		Bytes read
+//--
+
+ULONG ChannelRead (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		OUT PVOID			pBuffer,
+		IN ULONG			length,
+		OUT PNTSTATUS		pStatus			) {
+
+	*pStatus = STATUS_SUCCESS;
+	if (!pChannel->bMessageMode)
+		return RingRead( &pChannel->ring, pBuffer, length );
+
+	ULONG nDone = 0;
+	while (RingBytes(&pChannel->ring) != 0) {
+		ULONG messageLength;
+		RingPeek( &pChannel->ring, &messageLength, sizeof(ULONG) );
+		ULONG recordSize = LoopbackRecordSize(messageLength);
+		if (recordSize > length - nDone)
+			break;
+		nDone += RingRead( &pChannel->ring, (PUCHAR)pBuffer + nDone, recordSize );
+	}
+	if (nDone == 0 && RingBytes(&pChannel->ring) != 0)
+		*pStatus = STATUS_BUFFER_TOO_SMALL;
+	return nDone;
+}
+
 //++
 // Function:	DispatchRead
 //
 // Description:
 //		Handles call from Win32 ReadFile request
-//		For loopback driver, xfers pool buffer to user
+//		For loopback driver, xfers the oldest data in
+//			the handle's FIFO to the user (see
+//			ChannelRead).  If the FIFO is empty, a read
+//			on an overlapped handle waits (pends) for the
+//			next write, which completes it (see
+//			ReadChannel).
 //
 // Arguments:
 //		pDevObj - Passed from I/O Manager
@@ -356,24 +1002,22 @@ NTSTATUS DispatchRead (
 	// The stack location contains the user buffer info
 	PIO_STACK_LOCATION pIrpStack =
 		IoGetCurrentIrpStackLocation( pIrp );
-	// Dig out the Device Extension from the Device object
-	PDEVICE_EXTENSION pDevExt = (PDEVICE_EXTENSION)
-		pDevObj->DeviceExtension;
+	// Dig out this handle's channel from the File object
+	PLOOPBACK_CHANNEL pChannel = ChannelOf( pIrp );
 	// Determine the length of the request
 	xferSize = pIrpStack->Parameters.Read.Length;
 	// Obtain user buffer pointer
-	userBuffer = pIrp->AssociatedIrp.SystemBuffer;
-
-	// Don't transfer more than the user's request
-	xferSize = (xferSize < pDevExt->deviceBufferSize) ?
-				xferSize : pDevExt->deviceBufferSize;
-	// Now copy the pool buffer into user space
-	RtlCopyMemory( userBuffer, pDevExt->deviceBuffer,
-							xferSize );
-	// Free the temporary pool buffer
-	ExFreePool( pDevExt->deviceBuffer );
-	pDevExt->deviceBuffer = NULL;
-	pDevExt->deviceBufferSize = 0;
+	userBuffer = GetTransferBuffer( pIrp );
+	if (userBuffer == NULL && xferSize != 0) {
+		pIrp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+		pIrp->IoStatus.Information = 0;
+		IoCompleteRequest( pIrp, IO_NO_INCREMENT );
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	status = ReadChannel( pChannel, pIrp, userBuffer, xferSize, &xferSize );
+	if (status == STATUS_PENDING)
+		return status;		// the next write completes it
 
 	// Now complete the IRP
 	pIrp->IoStatus.Status = status;
@@ -382,3 +1026,709 @@ NTSTATUS DispatchRead (
 	return status;
 }
 
+//++
+// Function:	ReadChannel
+//
+// Description:
+//		A read IRP's work, for DispatchRead and for
+//		IOCTL_LOOPBACK_READ: xfers the oldest data in
+//		the channel's FIFO (see ChannelRead).  If the
+//		FIFO is empty, an overlapped handle's IRP waits
+//		(pends) for the next write, which completes it;
+//		a synchronous handle's gets nothing, as only
+//		its own write, held up behind it, could fill
+//		the FIFO.
+//
+// Arguments:
+//		pChannel - The handle's channel
+//		pIrp - The read; left to the caller to complete
+//				unless STATUS_PENDING is returned
+//		pBuffer - Where to put the data (in system space)
+//		length - Bytes of room there
+//		pXferSize - Receives the bytes read
+//
+// Return value:
+//		NTSTATUS - STATUS_PENDING if the IRP was queued,
+//		else its status
+//--
+
+NTSTATUS ReadChannel (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		IN PIRP				pIrp,
+		OUT PVOID			pBuffer,
+		IN ULONG			length,
+		OUT PULONG			pXferSize		) {
+
+	NTSTATUS status;
+	KIRQL oldIrql;
+
+	*pXferSize = 0;
+	KeAcquireSpinLock( &pChannel->lkRing, &oldIrql );
+	if (RingBytes(&pChannel->ring) == 0 && length != 0 &&
+		!(IoGetCurrentIrpStackLocation( pIrp )->FileObject->Flags &
+		  FO_SYNCHRONOUS_IO)) {
+		// Nothing to read yet - queue the IRP for ChannelWrite,
+		// unless it has been cancelled already
+		IoSetCancelRoutine( pIrp, CancelRead );
+		if (pIrp->Cancel && IoSetCancelRoutine(pIrp, NULL) != NULL) {
+			KeReleaseSpinLock( &pChannel->lkRing, oldIrql );
+			return STATUS_CANCELLED;
+		}
+		// (If CancelRead is already on its way, it will
+		// find the IRP queued and complete it)
+		pIrp->Tail.Overlay.DriverContext[0] = pBuffer;	// mapped before taking the lock
+		pIrp->Tail.Overlay.DriverContext[1] = UlongToPtr(length);
+		IoMarkIrpPending( pIrp );
+		InsertTailList( &pChannel->pendingReads,
+						&pIrp->Tail.Overlay.ListEntry );
+		KeReleaseSpinLock( &pChannel->lkRing, oldIrql );
+		return STATUS_PENDING;
+	}
+	// Don't transfer more than the user's request -
+	// the rest stays queued for the next read
+	*pXferSize = ChannelRead( pChannel, pBuffer, length, &status );
+	KeReleaseSpinLock( &pChannel->lkRing, oldIrql );
+	return status;
+}
+
+//++
+// Function:	FastIoDeviceControl
+//
+// Description:
+//		Called by the I/O manager for a DeviceIoControl
+//		on a synchronous handle before it builds an IRP.
+//		Takes small IOCTL_LOOPBACK_WRITEs and READs (see
+//		FastIoWrite and FastIoRead); every other request
+//		is left to the IRP.
+//
+// Arguments:
+//		pFileObject - The handle's file object
+//		bWait - Not used
+//		pInBuffer, inLength - The caller's input buffer
+//				(user space)
+//		pOutBuffer, outLength - The caller's output
+//				buffer (user space)
+//		ioControlCode - The request
+//		pIoStatus - Receives the result, as an IRP's
+//		pDevObj - The device
+//
+// Return value:
+//		TRUE if the request was done, FALSE to send an IRP
+//--
+
+BOOLEAN FastIoDeviceControl (
+		IN PFILE_OBJECT		pFileObject,
+		IN BOOLEAN			bWait,
+		IN PVOID			pInBuffer,
+		IN ULONG			inLength,
+		OUT PVOID			pOutBuffer,
+		IN ULONG			outLength,
+		IN ULONG			ioControlCode,
+		OUT PIO_STATUS_BLOCK	pIoStatus,
+		IN PDEVICE_OBJECT	pDevObj			) {
+
+	PLOOPBACK_CHANNEL pChannel = (PLOOPBACK_CHANNEL) pFileObject->FsContext;
+
+	switch (ioControlCode) {
+	case IOCTL_LOOPBACK_WRITE:
+		return FastIoWrite( pChannel, pInBuffer, inLength, pIoStatus );
+	case IOCTL_LOOPBACK_READ:
+		return FastIoRead( pChannel, pOutBuffer, outLength, pIoStatus );
+	default:
+		return FALSE;
+	}
+}
+
+//++
+// Function:	FastIoWrite
+//
+// Description:
+//		Fast I/O version of IOCTL_LOOPBACK_WRITE.  Takes
+//		writes of up to LOOPBACK_FAST_IO_MAX bytes that
+//		something fits of; anything else is left to the
+//		IRP.
+//
+// Arguments:
+//		pChannel - The handle's channel
+//		pBuffer - The caller's data (user space)
+//		length - Bytes to write
+//		pIoStatus - Receives the result, as an IRP's
+//
+// Return value:
+//		TRUE if the write was done, FALSE to send an IRP
+//--
+
+BOOLEAN FastIoWrite (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		IN PVOID			pBuffer,
+		IN ULONG			length,
+		OUT PIO_STATUS_BLOCK	pIoStatus		) {
+
+	UCHAR data[LOOPBACK_FAST_IO_MAX];
+	LIST_ENTRY satisfied;
+	KIRQL oldIrql;
+
+	if (length > LOOPBACK_FAST_IO_MAX)
+		return FALSE;
+	// User memory can't be touched holding a spin lock, so
+	// it comes through the stack.  A bad buffer is the IRP's
+	// problem - nothing has been written yet.
+	__try {
+		RtlCopyMemory( data, pBuffer, length );
+	} __except (EXCEPTION_EXECUTE_HANDLER) {
+		return FALSE;
+	}
+
+	InitializeListHead(&satisfied);
+	KeAcquireSpinLock( &pChannel->lkRing, &oldIrql );
+	ULONG nDone = ChannelWrite( pChannel, data, length, &satisfied );
+	KeReleaseSpinLock( &pChannel->lkRing, oldIrql );
+	CompleteReads( &satisfied );
+	if (nDone == 0 && length != 0)
+		return FALSE;	// full - WriteChannel says so
+
+	pIoStatus->Status = STATUS_SUCCESS;
+	pIoStatus->Information = nDone;
+	return TRUE;
+}
+
+//++
+// Function:	FastIoRead
+//
+// Description:
+//		Fast I/O version of IOCTL_LOOPBACK_READ.  Takes
+//		reads of up to LOOPBACK_FAST_IO_MAX bytes while
+//		the FIFO has data; a read that would wait, or a
+//		large one, is left to the IRP.
+//
+// Arguments:
+//		pChannel - The handle's channel
+//		pBuffer - The caller's buffer (user space)
+//		length - Bytes to read, at most
+//		pIoStatus - Receives the result, as an IRP's
+//
+// Return value:
+//		TRUE if the read was done, FALSE to send an IRP
+//--
+
+BOOLEAN FastIoRead (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		OUT PVOID			pBuffer,
+		IN ULONG			length,
+		OUT PIO_STATUS_BLOCK	pIoStatus		) {
+
+	UCHAR data[LOOPBACK_FAST_IO_MAX];
+	KIRQL oldIrql;
+
+	if (length > LOOPBACK_FAST_IO_MAX)
+		return FALSE;
+	NTSTATUS status;
+	KeAcquireSpinLock( &pChannel->lkRing, &oldIrql );
+	ULONG nRead = ChannelRead( pChannel, data, length, &status );
+	KeReleaseSpinLock( &pChannel->lkRing, oldIrql );
+	if (nRead == 0 && length != 0)
+		return FALSE;	// empty - ReadChannel decides
+
+	// Out through the stack, as FastIoWrite.  The data is
+	// gone from the FIFO by now, as it would be if the I/O
+	// manager failed to copy a buffered read's out.
+	pIoStatus->Status = STATUS_SUCCESS;
+	pIoStatus->Information = nRead;
+	__try {
+		RtlCopyMemory( pBuffer, data, nRead );
+	} __except (EXCEPTION_EXECUTE_HANDLER) {
+		pIoStatus->Status = STATUS_INVALID_USER_BUFFER;
+		pIoStatus->Information = 0;
+	}
+	return TRUE;
+}
+
+//++
+// Function:	DispatchDeviceControl
+//
+// Description:
+//		Handles call from Win32 DeviceIoControl request
+//		IOCTL_LOOPBACK_MAP_RING sets up the handle's
+//			shared-memory ring (see LoopbackIoctl.h);
+//		IOCTL_LOOPBACK_KICK_RING wakes its parked
+//			consumer.
+//		IOCTL_LOOPBACK_WRITEV and IOCTL_LOOPBACK_READV
+//			move many records in one IRP.
+//		IOCTL_LOOPBACK_MESSAGE_MODE switches the
+//			handle's channel to messages.
+//		IOCTL_LOOPBACK_WRITE and IOCTL_LOOPBACK_READ
+//			are the ones FastIoDeviceControl left:
+//			written and read as WriteFile and ReadFile
+//			are, a read waiting if need be.
+//
+// Arguments:
+//		pDevObj - Passed from I/O Manager
+//		pIrp - Passed from I/O Manager
+//
+// Return value:
+//		NTSTATUS - success or failuer code
+//--
+
+NTSTATUS DispatchDeviceControl (
+		IN PDEVICE_OBJECT	pDevObj,
+		IN PIRP				pIrp			) {
+
+	NTSTATUS status;
+	ULONG xferSize = 0;
+	PIO_STACK_LOCATION pIrpStack =
+		IoGetCurrentIrpStackLocation( pIrp );
+	PLOOPBACK_CHANNEL pChannel = ChannelOf( pIrp );
+	PKEVENT pEvent;
+	KIRQL oldIrql;
+
+	switch (pIrpStack->Parameters.DeviceIoControl.IoControlCode) {
+	case IOCTL_LOOPBACK_MAP_RING:
+		status = MapSharedRing( pChannel, pIrp );
+		if (NT_SUCCESS(status))
+			xferSize = sizeof(LOOPBACK_MAP_RING_OUT);
+		break;
+
+	case IOCTL_LOOPBACK_KICK_RING:
+		// The event stays referenced until DispatchClose
+		KeAcquireSpinLock( &pChannel->lkRing, &oldIrql );
+		pEvent = pChannel->pSharedEvent;
+		KeReleaseSpinLock( &pChannel->lkRing, oldIrql );
+		if (pEvent == NULL)
+			status = STATUS_INVALID_DEVICE_STATE;	// no ring yet
+		else {
+			KeSetEvent( pEvent, IO_NO_INCREMENT, FALSE );
+			status = STATUS_SUCCESS;
+		}
+		break;
+
+	case IOCTL_LOOPBACK_WRITEV:
+		status = WriteVector( pChannel, pIrp, &xferSize );
+		break;
+
+	case IOCTL_LOOPBACK_READV:
+		status = ReadVector( pChannel, pIrp, &xferSize );
+		break;
+
+	case IOCTL_LOOPBACK_WRITE:
+		status = WriteChannel( pChannel, pIrp->AssociatedIrp.SystemBuffer,
+			pIrpStack->Parameters.DeviceIoControl.InputBufferLength, &xferSize );
+		break;
+
+	case IOCTL_LOOPBACK_READ:
+		status = ReadChannel( pChannel, pIrp, pIrp->AssociatedIrp.SystemBuffer,
+			pIrpStack->Parameters.DeviceIoControl.OutputBufferLength, &xferSize );
+		if (status == STATUS_PENDING)
+			return status;	// the next write completes it
+		break;
+
+	case IOCTL_LOOPBACK_MESSAGE_MODE:
+		// Bytes already in the FIFO aren't records
+		KeAcquireSpinLock( &pChannel->lkRing, &oldIrql );
+		if (RingBytes(&pChannel->ring) != 0)
+			status = STATUS_INVALID_DEVICE_STATE;
+		else {
+			pChannel->bMessageMode = TRUE;
+			status = STATUS_SUCCESS;
+		}
+		KeReleaseSpinLock( &pChannel->lkRing, oldIrql );
+		break;
+
+	default:
+		// Not a recognized DeviceIoControl request
+		status = STATUS_INVALID_DEVICE_REQUEST;
+	}
+
+	pIrp->IoStatus.Status = status;
+	pIrp->IoStatus.Information = xferSize;
+	IoCompleteRequest( pIrp, IO_NO_INCREMENT );
+	return status;
+}
+
+//++
+// Function:	MapSharedRing
+//
+// Description:
+//		Sets up a channel's shared-memory ring: takes a
+//		reference to the caller's event, allocates locked
+//		pages for the ring and maps them both into system
+//		space and into the caller's process.  Called at
+//		PASSIVE_LEVEL in the caller's context, as the
+//		top-level driver's dispatch routines are.
+//
+// Arguments:
+//		pChannel - The handle's channel
+//		pIrp - The IOCTL_LOOPBACK_MAP_RING request;
+//				its output is filled in on success
+//
+// Return value:
+//		NTSTATUS - success or failuer code
+//--
+
+NTSTATUS MapSharedRing (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		IN PIRP				pIrp			) {
+
+	PIO_STACK_LOCATION pIrpStack =
+		IoGetCurrentIrpStackLocation( pIrp );
+	PLOOPBACK_MAP_RING_IN pIn = (PLOOPBACK_MAP_RING_IN)
+		pIrp->AssociatedIrp.SystemBuffer;
+	PLOOPBACK_MAP_RING_OUT pOut = (PLOOPBACK_MAP_RING_OUT)
+		pIrp->AssociatedIrp.SystemBuffer;	// the same buffer
+	PKEVENT pEvent;
+	PMDL pMdl;
+	PLOOPBACK_SHARED_RING pRing;
+	PVOID pUserVa;
+	PHYSICAL_ADDRESS lowAddress, highAddress, skipBytes;
+	BOOLEAN bMapped = FALSE;
+	KIRQL oldIrql;
+	NTSTATUS status;
+
+	if (pIrpStack->Parameters.DeviceIoControl.InputBufferLength <
+			sizeof(LOOPBACK_MAP_RING_IN) ||
+		pIrpStack->Parameters.DeviceIoControl.OutputBufferLength <
+			sizeof(LOOPBACK_MAP_RING_OUT))
+		return STATUS_BUFFER_TOO_SMALL;
+	ULONG size = pIn->Size;
+	if (size < LOOPBACK_MIN_BUFFER || size > LOOPBACK_MAX_BUFFER ||
+			(size & (size - 1)) != 0)
+		return STATUS_INVALID_PARAMETER;
+
+	// The caller's handle is only good in its own process
+	status = ObReferenceObjectByHandle( pIn->hEvent, EVENT_MODIFY_STATE,
+										*ExEventObjectType, pIrp->RequestorMode,
+										(PVOID*) &pEvent, NULL );
+	if (!NT_SUCCESS(status))
+		return status;
+
+	// Whole pages, which the process can have to itself -
+	// and count against the device's limit
+	ULONG totalBytes = sizeof(LOOPBACK_SHARED_RING) + size;
+	ULONG charge = ROUND_TO_PAGES(totalBytes);
+	if (!ChargeMemory( pChannel->pDevExt, charge )) {
+		ObDereferenceObject( pEvent );
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	lowAddress.QuadPart = 0;
+	highAddress.QuadPart = -1;
+	skipBytes.QuadPart = 0;
+	pMdl = MmAllocatePagesForMdl( lowAddress, highAddress, skipBytes, totalBytes );
+	if (pMdl != NULL && MmGetMdlByteCount(pMdl) < totalBytes) {
+		// Fewer pages than asked for
+		MmFreePagesFromMdl( pMdl );
+		ExFreePool( pMdl );
+		pMdl = NULL;
+	}
+	if (pMdl == NULL) {
+		UnchargeMemory( pChannel->pDevExt, charge );
+		ObDereferenceObject( pEvent );
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	pRing = (PLOOPBACK_SHARED_RING)
+		MmMapLockedPagesSpecifyCache( pMdl, KernelMode, MmCached,
+									  NULL, FALSE, NormalPagePriority );
+	if (pRing == NULL) {
+		FreeSharedRing( pMdl, NULL, NULL, pEvent );
+		UnchargeMemory( pChannel->pDevExt, charge );
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	// New pages hold whatever was in them last
+	RtlZeroMemory( pRing, totalBytes );
+	pRing->Size = size;
+
+	// A failed user-mode mapping raises an exception
+	__try {
+		pUserVa = MmMapLockedPagesSpecifyCache( pMdl, UserMode, MmCached,
+												NULL, FALSE, NormalPagePriority );
+	} __except (EXCEPTION_EXECUTE_HANDLER) {
+		pUserVa = NULL;
+	}
+	if (pUserVa == NULL) {
+		FreeSharedRing( pMdl, pRing, NULL, pEvent );
+		UnchargeMemory( pChannel->pDevExt, charge );
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	// One ring per handle
+	KeAcquireSpinLock( &pChannel->lkRing, &oldIrql );
+	if (pChannel->pSharedMdl == NULL) {
+		pChannel->pSharedMdl = pMdl;
+		pChannel->pSharedRing = pRing;
+		pChannel->pSharedUserVa = pUserVa;
+		// kept until cleanup has unmapped the view from it
+		pChannel->pSharedProcess = IoGetCurrentProcess();
+		ObReferenceObject( pChannel->pSharedProcess );
+		pChannel->pSharedEvent = pEvent;
+		pChannel->SharedCharge = charge;
+		bMapped = TRUE;
+	}
+	KeReleaseSpinLock( &pChannel->lkRing, oldIrql );
+	if (!bMapped) {
+		FreeSharedRing( pMdl, pRing, pUserVa, pEvent );
+		UnchargeMemory( pChannel->pDevExt, charge );
+		return STATUS_INVALID_DEVICE_STATE;
+	}
+
+	pOut->pRing = pUserVa;
+	return STATUS_SUCCESS;
+}
+
+//++
+// Function:	UnmapSharedView
+//
+// Description:
+//		Takes a channel's shared-memory ring out of the
+//		address space of the process that mapped it.
+//		That needn't be the current process - the handle
+//		may have been inherited, and closed last by
+//		another one - so this attaches to it if need be.
+//		The pages stay allocated.
+//
+// Arguments:
+//		pChannel - The handle's channel
+//
+// Return value:
+//		None
+//--
+
+VOID UnmapSharedView (
+		IN PLOOPBACK_CHANNEL	pChannel		) {
+
+	if (pChannel->pSharedUserVa == NULL)
+		return;		// no ring, or already unmapped
+	KAPC_STATE apcState;
+	BOOLEAN bAttach = (pChannel->pSharedProcess != IoGetCurrentProcess());
+	if (bAttach)
+		KeStackAttachProcess( pChannel->pSharedProcess, &apcState );
+	MmUnmapLockedPages( pChannel->pSharedUserVa, pChannel->pSharedMdl );
+	if (bAttach)
+		KeUnstackDetachProcess( &apcState );
+	pChannel->pSharedUserVa = NULL;
+	ObDereferenceObject( pChannel->pSharedProcess );
+	pChannel->pSharedProcess = NULL;
+}
+
+//++
+// Function:	FreeSharedRing
+//
+// Description:
+//		Undoes MapSharedRing, as far as it got
+//
+// Arguments:
+//		pMdl - The ring's pages
+//		pRing - Their system-space mapping, or NULL
+//		pUserVa - Their mapping in the current process,
+//				or NULL
+//		pEvent - The consumer's event
+//
+// Return value:
+//		None
+//--
+
+VOID FreeSharedRing (
+		IN PMDL				pMdl,
+		IN PLOOPBACK_SHARED_RING	pRing,
+		IN PVOID			pUserVa,
+		IN PKEVENT			pEvent			) {
+
+	if (pUserVa != NULL)
+		MmUnmapLockedPages( pUserVa, pMdl );
+	if (pRing != NULL)
+		MmUnmapLockedPages( pRing, pMdl );
+	MmFreePagesFromMdl( pMdl );
+	ExFreePool( pMdl );
+	ObDereferenceObject( pEvent );
+}
+
+//++
+// Function:	WriteVector
+//
+// Description:
+//		IOCTL_LOOPBACK_WRITEV: writes each record of the
+//		vector to the channel, whole, until one doesn't
+//		fit.  All under one acquisition of lkRing.
+//
+// Arguments:
+//		pChannel - The handle's channel
+//		pIrp - The request (METHOD_BUFFERED)
+//		pXferSize - Receives the bytes to copy back:
+//				the IOVECs
+//
+// Return value:
+//		NTSTATUS - success or failuer code
+//--
+
+NTSTATUS WriteVector (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		IN PIRP				pIrp,
+		OUT PULONG			pXferSize		) {
+
+	PIO_STACK_LOCATION pIrpStack =
+		IoGetCurrentIrpStackLocation( pIrp );
+	PLOOPBACK_VECTOR pVector = (PLOOPBACK_VECTOR)
+		pIrp->AssociatedIrp.SystemBuffer;
+	ULONG inLength = pIrpStack->Parameters.DeviceIoControl.InputBufferLength;
+	ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+	LIST_ENTRY satisfied;
+	KIRQL oldIrql;
+	ULONG i;
+
+	// The IOVECs must be there, and room to return them
+	if (inLength < LoopbackVectorSize(0) ||
+		pVector->Count > (inLength - LoopbackVectorSize(0)) / sizeof(LOOPBACK_IOVEC) ||
+		outLength < LoopbackVectorSize(pVector->Count))
+		return STATUS_BUFFER_TOO_SMALL;
+	// ... and every record inside the input
+	for (i = 0; i < pVector->Count; i++)
+		if (pVector->Iov[i].Offset > inLength ||
+			pVector->Iov[i].Length > inLength - pVector->Iov[i].Offset)
+			return STATUS_INVALID_PARAMETER;
+
+	InitializeListHead(&satisfied);
+	KeAcquireSpinLock( &pChannel->lkRing, &oldIrql );
+	for (i = 0; i < pVector->Count; i++) {
+		ULONG length = pVector->Iov[i].Length;
+		// Waiting reads mean an empty FIFO, so this is room
+		// enough for them too
+		if (ChannelNeeds(pChannel, length) > RingSpace(&pChannel->ring))
+			break;
+		ChannelWrite( pChannel, (PUCHAR)pVector + pVector->Iov[i].Offset,
+					  length, &satisfied );
+	}
+	KeReleaseSpinLock( &pChannel->lkRing, oldIrql );
+	CompleteReads( &satisfied );
+
+	pVector->Done = i;
+	for (; i < pVector->Count; i++)
+		pVector->Iov[i].Length = 0;
+	*pXferSize = LoopbackVectorSize(pVector->Count);
+	return STATUS_SUCCESS;
+}
+
+//++
+// Function:	ReadVector
+//
+// Description:
+//		IOCTL_LOOPBACK_READV: reads into each record of
+//		the vector in turn until the channel is empty,
+//		packing the data after the IOVECs.  All under
+//		one acquisition of lkRing.
+//
+// Arguments:
+//		pChannel - The handle's channel
+//		pIrp - The request (METHOD_BUFFERED)
+//		pXferSize - Receives the bytes to copy back:
+//				the IOVECs and the data
+//
+// Return value:
+//		NTSTATUS - success or failuer code
+//--
+
+NTSTATUS ReadVector (
+		IN PLOOPBACK_CHANNEL	pChannel,
+		IN PIRP				pIrp,
+		OUT PULONG			pXferSize		) {
+
+	PIO_STACK_LOCATION pIrpStack =
+		IoGetCurrentIrpStackLocation( pIrp );
+	PLOOPBACK_VECTOR pVector = (PLOOPBACK_VECTOR)
+		pIrp->AssociatedIrp.SystemBuffer;
+	ULONG inLength = pIrpStack->Parameters.DeviceIoControl.InputBufferLength;
+	ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+	KIRQL oldIrql;
+	ULONG i;
+
+	if (inLength < LoopbackVectorSize(0) ||
+		pVector->Count > (inLength - LoopbackVectorSize(0)) / sizeof(LOOPBACK_IOVEC) ||
+		outLength < LoopbackVectorSize(pVector->Count))
+		return STATUS_BUFFER_TOO_SMALL;
+
+	// Data goes right after the IOVECs - and no further than
+	// the output buffer, whatever the IOVECs say
+	ULONG offset = LoopbackVectorSize(pVector->Count);
+	KeAcquireSpinLock( &pChannel->lkRing, &oldIrql );
+	for (i = 0; i < pVector->Count; i++) {
+		ULONG length = min(pVector->Iov[i].Length, outLength - offset);
+		NTSTATUS status;
+		if (RingBytes(&pChannel->ring) == 0)
+			break;
+		length = ChannelRead( pChannel, (PUCHAR)pVector + offset, length, &status );
+		if (!NT_SUCCESS(status))
+			break;		// the next message doesn't fit
+		pVector->Iov[i].Offset = offset;
+		pVector->Iov[i].Length = length;
+		offset += length;
+	}
+	KeReleaseSpinLock( &pChannel->lkRing, oldIrql );
+
+	pVector->Done = i;
+	for (; i < pVector->Count; i++) {
+		pVector->Iov[i].Offset = offset;
+		pVector->Iov[i].Length = 0;
+	}
+	*pXferSize = offset;	// nothing past the data is copied back
+	return STATUS_SUCCESS;
+}
+
+//++
+// Function:	CancelRead
+//
+// Description:
+//		Cancel routine for a read waiting for data.
+//		Called holding the cancel spin lock.
+//
+// Arguments:
+//		pDevObj - Passed from I/O Manager
+//		pIrp - The read being cancelled
+//
+// Return value:
+//		None
+//--
+
+VOID CancelRead (
+		IN PDEVICE_OBJECT	pDevObj,
+		IN PIRP				pIrp			) {
+
+	PLOOPBACK_CHANNEL pChannel = ChannelOf( pIrp );
+	KIRQL oldIrql;
+
+	// The queue has its own lock
+	IoReleaseCancelSpinLock( pIrp->CancelIrql );
+
+	// Whoever dequeued the IRP without completing it left its
+	// entry pointing at itself, so this is always safe
+	KeAcquireSpinLock( &pChannel->lkRing, &oldIrql );
+	RemoveEntryList( &pIrp->Tail.Overlay.ListEntry );
+	KeReleaseSpinLock( &pChannel->lkRing, oldIrql );
+
+	pIrp->IoStatus.Status = STATUS_CANCELLED;
+	pIrp->IoStatus.Information = 0;
+	IoCompleteRequest( pIrp, IO_NO_INCREMENT );
+}
+
+//++
+// Function:	GetTransferBuffer
+//
+// Description:
+//		Finds a system address for a read or write's
+//		data: the SystemBuffer for buffered I/O, the
+//		MDL's pages for direct I/O
+//
+// Arguments:
+//		pIrp - Read or write IRP
+//
+// Return value:
+//		Buffer address, or NULL if there's no data or
+//		the pages couldn't be mapped
+//--
+
+PVOID GetTransferBuffer (
+		IN PIRP				pIrp			) {
+
+	if (DirectIo) {
+		if (pIrp->MdlAddress == NULL)	// zero-length transfer
+			return NULL;
+		return MmGetSystemAddressForMdlSafe( pIrp->MdlAddress,
+											 NormalPagePriority );
+	}
+	return pIrp->AssociatedIrp.SystemBuffer;
+}
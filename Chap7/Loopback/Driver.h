@@ -5,17 +5,75 @@
 
 #pragma once
 
+#ifdef WIN32DDK_TEST
+#include "DDKTestEnv.h"
+#else
 extern "C" {
 #include <NTDDK.h>
 }
+#endif
 #include "Unicode.h"
+#include "DevTable.h"
+#include "Ring.h"
+#include "LoopbackIoctl.h"
+
+// Capacity of each device's FIFO, from the BufferSize value
+// under the service's Parameters key
+#define LOOPBACK_DEFAULT_BUFFER	(64*1024)
+#define LOOPBACK_MIN_BUFFER		(4*1024)
+#define LOOPBACK_MAX_BUFFER		(4*1024*1024)
+
+// Number of devices (LBK1, LBK2...), from the DeviceCount value
+#define LOOPBACK_DEFAULT_DEVICES	1
+#define LOOPBACK_MAX_DEVICES		64
+
+// Most memory the channels of one device may use (their FIFOs and
+// shared-memory rings), from the MemoryLimit value.  Never less
+// than one FIFO.
+#define LOOPBACK_DEFAULT_MEMORY_LIMIT	(64*1024*1024)
+
+// Largest read or write the fast I/O routines serve themselves
+// (through a buffer on the stack); larger ones go as IRPs
+#define LOOPBACK_FAST_IO_MAX	512
 
 typedef struct _DEVICE_EXTENSION {
 	PDEVICE_OBJECT pDevice;
 	ULONG DeviceNumber;
 	CUString ustrDeviceName;	// internal name
 	CUString ustrSymLinkName;	// external name
-	// Reserve space for pointer to loopback buffer
-	PVOID deviceBuffer;
-	ULONG deviceBufferSize;
+	DEVICE_TABLE_ENTRY tableEntry;	// finds this device by number or name
+	KSPIN_LOCK lkMemory;
+	ULONG MemoryCharged;		// of MemoryLimit, under lkMemory
 } DEVICE_EXTENSION, *PDEVICE_EXTENSION;
+
+// Per-open state: each handle is a loopback of its own, reading
+// back what it wrote, so clients never share a buffer or a lock.
+// DispatchCreate hangs it off FileObject->FsContext.
+typedef struct _LOOPBACK_CHANNEL {
+	PDEVICE_EXTENSION pDevExt;	// its memory is charged to this device
+	// Data written and not yet read - allocated once, at
+	// DispatchCreate, and guarded by the spin lock
+	KSPIN_LOCK lkRing;
+	LOOPBACK_RING ring;
+	// Reads waiting for data, oldest first - only while the
+	// FIFO is empty.  Also under lkRing.
+	LIST_ENTRY pendingReads;
+	// Messages rather than bytes (IOCTL_LOOPBACK_MESSAGE_MODE):
+	// the FIFO holds records.  Also under lkRing.
+	BOOLEAN bMessageMode;
+	// Shared-memory ring, once IOCTL_LOOPBACK_MAP_RING has set
+	// it up (under lkRing, so only one gets set up)
+	PMDL pSharedMdl;			// its pages
+	PLOOPBACK_SHARED_RING pSharedRing;	// ... in system space
+	PVOID pSharedUserVa;		// ... in the process that mapped it
+	PEPROCESS pSharedProcess;	// (which is this one, referenced)
+	PKEVENT pSharedEvent;		// its consumer parks on this
+	ULONG SharedCharge;			// bytes charged to the device for it
+} LOOPBACK_CHANNEL, *PLOOPBACK_CHANNEL;
+
+// FIFO space a write of Length bytes takes
+#define ChannelNeeds(pChannel, Length)	\
+	((pChannel)->bMessageMode ? LoopbackRecordSize(Length) : (Length))
+
+#define ChannelOf(pIrp) ((PLOOPBACK_CHANNEL) \
+	IoGetCurrentIrpStackLocation(pIrp)->FileObject->FsContext)
@@ -97,6 +97,10 @@ PostBuild_Cmds=copy $(TargetPath) $(SystemRoot)\System32\Drivers\*.*
 # PROP Default_Filter "cpp;c;cxx;rc;def;r;odl;idl;hpj;bat"
 # Begin Source File
 
+SOURCE=.\DevTable.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\Driver.cpp
 # End Source File
 # Begin Source File
@@ -105,6 +109,10 @@ SOURCE=.\Loopback.reg
 # End Source File
 # Begin Source File
 
+SOURCE=.\Ring.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\Unicode.cpp
 # End Source File
 # End Group
@@ -113,14 +121,26 @@ SOURCE=.\Unicode.cpp
 # PROP Default_Filter "h;hpp;hxx;hm;inl"
 # Begin Source File
 
+SOURCE=.\DevTable.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\Driver.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\LoopbackIoctl.h
+# End Source File
+# Begin Source File
+
 SOURCE=D:\NTDDK\inc\ddk\ntddk.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\Ring.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\Unicode.h
 # End Source File
 # End Group
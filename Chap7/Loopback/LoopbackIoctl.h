@@ -0,0 +1,156 @@
+// LoopbackIoctl.h - Chapter 7 - Loopback Driver
+//
+// Copyright (C) 2000 by Jerry Lozano
+//
+
+// Device I/O controls of the Loopback driver, shared by the driver
+// and the programs that use them (Win32 code includes <winioctl.h>
+// first, for CTL_CODE)
+
+#pragma once
+
+//
+// Shared-memory ring.  IOCTL_LOOPBACK_MAP_RING sets up a ring of
+// records in locked pages mapped into the calling process, so a
+// producer thread and a consumer thread can pass messages without
+// any IRPs at all.  Records are a ULONG length and the data, padded
+// to LOOPBACK_RECORD_ALIGN; Head and Tail count bytes (mod 2^32) and
+// only ever grow.  The producer alone writes Head and the consumer
+// Tail, each on its own cache line, so neither side's line bounces
+// between processors on every message.
+//
+// A consumer that finds the ring empty sets Parked, looks once more,
+// and only then waits on its event.  A producer that finds Parked
+// set (after publishing Head) clears it and sends
+// IOCTL_LOOPBACK_KICK_RING, which sets the event - the only IRP on
+// the way, and only when the consumer really sleeps.  Both sides
+// must use interlocked operations (full barriers) for Head/Parked
+// and Tail/Parked, or each may miss the other's store.
+//
+// One ring per handle; it goes away when the handle is closed.
+//
+#define IOCTL_LOOPBACK_MAP_RING		\
+	CTL_CODE( FILE_DEVICE_UNKNOWN, 0x800,	\
+		METHOD_BUFFERED, FILE_ANY_ACCESS )
+
+#define IOCTL_LOOPBACK_KICK_RING	\
+	CTL_CODE( FILE_DEVICE_UNKNOWN, 0x801,	\
+		METHOD_BUFFERED, FILE_ANY_ACCESS )
+
+#define LOOPBACK_CACHE_LINE		64
+#define LOOPBACK_RECORD_ALIGN	sizeof(ULONG)
+
+// Bytes of a record (its length, its data and padding) - in the
+// shared ring, and in a message-mode read's buffer
+#define LoopbackRecordSize(Length)	(sizeof(ULONG) + \
+	(((Length) + LOOPBACK_RECORD_ALIGN - 1) & ~(LOOPBACK_RECORD_ALIGN - 1)))
+
+// IOCTL_LOOPBACK_MAP_RING's input...
+typedef struct _LOOPBACK_MAP_RING_IN {
+	HANDLE hEvent;		// auto-reset event the consumer parks on
+	ULONG Size;			// bytes of records: a power of 2, 4 KB to 4 MB
+} LOOPBACK_MAP_RING_IN, *PLOOPBACK_MAP_RING_IN;
+
+// ... and output
+typedef struct _LOOPBACK_MAP_RING_OUT {
+	PVOID pRing;		// LOOPBACK_SHARED_RING, in the caller's address space
+} LOOPBACK_MAP_RING_OUT, *PLOOPBACK_MAP_RING_OUT;
+
+// Starts the mapping (page aligned); the records follow it
+typedef struct _LOOPBACK_SHARED_RING {
+	// Producer's line
+	volatile ULONG Head;		// end of the last record written
+	UCHAR ProducerPad[LOOPBACK_CACHE_LINE - sizeof(ULONG)];
+	// Consumer's line
+	volatile ULONG Tail;		// end of the last record read
+	volatile LONG Parked;		// consumer is waiting, or about to
+	UCHAR ConsumerPad[LOOPBACK_CACHE_LINE - 2*sizeof(ULONG)];
+	// Set up by the driver
+	ULONG Size;					// bytes of records
+	UCHAR DriverPad[LOOPBACK_CACHE_LINE - sizeof(ULONG)];
+} LOOPBACK_SHARED_RING, *PLOOPBACK_SHARED_RING;
+
+#define LoopbackRingData(pRing)	((PUCHAR) ((pRing) + 1))
+
+//
+// Vectored reads and writes: many records in one IRP.  Both pass a
+// LOOPBACK_VECTOR - a count, one LOOPBACK_IOVEC per record, and the
+// records' data after those - as input and get it back, updated, as
+// output (one buffer for both will do).
+//
+// IOCTL_LOOPBACK_WRITEV writes each record to the channel in turn,
+// as WriteFile would, but whole or not at all: it stops at the
+// first record the FIFO hasn't room for.  Input is the whole
+// vector, data included; output needs only the IOVECs.
+//
+// IOCTL_LOOPBACK_READV reads up to each IOVEC's Length bytes for
+// each record in turn, as ReadFile would, but stops (rather than
+// waiting) once the channel is empty.  The driver packs the data
+// after the IOVECs and sets each Offset.  Input needs only the
+// IOVECs; output is the whole vector.
+//
+// Either way Done is the number of records transferred, and each
+// IOVEC's Length the bytes transferred for it (0 from Done on).
+//
+#define IOCTL_LOOPBACK_WRITEV		\
+	CTL_CODE( FILE_DEVICE_UNKNOWN, 0x802,	\
+		METHOD_BUFFERED, FILE_ANY_ACCESS )
+
+#define IOCTL_LOOPBACK_READV		\
+	CTL_CODE( FILE_DEVICE_UNKNOWN, 0x803,	\
+		METHOD_BUFFERED, FILE_ANY_ACCESS )
+
+typedef struct _LOOPBACK_IOVEC {
+	ULONG Offset;		// of the data, from the start of the LOOPBACK_VECTOR
+	ULONG Length;		// bytes to write, or room to read into; then bytes moved
+} LOOPBACK_IOVEC, *PLOOPBACK_IOVEC;
+
+typedef struct _LOOPBACK_VECTOR {
+	ULONG Count;		// IOVECs
+	ULONG Done;			// set by the driver
+	LOOPBACK_IOVEC Iov[1];	// Count of them, then the data
+} LOOPBACK_VECTOR, *PLOOPBACK_VECTOR;
+
+// Bytes of a vector up to its data
+#define LoopbackVectorSize(Count)	\
+	(2*sizeof(ULONG) + (Count) * sizeof(LOOPBACK_IOVEC))
+
+//
+// Message mode.  IOCTL_LOOPBACK_MESSAGE_MODE (no buffers) turns a
+// handle's channel from a byte stream into a queue of messages, as
+// long as nothing is in it yet (else STATUS_INVALID_DEVICE_STATE).
+// Each write is then one message, queued whole or not at all: a
+// message the FIFO has no room for now fails with
+// STATUS_DEVICE_BUSY, one it could never hold with
+// STATUS_INVALID_PARAMETER.  Zero-length writes do nothing, as in
+// byte mode.
+//
+// A read takes as many whole messages as fit in its buffer, each as
+// a record (see LoopbackRecordSize), so a buffer of
+// LoopbackRecordSize(n) bytes holds a message of n.  If the next
+// message doesn't fit, the read fails with STATUS_BUFFER_TOO_SMALL
+// and takes nothing.  READV fills each IOVEC the same way.
+//
+#define IOCTL_LOOPBACK_MESSAGE_MODE	\
+	CTL_CODE( FILE_DEVICE_UNKNOWN, 0x804,	\
+		METHOD_BUFFERED, FILE_ANY_ACCESS )
+
+//
+// Small reads and writes without an IRP.  On a synchronous handle
+// the I/O manager offers every DeviceIoControl to the driver's
+// FastIoDeviceControl before it builds an IRP - the fast I/O entry
+// it uses for a device that isn't a file system (FastIoRead and
+// FastIoWrite are only tried on files the cache manager holds).
+// IOCTL_LOOPBACK_WRITE writes its input buffer and
+// IOCTL_LOOPBACK_READ reads into its output buffer, as WriteFile and
+// ReadFile would, and the byte count is the bytes moved.  The driver
+// serves the small ones that can be done at once itself; the rest
+// take an IRP, and a read of an empty channel waits in it.
+//
+#define IOCTL_LOOPBACK_WRITE		\
+	CTL_CODE( FILE_DEVICE_UNKNOWN, 0x805,	\
+		METHOD_BUFFERED, FILE_ANY_ACCESS )
+
+#define IOCTL_LOOPBACK_READ			\
+	CTL_CODE( FILE_DEVICE_UNKNOWN, 0x806,	\
+		METHOD_BUFFERED, FILE_ANY_ACCESS )
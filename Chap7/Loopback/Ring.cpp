@@ -0,0 +1,150 @@
+//
+// Ring.cpp - Chapter 7 - Loopback ring buffer
+//
+// Copyright (C) 2000 by Jerry Lozano
+//
+
+#ifdef WIN32DDK_TEST
+#include "DDKTestEnv.h"
+#else
+extern "C" {
+#include <NTDDK.h>
+}
+#endif
+
+#include "Ring.h"
+
+#define RING_POOL_TAG	1635
+
+//++
+// Function:	RingInitialize
+//
+// Description:
+//		Allocates an empty ring buffer
+//
+// Arguments:
+//		pRing - Ring to set up
+//		Size - Capacity in bytes
+//
+// Return value:
+//		NTSTATUS signaling success or failure
+//--
+NTSTATUS RingInitialize(
+		IN PLOOPBACK_RING	pRing,
+		IN ULONG			Size			) {
+	pRing->pBuffer = (PUCHAR)
+		ExAllocatePoolWithTag(NonPagedPool, Size, RING_POOL_TAG);
+	if (pRing->pBuffer == NULL) {
+		pRing->Size = 0;
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	pRing->Size = Size;
+	pRing->Head = pRing->Count = 0;
+	return STATUS_SUCCESS;
+}
+
+//++
+// Function:	RingFree
+//
+// Description:
+//		Releases the ring's buffer, dropping any data in it
+//
+// Arguments:
+//		pRing - Ring set up by RingInitialize
+//
+// Return value:
+//		None
+//--
+VOID RingFree(
+		IN PLOOPBACK_RING	pRing			) {
+	if (pRing->pBuffer != NULL)
+		ExFreePool(pRing->pBuffer);
+	pRing->pBuffer = NULL;
+	pRing->Size = pRing->Head = pRing->Count = 0;
+}
+
+//++
+// Function:	RingWrite
+//
+// Description:
+//		Appends data behind whatever the ring holds.  The
+//		free space may wrap, so it takes up to two copies.
+//
+// Arguments:
+//		pRing - Ring set up by RingInitialize
+//		pData - Data to append
+//		Length - Bytes of data
+//
+// Return value:
+//		Bytes appended - less than Length if the ring filled up
+//--
+ULONG RingWrite(
+		IN PLOOPBACK_RING	pRing,
+		IN const VOID*		pData,
+		IN ULONG			Length			) {
+	ULONG nBytes = min(Length, RingSpace(pRing));
+	// Tail is where the next byte goes
+	ULONG tail = pRing->Head + pRing->Count;
+	if (tail >= pRing->Size)
+		tail -= pRing->Size;
+	ULONG nFirst = min(nBytes, pRing->Size - tail);
+	RtlCopyMemory(pRing->pBuffer + tail, pData, nFirst);
+	RtlCopyMemory(pRing->pBuffer, (const UCHAR*) pData + nFirst, nBytes - nFirst);
+	pRing->Count += nBytes;
+	return nBytes;
+}
+
+//++
+// Function:	RingPeek
+//
+// Description:
+//		Copies the oldest bytes out of the ring without
+//		taking them, in up to two copies
+//
+// Arguments:
+//		pRing - Ring set up by RingInitialize
+//		pData - Where to put the bytes
+//		Length - Most bytes wanted
+//
+// Return value:
+//		Bytes copied - less than Length if the ring ran dry
+//--
+ULONG RingPeek(
+		IN PLOOPBACK_RING	pRing,
+		OUT PVOID			pData,
+		IN ULONG			Length			) {
+	ULONG nBytes = min(Length, RingBytes(pRing));
+	ULONG nFirst = min(nBytes, pRing->Size - pRing->Head);
+	RtlCopyMemory(pData, pRing->pBuffer + pRing->Head, nFirst);
+	RtlCopyMemory((PUCHAR) pData + nFirst, pRing->pBuffer, nBytes - nFirst);
+	return nBytes;
+}
+
+//++
+// Function:	RingRead
+//
+// Description:
+//		Takes the oldest bytes out of the ring, in up
+//		to two copies
+//
+// Arguments:
+//		pRing - Ring set up by RingInitialize
+//		pData - Where to put the bytes
+//		Length - Most bytes wanted
+//
+// Return value:
+//		Bytes taken - less than Length if the ring ran dry
+//--
+ULONG RingRead(
+		IN PLOOPBACK_RING	pRing,
+		OUT PVOID			pData,
+		IN ULONG			Length			) {
+	ULONG nBytes = RingPeek(pRing, pData, Length);
+	pRing->Head += nBytes;
+	if (pRing->Head >= pRing->Size)
+		pRing->Head -= pRing->Size;
+	pRing->Count -= nBytes;
+	if (pRing->Count == 0)
+		pRing->Head = 0;	// keeps the next message in one piece
+	return nBytes;
+}
@@ -0,0 +1,46 @@
+// Ring.h - Chapter 7 - Loopback ring buffer
+//
+// Copyright (C) 2000 by Jerry Lozano
+//
+// A fixed-size circular byte buffer (FIFO), allocated once, so
+// writes and reads only ever copy.  Not synchronized: callers
+// hold their own lock.  Include NTDDK.h first.
+//
+
+#pragma once
+
+typedef struct _LOOPBACK_RING {
+	PUCHAR pBuffer;		// nonpaged - touched under a spin lock
+	ULONG Size;			// capacity in bytes
+	ULONG Head;			// offset of the oldest byte
+	ULONG Count;		// bytes held
+} LOOPBACK_RING, *PLOOPBACK_RING;
+
+#define RingBytes(pRing)	((pRing)->Count)
+#define RingSpace(pRing)	((pRing)->Size - (pRing)->Count)
+
+NTSTATUS RingInitialize(
+		IN PLOOPBACK_RING	pRing,
+		IN ULONG			Size			);
+
+VOID RingFree(
+		IN PLOOPBACK_RING	pRing			);
+
+// Appends as much of the data as fits; returns how much that was
+ULONG RingWrite(
+		IN PLOOPBACK_RING	pRing,
+		IN const VOID*		pData,
+		IN ULONG			Length			);
+
+// Copies up to Length of the oldest bytes, leaving them in the
+// ring; returns how many
+ULONG RingPeek(
+		IN PLOOPBACK_RING	pRing,
+		OUT PVOID			pData,
+		IN ULONG			Length			);
+
+// Removes up to Length of the oldest bytes; returns how many
+ULONG RingRead(
+		IN PLOOPBACK_RING	pRing,
+		OUT PVOID			pData,
+		IN ULONG			Length			);
@@ -1,13 +1,793 @@
 // Testor for Chapter 7 Loopback Driver
 
+#ifdef WIN32DDK_TEST
+// Linux build: the driver runs inside this program (see
+// Chap5/DDKTestWin32.h and the build line in Chap5/ReadMe.txt)
+#include "DDKTestWin32.h"
+extern "C" NTSTATUS DriverEntry(PDRIVER_OBJECT, PUNICODE_STRING);
+#define TEST_BUFFER_SIZE 8192	// Parameters\BufferSize for the test
+#define BENCH_BUFFER_SIZE (4*1024*1024)	// ... and for -bench
+#define TEST_DEVICE_COUNT 4		// Parameters\DeviceCount for the test
+#define BENCH_DEVICE_COUNT 8	// ... and for -bench
+#define TEST_MEMORY_LIMIT (16*TEST_BUFFER_SIZE)	// Parameters\MemoryLimit for the test
+#define BENCH_MEMORY_LIMIT (64*BENCH_BUFFER_SIZE)	// ... and for -bench
+#else
 #include <windows.h>
+#include <winioctl.h>
+#endif
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "../Loopback/LoopbackIoctl.h"
 
-int main() {
+// Writes blocks until the driver's FIFO refuses more, then
+// reads them all back.  Returns the FIFO's capacity, or 0 on error.
+static DWORD FillAndDrain(HANDLE hDevice) {
+	static char block[3000];	// not a divisor - ends short
+	DWORD total = 0, bW, bR;
+	for (;;) {
+		for (DWORD i = 0; i < sizeof(block); i++)
+			block[i] = (char) (total + i);
+		if (!WriteFile(hDevice, block, sizeof(block), &bW, NULL))
+			break;
+		total += bW;
+		if (bW < sizeof(block))
+			break;		// short write - full now
+	}
+	// Full: the next write must fail with ERROR_BUSY
+	if (WriteFile(hDevice, block, 1, &bW, NULL) ||
+			GetLastError() != ERROR_BUSY) {
+		printf("Write to a full device did not fail with ERROR_BUSY\n");
+		return 0;
+	}
+	for (DWORD done = 0; done < total; done += bR) {
+		if (!ReadFile(hDevice, block, sizeof(block), &bR, NULL) || bR == 0) {
+			printf("Device returned only %d of %d bytes\n", done, total);
+			return 0;
+		}
+		for (DWORD i = 0; i < bR; i++)
+			if (block[i] != (char) (done + i)) {
+				printf("Byte %d came back wrong\n", done + i);
+				return 0;
+			}
+	}
+	return total;
+}
+
+// Opens LBKn - LBK1 is device 0
+static HANDLE OpenLBK(DWORD number, DWORD dwFlags) {
+	char name[32];
+	sprintf(name, "\\\\.\\LBK%d", number);
+	return CreateFile(name, GENERIC_READ | GENERIC_WRITE,
+					  0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | dwFlags, NULL );
+}
+
+static HANDLE OpenLBK1(DWORD dwFlags) {
+	return OpenLBK(1, dwFlags);
+}
+
+// Waits for an overlapped ReadFile or WriteFile - bStarted is what
+// it returned
+static BOOL Finish(HANDLE hDevice, BOOL bStarted, OVERLAPPED* pOverlapped,
+				   DWORD* pCount) {
+	if (!bStarted && GetLastError() != ERROR_IO_PENDING)
+		return FALSE;
+	return GetOverlappedResult(hDevice, pOverlapped, pCount, TRUE);
+}
+
+// Writes a message and reads it back on an overlapped handle - two
+// IRPs, as the driver's fast I/O routines only see synchronous ones
+static BOOL PassByIrp(HANDLE hDevice, const char* pMessage, char* pReceived,
+					  DWORD length) {
+	OVERLAPPED ovRead, ovWrite;
+	DWORD bW, bR;
+	memset(&ovRead, 0, sizeof(ovRead));
+	memset(&ovWrite, 0, sizeof(ovWrite));
+	return Finish(hDevice, WriteFile(hDevice, pMessage, length, NULL, &ovWrite),
+				  &ovWrite, &bW) &&
+		   Finish(hDevice, ReadFile(hDevice, pReceived, length, NULL, &ovRead),
+				  &ovRead, &bR) &&
+		   bR == length;
+}
+
+// IOCTL_LOOPBACK_WRITE and IOCTL_LOOPBACK_READ: WriteFile and
+// ReadFile that the driver's fast I/O routine can serve without an
+// IRP, on a synchronous handle
+static BOOL FastWrite(HANDLE hDevice, const char* pMessage, DWORD length,
+					  DWORD* pWritten) {
+	return DeviceIoControl(hDevice, IOCTL_LOOPBACK_WRITE, (LPVOID) pMessage,
+						   length, NULL, 0, pWritten, NULL);
+}
+
+static BOOL FastRead(HANDLE hDevice, char* pReceived, DWORD length,
+					 DWORD* pRead) {
+	return DeviceIoControl(hDevice, IOCTL_LOOPBACK_READ, NULL, 0,
+						   pReceived, length, pRead, NULL);
+}
+
+// One end of a shared-memory ring (see LoopbackIoctl.h).  Each end
+// keeps its own index and a copy of the other's, and reads the
+// shared one only when its copy says the ring is full (or empty).
+// The padding keeps the two ends' copies off each other's line.
+typedef struct _RING_END {
 	HANDLE hDevice;
-	BOOL status;
+	HANDLE hEvent;				// the consumer's, to park on
+	PLOOPBACK_SHARED_RING pRing;
+	ULONG index;				// Head for the producer, Tail for the consumer
+	ULONG peer;					// ... and the other one, as last seen
+	DWORD waits;				// kicks sent, or times parked
+	char pad[LOOPBACK_CACHE_LINE];
+} RING_END;
+
+// Maps hDevice's ring (of size bytes), and sets up both its ends
+static BOOL MapRing(HANDLE hDevice, HANDLE hEvent, DWORD size,
+					RING_END* pProducer, RING_END* pConsumer) {
+	LOOPBACK_MAP_RING_IN in;
+	LOOPBACK_MAP_RING_OUT out;
+	DWORD bytes;
+	in.hEvent = hEvent;
+	in.Size = size;
+	if (!DeviceIoControl(hDevice, IOCTL_LOOPBACK_MAP_RING, &in, sizeof(in),
+						 &out, sizeof(out), &bytes, NULL) || bytes != sizeof(out))
+		return FALSE;
+	memset(pProducer, 0, sizeof(RING_END));
+	pProducer->hDevice = hDevice;
+	pProducer->pRing = (PLOOPBACK_SHARED_RING) out.pRing;
+	*pConsumer = *pProducer;
+	pConsumer->hEvent = hEvent;
+	return TRUE;
+}
+
+// An interlocked read of the other end's index - a full barrier, so
+// the records (or the free space) it shows are seen after it
+static ULONG PeerIndex(volatile ULONG* pIndex) {
+	return (ULONG) InterlockedCompareExchange((LONG volatile*) pIndex, 0, 0);
+}
+
+static void CopyToRing(PLOOPBACK_SHARED_RING pRing, ULONG at,
+					   const void* pFrom, ULONG n) {
+	ULONG offset = at & (pRing->Size - 1);
+	ULONG first = (n < pRing->Size - offset) ? n : pRing->Size - offset;
+	memcpy(LoopbackRingData(pRing) + offset, pFrom, first);
+	memcpy(LoopbackRingData(pRing), (const char*) pFrom + first, n - first);
+}
+
+static void CopyFromRing(PLOOPBACK_SHARED_RING pRing, ULONG at,
+						 void* pTo, ULONG n) {
+	ULONG offset = at & (pRing->Size - 1);
+	ULONG first = (n < pRing->Size - offset) ? n : pRing->Size - offset;
+	memcpy(pTo, LoopbackRingData(pRing) + offset, first);
+	memcpy((char*) pTo + first, LoopbackRingData(pRing), n - first);
+}
+
+// Appends a record, and wakes the consumer if it's parked.  FALSE
+// if the ring hasn't room for it.
+static BOOL RingPut(RING_END* pEnd, const void* pRecord, ULONG length) {
+	PLOOPBACK_SHARED_RING pRing = pEnd->pRing;
+	ULONG need = LoopbackRecordSize(length);
+	if (pRing->Size - (pEnd->index - pEnd->peer) < need) {
+		pEnd->peer = PeerIndex(&pRing->Tail);
+		if (pRing->Size - (pEnd->index - pEnd->peer) < need)
+			return FALSE;
+	}
+	CopyToRing(pRing, pEnd->index, &length, sizeof(ULONG));
+	CopyToRing(pRing, pEnd->index + sizeof(ULONG), pRecord, length);
+	pEnd->index += need;
+	// Publish it - and, with the same barrier, look at Parked only
+	// after: a consumer that parks later will see the record
+	InterlockedExchange((LONG volatile*) &pRing->Head, pEnd->index);
+	if (pRing->Parked && InterlockedExchange(&pRing->Parked, 0)) {
+		DWORD bytes;
+		pEnd->waits++;
+		return DeviceIoControl(pEnd->hDevice, IOCTL_LOOPBACK_KICK_RING,
+							   NULL, 0, NULL, 0, &bytes, NULL);
+	}
+	return TRUE;
+}
+
+// Takes the next record into pBuffer (size bytes) - parking until
+// there is one, if bWait.  *pLength is the record's whole length.
+static BOOL RingGet(RING_END* pEnd, BOOL bWait, void* pBuffer, ULONG size,
+					ULONG* pLength) {
+	PLOOPBACK_SHARED_RING pRing = pEnd->pRing;
+	while (pEnd->index == pEnd->peer) {
+		pEnd->peer = PeerIndex(&pRing->Head);
+		if (pEnd->index != pEnd->peer)
+			break;
+		if (!bWait)
+			return FALSE;
+		// Say so, then look once more - a producer that missed
+		// Parked published its record before we set it
+		InterlockedExchange(&pRing->Parked, 1);
+		pEnd->peer = PeerIndex(&pRing->Head);
+		if (pEnd->index != pEnd->peer) {
+			// A kick may be on its way anyway; it leaves the
+			// event set, and the next park falls through
+			InterlockedExchange(&pRing->Parked, 0);
+			break;
+		}
+		pEnd->waits++;
+		if (WaitForSingleObject(pEnd->hEvent, INFINITE) != WAIT_OBJECT_0)
+			return FALSE;
+	}
+	CopyFromRing(pRing, pEnd->index, pLength, sizeof(ULONG));
+	CopyFromRing(pRing, pEnd->index + sizeof(ULONG), pBuffer,
+				 (*pLength < size) ? *pLength : size);
+	pEnd->index += LoopbackRecordSize(*pLength);
+	InterlockedExchange((LONG volatile*) &pRing->Tail, pEnd->index);
+	return TRUE;
+}
+
+// The producer side of the shared-ring tests and benchmark: count
+// records of length bytes, each starting with its number
+typedef struct _PRODUCER {
+	RING_END end;
+	DWORD count;
+	DWORD length;
+	BOOL ok;
+} PRODUCER;
+
+static DWORD WINAPI ProducerThread(LPVOID pContext) {
+	PRODUCER* pProducer = (PRODUCER*) pContext;
+	char record[256];
+	memset(record, 'r', sizeof(record));
+	pProducer->ok = TRUE;
+	for (DWORD i = 0; i < pProducer->count && pProducer->ok; i++) {
+		memcpy(record, &i, sizeof(i));
+		while (!RingPut(&pProducer->end, record, pProducer->length))
+			Sleep(0);	// full - let the consumer catch up
+	}
+	return 0;
+}
+
+// Takes what a ProducerThread sends, checking the numbers.
+// Returns FALSE if a record is missing or out of order.
+static BOOL ConsumeRecords(RING_END* pEnd, DWORD count, DWORD length) {
+	char record[256];
+	ULONG recordLength;
+	for (DWORD i = 0; i < count; i++) {
+		DWORD number;
+		if (!RingGet(pEnd, TRUE, record, sizeof(record), &recordLength) ||
+				recordLength != length)
+			return FALSE;
+		memcpy(&number, record, sizeof(number));
+		if (number != i)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+// Writes count records of length bytes, record j filled with
+// (char) (first + j), in one IOCTL_LOOPBACK_WRITEV.  pBuffer holds
+// LoopbackVectorSize(count) + count * length bytes.
+static BOOL PutVector(HANDLE hDevice, char* pBuffer, DWORD count,
+					  DWORD length, DWORD first, DWORD* pDone) {
+	PLOOPBACK_VECTOR pVector = (PLOOPBACK_VECTOR) pBuffer;
+	DWORD offset = LoopbackVectorSize(count);
+	pVector->Count = count;
+	for (DWORD j = 0; j < count; j++, offset += length) {
+		pVector->Iov[j].Offset = offset;
+		pVector->Iov[j].Length = length;
+		memset(pBuffer + offset, (char) (first + j), length);
+	}
+	DWORD bytes;
+	if (!DeviceIoControl(hDevice, IOCTL_LOOPBACK_WRITEV, pBuffer, offset,
+						 pBuffer, LoopbackVectorSize(count), &bytes, NULL))
+		return FALSE;
+	*pDone = pVector->Done;
+	return TRUE;
+}
+
+// Reads up to count records of up to length bytes in one
+// IOCTL_LOOPBACK_READV, and checks each is length bytes of
+// (char) (first + j).  pBuffer is as for PutVector.
+static BOOL GetVector(HANDLE hDevice, char* pBuffer, DWORD count,
+					  DWORD length, DWORD first, DWORD* pDone) {
+	PLOOPBACK_VECTOR pVector = (PLOOPBACK_VECTOR) pBuffer;
+	pVector->Count = count;
+	for (DWORD j = 0; j < count; j++)
+		pVector->Iov[j].Length = length;
+	DWORD bytes;
+	if (!DeviceIoControl(hDevice, IOCTL_LOOPBACK_READV,
+						 pBuffer, LoopbackVectorSize(count), pBuffer,
+						 LoopbackVectorSize(count) + count * length, &bytes, NULL))
+		return FALSE;
+	for (DWORD j = 0; j < pVector->Done; j++) {
+		const char* pData = pBuffer + pVector->Iov[j].Offset;
+		// Right length, first byte right, and all bytes the same
+		if (pVector->Iov[j].Length != length ||
+			(length != 0 && (pData[0] != (char) (first + j) ||
+							 memcmp(pData, pData + 1, length - 1) != 0)))
+			return FALSE;
+	}
+	*pDone = pVector->Done;
+	return TRUE;
+}
+
+// Streams messages of 4 KB to 4 MB through one overlapped handle,
+// 128 MB for each size, and reports the throughput.  Each read is
+// already waiting when its message is written, so the driver copies
+// the message once, straight into the reader's buffer; with buffered
+// I/O the I/O manager copies it twice more.
+static int StreamBenchmark(const char* pMode) {
+	static const DWORD sizes[] = {4096, 65536, 1024*1024, 4*1024*1024};
+	const ULONGLONG total = 128*1024*1024;
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	printf("%-9s %8s %8s %8s %14s\n",
+		"I/O", "Message", "Count", "GB/s", "I/O mgr copies");
+	for (DWORD i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		DWORD size = sizes[i];
+		HANDLE hDevice = OpenLBK1(FILE_FLAG_OVERLAPPED);
+		if (hDevice == INVALID_HANDLE_VALUE) {
+			printf("Failed to open LBK1 - error: %d\n", GetLastError() );
+			return 1;
+		}
+		char* message = new char[size];
+		char* received = new char[size];
+		memset(message, 'x', size);
+		BOOL ok = TRUE;
+#ifdef WIN32DDK_TEST
+		ULONGLONG copies0, bytes0, copies1, bytes1;
+		TestEnvQueryIoCopies(&copies0, &bytes0);
+#endif
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		for (ULONGLONG sent = 0; sent < total; sent += size) {
+			OVERLAPPED ovRead, ovWrite;
+			DWORD bR, bW;
+			memset(&ovRead, 0, sizeof(ovRead));
+			memset(&ovWrite, 0, sizeof(ovWrite));
+			BOOL bRead = ReadFile(hDevice, received, size, NULL, &ovRead);
+			if (!Finish(hDevice,
+					WriteFile(hDevice, message, size, NULL, &ovWrite), &ovWrite, &bW) ||
+				!Finish(hDevice, bRead, &ovRead, &bR) || bR != size) {
+				printf("Failed to pass a message - error: %d\n", GetLastError() );
+				ok = FALSE;
+				break;
+			}
+		}
+		QueryPerformanceCounter(&end);
+		CloseHandle(hDevice);
+		delete[] message;
+		delete[] received;
+		if (!ok)
+			return 2;
+
+		double seconds = (double) (end.QuadPart - start.QuadPart) / freq.QuadPart;
+		printf("%-9s %7dK %8d %8.2f", pMode, size / 1024,
+			(int) (total / size), total / seconds / (1024*1024*1024));
+#ifdef WIN32DDK_TEST
+		TestEnvQueryIoCopies(&copies1, &bytes1);
+		printf(" %14.2f", (double) (bytes1 - bytes0) / total);	// per byte moved
+#endif
+		printf("\n");
+	}
+	return 0;
+}
+
+// One of the scaling benchmark's clients: writes and reads back 4 KB
+// messages on a handle of its own
+typedef struct _CLIENT {
+	HANDLE hDevice;
+	DWORD count;
+	BOOL ok;
+} CLIENT;
+
+static DWORD WINAPI ClientThread(LPVOID pContext) {
+	CLIENT* pClient = (CLIENT*) pContext;
+	char message[4096], received[4096];
+	DWORD bW, bR;
+	memset(message, 'x', sizeof(message));
+	pClient->ok = TRUE;
+	for (DWORD i = 0; i < pClient->count && pClient->ok; i++)
+		pClient->ok =
+			WriteFile(pClient->hDevice, message, sizeof(message), &bW, NULL) &&
+			ReadFile(pClient->hDevice, received, sizeof(received), &bR, NULL) &&
+			bR == sizeof(received);
+	return 0;
+}
+
+// Runs 1 to 8 clients at once, all on LBK1 or each on a device of
+// its own (LBK1 to LBK8 - DeviceCount must be 8 or more).  Each
+// handle has its own channel, so the clients shouldn't slow each
+// other down either way.
+static int ScalingBenchmark(const char* pMode, BOOL bPerDevice) {
+	const DWORD count = 100000;		// messages per client
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	printf("%-9s %8s %8s %12s %12s\n",
+		"I/O", "Clients", "Devices", "Messages/s", "Per client");
+	for (DWORD nClients = 1; nClients <= 8; nClients *= 2) {
+		CLIENT clients[8];
+		HANDLE hThreads[8];
+		for (DWORD i = 0; i < nClients; i++) {
+			clients[i].hDevice = OpenLBK(bPerDevice ? i + 1 : 1, 0);
+			clients[i].count = count;
+			if (clients[i].hDevice == INVALID_HANDLE_VALUE) {
+				printf("Failed to open LBK%d - error: %d\n",
+					bPerDevice ? i + 1 : 1, GetLastError() );
+				return 1;
+			}
+		}
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		for (DWORD i = 0; i < nClients; i++)
+			hThreads[i] = CreateThread(NULL, 0, ClientThread, &clients[i], 0, NULL);
+		for (DWORD i = 0; i < nClients; i++) {
+			WaitForSingleObject(hThreads[i], INFINITE);
+			CloseHandle(hThreads[i]);
+		}
+		QueryPerformanceCounter(&end);
+		for (DWORD i = 0; i < nClients; i++) {
+			CloseHandle(clients[i].hDevice);
+			if (!clients[i].ok) {
+				printf("Client %d failed\n", i);
+				return 2;
+			}
+		}
+		double seconds = (double) (end.QuadPart - start.QuadPart) / freq.QuadPart;
+		double rate = nClients * count / seconds;
+		printf("%-9s %8d %8d %12.0f %12.0f\n", pMode, nClients,
+			bPerDevice ? nClients : 1, rate, rate / nClients);
+	}
+	return 0;
+}
+
+// Small messages (64 bytes) from a producer thread to a consumer,
+// first with a WriteFile and a ReadFile each - two IRPs - then
+// through a shared-memory ring, where only the consumer's wake-ups
+// cost an IRP
+static int SharedRingBenchmark(const char* pMode) {
+	const DWORD count = 1000000;
+	const DWORD length = 64;
+	LARGE_INTEGER freq, start, end;
+	QueryPerformanceFrequency(&freq);
+
+	printf("%-9s %-12s %12s %14s\n", "I/O", "Path", "Messages/s", "IRPs/message");
+	HANDLE hDevice = OpenLBK1(0);
+	if (hDevice == INVALID_HANDLE_VALUE) {
+		printf("Failed to open LBK1 - error: %d\n", GetLastError() );
+		return 1;
+	}
+	HANDLE hIrpDevice = OpenLBK1(FILE_FLAG_OVERLAPPED);
+	if (hIrpDevice == INVALID_HANDLE_VALUE) {
+		printf("Failed to open LBK1 - error: %d\n", GetLastError() );
+		CloseHandle(hDevice);
+		return 1;
+	}
+	char message[64], received[64];
+	memset(message, 'x', sizeof(message));
+	QueryPerformanceCounter(&start);
+	for (DWORD i = 0; i < count / 10; i++)
+		if (!PassByIrp(hIrpDevice, message, received, length)) {
+			printf("Failed to pass a message - error: %d\n", GetLastError() );
+			CloseHandle(hIrpDevice);
+			CloseHandle(hDevice);
+			return 2;
+		}
+	QueryPerformanceCounter(&end);
+	CloseHandle(hIrpDevice);
+	double seconds = (double) (end.QuadPart - start.QuadPart) / freq.QuadPart;
+	printf("%-9s %-12s %12.0f %14.2f\n", pMode, "Read/Write", count / 10 / seconds, 2.0);
+
+	HANDLE hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	PRODUCER producer;
+	RING_END consumer;
+	if (!MapRing(hDevice, hEvent, 64*1024, &producer.end, &consumer)) {
+		printf("Failed to map the shared ring - error: %d\n", GetLastError() );
+		CloseHandle(hEvent);
+		CloseHandle(hDevice);
+		return 3;
+	}
+	producer.count = count;
+	producer.length = length;
+	QueryPerformanceCounter(&start);
+	HANDLE hThread = CreateThread(NULL, 0, ProducerThread, &producer, 0, NULL);
+	BOOL ok = ConsumeRecords(&consumer, count, length);
+	WaitForSingleObject(hThread, INFINITE);
+	QueryPerformanceCounter(&end);
+	CloseHandle(hThread);
+	CloseHandle(hEvent);
+	CloseHandle(hDevice);
+	if (!ok || !producer.ok) {
+		printf("Shared ring lost or reordered messages\n");
+		return 4;
+	}
+	seconds = (double) (end.QuadPart - start.QuadPart) / freq.QuadPart;
+	printf("%-9s %-12s %12.0f %14.4f\n", pMode, "Shared ring", count / seconds,
+		(double) producer.end.waits / count);
+	return 0;
+}
+
+// Small records (16 to 256 bytes), first with a WriteFile and a
+// ReadFile each, then 256 at a time with IOCTL_LOOPBACK_WRITEV and
+// IOCTL_LOOPBACK_READV - two IRPs per batch rather than per record
+static int VectorBenchmark(const char* pMode) {
+	static const DWORD lengths[] = {16, 64, 256};
+	const DWORD count = 1024*1024;		// records for each length
+	const DWORD batch = 256;
+	LARGE_INTEGER freq, start, end;
+	QueryPerformanceFrequency(&freq);
+
+	printf("%-9s %8s %-12s %12s\n", "I/O", "Record", "Path", "Records/s");
+	HANDLE hDevice = OpenLBK1(0);
+	if (hDevice == INVALID_HANDLE_VALUE) {
+		printf("Failed to open LBK1 - error: %d\n", GetLastError() );
+		return 1;
+	}
+	HANDLE hIrpDevice = OpenLBK1(FILE_FLAG_OVERLAPPED);
+	if (hIrpDevice == INVALID_HANDLE_VALUE) {
+		printf("Failed to open LBK1 - error: %d\n", GetLastError() );
+		CloseHandle(hDevice);
+		return 1;
+	}
+	char* pBuffer = new char[LoopbackVectorSize(batch) + batch * 256];
+	int result = 0;
+	for (DWORD i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		DWORD length = lengths[i];
+		QueryPerformanceCounter(&start);
+		for (DWORD n = 0; n < count / 16; n++)
+			if (!PassByIrp(hIrpDevice, pBuffer, pBuffer + 256, length)) {
+				printf("Failed to pass a record - error: %d\n", GetLastError() );
+				result = 2;
+				break;
+			}
+		if (result != 0)
+			break;
+		QueryPerformanceCounter(&end);
+		double seconds = (double) (end.QuadPart - start.QuadPart) / freq.QuadPart;
+		double perRecord = count / 16 / seconds;
+		printf("%-9s %8d %-12s %12.0f\n", pMode, length, "Read/Write", perRecord);
+
+		QueryPerformanceCounter(&start);
+		for (DWORD n = 0; n < count; n += batch) {
+			DWORD nPut, nGot;
+			if (!PutVector(hDevice, pBuffer, batch, length, n, &nPut) ||
+					!GetVector(hDevice, pBuffer, batch, length, n, &nGot) ||
+					nPut != batch || nGot != batch) {
+				printf("Failed to pass a vector - error: %d\n", GetLastError() );
+				result = 3;
+				break;
+			}
+		}
+		if (result != 0)
+			break;
+		QueryPerformanceCounter(&end);
+		seconds = (double) (end.QuadPart - start.QuadPart) / freq.QuadPart;
+		printf("%-9s %8d %-12s %12.0f (x%.1f)\n", pMode, length, "Vectored",
+			count / seconds, count / seconds / perRecord);
+	}
+	delete[] pBuffer;
+	CloseHandle(hIrpDevice);
+	CloseHandle(hDevice);
+	return result;
+}
 
-	printf("Beginning test of Loopback Driver (CH7)...\n");
+// Per-call latency of small writes and reads: IOCTL_LOOPBACK_WRITE
+// and READ on a synchronous handle, which the driver's fast I/O
+// routines serve, against WriteFile and ReadFile on an overlapped
+// handle, which always get IRPs
+static int FastIoBenchmark(const char* pMode) {
+	static const DWORD lengths[] = {16, 64, 512};
+	const DWORD count = 1000000;		// pairs for each length and path
+	LARGE_INTEGER freq, start, end;
+	QueryPerformanceFrequency(&freq);
+
+	printf("%-9s %8s %-10s %10s\n", "I/O", "Message", "Path", "ns/call");
+	HANDLE hSync = OpenLBK1(0);
+	HANDLE hAsync = OpenLBK1(FILE_FLAG_OVERLAPPED);
+	if (hSync == INVALID_HANDLE_VALUE || hAsync == INVALID_HANDLE_VALUE) {
+		printf("Failed to open LBK1 - error: %d\n", GetLastError() );
+		return 1;
+	}
+	char message[512], received[512];
+	memset(message, 'x', sizeof(message));
+	for (DWORD i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		DWORD length = lengths[i];
+		DWORD bW, bR;
+		QueryPerformanceCounter(&start);
+		for (DWORD n = 0; n < count; n++)
+			if (!FastWrite(hSync, message, length, &bW) ||
+					!FastRead(hSync, received, length, &bR) || bR != length) {
+				printf("Failed to pass a message - error: %d\n", GetLastError() );
+				return 2;
+			}
+		QueryPerformanceCounter(&end);
+		double fastNs = (double) (end.QuadPart - start.QuadPart) * 1e9 / freq.QuadPart
+			/ (2.0 * count);
+		printf("%-9s %8d %-10s %10.0f\n", pMode, length, "Fast I/O", fastNs);
+
+		QueryPerformanceCounter(&start);
+		for (DWORD n = 0; n < count; n++)
+			if (!PassByIrp(hAsync, message, received, length)) {
+				printf("Failed to pass a message - error: %d\n", GetLastError() );
+				return 3;
+			}
+		QueryPerformanceCounter(&end);
+		double irpNs = (double) (end.QuadPart - start.QuadPart) * 1e9 / freq.QuadPart
+			/ (2.0 * count);
+		printf("%-9s %8d %-10s %10.0f (x%.1f)\n", pMode, length, "IRP", irpNs,
+			irpNs / fastNs);
+	}
+	CloseHandle(hSync);
+	CloseHandle(hAsync);
+	return 0;
+}
+
+// One of the sweep's clients: keeps depth reads waiting on its own
+// overlapped handle, writes a message for each, and times each
+// message from its WriteFile to its read's completion
+typedef struct _SWEEPER {
+	HANDLE hDevice;
+	DWORD size;
+	DWORD depth;
+	DWORD count;			// messages, a multiple of depth
+	LONGLONG* pLatency;		// count of them, in counter ticks
+	BOOL ok;
+} SWEEPER;
+
+static DWORD WINAPI SweepThread(LPVOID pContext) {
+	SWEEPER* pSweeper = (SWEEPER*) pContext;
+	DWORD size = pSweeper->size, depth = pSweeper->depth;
+	char* message = new char[size];
+	char* received = new char[size * depth];
+	OVERLAPPED* ovRead = new OVERLAPPED[depth];
+	OVERLAPPED* ovWrite = new OVERLAPPED[depth];
+	BOOL* bRead = new BOOL[depth];
+	LARGE_INTEGER* sent = new LARGE_INTEGER[depth];
+	memset(message, 'x', size);
+	pSweeper->ok = TRUE;
+	for (DWORD done = 0; done < pSweeper->count && pSweeper->ok; done += depth) {
+		memset(ovRead, 0, depth * sizeof(OVERLAPPED));
+		memset(ovWrite, 0, depth * sizeof(OVERLAPPED));
+		for (DWORD k = 0; k < depth; k++)
+			bRead[k] = ReadFile(pSweeper->hDevice, received + k * size, size,
+								NULL, &ovRead[k]);
+		// Each write goes straight to the oldest waiting read
+		for (DWORD k = 0; k < depth; k++) {
+			DWORD bW;
+			QueryPerformanceCounter(&sent[k]);
+			pSweeper->ok = pSweeper->ok &&
+				Finish(pSweeper->hDevice,
+					WriteFile(pSweeper->hDevice, message, size, NULL, &ovWrite[k]),
+					&ovWrite[k], &bW) && bW == size;
+		}
+		for (DWORD k = 0; k < depth; k++) {
+			DWORD bR;
+			LARGE_INTEGER now;
+			if (!Finish(pSweeper->hDevice, bRead[k], &ovRead[k], &bR) || bR != size)
+				pSweeper->ok = FALSE;
+			QueryPerformanceCounter(&now);
+			pSweeper->pLatency[done + k] = now.QuadPart - sent[k].QuadPart;
+		}
+	}
+	delete[] message;
+	delete[] received;
+	delete[] ovRead;
+	delete[] ovWrite;
+	delete[] bRead;
+	delete[] sent;
+	return 0;
+}
+
+static int CompareTicks(const void* p1, const void* p2) {
+	LONGLONG t1 = *(const LONGLONG*) p1, t2 = *(const LONGLONG*) p2;
+	return (t1 < t2) ? -1 : (t1 > t2);
+}
+
+// Nearest-rank percentile of sorted ticks, in microseconds
+static double Percentile(const LONGLONG* pSorted, DWORD n, double p,
+						 LONGLONG freq) {
+	DWORD rank = (DWORD) (p * n + 0.999999);
+	return pSorted[(rank == 0) ? 0 : rank - 1] * 1e6 / freq;
+}
+
+// Sweeps message size (16 bytes to 16 MB), clients (1 to 4, each on
+// its own handle of LBK1) and queue depth (1 to 16 reads waiting per
+// client), and prints a CSV line - or, with bJson, a JSON object -
+// per combination: throughput, and percentiles of the time from a
+// WriteFile to its read's completion.  Combinations that would need
+// more than 64 MB of read buffers are skipped.  "Testor -sweep
+// [-json]" runs it; built with WIN32DDK_TEST it runs against the
+// test environment, so it needs no Windows machine.
+static int SweepBenchmark(const char* pMode, BOOL bJson) {
+	static const DWORD clients[] = {1, 2, 4};
+	static const DWORD depths[] = {1, 4, 16};
+	static BOOL bHeader = FALSE;
+	const ULONGLONG perClient = 32*1024*1024;	// bytes each client sends
+	const ULONGLONG maxBuffers = 64*1024*1024;
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+
+	if (!bJson && !bHeader) {
+		printf("io,bytes,clients,depth,messages,mb_per_s,messages_per_s,"
+			   "p50_us,p99_us,p999_us\n");
+		bHeader = TRUE;
+	}
+	for (DWORD size = 16; size <= 16*1024*1024; size *= 4)
+	for (DWORD c = 0; c < sizeof(clients) / sizeof(clients[0]); c++)
+	for (DWORD d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+		DWORD nClients = clients[c], depth = depths[d];
+		if ((ULONGLONG) size * depth * nClients > maxBuffers)
+			continue;
+		// Enough messages for a p99.9 where they're small, at least
+		// 32 where they're big
+		ULONGLONG want = perClient / size;
+		DWORD count = (DWORD) ((want > 20000) ? 20000 : (want < 32) ? 32 : want);
+		count = (count + depth - 1) / depth * depth;
+		LONGLONG* pLatency = new LONGLONG[nClients * count];
+		SWEEPER sweepers[4];
+		HANDLE hThreads[4];
+		for (DWORD i = 0; i < nClients; i++) {
+			sweepers[i].hDevice = OpenLBK1(FILE_FLAG_OVERLAPPED);
+			sweepers[i].size = size;
+			sweepers[i].depth = depth;
+			sweepers[i].count = count;
+			sweepers[i].pLatency = pLatency + i * count;
+			if (sweepers[i].hDevice == INVALID_HANDLE_VALUE) {
+				printf("Failed to open LBK1 - error: %d\n", GetLastError() );
+				return 1;
+			}
+		}
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		for (DWORD i = 0; i < nClients; i++)
+			hThreads[i] = CreateThread(NULL, 0, SweepThread, &sweepers[i], 0, NULL);
+		for (DWORD i = 0; i < nClients; i++) {
+			WaitForSingleObject(hThreads[i], INFINITE);
+			CloseHandle(hThreads[i]);
+		}
+		QueryPerformanceCounter(&end);
+		for (DWORD i = 0; i < nClients; i++) {
+			CloseHandle(sweepers[i].hDevice);
+			if (!sweepers[i].ok) {
+				printf("Client %d failed with %d-byte messages\n", i, size);
+				return 2;
+			}
+		}
+
+		DWORD n = nClients * count;
+		qsort(pLatency, n, sizeof(LONGLONG), CompareTicks);
+		double seconds = (double) (end.QuadPart - start.QuadPart) / freq.QuadPart;
+		double rate = n / seconds;
+		double p50 = Percentile(pLatency, n, 0.50, freq.QuadPart);
+		double p99 = Percentile(pLatency, n, 0.99, freq.QuadPart);
+		double p999 = Percentile(pLatency, n, 0.999, freq.QuadPart);
+		delete[] pLatency;
+		if (bJson)
+			printf("{\"io\": \"%s\", \"bytes\": %u, \"clients\": %u, \"depth\": %u, "
+				   "\"messages\": %u, \"mb_per_s\": %.1f, \"messages_per_s\": %.0f, "
+				   "\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f}\n",
+				pMode, size, nClients, depth, n, rate * size / (1024*1024), rate,
+				p50, p99, p999);
+		else
+			printf("%s,%u,%u,%u,%u,%.1f,%.0f,%.2f,%.2f,%.2f\n",
+				pMode, size, nClients, depth, n, rate * size / (1024*1024), rate,
+				p50, p99, p999);
+	}
+	return 0;
+}
+
+static int Benchmark(const char* pMode) {
+	int result = StreamBenchmark(pMode);
+	if (result == 0)
+		result = ScalingBenchmark(pMode, FALSE);
+	if (result == 0)
+		result = ScalingBenchmark(pMode, TRUE);
+	if (result == 0)
+		result = SharedRingBenchmark(pMode);
+	if (result == 0)
+		result = VectorBenchmark(pMode);
+	return (result != 0) ? result : FastIoBenchmark(pMode);
+}
+
+// Exercises LBK1: returns 0, or the number of the step that failed
+static int TestDevice() {
+	HANDLE hDevice;
+	BOOL status;
 
 	hDevice =
 		CreateFile("\\\\.\\LBK1",
@@ -68,6 +848,464 @@ int main() {
 		return 5;
 	}
 
+	printf("Attempting two writes, then reading them in pieces...\n");
+	char part1[] = "Loop";
+	char part2[] = "back";
+	if (!WriteFile(hDevice, part1, 4, &bW, NULL) || bW != 4 ||
+		!WriteFile(hDevice, part2, 5, &bW, NULL) || bW != 5) {
+		printf("Failed to append to the device - error: %d\n",
+			GetLastError() );
+		return 7;
+	}
+	memset(inBuffer, 0, sizeof(inBuffer));
+	if (!ReadFile(hDevice, inBuffer, 6, &bR, NULL) || bR != 6 ||
+		!ReadFile(hDevice, inBuffer + 6, inCount - 6, &bR, NULL) || bR != 3 ||
+		strcmp(inBuffer, "Loopback") != 0) {
+		printf("Failed to read back the writes in order\n");
+		return 8;
+	}
+	printf("Succeeded - read back \"%s\"\n", inBuffer);
+
+	printf("Attempting to fill the device...\n");
+	DWORD capacity = FillAndDrain(hDevice);
+	if (capacity == 0)
+		return 10;
+	printf("Succeeded - device holds %d bytes\n", capacity);
+#ifdef WIN32DDK_TEST
+	if (capacity != TEST_BUFFER_SIZE) {
+		printf("BufferSize was set to %d bytes\n", TEST_BUFFER_SIZE);
+		return 11;
+	}
+#endif
+
+	printf("Attempting to use two handles at once...\n");
+	HANDLE hOther = OpenLBK1(0);
+	char first[] = "first";
+	char second[] = "second";
+	if (hOther == INVALID_HANDLE_VALUE ||
+		!WriteFile(hDevice, first, sizeof(first), &bW, NULL) ||
+		!WriteFile(hOther, second, sizeof(second), &bW, NULL) ||
+		!ReadFile(hOther, inBuffer, inCount, &bR, NULL) ||
+		bR != sizeof(second) || strcmp(inBuffer, second) != 0 ||
+		!ReadFile(hDevice, inBuffer, inCount, &bR, NULL) ||
+		bR != sizeof(first) || strcmp(inBuffer, first) != 0) {
+		printf("Each handle did not read back its own data\n");
+		return 12;
+	}
+	CloseHandle(hOther);
+	printf("Succeeded - each handle has its own channel\n");
+
+	printf("Attempting to read an empty channel on a synchronous handle...\n");
+	// Nothing could ever fill it: the handle's next write waits
+	// behind the read
+	if (!ReadFile(hDevice, inBuffer, inCount, &bR, NULL) || bR != 0 ||
+		!FastRead(hDevice, inBuffer, inCount, &bR) || bR != 0) {
+		printf("Synchronous read of an empty channel did not return at once\n");
+		return 12;
+	}
+	printf("Succeeded - read returned 0 bytes\n");
+
+	printf("Attempting a read that waits for the next write...\n");
+	HANDLE hAsync = OpenLBK1(FILE_FLAG_OVERLAPPED);
+	OVERLAPPED ovRead, ovWrite;
+	memset(&ovRead, 0, sizeof(ovRead));
+	memset(&ovWrite, 0, sizeof(ovWrite));
+	if (hAsync == INVALID_HANDLE_VALUE ||
+		ReadFile(hAsync, inBuffer, inCount, NULL, &ovRead) ||
+		GetLastError() != ERROR_IO_PENDING) {
+		printf("Read of an empty channel did not wait\n");
+		return 13;
+	}
+	LARGE_INTEGER freq, start, end;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+	if (!Finish(hAsync, WriteFile(hAsync, outBuffer, outCount, NULL, &ovWrite),
+				&ovWrite, &bW) ||
+		!Finish(hAsync, FALSE, &ovRead, &bR)) {
+		printf("Failed to complete the waiting read - error: %d\n",
+			GetLastError() );
+		return 14;
+	}
+	QueryPerformanceCounter(&end);
+	if (bR != outCount || strcmp(inBuffer, outBuffer) != 0) {
+		printf("Waiting read did not get the write\n");
+		return 14;
+	}
+	printf("Succeeded - read completed %d microseconds after the write began\n",
+		(int) ((end.QuadPart - start.QuadPart) * 1000000 / freq.QuadPart));
+
+	printf("Attempting a write bigger than the waiting read...\n");
+	char bigBuffer[26];
+	for (DWORD i = 0; i < sizeof(bigBuffer); i++)
+		bigBuffer[i] = (char) ('A' + i);
+	BOOL bRead = ReadFile(hAsync, inBuffer, 10, NULL, &ovRead);
+	if (!Finish(hAsync, WriteFile(hAsync, bigBuffer, sizeof(bigBuffer), NULL, &ovWrite),
+				&ovWrite, &bW) || bW != sizeof(bigBuffer) ||
+		!Finish(hAsync, bRead, &ovRead, &bR) || bR != 10 ||
+		memcmp(inBuffer, bigBuffer, 10) != 0 ||
+		!Finish(hAsync, ReadFile(hAsync, inBuffer, inCount, NULL, &ovRead),
+				&ovRead, &bR) ||
+		bR != sizeof(bigBuffer) - 10 ||
+		memcmp(inBuffer, bigBuffer + 10, bR) != 0) {
+		printf("The rest of the write did not stay in the channel\n");
+		return 15;
+	}
+	printf("Succeeded - reader got 10 bytes, the channel kept %d\n", bR);
+
+	printf("Attempting to cancel a waiting read...\n");
+	bRead = ReadFile(hAsync, inBuffer, inCount, NULL, &ovRead);
+	CancelIo(hAsync);
+	if (Finish(hAsync, bRead, &ovRead, &bR) ||
+		GetLastError() != ERROR_OPERATION_ABORTED) {
+		printf("Waiting read was not cancelled\n");
+		return 17;
+	}
+	printf("Succeeded - read was cancelled\n");
+
+	printf("Attempting an IOCTL_LOOPBACK_READ that waits for the next write...\n");
+	memset(inBuffer, 0, inCount);
+	if (DeviceIoControl(hAsync, IOCTL_LOOPBACK_READ, NULL, 0,
+						inBuffer, inCount, NULL, &ovRead) ||
+		GetLastError() != ERROR_IO_PENDING ||
+		!Finish(hAsync, WriteFile(hAsync, outBuffer, outCount, NULL, &ovWrite),
+				&ovWrite, &bW) ||
+		!Finish(hAsync, FALSE, &ovRead, &bR) ||
+		bR != outCount || strcmp(inBuffer, outBuffer) != 0) {
+		printf("Waiting IOCTL_LOOPBACK_READ did not get the write\n");
+		return 17;
+	}
+	CloseHandle(hAsync);
+	printf("Succeeded - IOCTL_LOOPBACK_READ waited like ReadFile\n");
+
+	printf("Attempting to close a handle with a read waiting...\n");
+	HANDLE hClosing = OpenLBK1(FILE_FLAG_OVERLAPPED);
+	OVERLAPPED ovClosing;
+	memset(&ovClosing, 0, sizeof(ovClosing));
+	ovClosing.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (hClosing == INVALID_HANDLE_VALUE ||
+		ReadFile(hClosing, inBuffer, inCount, NULL, &ovClosing) ||
+		GetLastError() != ERROR_IO_PENDING) {
+		printf("Read of an empty channel did not wait\n");
+		return 16;
+	}
+	CloseHandle(hClosing);
+	bRead = GetOverlappedResult(hClosing, &ovClosing, &bR, TRUE);
+	CloseHandle(ovClosing.hEvent);
+	if (bRead || GetLastError() != ERROR_OPERATION_ABORTED) {
+		printf("Waiting read was not aborted by the close\n");
+		return 16;
+	}
+	printf("Succeeded - read was aborted\n");
+
+	printf("Attempting to map a shared-memory ring...\n");
+	HANDLE hRingDevice = OpenLBK1(0);
+	HANDLE hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	RING_END producerEnd, consumerEnd;
+	DWORD bytes;
+	if (DeviceIoControl(hRingDevice, IOCTL_LOOPBACK_KICK_RING,
+						NULL, 0, NULL, 0, &bytes, NULL) ||
+		MapRing(hRingDevice, hEvent, 5000, &producerEnd, &consumerEnd) ||
+		GetLastError() != ERROR_INVALID_PARAMETER) {
+		printf("Kick without a ring, or a ring of 5000 bytes, did not fail\n");
+		return 18;
+	}
+	if (!MapRing(hRingDevice, hEvent, 4096, &producerEnd, &consumerEnd) ||
+		producerEnd.pRing->Size != 4096 || producerEnd.pRing->Head != 0 ||
+		MapRing(hRingDevice, hEvent, 4096, &producerEnd, &consumerEnd)) {
+		printf("Failed to map just one ring - error: %d\n", GetLastError() );
+		return 18;
+	}
+	printf("Succeeded - ring of %d bytes at %p\n",
+		producerEnd.pRing->Size, producerEnd.pRing);
+
+	printf("Attempting to pass records of 0 to 255 bytes through it...\n");
+	char record[256], got[256];
+	ULONG gotLength;
+	DWORD nPut = 0, nGot = 0;
+	while (nGot < 5000) {
+		// Fill it up, then empty it, wrapping around many times
+		for (;; nPut++) {
+			DWORD length = nPut % 256;
+			for (DWORD i = 0; i < length; i++)
+				record[i] = (char) (nPut + i);
+			if (!RingPut(&producerEnd, record, length))
+				break;
+		}
+		for (; RingGet(&consumerEnd, FALSE, got, sizeof(got), &gotLength); nGot++) {
+			BOOL ok = (gotLength == nGot % 256);
+			for (DWORD i = 0; ok && i < gotLength; i++)
+				ok = (got[i] == (char) (nGot + i));
+			if (!ok) {
+				printf("Record %d came back wrong\n", nGot);
+				return 19;
+			}
+		}
+		if (nGot != nPut) {
+			printf("Put %d records but got %d\n", nPut, nGot);
+			return 19;
+		}
+	}
+	printf("Succeeded - %d records, no kicks needed\n", nGot);
+
+	printf("Attempting to pass records between two threads...\n");
+	PRODUCER producer;
+	producer.end = producerEnd;
+	producer.count = 100000;
+	producer.length = 100;
+	consumerEnd.waits = 0;
+	HANDLE hThread = CreateThread(NULL, 0, ProducerThread, &producer, 0, NULL);
+	BOOL consumed = ConsumeRecords(&consumerEnd, producer.count, producer.length);
+	WaitForSingleObject(hThread, INFINITE);
+	CloseHandle(hThread);
+	if (!consumed || !producer.ok || producer.end.waits > consumerEnd.waits) {
+		printf("Records were lost, reordered or kicked too often\n");
+		return 20;
+	}
+	printf("Succeeded - %d records, consumer parked %d times, %d kicks\n",
+		producer.count, consumerEnd.waits, producer.end.waits);
+	// The driver keeps its own reference to the event
+	CloseHandle(hEvent);
+	CloseHandle(hRingDevice);
+
+	printf("Attempting vectored writes and reads...\n");
+	// 40 records, each a 20th of the FIFO and a bit: more than it holds
+	DWORD vecLength = capacity / 20 + 1;
+	char* pVector = new char[LoopbackVectorSize(40) + 40 * vecLength];
+	DWORD nWritten, nRead;
+	if (!PutVector(hDevice, pVector, 40, vecLength, 0, &nWritten) ||
+		nWritten != capacity / vecLength ||
+		((PLOOPBACK_VECTOR) pVector)->Iov[nWritten].Length != 0) {
+		printf("WRITEV did not stop at the first record that didn't fit\n");
+		return 21;
+	}
+	if (!GetVector(hDevice, pVector, 40, vecLength, 0, &nRead) || nRead != nWritten ||
+		!GetVector(hDevice, pVector, 40, vecLength, 0, &nRead) || nRead != 0) {
+		printf("READV did not return just the records written\n");
+		return 21;
+	}
+	delete[] pVector;
+	printf("Succeeded - %d records in one IRP each way\n", nWritten);
+
+	printf("Attempting small reads and writes without IRPs...\n");
+	// hDevice is synchronous, so the driver's fast I/O routines
+	// get the first go at its IOCTLs; they leave large requests
+	// to IRPs
+	char small[64], large[1024], both[2048];	// fast I/O takes up to 512 bytes
+#ifdef WIN32DDK_TEST
+	ULONGLONG fastCalls0, fastTaken0, fastCalls1, fastTaken1;
+	TestEnvQueryFastIo(&fastCalls0, &fastTaken0);
+#endif
+	memset(small, 's', sizeof(small));
+	memset(large, 'l', sizeof(large));
+	if (!FastWrite(hDevice, small, sizeof(small), &bW) || bW != sizeof(small) ||
+		!FastWrite(hDevice, large, sizeof(large), &bW) || bW != sizeof(large) ||
+		!FastRead(hDevice, inBuffer, 10, &bR) || bR != 10 ||
+		!FastRead(hDevice, both, sizeof(both), &bR) ||
+		bR != sizeof(small) - 10 + sizeof(large) || both[0] != 's' ||
+		both[bR - 1] != 'l') {
+		printf("Small and large requests got mixed up - error: %d\n", GetLastError() );
+		return 22;
+	}
+#ifdef WIN32DDK_TEST
+	// Fast: the 64-byte write and the 10-byte read
+	TestEnvQueryFastIo(&fastCalls1, &fastTaken1);
+	if (fastCalls1 - fastCalls0 != 4 || fastTaken1 - fastTaken0 != 2) {
+		printf("Fast I/O took %d of %d requests, not 2 of 4\n",
+			(int) (fastTaken1 - fastTaken0), (int) (fastCalls1 - fastCalls0));
+		return 22;
+	}
+#endif
+	printf("Succeeded - small requests took the fast path\n");
+
+	printf("Attempting to use every device...\n");
+	// Each its own message, written to all before any is read
+	HANDLE hDevices[64];
+	DWORD nDevices;
+	for (nDevices = 0; nDevices < 64; nDevices++) {
+		char message[16];
+		hDevices[nDevices] = OpenLBK(nDevices + 1, 0);
+		if (hDevices[nDevices] == INVALID_HANDLE_VALUE)
+			break;
+		sprintf(message, "LBK%d", nDevices + 1);
+		if (!WriteFile(hDevices[nDevices], message, strlen(message) + 1, &bW, NULL)) {
+			printf("Failed to write to LBK%d - error: %d\n", nDevices + 1, GetLastError() );
+			return 23;
+		}
+	}
+	if (nDevices == 64 || GetLastError() != ERROR_FILE_NOT_FOUND) {
+		printf("Failed to open LBK%d - error: %d\n", nDevices + 1, GetLastError() );
+		return 23;
+	}
+#ifdef WIN32DDK_TEST
+	if (nDevices != TEST_DEVICE_COUNT) {
+		printf("DeviceCount was set to %d\n", TEST_DEVICE_COUNT);
+		return 23;
+	}
+#endif
+	for (DWORD i = 0; i < nDevices; i++) {
+		char expected[16];
+		sprintf(expected, "LBK%d", i + 1);
+		if (!ReadFile(hDevices[i], inBuffer, sizeof(inBuffer), &bR, NULL) ||
+			strcmp(inBuffer, expected) != 0) {
+			printf("LBK%d did not read back its own message\n", i + 1);
+			return 23;
+		}
+		CloseHandle(hDevices[i]);
+	}
+	printf("Succeeded - %d devices, LBK%d doesn't exist\n", nDevices, nDevices + 1);
+
+	printf("Attempting to pass messages...\n");
+	// Only an empty channel can switch
+	HANDLE hMessages = OpenLBK1(0);
+	if (!WriteFile(hMessages, "x", 1, &bW, NULL) ||
+		DeviceIoControl(hMessages, IOCTL_LOOPBACK_MESSAGE_MODE,
+						NULL, 0, NULL, 0, &bytes, NULL) ||
+		GetLastError() != ERROR_BAD_COMMAND ||
+		!ReadFile(hMessages, inBuffer, sizeof(inBuffer), &bR, NULL) ||
+		!DeviceIoControl(hMessages, IOCTL_LOOPBACK_MESSAGE_MODE,
+						 NULL, 0, NULL, 0, &bytes, NULL)) {
+		printf("Failed to switch to message mode - error: %d\n", GetLastError() );
+		return 24;
+	}
+	// Messages of 1 to 10 bytes, each byte its length
+	for (DWORD length = 1; length <= 10; length++) {
+		char message[10];
+		memset(message, (char) length, length);
+		if (!WriteFile(hMessages, message, length, &bW, NULL) || bW != length) {
+			printf("Failed to write a %d-byte message - error: %d\n",
+				length, GetLastError() );
+			return 24;
+		}
+	}
+	// Records of 8 bytes (1 to 4), 12 (5 to 8) and 16 (9, 10):
+	// 64 bytes only hold the first six whole
+	char records[256];
+	DWORD nMessages = 0;
+	if (ReadFile(hMessages, records, 4, &bR, NULL) ||
+		GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+		printf("A read too small for the next message did not fail\n");
+		return 24;
+	}
+	static const DWORD rooms[] = {64, sizeof(records)};
+	for (DWORD pass = 0; pass < 2; pass++) {
+		DWORD room = rooms[pass];
+		if (!ReadFile(hMessages, records, room, &bR, NULL)) {
+			printf("Failed to read messages - error: %d\n", GetLastError() );
+			return 24;
+		}
+		for (DWORD at = 0; at < bR; at += LoopbackRecordSize(*(ULONG*) (records + at))) {
+			ULONG length = *(ULONG*) (records + at);
+			nMessages++;
+			if (length != nMessages || records[at + sizeof(ULONG)] != (char) length ||
+				records[at + sizeof(ULONG) + length - 1] != (char) length) {
+				printf("Message %d came back wrong\n", nMessages);
+				return 24;
+			}
+		}
+		if (nMessages != ((pass == 0) ? 6 : 10)) {
+			printf("%d bytes held %d messages\n", room, nMessages);
+			return 24;
+		}
+	}
+	// Whole or not at all
+	char* pBig = new char[capacity];
+	memset(pBig, 'b', capacity);
+	DWORD nBig = 0;
+	while (WriteFile(hMessages, pBig, 1000, &bW, NULL))
+		nBig++;
+	if (GetLastError() != ERROR_BUSY || nBig != capacity / LoopbackRecordSize(1000) ||
+		WriteFile(hMessages, pBig, capacity, &bW, NULL) ||
+		GetLastError() != ERROR_INVALID_PARAMETER) {
+		printf("Message mode wrote part of a message\n");
+		return 24;
+	}
+	delete[] pBig;
+	CloseHandle(hMessages);
+
+	// A waiting read gets the message the next write brings
+	HANDLE hAsyncMessages = OpenLBK1(FILE_FLAG_OVERLAPPED);
+	OVERLAPPED ovMode, ovMessageRead, ovMessageWrite;
+	memset(&ovMode, 0, sizeof(ovMode));
+	memset(&ovMessageRead, 0, sizeof(ovMessageRead));
+	memset(&ovMessageWrite, 0, sizeof(ovMessageWrite));
+	if (!Finish(hAsyncMessages,
+			DeviceIoControl(hAsyncMessages, IOCTL_LOOPBACK_MESSAGE_MODE,
+							NULL, 0, NULL, 0, NULL, &ovMode), &ovMode, &bytes)) {
+		printf("Failed to switch to message mode - error: %d\n", GetLastError() );
+		return 24;
+	}
+	BOOL bMessageRead = ReadFile(hAsyncMessages, records, sizeof(records),
+								 NULL, &ovMessageRead);
+	if (!Finish(hAsyncMessages, WriteFile(hAsyncMessages, "waited", 6, NULL, &ovMessageWrite),
+				&ovMessageWrite, &bW) ||
+		!Finish(hAsyncMessages, bMessageRead, &ovMessageRead, &bR) ||
+		bR != LoopbackRecordSize(6) || *(ULONG*) records != 6 ||
+		memcmp(records + sizeof(ULONG), "waited", 6) != 0) {
+		printf("Waiting read did not get the message\n");
+		return 24;
+	}
+	// A waiting read too small for the message fails alone;
+	// the next one, big enough, still gets it
+	OVERLAPPED ovSmallRead;
+	memset(&ovSmallRead, 0, sizeof(ovSmallRead));
+	char smallRecord[8];
+	BOOL bWaiting =
+		!ReadFile(hAsyncMessages, smallRecord, sizeof(smallRecord),
+				  NULL, &ovSmallRead) &&
+		GetLastError() == ERROR_IO_PENDING &&
+		!ReadFile(hAsyncMessages, records, sizeof(records),
+				  NULL, &ovMessageRead) &&
+		GetLastError() == ERROR_IO_PENDING;
+	if (!bWaiting ||
+		!Finish(hAsyncMessages, WriteFile(hAsyncMessages, "too big for it", 14,
+										  NULL, &ovMessageWrite),
+				&ovMessageWrite, &bW) ||
+		GetOverlappedResult(hAsyncMessages, &ovSmallRead, &bR, TRUE) ||
+		GetLastError() != ERROR_INSUFFICIENT_BUFFER ||
+		!GetOverlappedResult(hAsyncMessages, &ovMessageRead, &bR, TRUE) ||
+		bR != LoopbackRecordSize(14) || *(ULONG*) records != 14 ||
+		memcmp(records + sizeof(ULONG), "too big for it", 14) != 0) {
+		printf("A small waiting read kept the message from a big one\n");
+		return 24;
+	}
+	CloseHandle(hAsyncMessages);
+	printf("Succeeded - %d messages, %d of them in one read\n", nMessages, 6);
+
+	printf("Attempting to use up LBK2's memory...\n");
+	// Each handle's FIFO counts against its device's MemoryLimit
+	const DWORD maxHandles = 4096;
+	HANDLE* phMemory = new HANDLE[maxHandles];
+	DWORD nMemory;
+	for (nMemory = 0; nMemory < maxHandles; nMemory++) {
+		phMemory[nMemory] = OpenLBK(2, 0);
+		if (phMemory[nMemory] == INVALID_HANDLE_VALUE)
+			break;
+	}
+	HANDLE hOtherDevice = OpenLBK(3, 0);
+	if (nMemory == maxHandles || GetLastError() != ERROR_NO_SYSTEM_RESOURCES ||
+		hOtherDevice == INVALID_HANDLE_VALUE) {
+		printf("LBK2's memory did not run out, or LBK3's did too\n");
+		return 25;
+	}
+#ifdef WIN32DDK_TEST
+	if (nMemory != TEST_MEMORY_LIMIT / TEST_BUFFER_SIZE) {
+		printf("MemoryLimit was set to %d bytes\n", TEST_MEMORY_LIMIT);
+		return 25;
+	}
+#endif
+	// Closing one makes room for one
+	CloseHandle(phMemory[--nMemory]);
+	phMemory[nMemory] = OpenLBK(2, 0);
+	if (phMemory[nMemory] == INVALID_HANDLE_VALUE) {
+		printf("Failed to reopen LBK2 - error: %d\n", GetLastError() );
+		return 25;
+	}
+	for (DWORD i = 0; i <= nMemory; i++)
+		CloseHandle(phMemory[i]);
+	CloseHandle(hOtherDevice);
+	delete[] phMemory;
+	printf("Succeeded - LBK2 took %d handles\n", nMemory + 1);
+
 	printf("Attempting to close device LBK1...\n");
 	status =
 		CloseHandle(hDevice);
@@ -76,9 +1314,59 @@ int main() {
 			GetLastError() );
 		return 6;
 	}
-	printf("Succeeded in closing device...exiting normally\n");
+	printf("Succeeded in closing device...\n");
 	return 0;
 }
 
+int main(int argc, char* argv[]) {
+	BOOL bBenchmark = (argc > 1 && strcmp(argv[1], "-bench") == 0);
+	// -sweep prints only its CSV (or, with -json, JSON Lines)
+	BOOL bSweep = (argc > 1 && strcmp(argv[1], "-sweep") == 0);
+	BOOL bJson = (bSweep && argc > 2 && strcmp(argv[2], "-json") == 0);
+	int result = 0;
+
+	if (!bSweep)
+		printf("Beginning test of Loopback Driver (CH7)...\n");
+
+#ifdef WIN32DDK_TEST
+	// Once with buffered I/O, once with direct I/O
+	for (ULONG directIo = 0; directIo <= 1 && result == 0; directIo++) {
+		PCWSTR pParameters =
+			L"\\Registry\\Machine\\System\\CurrentControlSet\\Services\\Loopback\\Parameters";
+		TestEnvSetRegistryValue(pParameters, L"BufferSize",
+			(bBenchmark || bSweep) ? BENCH_BUFFER_SIZE : TEST_BUFFER_SIZE);
+		TestEnvSetRegistryValue(pParameters, L"DirectIo", directIo);
+		TestEnvSetRegistryValue(pParameters, L"DeviceCount",
+			(bBenchmark || bSweep) ? BENCH_DEVICE_COUNT : TEST_DEVICE_COUNT);
+		TestEnvSetRegistryValue(pParameters, L"MemoryLimit",
+			(bBenchmark || bSweep) ? BENCH_MEMORY_LIMIT : TEST_MEMORY_LIMIT);
+		NTSTATUS ntStatus;
+		PDRIVER_OBJECT pDriverObject =
+			TestEnvLoadDriver(DriverEntry, L"Loopback", &ntStatus);
+		if (pDriverObject == NULL) {
+			printf("DriverEntry failed with status %08X\n", ntStatus);
+			return 1;
+		}
+		const char* pMode = directIo ? "direct" : "buffered";
+		if (bSweep)
+			result = SweepBenchmark(pMode, bJson);
+		else if (bBenchmark)
+			result = Benchmark(pMode);
+		else {
+			printf("--- %s I/O ---\n", pMode);
+			result = TestDevice();
+		}
+		TestEnvUnloadDriver(pDriverObject);
+	}
+#else
+	// Whichever mode the registry's DirectIo value selects
+	result = bSweep ? SweepBenchmark("LBK1", bJson) :
+			 bBenchmark ? Benchmark("LBK1") : TestDevice();
+#endif
+	if (result == 0 && !bSweep)
+		printf("Exiting normally\n");
+	return result;
+}
+
 
 	
\ No newline at end of file
@@ -6,8 +6,48 @@
 
 #include "Driver.h"
 
+// Bytes the ISR sends per interrupt, at most (see QueryParameters)
+static ULONG BurstBytes = PPORT_DEFAULT_BURST;
+// Bytes of receive ring per device
+static ULONG ReceiveSize = PPORT_DEFAULT_RECEIVE;
+// Longest write PPORT_CLASS_AUTO counts as a latency write
+static ULONG SmallWrite = PPORT_DEFAULT_SMALL_WRITE;
+// Latency writes started in a row before a waiting bulk one
+static ULONG LatencyRun = PPORT_DEFAULT_LATENCY_RUN;
+
+// What DispatchDeviceControl hands QueryStats
+typedef struct _QUERY_STATS_CONTEXT {
+	PDEVICE_EXTENSION pDevExt;
+	PPPORT_STATS pStats;
+} QUERY_STATS_CONTEXT, *PQUERY_STATS_CONTEXT;
+
+// What StartIo hands CountStart
+typedef struct _START_CONTEXT {
+	PDEVICE_EXTENSION pDevExt;
+	ULONG cls;				// PPORT_CLASS_LATENCY or _BULK
+	LONGLONG queued;		// when DispatchWrite queued it
+} START_CONTEXT, *PSTART_CONTEXT;
+
+// What the read routines hand TakeReceived
+typedef struct _TAKE_CONTEXT {
+	PDEVICE_EXTENSION pDevExt;
+	PUCHAR pBuffer;			// NULL to throw the bytes away
+	ULONG length;			// bytes wanted
+	ULONG tail;				// set: where the bytes start...
+	ULONG available;		// ... bytes in the ring...
+	ULONG taken;			// ... and bytes taken
+} TAKE_CONTEXT, *PTAKE_CONTEXT;
+
+// Performance counter ticks to nanoseconds, without overflow
+#define TicksToNs( ticks, freq )							\
+	(((ticks) / (freq).QuadPart) * 1000000000 +			\
+	 ((ticks) % (freq).QuadPart) * 1000000000 / (freq).QuadPart)
+
 // Forward declarations
 //
+static VOID QueryParameters (
+		IN PUNICODE_STRING	pRegistryPath	);
+
 static NTSTATUS CreateDevice (
 		IN PDRIVER_OBJECT	pDriverObject,
 		IN ULONG			DeviceNumber,
@@ -31,6 +71,10 @@ static NTSTATUS DispatchClose (
 		IN PDEVICE_OBJECT	pDevObj,
 		IN PIRP				pIrp			);
 
+static NTSTATUS DispatchCleanup (
+		IN PDEVICE_OBJECT	pDevObj,
+		IN PIRP				pIrp			);
+
 static NTSTATUS DispatchWrite (
 		IN PDEVICE_OBJECT	pDevObj,
 		IN PIRP				pIrp			);
@@ -39,6 +83,17 @@ static NTSTATUS DispatchRead (
 		IN PDEVICE_OBJECT	pDevObj,
 		IN PIRP				pIrp			);
 
+static NTSTATUS DispatchDeviceControl (
+		IN PDEVICE_OBJECT	pDevObj,
+		IN PIRP				pIrp			);
+
+static VOID CancelRead (
+		IN PDEVICE_OBJECT	pDevObj,
+		IN PIRP				pIrp			);
+
+static VOID ServiceReads (
+		IN PDEVICE_EXTENSION	pDevExt		);
+
 BOOLEAN Isr (
 			IN PKINTERRUPT pIntObj,
 			IN PVOID pServiceContext		);
@@ -46,6 +101,31 @@ BOOLEAN Isr (
 static BOOLEAN TransmitByte( 
 		IN PVOID pArg );
 
+static BOOLEAN FirstBurst( 
+		IN PVOID pArg );
+
+static BOOLEAN CountDpc( 
+		IN PVOID pArg );
+
+static BOOLEAN QueryStats( 
+		IN PVOID pArg );
+
+static BOOLEAN CountStart( 
+		IN PVOID pArg );
+
+static VOID StartNextWrite(
+		IN PDEVICE_OBJECT pDevObj,
+		IN BOOLEAN Cancelable );
+
+static VOID TakeReceived( 
+		IN PTAKE_CONTEXT pTake );
+
+static BOOLEAN PeekReceived( 
+		IN PVOID pArg );
+
+static BOOLEAN AdvanceReceived( 
+		IN PVOID pArg );
+
 VOID StartIo(
 	IN PDEVICE_OBJECT pDevObj,
 	IN PIRP pIrp
@@ -88,11 +168,20 @@ extern "C" NTSTATUS DriverEntry (
 				DispatchCreate;
 	pDriverObject->MajorFunction[IRP_MJ_CLOSE] =
 				DispatchClose;
+	pDriverObject->MajorFunction[IRP_MJ_CLEANUP] =
+				DispatchCleanup;
 	pDriverObject->MajorFunction[IRP_MJ_WRITE] =
 				DispatchWrite;
 	pDriverObject->MajorFunction[IRP_MJ_READ] =
 				DispatchRead;
+	// ... and for the statistics
+	pDriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] =
+				DispatchDeviceControl;
 	pDriverObject->DriverStartIo = StartIo;
+
+	// Pick up the burst and ring sizes before any
+	// device needs them
+	QueryParameters(pRegistryPath);
 	
 	// For each physical or logical device detected
 	// that will be under this Driver's control,
@@ -105,6 +194,102 @@ extern "C" NTSTATUS DriverEntry (
 	return status;
 }
 
+//++
+// Function:	QueryParameters
+//
+// Description:
+//		Reads the BurstBytes, ReceiveBuffer, SmallWrite
+//		and LatencyRun values from the Parameters subkey
+//		of the driver's own service key into the globals
+//		BurstBytes, ReceiveSize, SmallWrite and
+//		LatencyRun.  Missing values leave the defaults;
+//		all are kept in range, and the ring size a
+//		power of 2.
+//
+// Arguments:
+//		pRegistryPath - the service key, as passed
+//						to DriverEntry
+//
+// Return value:
+//		None
+//--
+VOID QueryParameters (
+		IN PUNICODE_STRING	pRegistryPath	) {
+	RTL_QUERY_REGISTRY_TABLE QueryTable[6];
+	ULONG burstBytes = PPORT_DEFAULT_BURST;
+	ULONG defaultBurst = PPORT_DEFAULT_BURST;
+	ULONG receiveSize = PPORT_DEFAULT_RECEIVE;
+	ULONG defaultReceive = PPORT_DEFAULT_RECEIVE;
+	ULONG smallWrite = PPORT_DEFAULT_SMALL_WRITE;
+	ULONG defaultSmallWrite = PPORT_DEFAULT_SMALL_WRITE;
+	ULONG latencyRun = PPORT_DEFAULT_LATENCY_RUN;
+	ULONG defaultLatencyRun = PPORT_DEFAULT_LATENCY_RUN;
+
+	RtlZeroMemory( QueryTable, sizeof( QueryTable ));
+
+	// The values live under <service key>\Parameters
+	QueryTable[0].Name	= (PWSTR) L"Parameters";
+	QueryTable[0].Flags	= RTL_QUERY_REGISTRY_SUBKEY;
+
+	QueryTable[1].Name	= (PWSTR) L"BurstBytes";
+	QueryTable[1].Flags	= RTL_QUERY_REGISTRY_DIRECT;
+	QueryTable[1].EntryContext = &burstBytes;
+	QueryTable[1].DefaultType = REG_DWORD;
+	QueryTable[1].DefaultData = &defaultBurst;
+	QueryTable[1].DefaultLength = sizeof(ULONG);
+
+	QueryTable[2].Name	= (PWSTR) L"ReceiveBuffer";
+	QueryTable[2].Flags	= RTL_QUERY_REGISTRY_DIRECT;
+	QueryTable[2].EntryContext = &receiveSize;
+	QueryTable[2].DefaultType = REG_DWORD;
+	QueryTable[2].DefaultData = &defaultReceive;
+	QueryTable[2].DefaultLength = sizeof(ULONG);
+
+	QueryTable[3].Name	= (PWSTR) L"SmallWrite";
+	QueryTable[3].Flags	= RTL_QUERY_REGISTRY_DIRECT;
+	QueryTable[3].EntryContext = &smallWrite;
+	QueryTable[3].DefaultType = REG_DWORD;
+	QueryTable[3].DefaultData = &defaultSmallWrite;
+	QueryTable[3].DefaultLength = sizeof(ULONG);
+
+	QueryTable[4].Name	= (PWSTR) L"LatencyRun";
+	QueryTable[4].Flags	= RTL_QUERY_REGISTRY_DIRECT;
+	QueryTable[4].EntryContext = &latencyRun;
+	QueryTable[4].DefaultType = REG_DWORD;
+	QueryTable[4].DefaultData = &defaultLatencyRun;
+	QueryTable[4].DefaultLength = sizeof(ULONG);
+
+	if (!NT_SUCCESS(
+			RtlQueryRegistryValues(
+					RTL_REGISTRY_ABSOLUTE,
+					pRegistryPath->Buffer,
+					QueryTable,
+					NULL, NULL ))) {
+		burstBytes = PPORT_DEFAULT_BURST;
+		receiveSize = PPORT_DEFAULT_RECEIVE;
+		smallWrite = PPORT_DEFAULT_SMALL_WRITE;
+		latencyRun = PPORT_DEFAULT_LATENCY_RUN;
+	}
+
+	if (burstBytes < 1)
+		burstBytes = 1;
+	if (burstBytes > PPORT_MAX_BURST)
+		burstBytes = PPORT_MAX_BURST;
+	BurstBytes = burstBytes;
+	if (receiveSize < PPORT_MIN_RECEIVE)
+		receiveSize = PPORT_MIN_RECEIVE;
+	if (receiveSize > PPORT_MAX_RECEIVE)
+		receiveSize = PPORT_MAX_RECEIVE;
+	// Keep only the top bit
+	while (receiveSize & (receiveSize - 1))
+		receiveSize &= receiveSize - 1;
+	ReceiveSize = receiveSize;
+	SmallWrite = smallWrite;
+	if (latencyRun < 1)
+		latencyRun = 1;
+	LatencyRun = latencyRun;
+}
+
 //++
 // Function:	CreateDevice
 //
@@ -131,14 +316,14 @@ NTSTATUS CreateDevice (
 	PDEVICE_EXTENSION pDevExt;
 
 	// Form the internal Device Name
-	CUString devName("\\Device\\PPORT");	// for "Parallel Port" device
-	devName += CUString(ulDeviceNumber);
+	CUString devName(	// for "Parallel Port" device
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\Device\\PPORT")).Append(ulDeviceNumber) );
 
 	// Now create the device
 	status =
 		IoCreateDevice( pDriverObject,
 						sizeof(DEVICE_EXTENSION),
-						&(UNICODE_STRING)devName,
+						&(UNICODE_STRING&)devName,
 						FILE_DEVICE_UNKNOWN,
 						0, TRUE,
 						&pDevObj );
@@ -154,8 +339,27 @@ NTSTATUS CreateDevice (
 	pDevExt->DeviceNumber = ulDeviceNumber;
 	pDevExt->ustrDeviceName = devName;
 	pDevExt->Irq = Irq;
-	pDevExt->portBase = (PUCHAR)portBase;
+	pDevExt->portBase = (PUCHAR)(ULONG_PTR)portBase;
 	pDevExt->pIntObj = NULL;
+	pDevExt->burstBytes = BurstBytes;
+	RtlZeroMemory( &pDevExt->stats, sizeof(PPORT_STATS) );
+	pDevExt->stats.BurstBytes = BurstBytes;
+	KeInitializeSpinLock( &pDevExt->lkReads );
+	InitializeListHead( &pDevExt->pendingReads );
+	pDevExt->bReadsWaiting = FALSE;
+	pDevExt->bWriteDone = FALSE;
+	pDevExt->latencyRun = 0;
+
+	// The receive ring is written at DIRQL, so
+	// it must be nonpaged
+	pDevExt->rxSize = ReceiveSize;
+	pDevExt->rxHead = pDevExt->rxTail = 0;
+	pDevExt->rxRing = (PUCHAR)
+		ExAllocatePool( NonPagedPool, ReceiveSize );
+	if (pDevExt->rxRing == NULL) {
+		IoDeleteDevice( pDevObj );
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
 
 	// Since this driver controlls real hardware,
 	// the hardware controlled must be "discovered."
@@ -215,6 +419,7 @@ NTSTATUS CreateDevice (
 			FALSE );		// save FP registers?
 	if (!NT_SUCCESS(status)) {
 		// if it fails now, must delete Device object
+		ExFreePool( pDevExt->rxRing );
 		IoDeleteDevice( pDevObj );
 		return status;
 	}
@@ -224,16 +429,18 @@ NTSTATUS CreateDevice (
 #endif
 	
 	// Form the symbolic link name
-	CUString symLinkName("\\??\\PPT");
-	symLinkName += CUString(ulDeviceNumber+1);	// 1 based
+	CUString symLinkName(
+		CUStringBuilder(CUSTRINGBUILDER_LITERAL("\\??\\PPT")).Append(ulDeviceNumber+1) );	// 1 based
 	pDevExt->ustrSymLinkName = symLinkName;
 
 	// Now create the link name
 	status = 
-		IoCreateSymbolicLink( &(UNICODE_STRING)symLinkName,
-							  &(UNICODE_STRING)devName );
+		IoCreateSymbolicLink( &(UNICODE_STRING&)symLinkName,
+							  &(UNICODE_STRING&)devName );
 	if (!NT_SUCCESS(status)) {
 		// if it fails now, must delete Device object
+		IoDisconnectInterrupt( pDevExt->pIntObj );
+		ExFreePool( pDevExt->rxRing );
 		IoDeleteDevice( pDevObj );
 		return status;
 	}
@@ -273,6 +480,8 @@ VOID DriverUnload (
 		// Delete our Interrupt object
 		if (pDevExt->pIntObj)
 			IoDisconnectInterrupt( pDevExt->pIntObj );
+		// ... and the receive ring it filled
+		ExFreePool( pDevExt->rxRing );
 
 		// This will yield the symbolic link name
 		UNICODE_STRING pLinkName =
@@ -363,7 +572,8 @@ NTSTATUS ClaimHardware(	PDRIVER_OBJECT pDriverObj,
 //
 // Description:
 //		Handles call from Win32 CreateFile request
-//		Does nothing.
+//		For PPort driver, gives the handle its
+//		write priority (PPORT_CLASS_AUTO to start)
 //
 // Arguments:
 //		pDevObj - Passed from I/O Manager
@@ -377,10 +587,24 @@ NTSTATUS DispatchCreate (
 		IN PDEVICE_OBJECT	pDevObj,
 		IN PIRP				pIrp			) {
 
-	pIrp->IoStatus.Status = STATUS_SUCCESS;
+	NTSTATUS status = STATUS_SUCCESS;
+	PIO_STACK_LOCATION pIrpStack =
+		IoGetCurrentIrpStackLocation( pIrp );
+	// DispatchWrite reads it, so nonpaged
+	PPPORT_PRIORITY pPriority = (PPPORT_PRIORITY)
+		ExAllocatePool( NonPagedPool, sizeof(PPORT_PRIORITY) );
+	if (pPriority == NULL)
+		status = STATUS_INSUFFICIENT_RESOURCES;
+	else {
+		pPriority->Class = PPORT_CLASS_AUTO;
+		pPriority->SortKey = 0;
+		pIrpStack->FileObject->FsContext = pPriority;
+	}
+
+	pIrp->IoStatus.Status = status;
 	pIrp->IoStatus.Information = 0;	// no bytes xfered
 	IoCompleteRequest( pIrp, IO_NO_INCREMENT );
-	return STATUS_SUCCESS;
+	return status;
 }
 
 //++
@@ -388,7 +612,8 @@ NTSTATUS DispatchCreate (
 //
 // Description:
 //		Handles call from Win32 CreateHandle request
-//		For PPort driver, frees any buffer
+//		For PPort driver, throws away any bytes
+//		the handle didn't read, and its priority
 //
 // Arguments:
 //		pDevObj - Passed from I/O Manager
@@ -405,22 +630,84 @@ NTSTATUS DispatchClose (
 	// Dig out the Device Extension from the Device object
 	PDEVICE_EXTENSION pDevExt = (PDEVICE_EXTENSION)
 		pDevObj->DeviceExtension;
-	if (pDevExt->deviceBuffer != NULL) {
-		ExFreePool(pDevExt->deviceBuffer);
-		pDevExt->deviceBuffer = NULL;
-		pDevExt->deviceBufferSize = 0;
-	}
+	TAKE_CONTEXT take;
+	take.pDevExt = pDevExt;
+	take.pBuffer = NULL;
+	take.length = pDevExt->rxSize;
+	KIRQL oldIrql;
+	KeAcquireSpinLock( &pDevExt->lkReads, &oldIrql );
+	TakeReceived( &take );
+	KeReleaseSpinLock( &pDevExt->lkReads, oldIrql );
+	ExFreePool( IoGetCurrentIrpStackLocation( pIrp )->FileObject->FsContext );
 	pIrp->IoStatus.Status = STATUS_SUCCESS;
 	pIrp->IoStatus.Information = 0;	// no bytes xfered
 	IoCompleteRequest( pIrp, IO_NO_INCREMENT );
 	return STATUS_SUCCESS;
 }
 
+//++
+// Function:	DispatchCleanup
+//
+// Description:
+//		Handles the last CloseHandle of a handle
+//		For PPort driver, cancels the reads still
+//		waiting for bytes
+//
+// Arguments:
+//		pDevObj - Passed from I/O Manager
+//		pIrp - Passed from I/O Manager
+//
+// Return value:
+//		NTSTATUS - success or failure code
+//--
+
+NTSTATUS DispatchCleanup (
+		IN PDEVICE_OBJECT	pDevObj,
+		IN PIRP				pIrp			) {
+
+	PDEVICE_EXTENSION pDevExt = (PDEVICE_EXTENSION)
+		pDevObj->DeviceExtension;
+	LIST_ENTRY cancelled;
+	KIRQL oldIrql;
+
+	// Collect the waiting reads under the lock...
+	InitializeListHead(&cancelled);
+	KeAcquireSpinLock( &pDevExt->lkReads, &oldIrql );
+	while (!IsListEmpty(&pDevExt->pendingReads)) {
+		PIRP pReadIrp = CONTAINING_RECORD(
+			RemoveHeadList(&pDevExt->pendingReads), IRP, Tail.Overlay.ListEntry);
+		if (IoSetCancelRoutine(pReadIrp, NULL) == NULL) {
+			// Being cancelled - CancelRead completes it
+			InitializeListHead( &pReadIrp->Tail.Overlay.ListEntry );
+			continue;
+		}
+		InsertTailList( &cancelled, &pReadIrp->Tail.Overlay.ListEntry );
+	}
+	pDevExt->bReadsWaiting = FALSE;
+	KeReleaseSpinLock( &pDevExt->lkReads, oldIrql );
+
+	// ...and complete them without it
+	while (!IsListEmpty(&cancelled)) {
+		PIRP pReadIrp = CONTAINING_RECORD(
+			RemoveHeadList(&cancelled), IRP, Tail.Overlay.ListEntry);
+		pReadIrp->IoStatus.Status = STATUS_CANCELLED;
+		pReadIrp->IoStatus.Information = 0;
+		IoCompleteRequest( pReadIrp, IO_NO_INCREMENT );
+	}
+
+	pIrp->IoStatus.Status = STATUS_SUCCESS;
+	pIrp->IoStatus.Information = 0;
+	IoCompleteRequest( pIrp, IO_NO_INCREMENT );
+	return STATUS_SUCCESS;
+}
+
 //++
 // Function:	DispatchCancel
 //
 // Description:
-//		Handles canceled IRP
+//		Handles canceled IRP.  Called holding the
+//		cancel spin lock, for an IRP still waiting
+//		its turn or one StartIo hasn't taken yet.
 //
 // Arguments:
 //		pDevObj - Passed from I/O Manager
@@ -438,11 +725,22 @@ VOID DispatchCancel (
 	DbgPrint("PPORT: IRP Canceled\n");
 #endif
 	
+	BOOLEAN bCurrent = (pIrp == pDevObj->CurrentIrp);
+	if (!bCurrent)
+		// Take it out of the StartIo queue
+		KeRemoveEntryDeviceQueue( &pDevObj->DeviceQueue,
+			&pIrp->Tail.Overlay.DeviceQueueEntry );
+	IoReleaseCancelSpinLock( pIrp->CancelIrql );
+
+	// Start the next write before completing this one:
+	// once the last IRP completes, the device may go
+	if (bCurrent)
+		StartNextWrite( pDevObj, TRUE );
+
 	// Just complete the IRP
 	pIrp->IoStatus.Status = STATUS_CANCELLED;
 	pIrp->IoStatus.Information = 0;	// bytes xfered
 	IoCompleteRequest( pIrp, IO_NO_INCREMENT );
-	IoStartNextPacket( pDevObj, TRUE );
 }
 
 
@@ -452,7 +750,8 @@ VOID DispatchCancel (
 // Description:
 //		Handles call from Win32 WriteFile request
 //		For PPort driver, "starts" the device by
-//		indirectly calling StartIo.
+//		indirectly calling StartIo, or queues the
+//		write by its priority if the device is busy.
 //
 // Arguments:
 //		pDevObj - Passed from I/O Manager
@@ -469,9 +768,26 @@ NTSTATUS DispatchWrite (
 	DbgPrint("PPORT: Write Operation requested (DispatchWrite)\n");
 #endif
 	
+	PIO_STACK_LOCATION pIrpStack =
+		IoGetCurrentIrpStackLocation( pIrp );
+	PPPORT_PRIORITY pPriority = (PPPORT_PRIORITY)
+		pIrpStack->FileObject->FsContext;
+
+	// The handle's class, or the write's own by its length
+	ULONG cls = pPriority->Class;
+	if (cls == PPORT_CLASS_AUTO)
+		cls = (pIrpStack->Parameters.Write.Length <= SmallWrite) ?
+			PPORT_CLASS_LATENCY : PPORT_CLASS_BULK;
+	ULONG key = PPORT_QUEUE_KEY( cls, pPriority->SortKey );
+
+	// IoStartPacket only sets the SortKey if the device
+	// is busy, so set it here for StartIo either way
+	pIrp->Tail.Overlay.DeviceQueueEntry.SortKey = key;
+	SetWriteQueued( pIrp, KeQueryPerformanceCounter( NULL ) );
+
 	// Start the I/O
 	IoMarkIrpPending( pIrp );
-	IoStartPacket( pDevObj, pIrp, 0, DispatchCancel);
+	IoStartPacket( pDevObj, pIrp, &key, DispatchCancel);
 	return STATUS_PENDING;
 }
 
@@ -480,7 +796,11 @@ NTSTATUS DispatchWrite (
 //
 // Description:
 //		Handles call from Win32 ReadFile request
-//		For PPort driver, xfers pool buffer to user
+//		For PPort driver, xfers bytes from the
+//			receive ring to user: as many as are
+//			there, up to the request's length.  If
+//			none are, the read waits for the next
+//			write to bring some back.
 //
 // Arguments:
 //		pDevObj - Passed from I/O Manager
@@ -499,33 +819,337 @@ NTSTATUS DispatchRead (
 #endif
 	
 	NTSTATUS status = STATUS_SUCCESS;
-	PVOID userBuffer;
-	ULONG xferSize;
 	// The stack location contains the user buffer info
 	PIO_STACK_LOCATION pIrpStack =
 		IoGetCurrentIrpStackLocation( pIrp );
 	// Dig out the Device Extension from the Device object
 	PDEVICE_EXTENSION pDevExt = (PDEVICE_EXTENSION)
 		pDevObj->DeviceExtension;
-	// Determine the length of the request
-	xferSize = pIrpStack->Parameters.Read.Length;
+	TAKE_CONTEXT take;
+	take.pDevExt = pDevExt;
 	// Obtain user buffer pointer
-	userBuffer = pIrp->AssociatedIrp.SystemBuffer;
-
-	// Don't transfer more than the user's request
-	xferSize = (xferSize < pDevExt->deviceBufferSize) ?
-				xferSize : pDevExt->deviceBufferSize;
-	// Now copy the pool buffer into user space
-	RtlCopyMemory( userBuffer, pDevExt->deviceBuffer,
-							xferSize );
-	// Free the temporary pool buffer
-	ExFreePool( pDevExt->deviceBuffer );
-	pDevExt->deviceBuffer = NULL;
-	pDevExt->deviceBufferSize = 0;
+	take.pBuffer = (PUCHAR) pIrp->AssociatedIrp.SystemBuffer;
+	// Determine the length of the request
+	take.length = pIrpStack->Parameters.Read.Length;
+	take.taken = 0;
+
+	KIRQL oldIrql;
+	KeAcquireSpinLock( &pDevExt->lkReads, &oldIrql );
+	// Unless other reads are waiting, take what's there
+	if (IsListEmpty(&pDevExt->pendingReads) && take.length != 0)
+		TakeReceived( &take );
+	if (take.taken == 0 && take.length != 0) {
+		// Nothing to read yet - queue the IRP for the DPC,
+		// unless it has been cancelled already
+		IoSetCancelRoutine( pIrp, CancelRead );
+		if (pIrp->Cancel && IoSetCancelRoutine(pIrp, NULL) != NULL) {
+			KeReleaseSpinLock( &pDevExt->lkReads, oldIrql );
+			pIrp->IoStatus.Status = STATUS_CANCELLED;
+			pIrp->IoStatus.Information = 0;
+			IoCompleteRequest( pIrp, IO_NO_INCREMENT );
+			return STATUS_CANCELLED;
+		}
+		// (If CancelRead is already on its way, it will
+		// find the IRP queued and complete it)
+		IoMarkIrpPending( pIrp );
+		InsertTailList( &pDevExt->pendingReads,
+						&pIrp->Tail.Overlay.ListEntry );
+		pDevExt->bReadsWaiting = TRUE;
+		KeReleaseSpinLock( &pDevExt->lkReads, oldIrql );
+		// Bytes may have come back since we looked, with
+		// the ISR not yet knowing anyone was waiting
+		ServiceReads( pDevExt );
+		return STATUS_PENDING;
+	}
+	KeReleaseSpinLock( &pDevExt->lkReads, oldIrql );
 
 	// Now complete the IRP
 	pIrp->IoStatus.Status = status;
-	pIrp->IoStatus.Information = xferSize;	// bytes xfered
+	pIrp->IoStatus.Information = take.taken;	// bytes xfered
+	IoCompleteRequest( pIrp, IO_NO_INCREMENT );
+	return status;
+}
+
+//++
+// Function:	ServiceReads
+//
+// Description:
+//		Hands the bytes in the receive ring to the
+//		waiting reads, oldest first, and completes
+//		those it gives any to
+//
+// Arguments:
+//		pDevExt - The device's extension
+//
+// Return value:
+//		None
+//--
+
+VOID ServiceReads (
+		IN PDEVICE_EXTENSION	pDevExt		) {
+
+	LIST_ENTRY satisfied;
+	TAKE_CONTEXT take;
+	KIRQL oldIrql;
+
+	InitializeListHead(&satisfied);
+	take.pDevExt = pDevExt;
+	KeAcquireSpinLock( &pDevExt->lkReads, &oldIrql );
+	while (!IsListEmpty(&pDevExt->pendingReads)) {
+		// Anything for it?  Only reads take bytes, and
+		// they hold the lock, so what's there stays
+		take.pBuffer = NULL;
+		take.length = 0;
+		TakeReceived( &take );
+		if (take.available == 0)
+			break;
+		PIRP pReadIrp = CONTAINING_RECORD(
+			RemoveHeadList(&pDevExt->pendingReads), IRP, Tail.Overlay.ListEntry);
+		if (IoSetCancelRoutine(pReadIrp, NULL) == NULL) {
+			// Being cancelled - CancelRead completes it
+			InitializeListHead( &pReadIrp->Tail.Overlay.ListEntry );
+			continue;
+		}
+		take.pBuffer = (PUCHAR) pReadIrp->AssociatedIrp.SystemBuffer;
+		take.length =
+			IoGetCurrentIrpStackLocation(pReadIrp)->Parameters.Read.Length;
+		TakeReceived( &take );
+		pReadIrp->IoStatus.Status = STATUS_SUCCESS;
+		pReadIrp->IoStatus.Information = take.taken;
+		InsertTailList( &satisfied, &pReadIrp->Tail.Overlay.ListEntry );
+	}
+	pDevExt->bReadsWaiting = !IsListEmpty(&pDevExt->pendingReads);
+	KeReleaseSpinLock( &pDevExt->lkReads, oldIrql );
+
+	while (!IsListEmpty(&satisfied)) {
+		PIRP pReadIrp = CONTAINING_RECORD(
+			RemoveHeadList(&satisfied), IRP, Tail.Overlay.ListEntry);
+		IoCompleteRequest( pReadIrp, IO_PARALLEL_INCREMENT );
+	}
+}
+
+//++
+// Function:	CancelRead
+//
+// Description:
+//		Cancel routine for a read waiting for bytes.
+//		Called holding the cancel spin lock.
+//
+// Arguments:
+//		pDevObj - Passed from I/O Manager
+//		pIrp - The read being cancelled
+//
+// Return value:
+//		None
+//--
+
+VOID CancelRead (
+		IN PDEVICE_OBJECT	pDevObj,
+		IN PIRP				pIrp			) {
+
+	PDEVICE_EXTENSION pDevExt = (PDEVICE_EXTENSION)
+		pDevObj->DeviceExtension;
+	KIRQL oldIrql;
+
+	// The queue has its own lock
+	IoReleaseCancelSpinLock( pIrp->CancelIrql );
+
+	// Whoever dequeued the IRP without completing it left its
+	// entry pointing at itself, so this is always safe
+	KeAcquireSpinLock( &pDevExt->lkReads, &oldIrql );
+	RemoveEntryList( &pIrp->Tail.Overlay.ListEntry );
+	pDevExt->bReadsWaiting = !IsListEmpty(&pDevExt->pendingReads);
+	KeReleaseSpinLock( &pDevExt->lkReads, oldIrql );
+
+	pIrp->IoStatus.Status = STATUS_CANCELLED;
+	pIrp->IoStatus.Information = 0;
+	IoCompleteRequest( pIrp, IO_NO_INCREMENT );
+}
+
+//++
+// Function:
+//		TakeReceived
+//
+// Description:
+//		Takes bytes from the receive ring.  Called
+//		holding lkReads, so no one else takes any;
+//		the ISR only adds them past rxHead.  Only
+//		the two ends move under the interrupt lock;
+//		the copy is made at DISPATCH_LEVEL.
+//
+// Arguments:
+//		Pointer to a TAKE_CONTEXT
+//
+// Return Value:
+//		(None)
+//--
+VOID TakeReceived( 
+		IN PTAKE_CONTEXT pTake ) {
+
+	PDEVICE_EXTENSION pDevExt = pTake->pDevExt;
+	ULONG mask = pDevExt->rxSize - 1;
+	KeSynchronizeExecution( pDevExt->pIntObj,
+							PeekReceived, pTake );
+	pTake->taken = (pTake->length < pTake->available) ?
+					pTake->length : pTake->available;
+	if (pTake->taken == 0)
+		return;
+	if (pTake->pBuffer != NULL) {
+		// In at most two pieces: to the end of the
+		// ring, then from its start
+		ULONG offset = pTake->tail & mask;
+		ULONG first = pDevExt->rxSize - offset;
+		if (first > pTake->taken)
+			first = pTake->taken;
+		RtlCopyMemory( pTake->pBuffer,
+					   pDevExt->rxRing + offset, first );
+		RtlCopyMemory( pTake->pBuffer + first,
+					   pDevExt->rxRing, pTake->taken - first );
+	}
+	// Only now may the ISR reuse the space
+	KeSynchronizeExecution( pDevExt->pIntObj,
+							AdvanceReceived, pTake );
+}
+
+//++
+// Function:
+//		PeekReceived
+//
+// Description:
+//		Synch critical section routine that notes
+//		where the bytes in the receive ring start,
+//		and how many there are.
+//
+// Arguments:
+//		Pointer to a TAKE_CONTEXT
+//
+// Return Value:
+//		TRUE
+//--
+BOOLEAN PeekReceived( 
+		IN PVOID pArg ) {
+
+	PTAKE_CONTEXT pTake = (PTAKE_CONTEXT)
+		pArg;
+	PDEVICE_EXTENSION pDevExt = pTake->pDevExt;
+	pTake->tail = pDevExt->rxTail;
+	pTake->available = pDevExt->rxHead - pDevExt->rxTail;
+	return TRUE;
+}
+
+//++
+// Function:
+//		AdvanceReceived
+//
+// Description:
+//		Synch critical section routine that gives
+//		the bytes TakeReceived took back to the ISR.
+//
+// Arguments:
+//		Pointer to a TAKE_CONTEXT
+//
+// Return Value:
+//		TRUE
+//--
+BOOLEAN AdvanceReceived( 
+		IN PVOID pArg ) {
+
+	PTAKE_CONTEXT pTake = (PTAKE_CONTEXT)
+		pArg;
+	pTake->pDevExt->rxTail += pTake->taken;
+	return TRUE;
+}
+
+//++
+// Function:	DispatchDeviceControl
+//
+// Description:
+//		Handles call from Win32 DeviceIoControl request
+//		IOCTL_PPORT_QUERY_STATS returns the burst
+//			statistics (see PPortIoctl.h) and starts
+//			them again.
+//
+// Arguments:
+//		pDevObj - Passed from I/O Manager
+//		pIrp - Passed from I/O Manager
+//
+// Return value:
+//		NTSTATUS - success or failuer code
+//--
+
+NTSTATUS DispatchDeviceControl (
+		IN PDEVICE_OBJECT	pDevObj,
+		IN PIRP				pIrp			) {
+
+	NTSTATUS status;
+	ULONG xferSize = 0;
+	PIO_STACK_LOCATION pIrpStack =
+		IoGetCurrentIrpStackLocation( pIrp );
+	PDEVICE_EXTENSION pDevExt = (PDEVICE_EXTENSION)
+		pDevObj->DeviceExtension;
+	PPPORT_STATS pStats = (PPPORT_STATS)
+		pIrp->AssociatedIrp.SystemBuffer;
+	PPPORT_PRIORITY pPriority = (PPPORT_PRIORITY)
+		pIrp->AssociatedIrp.SystemBuffer;
+	QUERY_STATS_CONTEXT context;
+	LARGE_INTEGER freq;
+	ULONG cls;
+
+	switch (pIrpStack->Parameters.DeviceIoControl.IoControlCode) {
+	case IOCTL_PPORT_QUERY_STATS:
+		if (pIrpStack->Parameters.DeviceIoControl.OutputBufferLength <
+				sizeof(PPORT_STATS)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		// The ISR keeps the counts, so take them
+		// under its lock...
+		context.pDevExt = pDevExt;
+		context.pStats = pStats;
+		KeSynchronizeExecution( pDevExt->pIntObj,
+								QueryStats, &context );
+		// ... and turn ticks into time at our leisure
+		KeQueryPerformanceCounter( &freq );
+		pStats->IsrNs = TicksToNs( pStats->IsrNs, freq );
+		pStats->MaxIsrNs = TicksToNs( pStats->MaxIsrNs, freq );
+		pStats->DpcLatencyNs =
+			TicksToNs( pStats->DpcLatencyNs, freq );
+		pStats->MaxDpcLatencyNs =
+			TicksToNs( pStats->MaxDpcLatencyNs, freq );
+		for (cls = 0; cls < PPORT_CLASSES; cls++) {
+			pStats->QueueWaitNs[cls] =
+				TicksToNs( pStats->QueueWaitNs[cls], freq );
+			pStats->MaxQueueWaitNs[cls] =
+				TicksToNs( pStats->MaxQueueWaitNs[cls], freq );
+		}
+		xferSize = sizeof(PPORT_STATS);
+		status = STATUS_SUCCESS;
+		break;
+
+	case IOCTL_PPORT_SET_PRIORITY:
+		if (pIrpStack->Parameters.DeviceIoControl.InputBufferLength <
+				sizeof(PPORT_PRIORITY)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		if (pPriority->Class > PPORT_CLASS_AUTO ||
+			pPriority->SortKey > PPORT_MAX_SORT_KEY) {
+			status = STATUS_INVALID_PARAMETER;
+			break;
+		}
+		// Writes already queued keep the priority they had
+		*(PPPORT_PRIORITY) pIrpStack->FileObject->FsContext =
+			*pPriority;
+		status = STATUS_SUCCESS;
+		break;
+
+	default:
+		status = STATUS_INVALID_DEVICE_REQUEST;
+		break;
+	}
+
+	pIrp->IoStatus.Status = status;
+	pIrp->IoStatus.Information = xferSize;
 	IoCompleteRequest( pIrp, IO_NO_INCREMENT );
 	return status;
 }
@@ -548,44 +1172,51 @@ BOOLEAN Isr (
 		return FALSE;
 
 	// its our interrupt, deal with it
+	LARGE_INTEGER start =
+		KeQueryPerformanceCounter( NULL );
 	WriteControl( pDevExt, CTL_DEFAULT);
-	// transmit another character
-	if (!TransmitByte( pDevExt ))
-		// if no more bytes, complete the request
+	// transmit another burst of characters
+	BOOLEAN bMore = TransmitByte( pDevExt );
+	if (!bMore)
+		pDevExt->bWriteDone = TRUE;
+	// if no more bytes, complete the request; either
+	// way, hand waiting reads what came back
+	if (!bMore || (pDevExt->bReadsWaiting &&
+				   pDevExt->rxHead != pDevExt->rxTail)) {
+		pDevExt->dpcRequested =
+			KeQueryPerformanceCounter( NULL ).QuadPart;
 		IoRequestDpc( pDevObj, pIrp, (PVOID)pDevExt );
+	}
+
+	ULONGLONG ticks = (ULONGLONG)
+		(KeQueryPerformanceCounter( NULL ).QuadPart - start.QuadPart);
+	pDevExt->stats.Interrupts++;
+	pDevExt->stats.IsrNs += ticks;
+	if (ticks > pDevExt->stats.MaxIsrNs)
+		pDevExt->stats.MaxIsrNs = ticks;
 
 	return TRUE;
 }
 
 //++
 // Function:
-//		TransmitByte
+//		SendByte
 //
 // Description:
-//		This function sends one character to the device
-//		An interrupt is then forced from the port.
-//		If no characters remain to be transmitted, return FALSE.
+//		This function sends the next character through
+//		the loopback connector and stores what came back.
 //
 // Arguments:
 //		Pointer to the Device Extension
 //
 // Return Value:
-//		TRUE - one more byte transmitted
-//		FALSE - no more bytes remain to be transmitted
+//		TRUE - the character came back as it should
+//		FALSE - the connector's lines hadn't settled
 //--
- BOOLEAN TransmitByte( 
-		IN PVOID pArg ) {
-	
-	PDEVICE_EXTENSION pDevExt = (PDEVICE_EXTENSION)
-		pArg;
-	 // If all the bytes have been sent, just quit
-	if( pDevExt->xferCount >= pDevExt->maxXferCount)
-		return FALSE;
+static BOOLEAN SendByte(
+		IN PDEVICE_EXTENSION pDevExt ) {
 
-	// A transfer is happening.
-	PDEVICE_OBJECT pDevObj =
-		pDevExt->pDevice;
-	PIRP pIrp = pDevObj->CurrentIrp;
+	PIRP pIrp = pDevExt->pDevice->CurrentIrp;
 	// Obtain user buffer pointer
 	PUCHAR userBuffer = (PUCHAR)
 		pIrp->AssociatedIrp.SystemBuffer;
@@ -598,20 +1229,14 @@ BOOLEAN Isr (
 				nextByte, nextByte, pDevExt->portBase);
 #endif
 	// The loopback connector requires us to do
-	// some bizzare work.
-	// Bit 0 of the data is sent as bit 0 of Port data.
-	WriteData( pDevExt, nextByte & 1);
-	// It will be read in Status bit 3
-	// Bits 1-3 of the data are sent as bits 0,1, & 3
-	// of the Control register.
-	// Control bits 0 & 1 are inverted.
-	UCHAR bits = (nextByte & 0x8) +
-				 ((nextByte & 0x6)>>1);
-	bits ^= 0x3;	// Invert the 2 control bits (0 & 1)
-	// These bits will be read in Status bits 4,5, & 7
-	WriteControl( pDevExt, bits | CTL_DEFAULT);
+	// some bizzare work (see Nibble.h).  StartIo
+	// has already worked out the register values.
+	NIBBLE_REGS regs =
+		pDevExt->encodedBuffer[pDevExt->xferCount];
+	WriteData( pDevExt, regs.Data );
+	WriteControl( pDevExt, regs.Control | CTL_DEFAULT);
 #if DBG==1
-	DbgPrint("PPORT: Wrote to Control: 0x%02X\n", bits);
+	DbgPrint("PPORT: Wrote to Control: 0x%02X\n", regs.Control);
 #endif
 
 	// Now read the data from the loopback
@@ -622,17 +1247,74 @@ BOOLEAN Isr (
 #endif
 
 	// Format the nibble into the upper half of the byte
-	UCHAR readByte =
-		((status & 0x8)<< 1) |
-		((status & 0x30)<<1) |
-		(status & 0x80);
-	pDevExt->deviceBuffer[pDevExt->xferCount++] =
+	UCHAR readByte = NibbleDecodeTable[status];
+	pDevExt->rxRing[pDevExt->rxHead++ & (pDevExt->rxSize - 1)] =
 		readByte;
+	pDevExt->xferCount++;
 #if DBG==1
 	DbgPrint("PPORT: TransmitByte read character: 0x%03X (%c)\n",
 				readByte, readByte);
 #endif
 
+	// The connector has no BUSY line of its own; the
+	// echo of the nibble is what shows it kept up
+	return readByte == (UCHAR)((nextByte & 0x0F) << 4);
+}
+
+//++
+// Function:
+//		TransmitByte
+//
+// Description:
+//		This function sends a burst of characters to the
+//		device: until one doesn't come back as it should,
+//		the device's burst size is reached, or the receive
+//		ring is full (which ends the write).  If any
+//		remain, an interrupt is then forced from the port.
+//
+// Arguments:
+//		Pointer to the Device Extension
+//
+// Return Value:
+//		TRUE - more bytes remain; an interrupt will follow
+//		FALSE - no more bytes remain to be transmitted
+//--
+ BOOLEAN TransmitByte( 
+		IN PVOID pArg ) {
+	
+	PDEVICE_EXTENSION pDevExt = (PDEVICE_EXTENSION)
+		pArg;
+	 // If all the bytes have been sent, just quit
+	if( pDevExt->xferCount >= pDevExt->maxXferCount)
+		return FALSE;
+
+	// A transfer is happening.
+	ULONG sent = 0;
+	BOOLEAN bReady = TRUE;
+	while (bReady && sent < pDevExt->burstBytes &&
+		   pDevExt->xferCount < pDevExt->maxXferCount) {
+		// With no room for what comes back, the
+		// write ends here, short
+		if (pDevExt->rxHead - pDevExt->rxTail == pDevExt->rxSize) {
+			pDevExt->maxXferCount = pDevExt->xferCount;
+			break;
+		}
+		bReady = SendByte( pDevExt );
+		sent++;
+	}
+
+	if (sent != 0) {
+		pDevExt->stats.Bursts++;
+		pDevExt->stats.Bytes += sent;
+		if (sent > pDevExt->stats.MaxBurst)
+			pDevExt->stats.MaxBurst = sent;
+	}
+
+	// That may have been the lot, with no
+	// need for another interrupt
+	if( pDevExt->xferCount >= pDevExt->maxXferCount)
+		return FALSE;
+
 	// Force an interrupt
 #if DBG==1
 	DbgPrint("PPORT: TransmitByte: generating interrupt.\n");
@@ -650,6 +1332,126 @@ BOOLEAN Isr (
 	return TRUE;
 }
 
+//++
+// Function:
+//		FirstBurst
+//
+// Description:
+//		Synch critical section routine that sends a
+//		write's first burst.  If that finishes the
+//		write, it tells the DPC so, as the ISR would.
+//
+// Arguments:
+//		Pointer to the Device Extension
+//
+// Return Value:
+//		TRUE - an interrupt will send the rest
+//		FALSE - StartIo must request the DPC
+//--
+BOOLEAN FirstBurst( 
+		IN PVOID pArg ) {
+
+	PDEVICE_EXTENSION pDevExt = (PDEVICE_EXTENSION)
+		pArg;
+	if (TransmitByte( pDevExt ))
+		return TRUE;
+	pDevExt->bWriteDone = TRUE;
+	pDevExt->dpcRequested =
+		KeQueryPerformanceCounter( NULL ).QuadPart;
+	return FALSE;
+}
+
+//++
+// Function:
+//		CountDpc
+//
+// Description:
+//		Synch critical section routine that adds the time
+//		since the ISR requested the DPC to the statistics,
+//		and collects the ISR's news of the write.
+//
+// Arguments:
+//		Pointer to the Device Extension
+//
+// Return Value:
+//		TRUE - the ISR finished the write
+//		FALSE - it is still going
+//--
+BOOLEAN CountDpc( 
+		IN PVOID pArg ) {
+
+	PDEVICE_EXTENSION pDevExt = (PDEVICE_EXTENSION)
+		pArg;
+	ULONGLONG ticks = (ULONGLONG)
+		(KeQueryPerformanceCounter( NULL ).QuadPart -
+		 pDevExt->dpcRequested);
+	pDevExt->stats.DpcLatencyNs += ticks;
+	if (ticks > pDevExt->stats.MaxDpcLatencyNs)
+		pDevExt->stats.MaxDpcLatencyNs = ticks;
+	pDevExt->stats.Dpcs++;
+	BOOLEAN bWriteDone = pDevExt->bWriteDone;
+	pDevExt->bWriteDone = FALSE;
+	return bWriteDone;
+}
+
+//++
+// Function:
+//		QueryStats
+//
+// Description:
+//		Synch critical section routine that copies the
+//		statistics out (times still in ticks) and starts
+//		them again.
+//
+// Arguments:
+//		Pointer to a QUERY_STATS_CONTEXT
+//
+// Return Value:
+//		TRUE
+//--
+BOOLEAN QueryStats( 
+		IN PVOID pArg ) {
+
+	PQUERY_STATS_CONTEXT pContext = (PQUERY_STATS_CONTEXT)
+		pArg;
+	PDEVICE_EXTENSION pDevExt = pContext->pDevExt;
+	*pContext->pStats = pDevExt->stats;
+	RtlZeroMemory( &pDevExt->stats, sizeof(PPORT_STATS) );
+	pDevExt->stats.BurstBytes = pDevExt->burstBytes;
+	return TRUE;
+}
+
+//++
+// Function:
+//		CountStart
+//
+// Description:
+//		Synch critical section routine that adds a
+//		write's time in the device queue to its
+//		class's statistics.
+//
+// Arguments:
+//		Pointer to a START_CONTEXT
+//
+// Return Value:
+//		TRUE
+//--
+BOOLEAN CountStart( 
+		IN PVOID pArg ) {
+
+	PSTART_CONTEXT pContext = (PSTART_CONTEXT)
+		pArg;
+	PPPORT_STATS pStats = &pContext->pDevExt->stats;
+	ULONGLONG ticks = (ULONGLONG)
+		(KeQueryPerformanceCounter( NULL ).QuadPart -
+		 pContext->queued);
+	pStats->Writes[pContext->cls]++;
+	pStats->QueueWaitNs[pContext->cls] += ticks;
+	if (ticks > pStats->MaxQueueWaitNs[pContext->cls])
+		pStats->MaxQueueWaitNs[pContext->cls] = ticks;
+	return TRUE;
+}
+
 //++
 // Function:
 //		StartIo
@@ -682,25 +1484,43 @@ StartIo(
 		pDevObj->DeviceExtension;
 	PUCHAR userBuffer;
 	ULONG xferSize;
+	KIRQL oldIrql;
+	START_CONTEXT start;
+
+	// Once the device has the IRP it can't be canceled,
+	// so take back the cancel routine IoStartPacket set.
+	// If it's too late, DispatchCancel has the IRP, and
+	// as it's the CurrentIrp, starts the next one.
+	IoAcquireCancelSpinLock( &oldIrql );
+	if (IoSetCancelRoutine( pIrp, NULL ) == NULL) {
+		IoReleaseCancelSpinLock( oldIrql );
+		return;
+	}
+	IoReleaseCancelSpinLock( oldIrql );
 		
 	switch( pIrpStack->MajorFunction ) {
 		
 		// Use a SynchCritSection routine to
 		// start the write operation...
 		case IRP_MJ_WRITE:
+			// Count its wait in the queue, and how many
+			// latency writes have gone since a bulk one
+			start.pDevExt = pDevExt;
+			start.cls = PPORT_KEY_CLASS(
+				pIrp->Tail.Overlay.DeviceQueueEntry.SortKey );
+			start.queued = GetWriteQueued( pIrp );
+			KeSynchronizeExecution( pDevExt->pIntObj,
+									CountStart, &start );
+			if (start.cls == PPORT_CLASS_LATENCY)
+				pDevExt->latencyRun++;
+			else
+				pDevExt->latencyRun = 0;
+
 			// Set up counts and byte pointer
 			pDevExt->maxXferCount = 
 				pIrpStack->Parameters.Write.Length;
 			pDevExt->xferCount = 0;
 
-			// Since we processing a new Write request,
-			// free up any old buffer
-			if (pDevExt->deviceBuffer != NULL) {
-				ExFreePool(pDevExt->deviceBuffer);
-				pDevExt->deviceBuffer = NULL;
-				pDevExt->deviceBufferSize = 0;
-			}
-
 			// Determine the length of the request
 			xferSize = 
 				pIrpStack->Parameters.Write.Length;
@@ -708,38 +1528,45 @@ StartIo(
 			userBuffer = (PUCHAR)
 				pIrp->AssociatedIrp.SystemBuffer;
 
-			// Allocate the new buffer
-			pDevExt->deviceBuffer = (PUCHAR)
-				ExAllocatePool( PagedPool, xferSize );
-			if (pDevExt->deviceBuffer == NULL) {
+			// Allocate a buffer for the register values.
+			// TransmitByte runs at DIRQL, so it must be
+			// nonpaged.  (What comes back goes to the
+			// receive ring.)
+			pDevExt->encodedBuffer = (PNIBBLE_REGS)
+				ExAllocatePool( NonPagedPool,
+					xferSize * sizeof(NIBBLE_REGS) );
+			if (pDevExt->encodedBuffer == NULL) {
 				// buffer didn't allocate???
 				// fail the IRP
 				pIrp->IoStatus.Status = 
 					STATUS_INSUFFICIENT_RESOURCES;
 				pIrp->IoStatus.Information = 0;
+				StartNextWrite( pDevObj, TRUE );
 				IoCompleteRequest( pIrp, IO_NO_INCREMENT );
-				IoStartNextPacket( pDevObj, FALSE );
+				return;
 			}
-			pDevExt->deviceBufferSize = xferSize;
+
+			// Encode the whole write up front, so the
+			// byte-at-a-time work at DIRQL is minimal
+			NibbleEncodeBuffer( userBuffer, xferSize,
+				pDevExt->encodedBuffer );
 
 			//
-			// Try to send the first byte of data.
-			// If there's a problem, use
-			// the DPC routine to fail the IRP.
+			// Try to send the first burst of data.
+			// If that was the lot, or there's a problem,
+			// the DPC completes the IRP - not a direct
+			// call, which would start the next write
+			// from here, one stack frame deeper each time.
 			//
 #if DBG==1
-	DbgPrint("PPORT: StartIO: Transmitting first byte of %d\n", pDevExt->deviceBufferSize);
+	DbgPrint("PPORT: StartIO: Transmitting first byte of %d\n", xferSize);
 #endif
 			if( !KeSynchronizeExecution(
 					pDevExt->pIntObj,
-					TransmitByte,
+					FirstBurst,
 					pDevExt ))
 			{
-				DpcForIsr(
-					NULL,
-					pDevObj,
-					pIrp,
-					pDevExt );
+				IoRequestDpc( pDevObj, pIrp, (PVOID)pDevExt );
 			}
 			break;
 		//
@@ -750,10 +1577,10 @@ StartIo(
 			pIrp->IoStatus.Status =
 						STATUS_NOT_SUPPORTED;
 			pIrp->IoStatus.Information = 0;
+			StartNextWrite( pDevObj, TRUE );
 			IoCompleteRequest(
 				pIrp,
 				IO_NO_INCREMENT );
-			IoStartNextPacket( pDevObj, FALSE );
 			break;
 	}
 }
@@ -790,25 +1617,76 @@ DpcForIsr(
 	DbgPrint("PPORT: DpcForIsr, xferCount = %d\n",
 				pDevExt->xferCount);
 #endif
+
+	// Waiting reads get what the write brought back
+	ServiceReads( pDevExt );
+
+	// The DPC may have been only for the reads.  If
+	// the write is done, it is the current IRP.
+	if( !KeSynchronizeExecution(
+			pDevExt->pIntObj,
+			CountDpc,
+			pDevExt ))
+		return;
+	pIrp = pDevObj->CurrentIrp;
 	
 	pIrp->IoStatus.Information =
 			pDevExt->xferCount;
 
-	// This loopback device always works
-	pIrp->IoStatus.Status =	
-			STATUS_SUCCESS;
+	// The register values have all been sent
+	if (pDevExt->encodedBuffer != NULL) {
+		ExFreePool(pDevExt->encodedBuffer);
+		pDevExt->encodedBuffer = NULL;
+	}
 
-	//
-	// If we're being called directly from Start I/O,
-	// don't give the user any priority boost.
-	//
-	if( pDpc == NULL )
-		IoCompleteRequest( pIrp, IO_NO_INCREMENT );
+	// This loopback device always works, but with
+	// the receive ring full it can't take a byte
+	if (pDevExt->xferCount == 0 &&
+		IoGetCurrentIrpStackLocation( pIrp )->Parameters.Write.Length != 0)
+		pIrp->IoStatus.Status =
+			STATUS_DEVICE_BUSY;	// full - reader must catch up
 	else
-		IoCompleteRequest( pIrp, IO_PARALLEL_INCREMENT );
+		pIrp->IoStatus.Status =	
+			STATUS_SUCCESS;
 
 	//
 	// This one's done. Begin working on the next
+	// before completing it: once the last IRP
+	// completes, the device may be deleted.
 	//
-	IoStartNextPacket( pDevObj, FALSE );
+	StartNextWrite( pDevObj, TRUE );
+
+	IoCompleteRequest( pIrp, IO_PARALLEL_INCREMENT );
+}
+
+//++
+// Function:
+//		StartNextWrite
+//
+// Description:
+//		Starts the next queued write: the first by
+//		key, so latency writes before bulk ones, unless
+//		LatencyRun latency writes have gone in a row -
+//		then the first bulk write, if one is waiting.
+//
+// Arguments:
+//		Pointer to the Device object
+//		Whether the IRPs are cancelable
+//
+// Return Value:
+//		(None)
+//--
+VOID
+StartNextWrite(
+	IN PDEVICE_OBJECT pDevObj,
+	IN BOOLEAN Cancelable
+	) {
+	PDEVICE_EXTENSION pDevExt = (PDEVICE_EXTENSION)
+		pDevObj->DeviceExtension;
+
+	if (pDevExt->latencyRun >= LatencyRun)
+		IoStartNextPacketByKey( pDevObj, Cancelable,
+			PPORT_QUEUE_KEY( PPORT_CLASS_BULK, 0 ));
+	else
+		IoStartNextPacket( pDevObj, Cancelable );
 }
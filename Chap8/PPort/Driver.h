@@ -5,25 +5,87 @@
 
 #pragma once
 
+#ifdef WIN32DDK_TEST
+#include "DDKTestEnv.h"
+#else
 extern "C" {
 #include <NTDDK.h>
 }
+#endif
 #include "Unicode.h"
+#include "Nibble.h"
+#include "PPortIoctl.h"
 
 typedef struct _DEVICE_EXTENSION {
 	PDEVICE_OBJECT pDevice;
 	ULONG DeviceNumber;
 	CUString ustrDeviceName;	// internal name
 	CUString ustrSymLinkName;	// external name
-	PUCHAR deviceBuffer;		// temporary pool buffer
-	ULONG deviceBufferSize;
+	PNIBBLE_REGS encodedBuffer;	// write, encoded for the port
 	ULONG xferCount;			// current transfer count
 	ULONG maxXferCount;			// requested xfer count
 	PUCHAR portBase;				// I/O register address
 	ULONG Irq;					// Irq for parallel port
 	PKINTERRUPT pIntObj;	// the interrupt object
+	ULONG burstBytes;			// bytes sent per interrupt, at most
+	PPORT_STATS stats;			// times in performance counter ticks
+	LONGLONG dpcRequested;		// when the ISR called IoRequestDpc
+	BOOLEAN bWriteDone;			// the ISR finished the write, for the DPC
+	ULONG latencyRun;			// latency writes started since a bulk one
+	// Receive ring.  TransmitByte puts each byte the connector
+	// sends back at rxHead; reads take them from rxTail.  Both
+	// only grow, and move under the interrupt lock.  Reads copy
+	// the bytes out holding only lkReads, then move rxTail.
+	PUCHAR rxRing;
+	ULONG rxSize;				// a power of 2
+	ULONG rxHead;
+	ULONG rxTail;
+	// Reads waiting for bytes, oldest first
+	KSPIN_LOCK lkReads;
+	LIST_ENTRY pendingReads;
+	BOOLEAN bReadsWaiting;		// pendingReads isn't empty, for the ISR
 } DEVICE_EXTENSION, *PDEVICE_EXTENSION;
 
+// Range of Parameters\BurstBytes
+#define PPORT_DEFAULT_BURST	16
+#define PPORT_MAX_BURST		256
+// ... and Parameters\ReceiveBuffer (rounded down to a power of 2)
+#define PPORT_DEFAULT_RECEIVE	4096
+#define PPORT_MIN_RECEIVE		256
+#define PPORT_MAX_RECEIVE		(1024*1024)
+// ... Parameters\SmallWrite (longest latency write, by default)
+#define PPORT_DEFAULT_SMALL_WRITE	64
+// ... and Parameters\LatencyRun (at least 1)
+#define PPORT_DEFAULT_LATENCY_RUN	4
+
+// A write's device queue key: class, then the handle's SortKey
+#define PPORT_CLASS_SHIFT	24
+#define PPORT_QUEUE_KEY( cls, sortKey )	\
+	(((cls) << PPORT_CLASS_SHIFT) | (sortKey))
+#define PPORT_KEY_CLASS( key )	((key) >> PPORT_CLASS_SHIFT)
+
+// The driver owns a write's Tail.Overlay until it completes it.
+// Its DeviceQueueEntry.SortKey keeps the queue key, and its
+// ListEntry (PPort queues only reads on it) keeps the time
+// DispatchWrite queued it, for StartIo.  The time is copied in
+// and out, as a LIST_ENTRY isn't a LARGE_INTEGER.
+inline VOID SetWriteQueued(
+	IN PIRP pIrp,
+	IN LARGE_INTEGER queued ) {
+
+	RtlCopyMemory( &pIrp->Tail.Overlay.ListEntry,
+				   &queued, sizeof(LARGE_INTEGER) );
+}
+
+inline LONGLONG GetWriteQueued(
+	IN PIRP pIrp ) {
+
+	LARGE_INTEGER queued;
+	RtlCopyMemory( &queued, &pIrp->Tail.Overlay.ListEntry,
+				   sizeof(LARGE_INTEGER) );
+	return queued.QuadPart;
+}
+
 #define PPORT_REG_LENGTH 4
 #define DATA_REG	0
 #define STATUS_REG	1
@@ -121,6 +121,14 @@ SOURCE=D:\NTDDK\inc\ddk\ntddk.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\Nibble.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\PPortIoctl.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\Unicode.h
 # End Source File
 # End Group
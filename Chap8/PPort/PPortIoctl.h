@@ -0,0 +1,68 @@
+// PPortIoctl.h - Chapter 8 - Parallel Port Driver
+//
+// Copyright (C) 2000 by Jerry Lozano
+//
+
+// Device I/O controls of the PPort driver, shared by the driver
+// and the programs that use them (Win32 code includes <winioctl.h>
+// first, for CTL_CODE)
+
+#pragma once
+
+//
+// Burst and queue statistics.  Each interrupt, the ISR sends up to
+// BurstBytes bytes (the service's Parameters\BurstBytes value)
+// before forcing the next interrupt, so a larger budget means
+// fewer interrupts but longer at DIRQL, and a later DPC for
+// whatever else wants the processor.  IOCTL_PPORT_QUERY_STATS
+// returns the counts since the last query (or since the driver
+// loaded) and starts them again.  No input buffer.
+//
+#define IOCTL_PPORT_QUERY_STATS		\
+	CTL_CODE( FILE_DEVICE_UNKNOWN, 0x800,	\
+		METHOD_BUFFERED, FILE_ANY_ACCESS )
+
+//
+// Queue priority.  Writes wait for the port in StartIo's device
+// queue, the latency class ahead of the bulk class and, within a
+// class, in SortKey order (first come, first served among equals).
+// So that bulk writes still get their turn, after LatencyRun
+// latency writes in a row (Parameters\LatencyRun) the next bulk
+// write goes first.  IOCTL_PPORT_SET_PRIORITY sets the priority of
+// the handle's later writes; a new handle has PPORT_CLASS_AUTO,
+// under which a write of up to SmallWrite bytes (also under
+// Parameters) is a latency write and a longer one is bulk.  Input
+// buffer: a PPORT_PRIORITY.  No output buffer.
+//
+#define IOCTL_PPORT_SET_PRIORITY	\
+	CTL_CODE( FILE_DEVICE_UNKNOWN, 0x801,	\
+		METHOD_BUFFERED, FILE_ANY_ACCESS )
+
+#define PPORT_CLASS_LATENCY	0
+#define PPORT_CLASS_BULK	1
+#define PPORT_CLASSES		2
+#define PPORT_CLASS_AUTO	PPORT_CLASSES	// by each write's length
+
+#define PPORT_MAX_SORT_KEY	0x00FFFFFF
+
+typedef struct _PPORT_PRIORITY {
+	ULONG Class;				// PPORT_CLASS_xxx
+	ULONG SortKey;				// lowest first, up to PPORT_MAX_SORT_KEY
+} PPORT_PRIORITY, *PPPORT_PRIORITY;
+
+typedef struct _PPORT_STATS {
+	ULONG BurstBytes;			// the per-interrupt budget
+	ULONG Interrupts;			// claimed by the ISR
+	ULONG Bursts;				// runs of bytes sent (by the ISR or StartIo)
+	ULONG Bytes;				// bytes sent
+	ULONG MaxBurst;				// most bytes in one run
+	ULONG Dpcs;					// run for the ISR
+	ULONGLONG IsrNs;			// total time in the ISR
+	ULONGLONG MaxIsrNs;			// longest time in the ISR
+	ULONGLONG DpcLatencyNs;		// total, IoRequestDpc to DpcForIsr
+	ULONGLONG MaxDpcLatencyNs;
+	// By class (PPORT_CLASS_LATENCY, PPORT_CLASS_BULK)
+	ULONG Writes[PPORT_CLASSES];			// started by StartIo
+	ULONGLONG QueueWaitNs[PPORT_CLASSES];	// total, IoStartPacket to StartIo
+	ULONGLONG MaxQueueWaitNs[PPORT_CLASSES];
+} PPORT_STATS, *PPPORT_STATS;
@@ -1,11 +1,30 @@
 // Testor for Chapter 8 Parallel Port Driver
 
+#ifdef WIN32DDK_TEST
+// Linux build: the driver runs inside this program, against a
+// model of the port and its loopback connector (see
+// Chap5/DDKTestEnv.h and the build line in Chap5/ReadMe.txt)
+#include "DDKTestWin32.h"
+extern "C" NTSTATUS DriverEntry(PDRIVER_OBJECT, PUNICODE_STRING);
+#define PPORT_BASE	0x378	// where the driver looks for it
+#define PPORT_IRQ	7
+#define TEST_BURST_BYTES	16	// Parameters\BurstBytes for the test
+#define TEST_RECEIVE_BUFFER	1024	// Parameters\ReceiveBuffer for the test
+#define BENCH_RECEIVE_BUFFER	4096	// ... and for -bench
+#include "Nibble.h"
+#else
 #include <windows.h>
+#include <winioctl.h>
+#endif
 #include <stdio.h>
+#include <string.h>
+#include "../PPort/PPortIoctl.h"
 
-int main() {
+// Exercises PPT1: returns 0, or the number of the step that failed
+static int TestDevice() {
 	HANDLE hDevice;
 	BOOL status;
+	DWORD i;
 
 	printf("Beginning test of Parallel Port Driver (CH8)...\n");
 
@@ -69,6 +88,13 @@ int main() {
 		for (i=0; i<bR; i++)
 			printf("%02X ", (UCHAR)inBuffer[i]);
 		printf("\n");
+		// The connector loops back the low nibble of each
+		// byte, which the driver reads into the high nibble
+		for (i=0; i<bR; i++)
+			if ((UCHAR)inBuffer[i] != (UCHAR)((outBuffer[i] & 0x0F) << 4)) {
+				printf("Byte %d came back as %02X\n", i, (UCHAR)inBuffer[i]);
+				return 5;
+			}
 	} else {
 		printf("Failed to read the correct number of bytes.\n"
 			"Should have read %d bytes, but ReadFile reported %d bytes.\n",
@@ -76,6 +102,54 @@ int main() {
 		return 5;
 	}
 
+	// Every byte value, to check the whole encoding
+	printf("Attempting round trip of all 256 byte values...\n");
+	char allBuffer[256];
+	for (i=0; i<sizeof(allBuffer); i++)
+		allBuffer[i] = (char)i;
+	if (!WriteFile(hDevice, allBuffer, sizeof(allBuffer), &bW, NULL) ||
+		bW != sizeof(allBuffer) ||
+		!ReadFile(hDevice, allBuffer, sizeof(allBuffer), &bR, NULL) ||
+		bR != sizeof(allBuffer)) {
+		printf("Round trip failed - error: %d\n", GetLastError() );
+		return 7;
+	}
+	for (i=0; i<bR; i++)
+		if ((UCHAR)allBuffer[i] != (UCHAR)((i & 0x0F) << 4)) {
+			printf("Byte %02X came back as %02X\n", i, (UCHAR)allBuffer[i]);
+			return 7;
+		}
+	printf("All 256 byte values came back correctly\n");
+
+	// Every byte went out in some burst, none over budget
+	printf("Attempting to query burst statistics...\n");
+	PPORT_STATS stats;
+	DWORD bytesReturned;
+	if (!DeviceIoControl(hDevice, IOCTL_PPORT_QUERY_STATS, NULL, 0,
+						 &stats, sizeof(stats), &bytesReturned, NULL) ||
+		bytesReturned != sizeof(stats)) {
+		printf("Failed on call to DeviceIoControl - error: %d\n",
+			GetLastError() );
+		return 9;
+	}
+	printf("%d bytes in %d bursts (at most %d of %d), %d interrupts\n",
+		stats.Bytes, stats.Bursts, stats.MaxBurst, stats.BurstBytes,
+		stats.Interrupts);
+	if (stats.Bytes != outCount + sizeof(allBuffer) ||
+		stats.MaxBurst > stats.BurstBytes ||
+		stats.Bursts < (stats.Bytes + stats.BurstBytes - 1) / stats.BurstBytes ||
+		stats.Interrupts + 2 != stats.Bursts) {
+		printf("Statistics don't add up\n");
+		return 9;
+	}
+	// ... and they start again once read
+	if (!DeviceIoControl(hDevice, IOCTL_PPORT_QUERY_STATS, NULL, 0,
+						 &stats, sizeof(stats), &bytesReturned, NULL) ||
+		stats.Bytes != 0 || stats.Interrupts != 0) {
+		printf("Statistics weren't reset\n");
+		return 9;
+	}
+
 	printf("Attempting to close device PPT1...\n");
 	status =
 		CloseHandle(hDevice);
@@ -88,5 +162,561 @@ int main() {
 	return 0;
 }
 
+// Writes count bytes to PPT1, size at a time, reading each write
+// back before the next, and returns the bytes per second, or 0 on
+// error.  *pStats gets the driver's burst statistics for the writes.
+static double TimeRoundTrips(DWORD size, DWORD count, PPPORT_STATS pStats) {
+	HANDLE hDevice = CreateFile("\\\\.\\PPT1", GENERIC_READ | GENERIC_WRITE,
+								0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if (hDevice == INVALID_HANDLE_VALUE) {
+		printf("Failed to open PPT1 - error: %d\n", GetLastError() );
+		return 0;
+	}
+	DWORD bytesReturned;
+	BOOL ok = DeviceIoControl(hDevice, IOCTL_PPORT_QUERY_STATS, NULL, 0,
+							  pStats, sizeof(PPORT_STATS), &bytesReturned, NULL);
+	char* buffer = new char[size];
+	memset(buffer, 0x5A, size);
+	LARGE_INTEGER freq, start, end;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+	for (DWORD sent = 0; sent < count && ok; sent += size) {
+		DWORD bW, bR;
+		ok = WriteFile(hDevice, buffer, size, &bW, NULL) && bW == size &&
+			 ReadFile(hDevice, buffer, size, &bR, NULL) && bR == size;
+	}
+	QueryPerformanceCounter(&end);
+	ok = ok && DeviceIoControl(hDevice, IOCTL_PPORT_QUERY_STATS, NULL, 0,
+							   pStats, sizeof(PPORT_STATS), &bytesReturned, NULL);
+	CloseHandle(hDevice);
+	delete[] buffer;
+	if (!ok) {
+		printf("Failed to write - error: %d\n", GetLastError() );
+		return 0;
+	}
+	return count / ((double) (end.QuadPart - start.QuadPart) / freq.QuadPart);
+}
+
+// Waits for an overlapped read or write
+static BOOL Finish(HANDLE hDevice, BOOL bStarted, OVERLAPPED* pOverlapped,
+				   DWORD* pCount) {
+	if (!bStarted && GetLastError() != ERROR_IO_PENDING)
+		return FALSE;
+	return GetOverlappedResult(hDevice, pOverlapped, pCount, TRUE);
+}
+
+// The reading half of a stream: reads from an overlapped handle,
+// Chunk bytes at most at a time, until Total bytes have come back,
+// checking each is the loopback of (char) its offset
+typedef struct _STREAM_READER {
+	HANDLE hDevice;
+	DWORD Total;
+	DWORD Chunk;
+	DWORD Received;
+	DWORD Reads;
+	BOOL ok;
+} STREAM_READER;
+
+static DWORD WINAPI StreamReader(LPVOID pContext) {
+	STREAM_READER* pReader = (STREAM_READER*) pContext;
+	UCHAR* buffer = new UCHAR[pReader->Chunk];
+	pReader->ok = TRUE;
+	while (pReader->ok && pReader->Received < pReader->Total) {
+		OVERLAPPED ov;
+		DWORD bR;
+		memset(&ov, 0, sizeof(ov));
+		pReader->ok = Finish(pReader->hDevice,
+			ReadFile(pReader->hDevice, buffer, pReader->Chunk, NULL, &ov),
+			&ov, &bR);
+		if (!pReader->ok)
+			printf("Streaming read failed - error: %d\n", GetLastError() );
+		pReader->Reads++;
+		for (DWORD i = 0; pReader->ok && i < bR; i++, pReader->Received++)
+			if (buffer[i] != (UCHAR)((pReader->Received & 0x0F) << 4)) {
+				printf("Byte %d came back as %02X\n", pReader->Received, buffer[i]);
+				pReader->ok = FALSE;
+			}
+	}
+	delete[] buffer;
+	return 0;
+}
+
+// Writes total bytes ((char) offset each) to PPT1, chunk at a
+// time, while a second thread reads them back - the writes go on
+// while the reads are waiting.  A full receive ring shortens a
+// write, or fails it with ERROR_BUSY, until the reader catches up.
+// Returns the bytes per second, or 0 on error.
+static double TimeStream(DWORD chunk, DWORD total) {
+	HANDLE hDevice = CreateFile("\\\\.\\PPT1", GENERIC_READ | GENERIC_WRITE,
+								0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL );
+	if (hDevice == INVALID_HANDLE_VALUE) {
+		printf("Failed to open PPT1 - error: %d\n", GetLastError() );
+		return 0;
+	}
+	STREAM_READER reader;
+	memset(&reader, 0, sizeof(reader));
+	reader.hDevice = hDevice;
+	reader.Total = total;
+	reader.Chunk = chunk;
+	char* buffer = new char[chunk];
+	LARGE_INTEGER freq, start, end;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+	HANDLE hThread = CreateThread(NULL, 0, StreamReader, &reader, 0, NULL);
+	BOOL ok = (hThread != NULL);
+	for (DWORD sent = 0; sent < total && ok; ) {
+		DWORD size = (total - sent < chunk) ? total - sent : chunk;
+		for (DWORD i = 0; i < size; i++)
+			buffer[i] = (char) (sent + i);
+		OVERLAPPED ov;
+		DWORD bW;
+		memset(&ov, 0, sizeof(ov));
+		if (Finish(hDevice, WriteFile(hDevice, buffer, size, NULL, &ov), &ov, &bW))
+			sent += bW;			// short if the ring filled
+		else if (GetLastError() == ERROR_BUSY)
+			Sleep(0);			// full - let the reader catch up
+		else {
+			printf("Streaming write failed - error: %d\n", GetLastError() );
+			ok = FALSE;
+		}
+	}
+	if (hThread != NULL) {
+		if (!ok)
+			CancelIo(hDevice);	// the reader would wait for ever
+		WaitForSingleObject(hThread, INFINITE);
+		CloseHandle(hThread);
+	}
+	QueryPerformanceCounter(&end);
+	CloseHandle(hDevice);
+	delete[] buffer;
+	if (!ok || !reader.ok)
+		return 0;
+	return total / ((double) (end.QuadPart - start.QuadPart) / freq.QuadPart);
+}
+
+// Exercises the receive ring on an overlapped handle: returns 0,
+// or the number of the step that failed
+static int TestStreaming() {
+	char buffer[64];
+	OVERLAPPED ovRead, ovWrite;
+	DWORD bR, bW, i;
+
+	printf("Beginning test of the receive ring...\n");
+	HANDLE hDevice = CreateFile("\\\\.\\PPT1", GENERIC_READ | GENERIC_WRITE,
+								0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL );
+	if (hDevice == INVALID_HANDLE_VALUE) {
+		printf("Failed to open PPT1 - error: %d\n", GetLastError() );
+		return 10;
+	}
+
+	// A read of an empty ring waits for the next write
+	memset(&ovRead, 0, sizeof(ovRead));
+	memset(&ovWrite, 0, sizeof(ovWrite));
+	if (ReadFile(hDevice, buffer, sizeof(buffer), NULL, &ovRead) ||
+		GetLastError() != ERROR_IO_PENDING) {
+		printf("Read of an empty ring didn't wait\n");
+		return 11;
+	}
+	for (i = 0; i < 16; i++)
+		buffer[32 + i] = (char) i;
+	if (!Finish(hDevice, WriteFile(hDevice, buffer + 32, 16, NULL, &ovWrite),
+				&ovWrite, &bW) ||
+		!GetOverlappedResult(hDevice, &ovRead, &bR, TRUE) ||
+		bW != 16 || bR == 0) {
+		printf("Waiting read wasn't satisfied - error: %d\n", GetLastError() );
+		return 11;
+	}
+	printf("Waiting read got %d bytes\n", bR);
+	// ... and a second one gets whatever it didn't
+	DWORD bR2 = 0;
+	if (bR < 16) {
+		memset(&ovRead, 0, sizeof(ovRead));
+		if (!Finish(hDevice, ReadFile(hDevice, buffer + bR, sizeof(buffer) - bR,
+									  NULL, &ovRead), &ovRead, &bR2)) {
+			printf("Second read failed - error: %d\n", GetLastError() );
+			return 11;
+		}
+	}
+	if (bR + bR2 != 16) {
+		printf("Read %d bytes of 16\n", bR + bR2);
+		return 11;
+	}
+	for (i = 0; i < 16; i++)
+		if ((UCHAR)buffer[i] != (UCHAR)(i << 4)) {
+			printf("Byte %d came back as %02X\n", i, (UCHAR)buffer[i]);
+			return 11;
+		}
+
+	// A waiting read can be cancelled
+	memset(&ovRead, 0, sizeof(ovRead));
+	if (ReadFile(hDevice, buffer, sizeof(buffer), NULL, &ovRead) ||
+		GetLastError() != ERROR_IO_PENDING ||
+		!CancelIo(hDevice) ||
+		GetOverlappedResult(hDevice, &ovRead, &bR, TRUE) ||
+		GetLastError() != ERROR_OPERATION_ABORTED) {
+		printf("Waiting read wasn't cancelled - error: %d\n", GetLastError() );
+		return 12;
+	}
+
+	// With nobody reading, a write stops when the ring is full,
+	// and the next one fails
+	DWORD ringBytes = 0;
+	for (;;) {
+		static char block[1000];
+		memset(&ovWrite, 0, sizeof(ovWrite));
+		if (!Finish(hDevice, WriteFile(hDevice, block, sizeof(block), NULL, &ovWrite),
+					&ovWrite, &bW)) {
+			if (GetLastError() != ERROR_BUSY || ringBytes == 0) {
+				printf("Write to a full ring failed with %d\n", GetLastError() );
+				return 13;
+			}
+			break;
+		}
+		ringBytes += bW;
+		if (bW != sizeof(block))
+			break;
+	}
+	printf("Receive ring holds %d bytes\n", ringBytes);
+	CloseHandle(hDevice);	// ... throwing them away
+
+	// Writes and reads at once, through a ring much smaller
+	// than the transfer
+	printf("Streaming %d bytes...\n", 16 * ringBytes);
+	if (TimeStream(300, 16 * ringBytes) == 0)
+		return 14;
+	printf("Receive ring test succeeded\n");
+	return 0;
+}
+
+// Sets the priority of an overlapped handle's later writes
+static BOOL SetPriority(HANDLE hDevice, ULONG cls, ULONG sortKey) {
+	PPORT_PRIORITY priority;
+	OVERLAPPED ov;
+	DWORD bytesReturned;
+	priority.Class = cls;
+	priority.SortKey = sortKey;
+	memset(&ov, 0, sizeof(ov));
+	return Finish(hDevice,
+		DeviceIoControl(hDevice, IOCTL_PPORT_SET_PRIORITY,
+						&priority, sizeof(priority), NULL, 0,
+						&bytesReturned, &ov),
+		&ov, &bytesReturned);
+}
+
+#ifdef WIN32DDK_TEST
+// Exercises the write queue: returns 0, or the number of the step
+// that failed.  The port's interrupt is held off while the writes
+// queue up behind the first, and the order they went out in is
+// read back from the receive ring.
+static int TestPriority(PTESTENV_PARALLEL_PORT pPort) {
+	// Bulk (B) writes of 200 bytes, small (S) ones of 16 and
+	// one urgent (U) latency write of 200, in the order queued,
+	// and the order they should go out in: after LatencyRun
+	// (4) latency writes in a row, a bulk write gets its turn
+	static const char queued[] = "BBBSSSSSSU";
+	static const char expected[] = "BUSSSBSSSB";
+	const DWORD writes = sizeof(queued) - 1;
+	static char block[writes][200];
+	OVERLAPPED ov[writes];
+	DWORD i, b, bR, bytes[writes];
+	char first;
+	PPORT_STATS stats;
+	DWORD bytesReturned;
+
+	printf("Beginning test of the write queue...\n");
+	HANDLE hDevice = CreateFile("\\\\.\\PPT1", GENERIC_READ | GENERIC_WRITE,
+								0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL );
+	if (hDevice == INVALID_HANDLE_VALUE) {
+		printf("Failed to open PPT1 - error: %d\n", GetLastError() );
+		return 15;
+	}
+	if (SetPriority(hDevice, PPORT_CLASSES + 1, 0) ||
+		GetLastError() != ERROR_INVALID_PARAMETER ||
+		SetPriority(hDevice, PPORT_CLASS_AUTO, PPORT_MAX_SORT_KEY + 1) ||
+		GetLastError() != ERROR_INVALID_PARAMETER) {
+		printf("Bad priority wasn't refused\n");
+		return 15;
+	}
+	memset(&ov, 0, sizeof(ov));
+	memset(&stats, 0, sizeof(stats));
+	Finish(hDevice,
+		DeviceIoControl(hDevice, IOCTL_PPORT_QUERY_STATS, NULL, 0,
+						&stats, sizeof(stats), &bytesReturned, &ov[0]),
+		&ov[0], &bytesReturned);	// start the counts again
+
+	// Each write's bytes say which it was (the connector
+	// brings back the low nibble, shifted up)
+	ULONG delayNs = pPort->InterruptDelayNs;
+	pPort->InterruptDelayNs = 50000000;	// 50 ms
+	BOOL ok = SetPriority(hDevice, PPORT_CLASS_AUTO, 10);
+	for (i = 0; ok && i < writes; i++) {
+		DWORD size = (queued[i] == 'S') ? 16 : 200;
+		if (queued[i] == 'U')
+			ok = SetPriority(hDevice, PPORT_CLASS_LATENCY, 0);
+		memset(block[i], (char) i, size);
+		memset(&ov[i], 0, sizeof(ov[i]));
+		if (ok && (WriteFile(hDevice, block[i], size, NULL, &ov[i]) ||
+				   GetLastError() != ERROR_IO_PENDING))
+			ok = FALSE;		// the first should be waiting on the port
+		// Once the first's opening burst comes back, it has
+		// the port (the last write's DPC may still have had it)
+		if (ok && i == 0) {
+			OVERLAPPED ovRead;
+			memset(&ovRead, 0, sizeof(ovRead));
+			ok = Finish(hDevice, ReadFile(hDevice, &first, 1, NULL, &ovRead),
+						&ovRead, &bR);
+		}
+	}
+	pPort->InterruptDelayNs = delayNs;
+	if (!ok) {
+		printf("Failed to queue the writes - error: %d\n", GetLastError() );
+		CancelIo(hDevice);
+	}
+	for (b = 0; b < i; b++)
+		if (!GetOverlappedResult(hDevice, &ov[b], &bytes[b], TRUE))
+			ok = FALSE;
+	if (!ok)
+		return 16;
+
+	// What came back, a write at a time
+	for (i = 0; i < writes; i++) {
+		char buffer[200];
+		DWORD wanted = (expected[i] == 'S') ? 16 : 200;
+		DWORD got = 0;
+		OVERLAPPED ovRead;
+		if (i == 0)
+			buffer[got++] = first;
+		memset(&ovRead, 0, sizeof(ovRead));
+		for (; got < wanted; got += bR) {
+			if (!Finish(hDevice, ReadFile(hDevice, buffer + got, wanted - got,
+										  NULL, &ovRead), &ovRead, &bR)) {
+				printf("Read failed - error: %d\n", GetLastError() );
+				return 16;
+			}
+			memset(&ovRead, 0, sizeof(ovRead));
+		}
+		b = ((UCHAR) buffer[0]) >> 4;
+		if (b >= writes || queued[b] != expected[i] || bytes[b] != wanted) {
+			printf("Write %d went out in place %d\n", b, i);
+			return 16;
+		}
+	}
+	printf("Writes went out in the order %s\n", expected);
+
+	// The bulk write that waited longest waited longer than
+	// any latency write
+	memset(&ov[0], 0, sizeof(ov[0]));
+	if (!Finish(hDevice,
+			DeviceIoControl(hDevice, IOCTL_PPORT_QUERY_STATS, NULL, 0,
+							&stats, sizeof(stats), &bytesReturned, &ov[0]),
+			&ov[0], &bytesReturned)) {
+		printf("Failed on call to DeviceIoControl - error: %d\n",
+			GetLastError() );
+		return 17;
+	}
+	printf("%d latency writes waited %.0f us at most, %d bulk %.0f us\n",
+		stats.Writes[PPORT_CLASS_LATENCY],
+		stats.MaxQueueWaitNs[PPORT_CLASS_LATENCY] / 1000.0,
+		stats.Writes[PPORT_CLASS_BULK],
+		stats.MaxQueueWaitNs[PPORT_CLASS_BULK] / 1000.0);
+	if (stats.Writes[PPORT_CLASS_LATENCY] != 7 ||
+		stats.Writes[PPORT_CLASS_BULK] != 3 ||
+		stats.MaxQueueWaitNs[PPORT_CLASS_BULK] <=
+			stats.MaxQueueWaitNs[PPORT_CLASS_LATENCY]) {
+		printf("Queue statistics don't add up\n");
+		return 17;
+	}
+	CloseHandle(hDevice);
+	printf("Write queue test succeeded\n");
+	return 0;
+}
+
+// Checks Nibble.h against the port model, with the driver not
+// loaded: every byte value is encoded, sent through the loopback
+// connector and decoded, and the batch (possibly SIMD) decoder
+// must agree with the table for every STATUS value.
+static int TestCodec() {
+	PUCHAR portBase = (PUCHAR)(ULONG_PTR) PPORT_BASE;
+	UCHAR bytes[256], status[256 + 7], decoded[256 + 7];
+	NIBBLE_REGS regs[256];
+	ULONG i;
+
+	printf("Testing the loopback encoding...\n");
+	for (i=0; i<256; i++)
+		bytes[i] = (UCHAR) i;
+	NibbleEncodeBuffer(bytes, 256, regs);
+	for (i=0; i<256; i++) {
+		WRITE_PORT_UCHAR(portBase, regs[i].Data);
+		WRITE_PORT_UCHAR(portBase + 2, regs[i].Control | 0xC0);
+		status[i] = READ_PORT_UCHAR(portBase + 1);
+	}
+	NibbleDecodeBuffer(status, 256, decoded);
+	for (i=0; i<256; i++)
+		if (decoded[i] != (UCHAR)((i & 0x0F) << 4)) {
+			printf("Byte %02X decoded as %02X (STATUS %02X)\n",
+				i, decoded[i], status[i]);
+			return 8;
+		}
+
+	// Odd lengths and offsets exercise the scalar tail
+	for (i=0; i<sizeof(status); i++)
+		status[i] = (UCHAR)(i * 7 + 3);
+	for (ULONG offset = 0; offset < 8; offset++) {
+		ULONG count = sizeof(status) - offset;
+		NibbleDecodeBuffer(status + offset, count, decoded);
+		for (i=0; i<count; i++)
+			if (decoded[i] != NibbleDecodeTable[status[offset + i]]) {
+				printf("STATUS %02X decoded as %02X at offset %d\n",
+					status[offset + i], decoded[i], offset);
+				return 8;
+			}
+	}
+	printf("Encoding checked for all 256 values\n");
+	return 0;
+}
+
+#endif
+
+// Prints a line of Benchmark's table for one run
+static VOID PrintRun(ULONG accessNs, ULONG delayNs, double rate,
+					 PPPORT_STATS pStats) {
+	printf("%6d %6dns %6dns %10.0f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+		pStats->BurstBytes, accessNs, delayNs, rate,
+		pStats->Bursts ? (double) pStats->Bytes / pStats->Bursts : 0.0,
+		pStats->Interrupts ? pStats->IsrNs / 1000.0 / pStats->Interrupts : 0.0,
+		pStats->MaxIsrNs / 1000.0,
+		pStats->Dpcs ? pStats->DpcLatencyNs / 1000.0 / pStats->Dpcs : 0.0,
+		pStats->MaxDpcLatencyNs / 1000.0);
+}
+
+static VOID PrintHeading() {
+	printf("%6s %8s %8s %10s %8s %8s %8s %8s %8s\n",
+		"Burst", "Access", "Delay", "Bytes/s", "B/burst",
+		"ISR us", "max", "DPC us", "max");
+}
+
+// Round trips against streaming, for a few transfer sizes
+static int CompareStreaming(DWORD total) {
+	static const DWORD chunk[] = {64, 500, 4096};
+
+	printf("\n%6s %12s %12s\n", "Chunk", "Round trip", "Streamed");
+	for (DWORD c = 0; c < sizeof(chunk) / sizeof(chunk[0]); c++) {
+		PPORT_STATS stats;
+		double roundTrip = TimeRoundTrips(chunk[c], total, &stats);
+		double streamed = TimeStream(chunk[c], total);
+		if (roundTrip == 0 || streamed == 0)
+			return 1;
+		printf("%6d %12.0f %12.0f\n", chunk[c], roundTrip, streamed);
+	}
+	return 0;
+}
+
+#ifdef WIN32DDK_TEST
+// Loads the driver with the given Parameters\BurstBytes and
+// ReceiveBuffer
+static PDRIVER_OBJECT LoadDriver(ULONG burstBytes, ULONG receiveBuffer) {
+	static const WCHAR* pParameters =
+		L"\\Registry\\Machine\\System\\CurrentControlSet\\Services\\PPort\\Parameters";
+	TestEnvSetRegistryValue(pParameters, L"BurstBytes", burstBytes);
+	TestEnvSetRegistryValue(pParameters, L"ReceiveBuffer", receiveBuffer);
+	NTSTATUS ntStatus;
+	PDRIVER_OBJECT pDriverObject =
+		TestEnvLoadDriver(DriverEntry, L"PPort", &ntStatus);
+	if (pDriverObject == NULL)
+		printf("DriverEntry failed with status %08X\n", ntStatus);
+	return pDriverObject;
+}
+
+// The driver's throughput for each burst size, register access
+// time and interrupt delay, with the bytes sent per burst, the time
+// spent in the ISR and the time from IoRequestDpc to the DPC.
+// Each burst costs an interrupt, and TransmitByte's 50 us ACK#
+// pulse, whatever the port's timing.
+static int Benchmark(PTESTENV_PARALLEL_PORT pPort) {
+	static const ULONG burstBytes[] = {1, 4, 16, 64};
+	static const ULONG accessNs[] = {0, 1000};
+	static const ULONG delayNs[] = {0, 5000, 20000};
+	const DWORD count = 4000;
+
+	PrintHeading();
+	for (DWORD b = 0; b < sizeof(burstBytes) / sizeof(burstBytes[0]); b++) {
+		PDRIVER_OBJECT pDriverObject =
+			LoadDriver(burstBytes[b], BENCH_RECEIVE_BUFFER);
+		if (pDriverObject == NULL)
+			return 1;
+		for (DWORD a = 0; a < sizeof(accessNs) / sizeof(accessNs[0]); a++)
+		for (DWORD d = 0; d < sizeof(delayNs) / sizeof(delayNs[0]); d++) {
+			pPort->AccessNs = accessNs[a];
+			pPort->InterruptDelayNs = delayNs[d];
+			PPORT_STATS stats;
+			double rate = TimeRoundTrips(500, count, &stats);
+			if (rate == 0) {
+				TestEnvUnloadDriver(pDriverObject);
+				return 1;
+			}
+			PrintRun(accessNs[a], delayNs[d], rate, &stats);
+		}
+		TestEnvUnloadDriver(pDriverObject);
+	}
+
+	// Then, at the default port timing, writing and reading
+	// by turns against both at once
+	pPort->AccessNs = 1000;
+	pPort->InterruptDelayNs = 5000;
+	PDRIVER_OBJECT pDriverObject =
+		LoadDriver(TEST_BURST_BYTES, BENCH_RECEIVE_BUFFER);
+	if (pDriverObject == NULL)
+		return 1;
+	int result = CompareStreaming(8 * BENCH_RECEIVE_BUFFER);
+	TestEnvUnloadDriver(pDriverObject);
+	return result;
+}
+#endif
+
+int main(int argc, char* argv[]) {
+	BOOL bBenchmark = (argc > 1 && strcmp(argv[1], "-bench") == 0);
+	int result;
+#ifdef WIN32DDK_TEST
+	TESTENV_PARALLEL_PORT port;
+	memset(&port, 0, sizeof(port));
+	port.PortBase = PPORT_BASE;
+	port.Irq = PPORT_IRQ;
+	port.AccessNs = 1000;			// an ISA bus cycle, roughly
+	port.InterruptDelayNs = 5000;
+	TestEnvAttachParallelPort(&port);
+	if (bBenchmark)
+		result = Benchmark(&port);
+	else if ((result = TestCodec()) == 0) {
+		PDRIVER_OBJECT pDriverObject =
+			LoadDriver(TEST_BURST_BYTES, TEST_RECEIVE_BUFFER);
+		if (pDriverObject == NULL)
+			return 1;
+		result = TestDevice();
+		if (result == 0)
+			result = TestStreaming();
+		if (result == 0)
+			result = TestPriority(&port);
+		TestEnvUnloadDriver(pDriverObject);
+	}
+	TestEnvDetachParallelPort(&port);
+#else
+	if (bBenchmark) {
+		// For the burst size the registry gives
+		PPORT_STATS stats;
+		double rate = TimeRoundTrips(500, 2000, &stats);
+		if (rate != 0) {
+			PrintHeading();
+			PrintRun(0, 0, rate, &stats);
+		}
+		result = (rate != 0) ? CompareStreaming(32768) : 1;
+	} else {
+		result = TestDevice();
+		if (result == 0)
+			result = TestStreaming();
+	}
+#endif
+	return result;
+}
+
 
 	
\ No newline at end of file
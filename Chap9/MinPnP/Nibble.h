@@ -0,0 +1,178 @@
+// Nibble.h
+//
+// Copyright (C) 2000 by Jerry Lozano
+//
+// Encoding of a byte for the parallel port loopback connector.
+// Only the low nibble makes the round trip:
+//
+//		byte bit 0		-> DATA bit 0			-> STATUS bit 3
+//		byte bit 1		-> CONTROL bit 0 (inv)	-> STATUS bit 4
+//		byte bit 2		-> CONTROL bit 1 (inv)	-> STATUS bit 5
+//		byte bit 3		-> CONTROL bit 3		-> STATUS bit 7
+//
+// and the STATUS bits are read back as the nibble in the upper
+// half of a byte.  Both directions are precomputed tables, so a
+// byte costs one lookup instead of a rebuilt bit shuffle.
+// NibbleEncodeBuffer encodes a whole write ahead of time;
+// NibbleDecodeBuffer decodes a run of captured STATUS values,
+// 16 or 32 at a time when the compiler targets SSSE3 or AVX2.
+
+#pragma once
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NIBBLE_AVX2
+#define NIBBLE_SSSE3
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define NIBBLE_SSSE3
+#endif
+
+// Register values that send one byte.  Control does not include
+// the driver's CTL_DEFAULT bits; or them in when writing.
+typedef struct _NIBBLE_REGS {
+	UCHAR Data;
+	UCHAR Control;
+} NIBBLE_REGS, *PNIBBLE_REGS;
+
+// Indexed by the byte to send
+static const NIBBLE_REGS NibbleEncodeTable[256] = {
+	{0,0x3}, {1,0x3}, {0,0x2}, {1,0x2}, {0,0x1}, {1,0x1}, {0,0x0}, {1,0x0},
+	{0,0xB}, {1,0xB}, {0,0xA}, {1,0xA}, {0,0x9}, {1,0x9}, {0,0x8}, {1,0x8},
+	{0,0x3}, {1,0x3}, {0,0x2}, {1,0x2}, {0,0x1}, {1,0x1}, {0,0x0}, {1,0x0},
+	{0,0xB}, {1,0xB}, {0,0xA}, {1,0xA}, {0,0x9}, {1,0x9}, {0,0x8}, {1,0x8},
+	{0,0x3}, {1,0x3}, {0,0x2}, {1,0x2}, {0,0x1}, {1,0x1}, {0,0x0}, {1,0x0},
+	{0,0xB}, {1,0xB}, {0,0xA}, {1,0xA}, {0,0x9}, {1,0x9}, {0,0x8}, {1,0x8},
+	{0,0x3}, {1,0x3}, {0,0x2}, {1,0x2}, {0,0x1}, {1,0x1}, {0,0x0}, {1,0x0},
+	{0,0xB}, {1,0xB}, {0,0xA}, {1,0xA}, {0,0x9}, {1,0x9}, {0,0x8}, {1,0x8},
+	{0,0x3}, {1,0x3}, {0,0x2}, {1,0x2}, {0,0x1}, {1,0x1}, {0,0x0}, {1,0x0},
+	{0,0xB}, {1,0xB}, {0,0xA}, {1,0xA}, {0,0x9}, {1,0x9}, {0,0x8}, {1,0x8},
+	{0,0x3}, {1,0x3}, {0,0x2}, {1,0x2}, {0,0x1}, {1,0x1}, {0,0x0}, {1,0x0},
+	{0,0xB}, {1,0xB}, {0,0xA}, {1,0xA}, {0,0x9}, {1,0x9}, {0,0x8}, {1,0x8},
+	{0,0x3}, {1,0x3}, {0,0x2}, {1,0x2}, {0,0x1}, {1,0x1}, {0,0x0}, {1,0x0},
+	{0,0xB}, {1,0xB}, {0,0xA}, {1,0xA}, {0,0x9}, {1,0x9}, {0,0x8}, {1,0x8},
+	{0,0x3}, {1,0x3}, {0,0x2}, {1,0x2}, {0,0x1}, {1,0x1}, {0,0x0}, {1,0x0},
+	{0,0xB}, {1,0xB}, {0,0xA}, {1,0xA}, {0,0x9}, {1,0x9}, {0,0x8}, {1,0x8},
+	{0,0x3}, {1,0x3}, {0,0x2}, {1,0x2}, {0,0x1}, {1,0x1}, {0,0x0}, {1,0x0},
+	{0,0xB}, {1,0xB}, {0,0xA}, {1,0xA}, {0,0x9}, {1,0x9}, {0,0x8}, {1,0x8},
+	{0,0x3}, {1,0x3}, {0,0x2}, {1,0x2}, {0,0x1}, {1,0x1}, {0,0x0}, {1,0x0},
+	{0,0xB}, {1,0xB}, {0,0xA}, {1,0xA}, {0,0x9}, {1,0x9}, {0,0x8}, {1,0x8},
+	{0,0x3}, {1,0x3}, {0,0x2}, {1,0x2}, {0,0x1}, {1,0x1}, {0,0x0}, {1,0x0},
+	{0,0xB}, {1,0xB}, {0,0xA}, {1,0xA}, {0,0x9}, {1,0x9}, {0,0x8}, {1,0x8},
+	{0,0x3}, {1,0x3}, {0,0x2}, {1,0x2}, {0,0x1}, {1,0x1}, {0,0x0}, {1,0x0},
+	{0,0xB}, {1,0xB}, {0,0xA}, {1,0xA}, {0,0x9}, {1,0x9}, {0,0x8}, {1,0x8},
+	{0,0x3}, {1,0x3}, {0,0x2}, {1,0x2}, {0,0x1}, {1,0x1}, {0,0x0}, {1,0x0},
+	{0,0xB}, {1,0xB}, {0,0xA}, {1,0xA}, {0,0x9}, {1,0x9}, {0,0x8}, {1,0x8},
+	{0,0x3}, {1,0x3}, {0,0x2}, {1,0x2}, {0,0x1}, {1,0x1}, {0,0x0}, {1,0x0},
+	{0,0xB}, {1,0xB}, {0,0xA}, {1,0xA}, {0,0x9}, {1,0x9}, {0,0x8}, {1,0x8},
+	{0,0x3}, {1,0x3}, {0,0x2}, {1,0x2}, {0,0x1}, {1,0x1}, {0,0x0}, {1,0x0},
+	{0,0xB}, {1,0xB}, {0,0xA}, {1,0xA}, {0,0x9}, {1,0x9}, {0,0x8}, {1,0x8},
+	{0,0x3}, {1,0x3}, {0,0x2}, {1,0x2}, {0,0x1}, {1,0x1}, {0,0x0}, {1,0x0},
+	{0,0xB}, {1,0xB}, {0,0xA}, {1,0xA}, {0,0x9}, {1,0x9}, {0,0x8}, {1,0x8},
+};
+
+// Indexed by the STATUS register value; yields the received
+// nibble in bits 4-7
+static const UCHAR NibbleDecodeTable[256] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x50, 0x50, 0x50, 0x50, 0x50, 0x50, 0x50, 0x50,
+	0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x70, 0x70, 0x70, 0x70, 0x70, 0x70, 0x70, 0x70,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x50, 0x50, 0x50, 0x50, 0x50, 0x50, 0x50, 0x50,
+	0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x70, 0x70, 0x70, 0x70, 0x70, 0x70, 0x70, 0x70,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90,
+	0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xB0, 0xB0, 0xB0, 0xB0, 0xB0, 0xB0, 0xB0, 0xB0,
+	0xC0, 0xC0, 0xC0, 0xC0, 0xC0, 0xC0, 0xC0, 0xC0, 0xD0, 0xD0, 0xD0, 0xD0, 0xD0, 0xD0, 0xD0, 0xD0,
+	0xE0, 0xE0, 0xE0, 0xE0, 0xE0, 0xE0, 0xE0, 0xE0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+	0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90, 0x90,
+	0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xA0, 0xB0, 0xB0, 0xB0, 0xB0, 0xB0, 0xB0, 0xB0, 0xB0,
+	0xC0, 0xC0, 0xC0, 0xC0, 0xC0, 0xC0, 0xC0, 0xC0, 0xD0, 0xD0, 0xD0, 0xD0, 0xD0, 0xD0, 0xD0, 0xD0,
+	0xE0, 0xE0, 0xE0, 0xE0, 0xE0, 0xE0, 0xE0, 0xE0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+};
+
+//++
+// Function:
+//		NibbleEncodeBuffer
+//
+// Description:
+//		Converts a buffer of bytes into the DATA and
+//		CONTROL register values that send them.
+//
+// Arguments:
+//		Pointer to the bytes to send
+//		Number of bytes
+//		Pointer to count NIBBLE_REGS to receive the result
+//
+// Return value:
+//		(None)
+//--
+inline VOID NibbleEncodeBuffer(
+	IN const UCHAR* pBytes,
+	IN ULONG count,
+	OUT PNIBBLE_REGS pRegs ) {
+
+	for (ULONG i = 0; i < count; i++)
+		pRegs[i] = NibbleEncodeTable[pBytes[i]];
+}
+
+//++
+// Function:
+//		NibbleDecodeBuffer
+//
+// Description:
+//		Converts a buffer of captured STATUS register
+//		values into received bytes (nibble in bits 4-7).
+//		pStatus and pBytes may be the same buffer.
+//
+// Arguments:
+//		Pointer to the STATUS values
+//		Number of values
+//		Pointer to count bytes to receive the result
+//
+// Return value:
+//		(None)
+//--
+inline VOID NibbleDecodeBuffer(
+	IN const UCHAR* pStatus,
+	IN ULONG count,
+	OUT PUCHAR pBytes ) {
+
+	ULONG i = 0;
+#ifdef NIBBLE_SSSE3
+	// Gather STATUS bits 3,4,5 and 7 into a 4-bit index, then
+	// let pshufb look up all 16 (or 32) results at once.  The
+	// 16-bit shifts drag in bits from the neighbouring byte,
+	// but the masks throw them away again.
+	const __m128i lut = _mm_setr_epi8(
+		0x00, 0x10, 0x20, 0x30, 0x40, 0x50, 0x60, 0x70,
+		(char)0x80, (char)0x90, (char)0xA0, (char)0xB0,
+		(char)0xC0, (char)0xD0, (char)0xE0, (char)0xF0 );
+#ifdef NIBBLE_AVX2
+	const __m256i lut2 = _mm256_broadcastsi128_si256( lut );
+	const __m256i low3 = _mm256_set1_epi8( 0x07 );
+	const __m256i bit3 = _mm256_set1_epi8( 0x08 );
+	for (; i + 32 <= count; i += 32) {
+		__m256i s = _mm256_loadu_si256( (const __m256i*)(pStatus + i) );
+		__m256i idx = _mm256_or_si256(
+			_mm256_and_si256( _mm256_srli_epi16( s, 3 ), low3 ),
+			_mm256_and_si256( _mm256_srli_epi16( s, 4 ), bit3 ) );
+		_mm256_storeu_si256( (__m256i*)(pBytes + i),
+			_mm256_shuffle_epi8( lut2, idx ) );
+	}
+#endif
+	const __m128i low3x = _mm_set1_epi8( 0x07 );
+	const __m128i bit3x = _mm_set1_epi8( 0x08 );
+	for (; i + 16 <= count; i += 16) {
+		__m128i s = _mm_loadu_si128( (const __m128i*)(pStatus + i) );
+		__m128i idx = _mm_or_si128(
+			_mm_and_si128( _mm_srli_epi16( s, 3 ), low3x ),
+			_mm_and_si128( _mm_srli_epi16( s, 4 ), bit3x ) );
+		_mm_storeu_si128( (__m128i*)(pBytes + i),
+			_mm_shuffle_epi8( lut, idx ) );
+	}
+#endif
+	for (; i < count; i++)
+		pBytes[i] = NibbleDecodeTable[pStatus[i]];
+}